@@ -0,0 +1,586 @@
+/*
+ * 性能基准测试，用lavfi生成确定的测试素材，运行转封装、转封装推流（不控速）、转编码场景，以JSON输出吞吐量、延迟分位数、峰值内存和内存分配次数
+ * Performance benchmark, generates deterministic test media with lavfi, runs the remux, remux to stream (no pacing) and transcode scenarios, outputs throughput, latency percentiles, peak memory and allocation counts as JSON
+ * Depends on FFmpeg 6.0
+ * Wirte by stoprefactoring.com
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+extern "C" {
+    #include <libavutil/timestamp.h>
+    #include <libavutil/time.h>
+    #include <libavutil/avutil.h>
+    #include <libavutil/channel_layout.h>
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+    #include <libavdevice/avdevice.h>
+    #include <libswresample/swresample.h>
+}
+#include "../common/alloc_count.h"
+
+int ret = 0;
+
+//测试素材列表，用lavfi的testsrc2（视频）和sine（音频）生成，同样的配置每次生成的文件相同
+//Test media list, generated with lavfi testsrc2 (video) and sine (audio), the same settings always produce the same file
+typedef struct Media {
+    const char *name;                                                           //素材名称，也是文件名，media name, also the file name
+    int width;                                                                  //宽度，width
+    int height;                                                                 //高度，height
+    AVCodecID codecID;                                                          //视频编码，video codec
+    int gopSize;                                                                //关键帧间隔（帧），keyframe interval (frames)
+} Media;
+const Media mediaList[] = {
+    {"360p_h264_gop25", 640, 360, AV_CODEC_ID_H264, 25},
+    {"720p_h264_gop50", 1280, 720, AV_CODEC_ID_H264, 50},
+    {"1080p_h265_gop250", 1920, 1080, AV_CODEC_ID_H265, 250},
+};
+const int mediaLength = sizeof(mediaList) / sizeof(*mediaList);
+
+//素材时长（秒）和帧率
+//Media duration (seconds) and frame rate
+const int mediaDuration = 10;
+const int mediaFrameRate = 25;
+
+//转编码场景的目标编码
+//Target encoding of the transcode scenario
+const AVCodecID transcodeCodecID = AV_CODEC_ID_H265;
+
+//转封装推流场景的输出地址，UDP不需要服务端，不控速，按最快速度发送
+//Output address of the remux to stream scenario, UDP needs no server, no pacing, sent as fast as possible
+const char *streamOutPath = "udp://127.0.0.1:12345?pkt_size=1316";
+
+//JSON结果输出路径
+//JSON result output path
+const char *resultPath = "./benchmark.json";
+
+//单个场景的测试结果，在子进程中测得，通过管道传回父进程
+//The result of a single scenario, measured in a child process and passed back to the parent through a pipe
+typedef struct Result {
+    char scenario[32];                                                          //场景名称，scenario name
+    char media[64];                                                             //素材名称，media name
+    int64_t packets;                                                            //处理的数据包数，number of processed packets
+    int64_t frames;                                                             //编码的帧数，number of encoded frames
+    int64_t bytes;                                                              //输入文件大小，input file size
+    double seconds;                                                             //耗时，time cost
+    int64_t latencyP50;                                                         //单个数据包处理耗时的分位数（微秒），percentiles of the per-packet processing time (microseconds)
+    int64_t latencyP90;
+    int64_t latencyP99;
+    int64_t latencyMax;
+    int64_t peakRss;                                                            //峰值常驻内存（KB），peak resident memory (KB)
+    int64_t allocations;                                                        //内存分配次数，未统计时为-1，number of allocations, -1 when not counted
+    int64_t allocatedBytes;                                                     //内存分配字节数，未统计时为-1，allocated bytes, -1 when not counted
+} Result;
+
+void termination(const char* param){
+    std::cout<<param<<std::endl;
+    std::cout<<"Error occur, quit!"<<std::endl;
+    exit(-1);
+}
+
+std::string GetMediaPath(const Media *media){
+    return std::string("./bench_") + media->name + ".mp4";
+}
+
+void Generate_Encode(AVCodecContext *encoder, AVFrame *frame, AVPacket *packet, AVFormatContext *outFileHandle, int outIndex){
+    ret = avcodec_send_frame(encoder, frame);
+    if(ret<0){
+        termination("Could not encoding.");
+    }
+    while(1){
+        ret = avcodec_receive_packet(encoder, packet);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF){
+            break;
+        } else if (ret < 0) {
+            termination("Could not receive encoding.");
+        }
+        packet->stream_index = outIndex;
+        av_packet_rescale_ts(packet, encoder->time_base, outFileHandle->streams[outIndex]->time_base);
+        ret = av_interleaved_write_frame(outFileHandle, packet);
+        if (ret < 0) {
+            termination("Could not mux packet.");
+        }
+    }
+}
+
+void Step1_Generate(const Media *media){
+    //STEP::素材已存在时不重复生成
+    //STEP::Do not generate the media again if it already exists
+    std::string outFilePath = GetMediaPath(media);
+    struct stat fileStat;
+    if(stat(outFilePath.c_str(), &fileStat) == 0){
+        return;
+    }
+    std::cout<<"generate "<<outFilePath<<std::endl;
+
+    //STEP::打开lavfi输入，out0为视频，out1为音频
+    //STEP::Open the lavfi input, out0 is the video, out1 is the audio
+    char graph[512];
+    snprintf(graph, sizeof(graph),
+             "testsrc2=size=%dx%d:rate=%d:duration=%d,format=yuv420p[out0];"
+             "sine=frequency=1000:sample_rate=48000:samples_per_frame=1024:duration=%d[out1]",
+             media->width, media->height, mediaFrameRate, mediaDuration, mediaDuration);
+    AVFormatContext *inFileHandle = NULL;
+    ret = avformat_open_input(&inFileHandle, graph, av_find_input_format("lavfi"), NULL);
+    if(ret<0){
+        termination("Could not open lavfi input.");
+    }
+    ret = avformat_find_stream_info(inFileHandle, NULL);
+    if(ret<0){
+        termination("Failed to retrieve input stream information.");
+    }
+    AVFormatContext *outFileHandle = NULL;
+    ret = avformat_alloc_output_context2(&outFileHandle, NULL, NULL, outFilePath.c_str());
+    if(ret<0){
+        termination("Could not create output handle.");
+    }
+    outFileHandle->flags |= AVFMT_FLAG_BITEXACT;
+
+    //STEP::为每个轨道创建解码器、编码器，编码器单线程并开启bitexact，保证每次生成的文件相同
+    //STEP::Create a decoder and an encoder for each track, encoders are single-threaded with bitexact, so the generated file is the same every time
+    unsigned int streamLength = inFileHandle->nb_streams;
+    std::vector<AVCodecContext *> decoderList(streamLength, NULL);
+    std::vector<AVCodecContext *> encoderList(streamLength, NULL);
+    SwrContext *resampler = NULL;
+    for(unsigned int i=0;i<streamLength;i++){
+        AVStream *inStream = inFileHandle->streams[i];
+        const AVCodec *decoderInfo = avcodec_find_decoder(inStream->codecpar->codec_id);
+        decoderList[i] = avcodec_alloc_context3(decoderInfo);
+        if(!decoderInfo || !decoderList[i] ||
+           avcodec_parameters_to_context(decoderList[i], inStream->codecpar) < 0 ||
+           avcodec_open2(decoderList[i], decoderInfo, NULL) < 0){
+            termination("Could not open decoder.");
+        }
+
+        bool isVideo = inStream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
+        const AVCodec *encoderInfo = avcodec_find_encoder(isVideo ? media->codecID : AV_CODEC_ID_AAC);
+        if(!encoderInfo){
+            termination("Could not find encoder for stream.");
+        }
+        AVCodecContext *encoder = avcodec_alloc_context3(encoderInfo);
+        if(!encoder){
+            termination("Could not allocate encoder context.");
+        }
+        if(isVideo){
+            encoder->width = media->width;
+            encoder->height = media->height;
+            encoder->pix_fmt = AV_PIX_FMT_YUV420P;
+            encoder->framerate = av_make_q(mediaFrameRate, 1);
+            encoder->time_base = av_make_q(1, mediaFrameRate);
+            encoder->gop_size = media->gopSize;
+            encoder->bit_rate = (int64_t)media->width * media->height * 2;
+        } else {
+            encoder->sample_rate = decoderList[i]->sample_rate;
+            av_channel_layout_copy(&encoder->ch_layout, &decoderList[i]->ch_layout);
+            encoder->sample_fmt = AV_SAMPLE_FMT_FLTP;
+            encoder->time_base = av_make_q(1, encoder->sample_rate);
+            encoder->bit_rate = 128000;
+            ret = swr_alloc_set_opts2(&resampler,
+                                      &encoder->ch_layout, encoder->sample_fmt, encoder->sample_rate,
+                                      &decoderList[i]->ch_layout, decoderList[i]->sample_fmt, decoderList[i]->sample_rate,
+                                      0, NULL);
+            if(ret < 0 || swr_init(resampler) < 0){
+                termination("Could not initialize resampler.");
+            }
+        }
+        encoder->thread_count = 1;
+        encoder->flags |= AV_CODEC_FLAG_BITEXACT | AV_CODEC_FLAG_GLOBAL_HEADER;
+        ret = avcodec_open2(encoder, encoderInfo, NULL);
+        if(ret<0){
+            termination("Could not open encoder.");
+        }
+        encoderList[i] = encoder;
+
+        AVStream *outStream = avformat_new_stream(outFileHandle, NULL);
+        ret = avcodec_parameters_from_context(outStream->codecpar, encoder);
+        if(ret<0){
+            termination("Could not copy codec parameters.");
+        }
+        outStream->time_base = encoder->time_base;
+    }
+    ret = avio_open(&outFileHandle->pb, outFilePath.c_str(), AVIO_FLAG_WRITE);
+    if(ret<0){
+        termination("Could not open out file.");
+    }
+    ret = avformat_write_header(outFileHandle, NULL);
+    if(ret<0){
+        termination("Could not write stream header to out file.");
+    }
+
+    //STEP::解码lavfi输出的原始数据并编码写入文件
+    //STEP::Decode the raw data from lavfi, encode and write to the file
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    AVFrame *audioFrame = av_frame_alloc();
+    if (!packet || !frame || !audioFrame) {
+        termination("Could not allocate AVPacket or AVFrame.");
+    }
+    for(bool isEnd = false; !isEnd; ){
+        isEnd = av_read_frame(inFileHandle, packet) < 0;
+        for(unsigned int i=0;i<streamLength;i++){
+            if(isEnd ? false : packet->stream_index != (int)i){
+                continue;
+            }
+            AVStream *inStream = inFileHandle->streams[i];
+            ret = avcodec_send_packet(decoderList[i], isEnd ? NULL : packet);
+            if(ret<0){
+                termination("Could not decoding.");
+            }
+            while(avcodec_receive_frame(decoderList[i], frame) >= 0){
+                AVCodecContext *encoder = encoderList[i];
+                int64_t pts = av_rescale_q(frame->best_effort_timestamp, inStream->time_base, encoder->time_base);
+                if(encoder->codec_type == AVMEDIA_TYPE_VIDEO){
+                    frame->pts = pts;
+                    frame->pict_type = AV_PICTURE_TYPE_NONE;
+                    Generate_Encode(encoder, frame, packet, outFileHandle, i);
+                } else {
+                    audioFrame->format = encoder->sample_fmt;
+                    audioFrame->sample_rate = encoder->sample_rate;
+                    audioFrame->nb_samples = frame->nb_samples;
+                    av_channel_layout_copy(&audioFrame->ch_layout, &encoder->ch_layout);
+                    if(av_frame_get_buffer(audioFrame, 0) < 0){
+                        termination("Could not allocate audio frame.");
+                    }
+                    audioFrame->nb_samples = swr_convert(resampler, audioFrame->data, frame->nb_samples, (const uint8_t **)frame->extended_data, frame->nb_samples);
+                    audioFrame->pts = pts;
+                    Generate_Encode(encoder, audioFrame, packet, outFileHandle, i);
+                    av_frame_unref(audioFrame);
+                }
+                av_frame_unref(frame);
+            }
+            if(isEnd){
+                Generate_Encode(encoderList[i], NULL, packet, outFileHandle, i);
+            }
+        }
+        av_packet_unref(packet);
+    }
+
+    ret = av_write_trailer(outFileHandle);
+    if(ret < 0) {
+        termination("Could not write the stream trailer to out file.");
+    }
+    avio_closep(&outFileHandle->pb);
+    avformat_free_context(outFileHandle);
+    for(unsigned int i=0;i<streamLength;i++){
+        avcodec_free_context(&decoderList[i]);
+        avcodec_free_context(&encoderList[i]);
+    }
+    swr_free(&resampler);
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    av_frame_free(&audioFrame);
+    avformat_close_input(&inFileHandle);
+}
+
+void Scenario_Remux(const char *inFilePath, const char *outFilePath, const char *formatName, Result *result, std::vector<int64_t> &latencyList){
+    //STEP::与remux_tofile.cpp、remux_tostream.cpp相同的转封装流程，推流场景不做av_usleep控速
+    //STEP::The same remux flow as remux_tofile.cpp and remux_tostream.cpp, the stream scenario does not pace with av_usleep
+    AVFormatContext *inFileHandle = NULL;
+    AVFormatContext *outFileHandle = NULL;
+    if(avformat_open_input(&inFileHandle, inFilePath, NULL, NULL) < 0 ||
+       avformat_find_stream_info(inFileHandle, NULL) < 0){
+        termination("Could not open input file.");
+    }
+    result->bytes = avio_size(inFileHandle->pb);
+    ret = avformat_alloc_output_context2(&outFileHandle, NULL, formatName, outFilePath);
+    if(ret<0){
+        termination("Could not create output handle.");
+    }
+    std::vector<int> streamMapping(inFileHandle->nb_streams, -1);
+    int outStreamIndex = 0;
+    for(unsigned int i = 0; i < inFileHandle->nb_streams; i++) {
+        AVStream *outStream = avformat_new_stream(outFileHandle, NULL);
+        ret = avcodec_parameters_copy(outStream->codecpar, inFileHandle->streams[i]->codecpar);
+        if(ret<0){
+            termination("Could not copy codec parameters.");
+        }
+        outStream->codecpar->codec_tag = 0;
+        streamMapping[i] = outStreamIndex++;
+    }
+    if(avio_open(&outFileHandle->pb, outFilePath, AVIO_FLAG_WRITE) < 0 ||
+       avformat_write_header(outFileHandle, NULL) < 0){
+        termination("Could not open out file.");
+    }
+
+    AVPacket *packet = av_packet_alloc();
+    if (!packet) {
+        termination("Could not allocate AVPacket.");
+    }
+    while(1){
+        int64_t packetStart = av_gettime_relative();
+        if(av_read_frame(inFileHandle, packet) < 0){
+            break;
+        }
+        AVStream *inStream = inFileHandle->streams[packet->stream_index];
+        AVStream *outStream = outFileHandle->streams[streamMapping[packet->stream_index]];
+        av_packet_rescale_ts(packet, inStream->time_base, outStream->time_base);
+        packet->stream_index = streamMapping[packet->stream_index];
+        ret = av_interleaved_write_frame(outFileHandle, packet);
+        if (ret < 0) {
+            termination("Could not mux packet.");
+        }
+        latencyList.push_back(av_gettime_relative() - packetStart);
+        result->packets++;
+    }
+    av_packet_free(&packet);
+
+    ret = av_write_trailer(outFileHandle);
+    if(ret < 0) {
+        termination("Could not write the stream trailer to out file.");
+    }
+    avio_closep(&outFileHandle->pb);
+    avformat_free_context(outFileHandle);
+    avformat_close_input(&inFileHandle);
+}
+
+void Scenario_Transcode_Encode(AVCodecContext *encoder, AVFrame *frame, AVPacket *packet, AVFormatContext *outFileHandle, Result *result){
+    ret = avcodec_send_frame(encoder, frame);
+    if(ret<0){
+        termination("Could not encoding.");
+    }
+    while(1){
+        ret = avcodec_receive_packet(encoder, packet);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF){
+            break;
+        } else if (ret < 0) {
+            termination("Could not receive encoding.");
+        }
+        packet->stream_index = 0;
+        av_packet_rescale_ts(packet, encoder->time_base, outFileHandle->streams[0]->time_base);
+        ret = av_interleaved_write_frame(outFileHandle, packet);
+        if (ret < 0) {
+            termination("Could not mux packet.");
+        }
+        result->frames++;
+    }
+}
+
+void Scenario_Transcode(const char *inFilePath, const char *outFilePath, Result *result, std::vector<int64_t> &latencyList){
+    //STEP::与transcode.cpp相同的解码、编码流程，只处理视频轨道，编解码器使用默认线程数
+    //STEP::The same decode and encode flow as transcode.cpp, only the video track is processed, codecs use the default thread count
+    AVFormatContext *inFileHandle = NULL;
+    AVFormatContext *outFileHandle = NULL;
+    if(avformat_open_input(&inFileHandle, inFilePath, NULL, NULL) < 0 ||
+       avformat_find_stream_info(inFileHandle, NULL) < 0){
+        termination("Could not open input file.");
+    }
+    result->bytes = avio_size(inFileHandle->pb);
+    int videoIndex = av_find_best_stream(inFileHandle, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if(videoIndex < 0){
+        termination("Could not find video stream.");
+    }
+    AVStream *inStream = inFileHandle->streams[videoIndex];
+
+    const AVCodec *decoderInfo = avcodec_find_decoder(inStream->codecpar->codec_id);
+    AVCodecContext *decoder = avcodec_alloc_context3(decoderInfo);
+    if(!decoderInfo || !decoder || avcodec_parameters_to_context(decoder, inStream->codecpar) < 0){
+        termination("Could not allocate decoder context.");
+    }
+    decoder->pkt_timebase = inStream->time_base;
+    if(avcodec_open2(decoder, decoderInfo, NULL) < 0){
+        termination("Could not open decoder.");
+    }
+
+    const AVCodec *encoderInfo = avcodec_find_encoder(transcodeCodecID);
+    AVCodecContext *encoder = avcodec_alloc_context3(encoderInfo);
+    if(!encoderInfo || !encoder){
+        termination("Could not allocate encoder context.");
+    }
+    encoder->width = decoder->width;
+    encoder->height = decoder->height;
+    encoder->pix_fmt = decoder->pix_fmt;
+    encoder->sample_aspect_ratio = decoder->sample_aspect_ratio;
+    encoder->framerate = av_guess_frame_rate(inFileHandle, inStream, NULL);
+    encoder->time_base = inStream->time_base;
+    encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if(avcodec_open2(encoder, encoderInfo, NULL) < 0){
+        termination("Could not open encoder.");
+    }
+
+    ret = avformat_alloc_output_context2(&outFileHandle, NULL, NULL, outFilePath);
+    if(ret<0){
+        termination("Could not create output handle.");
+    }
+    AVStream *outStream = avformat_new_stream(outFileHandle, NULL);
+    if(avcodec_parameters_from_context(outStream->codecpar, encoder) < 0 ||
+       avio_open(&outFileHandle->pb, outFilePath, AVIO_FLAG_WRITE) < 0 ||
+       avformat_write_header(outFileHandle, NULL) < 0){
+        termination("Could not open out file.");
+    }
+
+    AVPacket *packet = av_packet_alloc();
+    AVPacket *outPacket = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    if (!packet || !outPacket || !frame) {
+        termination("Could not allocate AVPacket or AVFrame.");
+    }
+    for(bool isEnd = false; !isEnd; ){
+        int64_t packetStart = av_gettime_relative();
+        isEnd = av_read_frame(inFileHandle, packet) < 0;
+        if(!isEnd && packet->stream_index != videoIndex){
+            av_packet_unref(packet);
+            continue;
+        }
+        ret = avcodec_send_packet(decoder, isEnd ? NULL : packet);
+        av_packet_unref(packet);
+        if(ret<0){
+            termination("Could not decoding.");
+        }
+        while(avcodec_receive_frame(decoder, frame) >= 0){
+            frame->pts = frame->best_effort_timestamp;
+            frame->pict_type = AV_PICTURE_TYPE_NONE;
+            Scenario_Transcode_Encode(encoder, frame, outPacket, outFileHandle, result);
+            av_frame_unref(frame);
+        }
+        if(isEnd){
+            Scenario_Transcode_Encode(encoder, NULL, outPacket, outFileHandle, result);
+        }
+        latencyList.push_back(av_gettime_relative() - packetStart);
+        result->packets++;
+    }
+
+    ret = av_write_trailer(outFileHandle);
+    if(ret < 0) {
+        termination("Could not write the stream trailer to out file.");
+    }
+    avio_closep(&outFileHandle->pb);
+    avformat_free_context(outFileHandle);
+    avcodec_free_context(&decoder);
+    avcodec_free_context(&encoder);
+    av_packet_free(&packet);
+    av_packet_free(&outPacket);
+    av_frame_free(&frame);
+    avformat_close_input(&inFileHandle);
+}
+
+int64_t GetPercentile(std::vector<int64_t> &latencyList, int percent){
+    if(latencyList.empty()){
+        return 0;
+    }
+    size_t index = latencyList.size() * percent / 100;
+    return latencyList[index < latencyList.size() ? index : latencyList.size() - 1];
+}
+
+Result Step2_RunScenario(const char *scenario, const Media *media){
+    //STEP::每个场景在独立的子进程中运行，峰值内存和内存分配次数互不影响
+    //STEP::Each scenario runs in its own child process, so peak memory and allocation counts do not affect each other
+    Result result;
+    memset(&result, 0, sizeof(result));
+    int pipeFd[2];
+    if(pipe(pipeFd) < 0){
+        termination("Could not create pipe.");
+    }
+    pid_t pid = fork();
+    if(pid < 0){
+        termination("Could not fork.");
+    }
+    if(pid == 0){
+        close(pipeFd[0]);
+        snprintf(result.scenario, sizeof(result.scenario), "%s", scenario);
+        snprintf(result.media, sizeof(result.media), "%s", media->name);
+        std::string inFilePath = GetMediaPath(media);
+        std::vector<int64_t> latencyList;
+        latencyList.reserve(1 << 16);
+        allocCount.store(0);
+        allocBytes.store(0);
+
+        int64_t startTime = av_gettime_relative();
+        if(strcmp(scenario, "remux") == 0){
+            Scenario_Remux(inFilePath.c_str(), "./bench_remux.mkv", NULL, &result, latencyList);
+        } else if(strcmp(scenario, "remux_stream") == 0){
+            Scenario_Remux(inFilePath.c_str(), streamOutPath, "mpegts", &result, latencyList);
+        } else {
+            Scenario_Transcode(inFilePath.c_str(), "./bench_transcode.mp4", &result, latencyList);
+        }
+        result.seconds = (av_gettime_relative() - startTime) / 1000000.0;
+        result.allocations = isAllocCount ? allocCount.load() : -1;                   //未开启ALLOC_COUNT时为-1，-1 when ALLOC_COUNT is off
+        result.allocatedBytes = isAllocCount ? allocBytes.load() : -1;
+
+        std::sort(latencyList.begin(), latencyList.end());
+        result.latencyP50 = GetPercentile(latencyList, 50);
+        result.latencyP90 = GetPercentile(latencyList, 90);
+        result.latencyP99 = GetPercentile(latencyList, 99);
+        result.latencyMax = latencyList.empty() ? 0 : latencyList.back();
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        result.peakRss = usage.ru_maxrss;
+
+        if(write(pipeFd[1], &result, sizeof(result)) != sizeof(result)){
+            _exit(-1);
+        }
+        _exit(0);
+    }
+
+    close(pipeFd[1]);
+    ssize_t size = read(pipeFd[0], &result, sizeof(result));
+    close(pipeFd[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if(size != sizeof(result) || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+        termination("Scenario failed.");
+    }
+    return result;
+}
+
+void Step3_Report(std::vector<Result> &resultList){
+    //STEP::以JSON格式输出到终端和文件，方便脚本对比不同版本的结果
+    //STEP::Output in JSON format to the terminal and the file, so scripts can compare the results of different versions
+    std::ostringstream json;
+    json<<"{\n  \"ffmpeg\": \""<<av_version_info()<<"\",\n  \"results\": [\n";
+    for(unsigned int i=0;i<resultList.size();i++){
+        Result *result = &resultList[i];
+        double seconds = result->seconds > 0 ? result->seconds : 1e-9;
+        json<<"    {\"scenario\": \""<<result->scenario<<"\", \"media\": \""<<result->media<<"\""
+            <<", \"seconds\": "<<result->seconds
+            <<", \"packets\": "<<result->packets
+            <<", \"packets_per_second\": "<<result->packets / seconds
+            <<", \"mbytes_per_second\": "<<result->bytes / 1048576.0 / seconds
+            <<", \"frames\": "<<result->frames
+            <<", \"fps\": "<<result->frames / seconds
+            <<", \"latency_us\": {\"p50\": "<<result->latencyP50<<", \"p90\": "<<result->latencyP90
+            <<", \"p99\": "<<result->latencyP99<<", \"max\": "<<result->latencyMax<<"}"
+            <<", \"peak_rss_kb\": "<<result->peakRss
+            <<", \"allocations\": "<<result->allocations
+            <<", \"allocated_bytes\": "<<result->allocatedBytes<<"}"
+            <<(i + 1 < resultList.size() ? ",\n" : "\n");
+    }
+    json<<"  ]\n}\n";
+    std::cout<<json.str();
+    std::ofstream resultFile(resultPath);
+    resultFile<<json.str();
+}
+
+int main(int argc, char *argv[]){
+    avdevice_register_all();
+
+    //STEP::生成测试素材
+    //STEP::Generate the test media
+    for(int i=0;i<mediaLength;i++){
+        Step1_Generate(&mediaList[i]);
+    }
+
+    //STEP::对每个素材依次运行所有场景
+    //STEP::Run all scenarios on each media in turn
+    const char *scenarioList[] = {"remux", "remux_stream", "transcode"};
+    std::vector<Result> resultList;
+    for(int i=0;i<mediaLength;i++){
+        for(unsigned int j=0;j<sizeof(scenarioList) / sizeof(*scenarioList);j++){
+            std::cout<<"run "<<scenarioList[j]<<" "<<mediaList[i].name<<std::endl;
+            resultList.push_back(Step2_RunScenario(scenarioList[j], &mediaList[i]));
+        }
+    }
+
+    //STEP::输出结果
+    //STEP::Output the results
+    Step3_Report(resultList);
+}
@@ -0,0 +1,68 @@
+/*
+ * 内存分配计数，remux_tofile.cpp、remux_tostream.cpp、benchmark.cpp使用
+ * Allocation counting, used by remux_tofile.cpp, remux_tostream.cpp and benchmark.cpp
+ * Depends on glibc
+ * Wirte by stoprefactoring.com
+*/
+
+#ifndef COMMON_ALLOC_COUNT_H
+#define COMMON_ALLOC_COUNT_H
+
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+
+//内存分配次数和字节数，每个程序只有一个.cpp，所以直接定义在头文件中
+//Allocation count and bytes, every program has only one .cpp, so they are defined in the header directly
+std::atomic<int64_t> allocCount(0);
+std::atomic<int64_t> allocBytes(0);
+
+//只有编译时定义ALLOC_COUNT（cmake -DALLOC_COUNT=ON）才替换malloc、calloc、realloc、posix_memalign、aligned_alloc，FFmpeg（av_malloc）和C++的new都会经过这里，计数后交给glibc分配
+//未定义时不替换任何函数，计数始终为0，isAllocCount为false，调用方不输出分配统计
+//Only when ALLOC_COUNT is defined at compile time (cmake -DALLOC_COUNT=ON) are malloc, calloc, realloc, posix_memalign and aligned_alloc replaced, FFmpeg (av_malloc) and C++ new all pass through here, they are counted and handed to glibc
+//When it is not defined nothing is replaced, the counts stay 0, isAllocCount is false and the callers do not report allocations
+#ifdef ALLOC_COUNT
+const bool isAllocCount = true;
+extern "C" {
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t count, size_t size);
+    void *__libc_realloc(void *pointer, size_t size);
+    void *__libc_memalign(size_t alignment, size_t size);
+    void __libc_free(void *pointer);
+
+    void *malloc(size_t size) throw(){
+        allocCount.fetch_add(1, std::memory_order_relaxed);
+        allocBytes.fetch_add(size, std::memory_order_relaxed);
+        return __libc_malloc(size);
+    }
+    void *calloc(size_t count, size_t size) throw(){
+        allocCount.fetch_add(1, std::memory_order_relaxed);
+        allocBytes.fetch_add(count * size, std::memory_order_relaxed);
+        return __libc_calloc(count, size);
+    }
+    void *realloc(void *pointer, size_t size) throw(){
+        allocCount.fetch_add(1, std::memory_order_relaxed);
+        allocBytes.fetch_add(size, std::memory_order_relaxed);
+        return __libc_realloc(pointer, size);
+    }
+    int posix_memalign(void **pointer, size_t alignment, size_t size) throw(){
+        allocCount.fetch_add(1, std::memory_order_relaxed);
+        allocBytes.fetch_add(size, std::memory_order_relaxed);
+        *pointer = __libc_memalign(alignment, size);
+        return *pointer ? 0 : ENOMEM;
+    }
+    void *aligned_alloc(size_t alignment, size_t size) throw(){
+        allocCount.fetch_add(1, std::memory_order_relaxed);
+        allocBytes.fetch_add(size, std::memory_order_relaxed);
+        return __libc_memalign(alignment, size);
+    }
+    void free(void *pointer) throw(){
+        __libc_free(pointer);
+    }
+}
+#else
+const bool isAllocCount = false;
+#endif
+
+#endif
@@ -0,0 +1,284 @@
+/*
+ * 索引文件格式和读取，remux_index.cpp生成，remux_tofile.cpp、transcode.cpp、transcode_chunked.cpp读取
+ * The index file format and reader, built by remux_index.cpp, read by remux_tofile.cpp, transcode.cpp and transcode_chunked.cpp
+ * Depends on FFmpeg 6.0
+ * Wirte by stoprefactoring.com
+*/
+
+#ifndef COMMON_INDEX_FORMAT_H
+#define COMMON_INDEX_FORMAT_H
+
+#include <iostream>
+#include <string>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+extern "C" {
+    #include <libavformat/avformat.h>
+}
+
+//索引文件格式，所有结构体按8字节对齐，可直接mmap后使用
+//文件布局：IndexHeader | IndexStream × streamCount | IndexKeyframe × keyframeCount | IndexPacket × packetCount | extradata
+//remux_tofile.cpp的轨道参数缓存使用相同的格式，没有关键帧和数据包，sourceSize、sourceHash为输入地址的长度和哈希
+//Index file format, all structures are 8-byte aligned so the file can be used directly after mmap
+//File layout: IndexHeader | IndexStream × streamCount | IndexKeyframe × keyframeCount | IndexPacket × packetCount | extradata
+//The track parameter cache of remux_tofile.cpp uses the same format without keyframes and packets, sourceSize and sourceHash are the length and hash of the input address
+#define INDEX_MAGIC "VPINDEX"
+#define INDEX_VERSION 1
+#define INDEX_HASH_SIZE 65536
+
+typedef struct IndexHeader {
+    char magic[8];                                                              //INDEX_MAGIC
+    uint32_t version;                                                           //格式版本，format version
+    uint32_t streamCount;                                                       //轨道数，number of tracks
+    int64_t sourceSize;                                                         //源文件大小，source file size
+    int64_t sourceMtime;                                                        //源文件修改时间（纳秒），source file modification time (nanoseconds)
+    uint64_t sourceHash;                                                        //源文件头尾各64KB的哈希，hash of the first and last 64KB of the source file
+    int64_t startTime;                                                          //AVFormatContext.start_time
+    int64_t duration;                                                           //AVFormatContext.duration
+    int64_t keyframeCount;                                                      //关键帧总数，total number of keyframes
+    int64_t packetCount;                                                        //数据包总数，total number of packets
+    int64_t extradataSize;                                                      //extradata总字节数，total bytes of extradata
+    char formatName[64];                                                        //解封装器名称，demuxer name
+} IndexHeader;
+
+typedef struct IndexStream {
+    int64_t bitRate;
+    int64_t startTime;                                                          //AVStream.start_time
+    int64_t duration;                                                           //AVStream.duration
+    int64_t extradataOffset;                                                    //在extradata区的偏移，offset in the extradata area
+    int64_t extradataSize;
+    int64_t keyframeOffset;                                                     //本轨道第一个关键帧在关键帧表中的序号，index of the first keyframe of this track in the keyframe table
+    int64_t keyframeCount;
+    int32_t codecType;
+    int32_t codecID;
+    int32_t format;
+    int32_t profile;
+    int32_t level;
+    int32_t width;
+    int32_t height;
+    int32_t sampleRate;
+    int32_t channels;
+    int32_t fieldOrder;
+    int32_t colorRange;
+    int32_t colorPrimaries;
+    int32_t colorTrc;
+    int32_t colorSpace;
+    int32_t sampleAspectRatio[2];
+    int32_t timeBase[2];
+    int32_t frameRate[2];                                                       //AVStream.r_frame_rate
+    int32_t avgFrameRate[2];                                                    //AVStream.avg_frame_rate
+} IndexStream;
+
+//关键帧，同一轨道内按pts排序，时间戳为轨道的timebase
+//Keyframe, sorted by pts within a track, timestamps are in the track timebase
+typedef struct IndexKeyframe {
+    int64_t pos;                                                                //字节位置，-1表示未知，byte offset, -1 means unknown
+    int64_t pts;
+    int64_t dts;
+} IndexKeyframe;
+
+//数据包，按文件中的顺序排列
+//Packet, in file order
+typedef struct IndexPacket {
+    int64_t dts;
+    int32_t size;
+    int16_t stream;
+    int16_t flags;                                                              //AV_PKT_FLAG_*
+} IndexPacket;
+
+//已加载的索引，header为NULL表示没有可用的索引
+//The loaded index, header is NULL when no index is available
+typedef struct SourceIndex {
+    void *mapping;                                                              //mmap的索引文件，mmap'ed index file
+    size_t size;                                                                //索引文件大小，index file size
+    const IndexHeader *header;
+    const IndexStream *streams;
+    const IndexKeyframe *keyframes;
+    const IndexPacket *packets;
+    const uint8_t *extradata;
+} SourceIndex;
+
+static inline uint64_t Index_Hash(const char *path, int64_t size){
+    //STEP::对文件头尾各64KB计算FNV-1a哈希，大小、修改时间不变但内容被改写时也能发现
+    //STEP::FNV-1a hash of the first and last 64KB of the file, detects rewritten content even when size and modification time are unchanged
+    uint64_t hash = 14695981039346656037ULL;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        return 0;
+    }
+    uint8_t buffer[INDEX_HASH_SIZE];
+    int64_t offsetList[2] = {0, size > INDEX_HASH_SIZE ? size - INDEX_HASH_SIZE : 0};
+    for(int i=0;i<2;i++){
+        ssize_t length = pread(fd, buffer, sizeof(buffer), offsetList[i]);
+        for(ssize_t j=0;j<length;j++){
+            hash = (hash ^ buffer[j]) * 1099511628211ULL;
+        }
+    }
+    close(fd);
+    return hash;
+}
+
+static inline void Index_Close(SourceIndex *sourceIndex){
+    if(sourceIndex->mapping){
+        munmap(sourceIndex->mapping, sourceIndex->size);
+    }
+    memset(sourceIndex, 0, sizeof(*sourceIndex));
+}
+
+static inline bool Index_Map(SourceIndex *sourceIndex, const char *path){
+    //STEP::映射索引文件并检查格式和大小，成功时填写sourceIndex
+    //STEP::Map the index file and check its format and size, fill sourceIndex on success
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        return false;
+    }
+    struct stat indexStat;
+    if(fstat(fd, &indexStat) < 0 || indexStat.st_size < (off_t)sizeof(IndexHeader)){
+        close(fd);
+        return false;
+    }
+    void *mapping = mmap(NULL, indexStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED){
+        return false;
+    }
+    const IndexHeader *header = (const IndexHeader *)mapping;
+    int64_t expectSize = sizeof(IndexHeader) + (int64_t)header->streamCount * sizeof(IndexStream) + header->keyframeCount * (int64_t)sizeof(IndexKeyframe) +
+                         header->packetCount * (int64_t)sizeof(IndexPacket) + header->extradataSize;
+    if(memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || header->version != INDEX_VERSION || expectSize != indexStat.st_size){
+        munmap(mapping, indexStat.st_size);
+        return false;
+    }
+    sourceIndex->mapping = mapping;
+    sourceIndex->size = indexStat.st_size;
+    sourceIndex->header = header;
+    sourceIndex->streams = (const IndexStream *)(header + 1);
+    sourceIndex->keyframes = (const IndexKeyframe *)(sourceIndex->streams + header->streamCount);
+    sourceIndex->packets = (const IndexPacket *)(sourceIndex->keyframes + header->keyframeCount);
+    sourceIndex->extradata = (const uint8_t *)(sourceIndex->packets + header->packetCount);
+    return true;
+}
+
+static inline bool Index_Open(SourceIndex *sourceIndex, const char *inFilePath, const char *indexSuffix){
+    //STEP::映射本地源文件的索引文件（源文件路径加indexSuffix），检查源文件的大小、修改时间、哈希，任一不一致时忽略索引
+    //STEP::Map the index file of a local source file (the source path plus indexSuffix), check the size, modification time and hash of the source file, ignore the index if any of them differs
+    if(sourceIndex->header){
+        return true;
+    }
+    if(!indexSuffix || strstr(inFilePath, "://")){
+        return false;
+    }
+    std::string indexPath = std::string(inFilePath) + indexSuffix;
+    struct stat sourceStat;
+    if(stat(inFilePath, &sourceStat) < 0 || !Index_Map(sourceIndex, indexPath.c_str())){
+        return false;
+    }
+    const IndexHeader *header = sourceIndex->header;
+    bool isValid = header->sourceSize == sourceStat.st_size &&
+                   header->sourceMtime == sourceStat.st_mtim.tv_sec * 1000000000LL + sourceStat.st_mtim.tv_nsec &&
+                   header->sourceHash == Index_Hash(inFilePath, sourceStat.st_size);
+    if(!isValid){
+        std::cout<<"index "<<indexPath<<" is stale, ignored"<<std::endl;
+        Index_Close(sourceIndex);
+        return false;
+    }
+    return true;
+}
+
+static inline bool Index_ApplyStreams(const SourceIndex *sourceIndex, AVFormatContext *inFileHandle){
+    //STEP::用索引中的参数补全解封装器读到的轨道参数，代替avformat_find_stream_info；轨道数或编码不一致时返回false，改为完整探测
+    //STEP::Complete the track parameters read by the demuxer with the ones in the index, instead of avformat_find_stream_info; return false when the number of tracks or the codecs differ, to do a full probe
+    if(!sourceIndex->header || inFileHandle->nb_streams != sourceIndex->header->streamCount){
+        return false;
+    }
+    for(unsigned int i = 0; i < inFileHandle->nb_streams; i++) {
+        AVCodecParameters *codecpar = inFileHandle->streams[i]->codecpar;
+        const IndexStream *indexStream = &sourceIndex->streams[i];
+        if(codecpar->codec_type != indexStream->codecType || (codecpar->codec_id != AV_CODEC_ID_NONE && codecpar->codec_id != indexStream->codecID)){
+            return false;
+        }
+    }
+    for(unsigned int i = 0; i < inFileHandle->nb_streams; i++) {
+        AVStream *inStream = inFileHandle->streams[i];
+        AVCodecParameters *codecpar = inStream->codecpar;
+        const IndexStream *indexStream = &sourceIndex->streams[i];
+        codecpar->codec_id = (AVCodecID)indexStream->codecID;
+        codecpar->format = indexStream->format;
+        codecpar->profile = indexStream->profile;
+        codecpar->level = indexStream->level;
+        codecpar->width = indexStream->width;
+        codecpar->height = indexStream->height;
+        codecpar->sample_rate = indexStream->sampleRate;
+        if(indexStream->channels > 0 && codecpar->ch_layout.nb_channels == 0){
+            av_channel_layout_default(&codecpar->ch_layout, indexStream->channels);
+        }
+        codecpar->field_order = (AVFieldOrder)indexStream->fieldOrder;
+        codecpar->color_range = (AVColorRange)indexStream->colorRange;
+        codecpar->color_primaries = (AVColorPrimaries)indexStream->colorPrimaries;
+        codecpar->color_trc = (AVColorTransferCharacteristic)indexStream->colorTrc;
+        codecpar->color_space = (AVColorSpace)indexStream->colorSpace;
+        codecpar->sample_aspect_ratio = av_make_q(indexStream->sampleAspectRatio[0], indexStream->sampleAspectRatio[1]);
+        if(codecpar->bit_rate <= 0){
+            codecpar->bit_rate = indexStream->bitRate;
+        }
+        if(codecpar->extradata_size <= 0 && indexStream->extradataSize > 0){
+            codecpar->extradata = (uint8_t *)av_mallocz(indexStream->extradataSize + AV_INPUT_BUFFER_PADDING_SIZE);
+            if(!codecpar->extradata){
+                return false;
+            }
+            memcpy(codecpar->extradata, sourceIndex->extradata + indexStream->extradataOffset, indexStream->extradataSize);
+            codecpar->extradata_size = indexStream->extradataSize;
+        }
+        inStream->r_frame_rate = av_make_q(indexStream->frameRate[0], indexStream->frameRate[1]);
+        inStream->avg_frame_rate = av_make_q(indexStream->avgFrameRate[0], indexStream->avgFrameRate[1]);
+        if(inStream->start_time == AV_NOPTS_VALUE){
+            inStream->start_time = indexStream->startTime;
+        }
+        if(inStream->duration == AV_NOPTS_VALUE){
+            inStream->duration = indexStream->duration;
+        }
+    }
+    if(inFileHandle->start_time == AV_NOPTS_VALUE){
+        inFileHandle->start_time = sourceIndex->header->startTime;
+    }
+    if(inFileHandle->duration == AV_NOPTS_VALUE){
+        inFileHandle->duration = sourceIndex->header->duration;
+    }
+    return true;
+}
+
+static inline int Index_Seek(const SourceIndex *sourceIndex, AVFormatContext *inFileHandle, int streamIndex, int64_t time){
+    //STEP::二分查找pts不大于time的最后一个关键帧，按它的dts定位，解封装器不必自己搜索；按时间戳定位失败时按字节位置定位
+    //没有索引时使用解封装器自己的定位
+    //STEP::Binary search the last keyframe whose pts is not greater than time and seek to its dts, so the demuxer does not have to search; seek to its byte position if seeking by timestamp fails
+    //Without an index the demuxer's own seeking is used
+    if(!sourceIndex->header || streamIndex < 0 || sourceIndex->streams[streamIndex].keyframeCount == 0){
+        return av_seek_frame(inFileHandle, -1, time, AVSEEK_FLAG_BACKWARD);
+    }
+    const IndexStream *indexStream = &sourceIndex->streams[streamIndex];
+    const IndexKeyframe *keyframeList = sourceIndex->keyframes + indexStream->keyframeOffset;
+    int64_t target = av_rescale_q(time, AV_TIME_BASE_Q, inFileHandle->streams[streamIndex]->time_base);
+    int64_t low = 0;
+    int64_t high = indexStream->keyframeCount - 1;
+    int64_t found = 0;
+    while(low <= high){
+        int64_t middle = (low + high) / 2;
+        if(keyframeList[middle].pts <= target){
+            found = middle;
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    int result = av_seek_frame(inFileHandle, streamIndex, keyframeList[found].dts, AVSEEK_FLAG_BACKWARD);
+    if(result < 0 && keyframeList[found].pos >= 0){
+        result = av_seek_frame(inFileHandle, streamIndex, keyframeList[found].pos, AVSEEK_FLAG_BYTE);
+    }
+    return result;
+}
+
+#endif
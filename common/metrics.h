@@ -0,0 +1,267 @@
+/*
+ * 性能统计，remux_tofile.cpp、remux_tostream.cpp、transcode.cpp使用
+ * Metrics, used by remux_tofile.cpp, remux_tostream.cpp and transcode.cpp
+ * Depends on FFmpeg 6.0
+ * Wirte by stoprefactoring.com
+*/
+
+#ifndef COMMON_METRICS_H
+#define COMMON_METRICS_H
+
+#include <iostream>
+#include <string>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+extern "C" {
+    #include <libavutil/time.h>
+    #include <libavformat/avformat.h>
+}
+
+//性能统计：每个轨道、每个处理阶段的耗时直方图，输入输出字节数，处理速度（相对实时的倍数）
+//直方图按2的幂分桶，每次记录只有一次取时间和几次加法，开销可以忽略
+//处理阶段、统计配置由各程序定义，各程序特有的指标通过MetricsExtra追加
+//Metrics: latency histograms per track and per processing stage, bytes in and out, processing speed (multiple of realtime)
+//The histograms use power-of-2 buckets, each record costs one clock read and a few additions, the overhead is negligible
+//The processing stages and the configuration are defined by each program, metrics specific to a program are appended through MetricsExtra
+typedef enum MetricsFormat {
+    METRICS_NONE = 0,                                                           //关闭统计，各统计点只有一次判断，metrics disabled, each measuring point costs only one check
+    METRICS_PROMETHEUS,                                                         //Prometheus文本格式，可由node_exporter的textfile收集，Prometheus text format, can be collected by the node_exporter textfile collector
+    METRICS_JSON,                                                               //JSON格式，JSON format
+} MetricsFormat;
+
+//直方图桶数，第i个桶统计耗时不超过2^i微秒的次数，最后一个桶统计更长的耗时
+//Number of histogram buckets, bucket i counts latencies of at most 2^i microseconds, the last bucket counts longer latencies
+#define METRICS_BUCKET_LENGTH 24
+
+typedef struct Histogram {
+    int64_t bucket[METRICS_BUCKET_LENGTH];                                      //各桶的次数，count of each bucket
+    int64_t count;                                                              //总次数，total count
+    int64_t sum;                                                                //总耗时（微秒），total latency (microseconds)
+} Histogram;
+
+//追加程序特有的指标：Prometheus格式追加完整的行，JSON格式追加以逗号开头的字段，位于stages之后
+//Append the metrics specific to a program: whole lines for Prometheus, fields starting with a comma for JSON, placed after stages
+typedef void (*MetricsExtra)(std::string *text, MetricsFormat format);
+
+typedef struct Metrics {
+    MetricsFormat format;                                                       //导出格式，export format
+    const char *name;                                                           //指标名前缀，metric name prefix
+    const char *filePath;                                                       //导出文件路径，NULL表示不写文件，export file path, NULL means no file
+    int interval;                                                               //导出间隔（秒），export interval (seconds)
+    const char **stageName;                                                     //处理阶段的名称，names of the processing stages
+    int stageLength;                                                            //处理阶段数，number of processing stages
+    MetricsExtra extra;                                                         //程序特有的指标，可为NULL，metrics specific to the program, can be NULL
+    Histogram *histogram;                                                       //按[轨道][阶段]排列的直方图，histograms laid out as [track][stage]
+    int streamLength;                                                           //轨道数，number of tracks
+    int64_t bytesIn;                                                            //读取的数据包字节数，bytes of packets read
+    int64_t startTime;                                                          //开始时间，start time
+    int64_t exportTime;                                                         //上次导出时间，last export time
+    int64_t firstDts;                                                           //第一个数据包的dts（微秒），dts of the first packet (microseconds)
+    int64_t lastDts;                                                            //最新数据包的dts（微秒），dts of the latest packet (microseconds)
+    int udpFd;                                                                  //UDP导出的socket，socket for UDP export
+    struct sockaddr_in udpAddress;                                              //UDP导出地址，UDP export address
+} Metrics;
+
+//统计状态，每个程序只有一个.cpp，所以直接定义在头文件中
+//Metrics state, every program has only one .cpp, so it is defined in the header directly
+Metrics metrics = {METRICS_NONE};
+
+static inline bool Metrics_Init(MetricsFormat format, const char *name, const char *filePath, const char *udpAddress, int interval,
+                                const char **stageName, int stageLength, int streamLength, MetricsExtra extra){
+    //STEP::保存配置，分配直方图，需要时创建UDP socket；udpAddress格式为ip:port，NULL表示不发送
+    //STEP::Keep the configuration, allocate the histograms, create the UDP socket when needed; udpAddress is in ip:port format, NULL means not sending
+    metrics.format = format;
+    metrics.udpFd = -1;
+    if(format == METRICS_NONE){
+        return true;
+    }
+    metrics.name = name;
+    metrics.filePath = filePath;
+    metrics.interval = interval;
+    metrics.stageName = stageName;
+    metrics.stageLength = stageLength;
+    metrics.extra = extra;
+    metrics.streamLength = streamLength;
+    metrics.histogram = (Histogram *)av_calloc(streamLength * stageLength, sizeof(*metrics.histogram));
+    if(!metrics.histogram){
+        std::cout<<"could not allocate metrics"<<std::endl;
+        return false;
+    }
+    metrics.bytesIn = 0;
+    metrics.startTime = av_gettime_relative();
+    metrics.exportTime = metrics.startTime;
+    metrics.firstDts = AV_NOPTS_VALUE;
+    metrics.lastDts = AV_NOPTS_VALUE;
+    if(udpAddress){
+        std::string address = udpAddress;
+        size_t colon = address.rfind(':');
+        memset(&metrics.udpAddress, 0, sizeof(metrics.udpAddress));
+        metrics.udpAddress.sin_family = AF_INET;
+        metrics.udpAddress.sin_port = htons(colon == std::string::npos ? 0 : atoi(address.c_str() + colon + 1));
+        if(colon == std::string::npos || inet_pton(AF_INET, address.substr(0, colon).c_str(), &metrics.udpAddress.sin_addr) != 1){
+            std::cout<<"invalid metrics UDP address "<<udpAddress<<std::endl;
+            return false;
+        }
+        metrics.udpFd = socket(AF_INET, SOCK_DGRAM, 0);
+        if(metrics.udpFd < 0){
+            std::cout<<"could not create metrics socket"<<std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline int64_t Metrics_Now(){
+    return metrics.format != METRICS_NONE ? av_gettime_relative() : 0;
+}
+
+static inline void Histogram_Add(Histogram *histogram, int64_t cost){
+    //STEP::记录一次耗时，桶序号为耗时向上取整的log2
+    //STEP::Record a latency, the bucket index is the log2 of the latency rounded up
+    int index = cost > 1 ? 64 - __builtin_clzll(cost - 1) : 0;
+    if(index >= METRICS_BUCKET_LENGTH){
+        index = METRICS_BUCKET_LENGTH - 1;
+    }
+    histogram->bucket[index]++;
+    histogram->count++;
+    histogram->sum += cost;
+}
+
+static inline void Metrics_Record(int streamIndex, int stage, int64_t startTime){
+    if(metrics.format == METRICS_NONE){
+        return;
+    }
+    Histogram_Add(&metrics.histogram[streamIndex * metrics.stageLength + stage], av_gettime_relative() - startTime);
+}
+
+static inline void Metrics_Progress(AVStream *inStream, AVPacket *packet){
+    //STEP::记录读取的字节数和处理到的时间位置，用于计算处理速度
+    //STEP::Record the bytes read and the processed time position, used to calculate the processing speed
+    if(metrics.format == METRICS_NONE){
+        return;
+    }
+    metrics.bytesIn += packet->size;
+    if(packet->dts == AV_NOPTS_VALUE){
+        return;
+    }
+    int64_t dts = av_rescale_q(packet->dts, inStream->time_base, AV_TIME_BASE_Q);
+    if(metrics.firstDts == AV_NOPTS_VALUE || dts < metrics.firstDts){
+        metrics.firstDts = dts;
+    }
+    if(metrics.lastDts == AV_NOPTS_VALUE || dts > metrics.lastDts){
+        metrics.lastDts = dts;
+    }
+}
+
+static inline void Metrics_Append(std::string *text, const char *format, ...){
+    char buffer[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    text->append(buffer);
+}
+
+static inline void Metrics_Export(AVFormatContext *outFileHandle, bool isForce){
+    //STEP::到达导出间隔时，生成Prometheus文本或JSON，输出字节数取输出句柄的写入位置
+    //STEP::When the export interval is reached, generate Prometheus text or JSON, the bytes out are the write position of the output handle
+    if(metrics.format == METRICS_NONE){
+        return;
+    }
+    int64_t now = av_gettime_relative();
+    if(!isForce && now - metrics.exportTime < metrics.interval * 1000000LL){
+        return;
+    }
+    metrics.exportTime = now;
+    double elapsed = (now - metrics.startTime) / 1000000.0;
+    double speed = elapsed > 0 && metrics.firstDts != AV_NOPTS_VALUE ? (metrics.lastDts - metrics.firstDts) / 1000000.0 / elapsed : 0;
+    int64_t bytesOut = outFileHandle && outFileHandle->pb ? avio_tell(outFileHandle->pb) : 0;
+    const char *name = metrics.name;
+
+    std::string text;
+    if(metrics.format == METRICS_PROMETHEUS){
+        Metrics_Append(&text, "# TYPE %s_stage_latency_us histogram\n", name);
+        for(int i=0;i<metrics.streamLength;i++){
+            for(int j=0;j<metrics.stageLength;j++){
+                Histogram *histogram = &metrics.histogram[i * metrics.stageLength + j];
+                if(histogram->count == 0){
+                    continue;
+                }
+                int64_t cumulative = 0;
+                for(int k=0;k<METRICS_BUCKET_LENGTH - 1;k++){
+                    cumulative += histogram->bucket[k];
+                    Metrics_Append(&text, "%s_stage_latency_us_bucket{stream=\"%d\",stage=\"%s\",le=\"%lld\"} %" PRId64 "\n", name, i, metrics.stageName[j], 1LL << k, cumulative);
+                }
+                Metrics_Append(&text, "%s_stage_latency_us_bucket{stream=\"%d\",stage=\"%s\",le=\"+Inf\"} %" PRId64 "\n", name, i, metrics.stageName[j], histogram->count);
+                Metrics_Append(&text, "%s_stage_latency_us_sum{stream=\"%d\",stage=\"%s\"} %" PRId64 "\n", name, i, metrics.stageName[j], histogram->sum);
+                Metrics_Append(&text, "%s_stage_latency_us_count{stream=\"%d\",stage=\"%s\"} %" PRId64 "\n", name, i, metrics.stageName[j], histogram->count);
+            }
+        }
+        Metrics_Append(&text, "# TYPE %s_bytes_in_total counter\n%s_bytes_in_total %" PRId64 "\n", name, name, metrics.bytesIn);
+        Metrics_Append(&text, "# TYPE %s_bytes_out_total counter\n%s_bytes_out_total %" PRId64 "\n", name, name, bytesOut);
+        Metrics_Append(&text, "# TYPE %s_speed gauge\n%s_speed %.3f\n", name, name, speed);
+        if(metrics.extra){
+            metrics.extra(&text, metrics.format);
+        }
+    } else {
+        Metrics_Append(&text, "{\"name\":\"%s\",\"elapsed\":%.3f,\"speed\":%.3f,\"bytes_in\":%" PRId64 ",\"bytes_out\":%" PRId64 ",\"stages\":[",
+                       name, elapsed, speed, metrics.bytesIn, bytesOut);
+        bool isFirstStage = true;
+        for(int i=0;i<metrics.streamLength;i++){
+            for(int j=0;j<metrics.stageLength;j++){
+                Histogram *histogram = &metrics.histogram[i * metrics.stageLength + j];
+                if(histogram->count == 0){
+                    continue;
+                }
+                Metrics_Append(&text, "%s{\"stream\":%d,\"stage\":\"%s\",\"count\":%" PRId64 ",\"sum_us\":%" PRId64 ",\"buckets\":[",
+                               isFirstStage ? "" : ",", i, metrics.stageName[j], histogram->count, histogram->sum);
+                for(int k=0;k<METRICS_BUCKET_LENGTH;k++){
+                    Metrics_Append(&text, "%s%" PRId64, k ? "," : "", histogram->bucket[k]);
+                }
+                Metrics_Append(&text, "]}");
+                isFirstStage = false;
+            }
+        }
+        Metrics_Append(&text, "]");
+        if(metrics.extra){
+            metrics.extra(&text, metrics.format);
+        }
+        Metrics_Append(&text, "}\n");
+    }
+
+    //STEP::写入临时文件后rename，读取方不会读到写了一半的内容；需要时通过UDP发送
+    //STEP::Write a temporary file and rename it, so readers never see a half-written file; send via UDP when needed
+    if(metrics.filePath){
+        std::string tempPath = std::string(metrics.filePath) + ".tmp";
+        FILE *file = fopen(tempPath.c_str(), "w");
+        if(file){
+            bool isWritten = fwrite(text.data(), 1, text.size(), file) == text.size();
+            if(fclose(file) == 0 && isWritten){
+                rename(tempPath.c_str(), metrics.filePath);
+            }
+        }
+    }
+    if(metrics.udpFd >= 0){
+        sendto(metrics.udpFd, text.data(), text.size(), 0, (struct sockaddr *)&metrics.udpAddress, sizeof(metrics.udpAddress));
+    }
+}
+
+static inline void Metrics_Free(){
+    if(metrics.format == METRICS_NONE){
+        return;
+    }
+    av_freep(&metrics.histogram);
+    if(metrics.udpFd >= 0){
+        close(metrics.udpFd);
+        metrics.udpFd = -1;
+    }
+}
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * 编解码线程分配规则，transcode.cpp、transcode_pipeline.cpp使用
+ * The codec thread allocation rules, used by transcode.cpp and transcode_pipeline.cpp
+ * Depends on FFmpeg 6.0
+ * Wirte by stoprefactoring.com
+*/
+
+#ifndef COMMON_THREAD_POLICY_H
+#define COMMON_THREAD_POLICY_H
+
+#include <iostream>
+#include <vector>
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavutil/cpu.h>
+}
+
+//一个轨道的编解码线程数
+//Codec threads of one track
+typedef struct ThreadPlan {
+    int decodeThreads;                                                          //解码线程数，number of decoder threads
+    int encodeThreads;                                                          //编码线程数，number of encoder threads
+} ThreadPlan;
+
+static inline double ThreadPolicy_Cost(AVFormatContext *inFileHandle, AVStream *inStream){
+    //STEP::视频轨道的像素率（宽x高x帧率），帧率未知时按25计算
+    //STEP::Pixel rate of a video track (width x height x fps), 25 fps when the frame rate is unknown
+    AVRational frameRate = av_guess_frame_rate(inFileHandle, inStream, NULL);
+    double fps = frameRate.num > 0 && frameRate.den > 0 ? av_q2d(frameRate) : 25;
+    return (double)inStream->codecpar->width * inStream->codecpar->height * fps;
+}
+
+static inline std::vector<ThreadPlan> ThreadPolicy_Plan(AVFormatContext *inFileHandle, const std::vector<bool> &isCodecList, int threadBudget){
+    //STEP::计算线程预算，threadBudget为0时使用全部CPU核心；音频编解码开销很小，每个音频解码器、编码器只分配1个线程；isCodecList为false的轨道（如复制的轨道）不需要编解码线程
+    //STEP::Calculate the thread budget, all CPU cores when threadBudget is 0; audio codecs cost very little, so each audio decoder and encoder only gets 1 thread; tracks whose isCodecList is false (such as copied tracks) need no codec threads
+    std::vector<ThreadPlan> planList(isCodecList.size());
+    int budget = threadBudget > 0 ? threadBudget : av_cpu_count();
+    double videoCost = 0;
+    for(size_t i=0;i<isCodecList.size();i++){
+        AVStream *inStream = inFileHandle->streams[i];
+        planList[i].decodeThreads = 1;
+        planList[i].encodeThreads = 1;
+        if(!isCodecList[i]){
+            continue;
+        }
+        if(inStream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO){
+            budget -= 2;
+        } else if(inStream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO){
+            videoCost += ThreadPolicy_Cost(inFileHandle, inStream);
+        }
+    }
+    if(budget < 1){
+        budget = 1;
+    }
+
+    //STEP::剩余线程按每个视频轨道的像素率分配，其中约1/4给解码器，其余给编码器（h265编码比h264解码慢得多）
+    //STEP::The remaining threads are shared by the pixel rate of each video track, about 1/4 for the decoder and the rest for the encoder (h265 encoding is much slower than h264 decoding)
+    for(size_t i=0;i<isCodecList.size();i++){
+        AVStream *inStream = inFileHandle->streams[i];
+        if(inStream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO || videoCost <= 0 || !isCodecList[i]){
+            continue;
+        }
+        int threads = (int)(budget * ThreadPolicy_Cost(inFileHandle, inStream) / videoCost);
+        if(threads < 2){
+            threads = 2;
+        }
+        planList[i].decodeThreads = threads / 4 > 1 ? threads / 4 : 1;
+        planList[i].encodeThreads = threads - planList[i].decodeThreads;
+        std::cout<<"stream "<<i<<": decoder threads "<<planList[i].decodeThreads<<", encoder threads "<<planList[i].encodeThreads<<std::endl;
+    }
+    return planList;
+}
+
+#endif
@@ -0,0 +1,299 @@
+/*
+ * 批量转封装例子，从清单文件读取多组输入输出路径，用工作线程池并行转封装，适合大量文件的离线处理
+ * The sample of batch remuxing, reads input/output path pairs from a manifest file and remuxes them in parallel on a worker thread pool, suitable for offline processing of large file sets
+ * Depends on FFmpeg 6.0
+ * Wirte by stoprefactoring.com
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+extern "C" {
+    #include <libavutil/timestamp.h>
+    #include <libavutil/time.h>
+    #include <libavutil/cpu.h>
+    #include <libavutil/error.h>
+    #include <libavformat/avformat.h>
+}
+
+//清单文件路径，每行一个任务："输入路径 输出路径"，输出格式按输出文件后缀判断，#开头的行为注释
+//Manifest file path, one job per line: "input_path output_path", the output format is guessed from the output file suffix, lines starting with # are comments
+const char *manifestPath = "./manifest.txt";
+
+//工作线程数，0表示使用CPU核心数
+//转封装主要是磁盘读写，源文件与输出文件在同一块机械硬盘时，建议设置为较小的值（如2），避免磁头来回寻道
+//Number of worker threads, 0 means the number of CPU cores
+//Remuxing is mostly disk I/O, when the input and output files are on the same hard disk, a small value (e.g. 2) is recommended to avoid seeking back and forth
+const int workerCount = 0;
+
+//单个任务的上下文，原来remux_tofile.cpp中的全局变量都放到这里，每个工作线程各自使用
+//The context of a single job, the global variables of remux_tofile.cpp are all moved here, so each worker thread uses its own
+typedef struct RemuxJob {
+    std::string inFilePath;                                                     //输入文件路径，input file path
+    std::string outFilePath;                                                    //输出文件路径，output file path
+    AVFormatContext *inFileHandle;                                              //输入文件句柄，input file handle
+    AVFormatContext *outFileHandle;                                             //输出文件句柄，output file handle
+    int *streamMapping;                                                         //输入文件、输出文件的轨道序号关联表，track number correlation table for input and output files
+    int64_t inBytes;                                                            //输入文件大小，input file size
+    double costTime;                                                            //耗时（秒），time cost (seconds)
+    const char *errorStep;                                                      //出错的步骤，NULL表示成功，the failed step, NULL means success
+    int errorCode;                                                              //FFmpeg错误码，FFmpeg error code
+} RemuxJob;
+
+std::vector<RemuxJob> jobList;
+std::atomic<unsigned int> nextJob(0);
+std::mutex printMutex;
+
+void termination(const char* param){
+    std::cout<<param<<std::endl;
+    std::cout<<"Error occur, quit!"<<std::endl;
+    exit(-1);
+}
+
+int Job_Fail(RemuxJob *job, const char *step, int code){
+    //批量任务中单个文件出错不能结束整个进程，记录出错步骤后返回
+    //A failed file must not end the whole process in a batch, record the failed step and return
+    job->errorStep = step;
+    job->errorCode = code;
+    return code < 0 ? code : AVERROR_UNKNOWN;
+}
+
+int Job_OpenInFile(RemuxJob *job){
+    //STEP::打开源视频文件
+    //STEP::Open the input video file
+    int result = avformat_open_input(&job->inFileHandle, job->inFilePath.c_str(), NULL, NULL);
+    if(result<0){
+        return Job_Fail(job, "Could not open input file.", result);
+    }
+
+    //STEP::获取源视频文件的流信息
+    //STEP::Get the stream information of the source video file
+    result = avformat_find_stream_info(job->inFileHandle, NULL);
+    if(result<0){
+        return Job_Fail(job, "Failed to retrieve input stream information.", result);
+    }
+    job->inBytes = job->inFileHandle->pb ? avio_size(job->inFileHandle->pb) : 0;
+    return 0;
+}
+
+int Job_CreateOutFile(RemuxJob *job){
+    //STEP::创建输出文件句柄，输出格式按后缀判断
+    //STEP::Creates an output file handle, the format is guessed from the suffix
+    int result = avformat_alloc_output_context2(&job->outFileHandle, NULL, NULL, job->outFilePath.c_str());
+    if(result<0){
+        return Job_Fail(job, "Could not create output handle.", result);
+    }
+
+    //STEP::根据源轨道信息创建输出文件的音视频轨道
+    //STEP::Create audio/video tracks for output files based on source track information
+    int outStreamIndex = 0;
+    job->streamMapping = (int *)av_malloc_array(job->inFileHandle->nb_streams, sizeof(*job->streamMapping));
+    if(!job->streamMapping){
+        return Job_Fail(job, "Could not allocate stream mapping.", AVERROR(ENOMEM));
+    }
+    for(unsigned int i = 0; i < job->inFileHandle->nb_streams; i++) {
+        AVStream *inStream = job->inFileHandle->streams[i];
+        if (inStream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO &&                               //过滤除video、audio、subtitle以外的轨道，Filter tracks except video, audio, subtitle
+            inStream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO &&
+            inStream->codecpar->codec_type != AVMEDIA_TYPE_SUBTITLE) {
+            job->streamMapping[i] = -1;
+            continue;
+        }
+
+        AVStream *outStream = avformat_new_stream(job->outFileHandle, NULL);                       //创建输出的轨道，Creating the output track
+        if(!outStream){
+            return Job_Fail(job, "Could not create output stream.", AVERROR(ENOMEM));
+        }
+        result = avcodec_parameters_copy(outStream->codecpar, inStream->codecpar);                 //复制源轨道的信息到输出轨道，Copying information from the source track to the output track
+        if(result<0){
+            return Job_Fail(job, "Could not copy codec parameters.", result);
+        }
+        outStream->codecpar->codec_tag = 0;
+        job->streamMapping[i] = outStreamIndex++;
+    }
+
+    //STEP::打开输出文件，写入文件头信息
+    //STEP::Open the output file, write file header information
+    result = avio_open(&job->outFileHandle->pb, job->outFilePath.c_str(), AVIO_FLAG_WRITE);
+    if(result<0){
+        return Job_Fail(job, "Could not open out file.", result);
+    }
+    result = avformat_write_header(job->outFileHandle, NULL);
+    if(result<0){
+        return Job_Fail(job, "Could not write stream header to out file.", result);
+    }
+    return 0;
+}
+
+int Job_Operation(RemuxJob *job){
+    AVPacket *packet = av_packet_alloc();
+    if (!packet) {
+        return Job_Fail(job, "Could not allocate AVPacket.", AVERROR(ENOMEM));
+    }
+
+    //STEP::解封装源文件，转换时间基后写入输出文件
+    //STEP::Demux the source file, convert the timebase and write to the output file
+    int result = 0;
+    while ((result = av_read_frame(job->inFileHandle, packet)) >= 0) {
+        if(job->streamMapping[packet->stream_index] < 0){
+            av_packet_unref(packet);
+            continue;
+        }
+        AVStream *inStream = job->inFileHandle->streams[packet->stream_index];
+        AVStream *outStream = job->outFileHandle->streams[job->streamMapping[packet->stream_index]];
+        av_packet_rescale_ts(packet, inStream->time_base, outStream->time_base);
+        packet->stream_index = job->streamMapping[packet->stream_index];
+        result = av_interleaved_write_frame(job->outFileHandle, packet);
+        av_packet_unref(packet);
+        if (result < 0) {
+            av_packet_free(&packet);
+            return Job_Fail(job, "Could not mux packet.", result);
+        }
+    }
+    av_packet_free(&packet);
+    if(result != AVERROR_EOF){
+        return Job_Fail(job, "Could not read packet.", result);
+    }
+
+    //STEP::写入输出文件尾信息
+    //STEP::Write output file tail information
+    result = av_write_trailer(job->outFileHandle);
+    if(result < 0) {
+        return Job_Fail(job, "Could not write the stream trailer to out file.", result);
+    }
+    return 0;
+}
+
+void Job_End(RemuxJob *job){
+    //STEP::无论成功与否都关闭输入、输出文件，释放资源
+    //STEP::Close input and output files and free resources, whether successful or not
+    if(job->outFileHandle){
+        avio_closep(&job->outFileHandle->pb);
+        avformat_free_context(job->outFileHandle);
+        job->outFileHandle = NULL;
+    }
+    avformat_close_input(&job->inFileHandle);
+    av_freep(&job->streamMapping);
+}
+
+void Job_Run(RemuxJob *job){
+    int64_t startTime = av_gettime_relative();
+    if(Job_OpenInFile(job) >= 0 && Job_CreateOutFile(job) >= 0){
+        Job_Operation(job);
+    }
+    Job_End(job);
+    job->costTime = (av_gettime_relative() - startTime) / 1000000.0;
+
+    //STEP::输出单个任务的状态
+    //STEP::Print the status of a single job
+    std::lock_guard<std::mutex> lock(printMutex);
+    if(job->errorStep){
+        char errorString[AV_ERROR_MAX_STRING_SIZE] = {0};
+        av_make_error_string(errorString, sizeof(errorString), job->errorCode);
+        std::cout<<"[FAIL] "<<job->inFilePath<<" -> "<<job->outFilePath<<": "<<job->errorStep<<" ("<<errorString<<")"<<std::endl;
+    } else {
+        std::cout<<"[ OK ] "<<job->inFilePath<<" -> "<<job->outFilePath<<": "<<job->costTime<<"s"<<std::endl;
+    }
+}
+
+void Thread_Worker(){
+    //STEP::工作线程不断领取下一个任务，直到清单处理完
+    //STEP::Worker threads keep taking the next job until the manifest is finished
+    while(1){
+        unsigned int index = nextJob.fetch_add(1);
+        if(index >= jobList.size()){
+            break;
+        }
+        Job_Run(&jobList[index]);
+    }
+}
+
+void Step1_ReadManifest(){
+    //STEP::读取清单文件，每行解析出一组输入输出路径
+    //STEP::Read the manifest file, parse a pair of input and output paths from each line
+    std::ifstream manifest(manifestPath);
+    if(!manifest.is_open()){
+        termination("Could not open manifest file.");
+    }
+    std::string line;
+    while(std::getline(manifest, line)){
+        std::istringstream lineStream(line);
+        RemuxJob job;
+        if(!(lineStream >> job.inFilePath) || job.inFilePath[0] == '#'){
+            continue;
+        }
+        if(!(lineStream >> job.outFilePath)){
+            termination("Manifest line must contain an input path and an output path.");
+        }
+        job.inFileHandle = NULL;
+        job.outFileHandle = NULL;
+        job.streamMapping = NULL;
+        job.inBytes = 0;
+        job.costTime = 0;
+        job.errorStep = NULL;
+        job.errorCode = 0;
+        jobList.push_back(job);
+    }
+    if(jobList.empty()){
+        termination("Manifest has no job.");
+    }
+}
+
+void Step2_Operation(){
+    //STEP::启动工作线程池，等待所有任务完成
+    //STEP::Start the worker thread pool and wait for all jobs to finish
+    int threads = workerCount > 0 ? workerCount : av_cpu_count();
+    if(threads > (int)jobList.size()){
+        threads = jobList.size();
+    }
+    std::vector<std::thread> workerList;
+    for(int i=0;i<threads;i++){
+        workerList.push_back(std::thread(Thread_Worker));
+    }
+    for(unsigned int i=0;i<workerList.size();i++){
+        workerList[i].join();
+    }
+}
+
+void Step3_Report(double costTime){
+    //STEP::汇总输出成功、失败数量和整体吞吐量
+    //STEP::Print the number of successes and failures and the aggregate throughput
+    int okCount = 0;
+    int64_t totalBytes = 0;
+    for(unsigned int i=0;i<jobList.size();i++){
+        if(!jobList[i].errorStep){
+            okCount++;
+            totalBytes += jobList[i].inBytes;
+        }
+    }
+    std::cout<<"jobs: "<<jobList.size()<<", ok: "<<okCount<<", failed: "<<(jobList.size() - okCount)<<std::endl;
+    std::cout<<"time: "<<costTime<<"s, "
+             <<(costTime > 0 ? okCount / costTime : 0)<<" files/s, "
+             <<(costTime > 0 ? totalBytes / 1048576.0 / costTime : 0)<<" MB/s"<<std::endl;
+}
+
+int main(int argc, char *argv[]){
+    //STEP::读取任务清单
+    //STEP::Read the job manifest
+    Step1_ReadManifest();
+
+    //STEP::并行处理所有任务
+    //STEP::Process all jobs in parallel
+    int64_t startTime = av_gettime_relative();
+    Step2_Operation();
+
+    //STEP::输出统计结果，有任务失败时返回非0
+    //STEP::Print the statistics, return non-zero if any job failed
+    Step3_Report((av_gettime_relative() - startTime) / 1000000.0);
+    for(unsigned int i=0;i<jobList.size();i++){
+        if(jobList[i].errorStep){
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * 索引文件生成例子，读取一遍源文件，把轨道参数、关键帧位置（字节位置、pts、dts）和每个数据包的大小写入一个可mmap的索引文件
+ * 之后remux_tofile、transcode、transcode_chunked读取该索引，跳过探测、直接定位、规划并行分段；源文件变化（大小、修改时间、哈希）后索引自动失效
+ * The sample of building an index file, read the source file once, write the track parameters, keyframe positions (byte offset, pts, dts) and the size of every packet into an index file that can be mmap'ed
+ * remux_tofile, transcode and transcode_chunked then read the index to skip probing, seek directly and plan parallel chunks; the index becomes invalid automatically when the source file changes (size, modification time, hash)
+ * Depends on FFmpeg 6.0
+ * Wirte by stoprefactoring.com
+*/
+
+#include <iostream>
+#include <string>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+extern "C" {
+    #include <libavutil/timestamp.h>
+    #include <libavutil/time.h>
+    #include <libavformat/avformat.h>
+}
+#include "../common/index_format.h"
+
+int ret = 0;
+
+//源文件路径，只支持本地文件
+//Source file path, only local files are supported
+const char *inFilePath  = "../../common/test.mp4";
+
+//索引文件的后缀，索引文件路径为源文件路径加后缀，需与读取方的设置一致
+//Suffix of the index file, the index file path is the source file path plus the suffix, must match the setting of the readers
+const char *indexSuffix = ".idx";
+
+//输入文件句柄
+//Input file handle
+AVFormatContext *inFileHandle = NULL;
+
+//扫描结果
+//Scan result
+std::vector<IndexPacket> packetList;
+std::vector<std::vector<IndexKeyframe> > keyframeList;
+
+void termination(const char* param){
+    std::cout<<param<<std::endl;
+    std::cout<<"Error occur, quit!"<<std::endl;
+    exit(-1);
+}
+
+void Step1_OpenInFile(){
+    //STEP::打开源视频文件
+    //STEP::Open the input video file
+    ret = avformat_open_input(&inFileHandle, inFilePath, NULL, NULL);
+    if(ret<0){
+        termination("Could not open input file.");
+    }
+
+    //STEP::获取源视频文件的流信息，只在生成索引时做一次完整探测
+    //STEP::Get the stream information of the source video file, the full probe is only done once when building the index
+    ret = avformat_find_stream_info(inFileHandle, NULL);
+    if(ret<0){
+        termination("Failed to retrieve input stream information.");
+    }
+}
+
+void Step2_Scan(){
+    //STEP::顺序读取所有数据包，记录每个数据包的大小和每个关键帧的位置
+    //STEP::Read all packets in order, record the size of every packet and the position of every keyframe
+    AVPacket *packet = av_packet_alloc();
+    if (!packet) {
+        termination("Could not allocate AVPacket.");
+    }
+    keyframeList.resize(inFileHandle->nb_streams);
+    while (av_read_frame(inFileHandle, packet) >= 0) {
+        IndexPacket indexPacket;
+        indexPacket.dts = packet->dts;
+        indexPacket.size = packet->size;
+        indexPacket.stream = (int16_t)packet->stream_index;
+        indexPacket.flags = (int16_t)packet->flags;
+        packetList.push_back(indexPacket);
+        if(packet->flags & AV_PKT_FLAG_KEY){
+            IndexKeyframe keyframe;
+            keyframe.pos = packet->pos;
+            keyframe.pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+            keyframe.dts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+            keyframeList[packet->stream_index].push_back(keyframe);
+        }
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+
+    //STEP::关键帧按pts排序，读取方可以二分查找
+    //STEP::Sort keyframes by pts so readers can binary search
+    for(size_t i=0;i<keyframeList.size();i++){
+        std::stable_sort(keyframeList[i].begin(), keyframeList[i].end(), [](const IndexKeyframe &a, const IndexKeyframe &b){ return a.pts < b.pts; });
+    }
+}
+
+void Step3_WriteIndex(){
+    //STEP::填写文件头，记录源文件的大小、修改时间和哈希，用于判断索引是否失效
+    //STEP::Fill the header, record the size, modification time and hash of the source file, used to check whether the index is stale
+    struct stat sourceStat;
+    if(stat(inFilePath, &sourceStat) < 0){
+        termination("Could not stat input file.");
+    }
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = INDEX_VERSION;
+    header.streamCount = inFileHandle->nb_streams;
+    header.sourceSize = sourceStat.st_size;
+    header.sourceMtime = sourceStat.st_mtim.tv_sec * 1000000000LL + sourceStat.st_mtim.tv_nsec;
+    header.sourceHash = Index_Hash(inFilePath, sourceStat.st_size);
+    header.startTime = inFileHandle->start_time;
+    header.duration = inFileHandle->duration;
+    header.packetCount = packetList.size();
+    const char *formatName = inFileHandle->iformat->name;                                          //只保存第一个名称，如"mov,mp4,m4a"保存为"mov"，av_find_input_format才能找到，only the first name is kept, such as "mov" for "mov,mp4,m4a", so av_find_input_format can find it
+    size_t formatLength = strcspn(formatName, ",");
+    memcpy(header.formatName, formatName, FFMIN(formatLength, sizeof(header.formatName) - 1));
+
+    //STEP::每个轨道的参数，关键帧和extradata记录在各自区域中的位置
+    //STEP::Parameters of every track, the keyframes and extradata record their position in their own areas
+    std::vector<IndexStream> streamList(inFileHandle->nb_streams);
+    for(unsigned int i = 0; i < inFileHandle->nb_streams; i++) {
+        AVStream *inStream = inFileHandle->streams[i];
+        AVCodecParameters *codecpar = inStream->codecpar;
+        IndexStream *indexStream = &streamList[i];
+        memset(indexStream, 0, sizeof(*indexStream));
+        indexStream->bitRate = codecpar->bit_rate;
+        indexStream->startTime = inStream->start_time;
+        indexStream->duration = inStream->duration;
+        indexStream->extradataOffset = header.extradataSize;
+        indexStream->extradataSize = codecpar->extradata_size;
+        indexStream->keyframeOffset = header.keyframeCount;
+        indexStream->keyframeCount = keyframeList[i].size();
+        indexStream->codecType = codecpar->codec_type;
+        indexStream->codecID = codecpar->codec_id;
+        indexStream->format = codecpar->format;
+        indexStream->profile = codecpar->profile;
+        indexStream->level = codecpar->level;
+        indexStream->width = codecpar->width;
+        indexStream->height = codecpar->height;
+        indexStream->sampleRate = codecpar->sample_rate;
+        indexStream->channels = codecpar->ch_layout.nb_channels;
+        indexStream->fieldOrder = codecpar->field_order;
+        indexStream->colorRange = codecpar->color_range;
+        indexStream->colorPrimaries = codecpar->color_primaries;
+        indexStream->colorTrc = codecpar->color_trc;
+        indexStream->colorSpace = codecpar->color_space;
+        indexStream->sampleAspectRatio[0] = codecpar->sample_aspect_ratio.num;
+        indexStream->sampleAspectRatio[1] = codecpar->sample_aspect_ratio.den;
+        indexStream->timeBase[0] = inStream->time_base.num;
+        indexStream->timeBase[1] = inStream->time_base.den;
+        indexStream->frameRate[0] = inStream->r_frame_rate.num;
+        indexStream->frameRate[1] = inStream->r_frame_rate.den;
+        indexStream->avgFrameRate[0] = inStream->avg_frame_rate.num;
+        indexStream->avgFrameRate[1] = inStream->avg_frame_rate.den;
+        header.extradataSize += codecpar->extradata_size;
+        header.keyframeCount += keyframeList[i].size();
+    }
+
+    //STEP::先写临时文件再rename，读取方不会读到写了一半的索引
+    //STEP::Write a temporary file and then rename it, so readers never see a half-written index
+    std::string indexPath = std::string(inFilePath) + indexSuffix;
+    std::string tempPath = indexPath + ".tmp";
+    FILE *file = fopen(tempPath.c_str(), "wb");
+    if(!file){
+        termination("Could not open index file.");
+    }
+    bool isWritten = fwrite(&header, sizeof(header), 1, file) == 1;
+    isWritten = isWritten && (streamList.empty() || fwrite(streamList.data(), sizeof(IndexStream), streamList.size(), file) == streamList.size());
+    for(size_t i=0;isWritten && i<keyframeList.size();i++){
+        isWritten = keyframeList[i].empty() || fwrite(keyframeList[i].data(), sizeof(IndexKeyframe), keyframeList[i].size(), file) == keyframeList[i].size();
+    }
+    isWritten = isWritten && (packetList.empty() || fwrite(packetList.data(), sizeof(IndexPacket), packetList.size(), file) == packetList.size());
+    for(unsigned int i = 0; isWritten && i < inFileHandle->nb_streams; i++) {
+        AVCodecParameters *codecpar = inFileHandle->streams[i]->codecpar;
+        isWritten = codecpar->extradata_size <= 0 || fwrite(codecpar->extradata, 1, codecpar->extradata_size, file) == (size_t)codecpar->extradata_size;
+    }
+    if(fclose(file) != 0 || !isWritten || rename(tempPath.c_str(), indexPath.c_str()) != 0){
+        unlink(tempPath.c_str());
+        termination("Could not write index file.");
+    }
+    std::cout<<"index: "<<indexPath<<", "<<header.streamCount<<" streams, "<<header.keyframeCount<<" keyframes, "<<header.packetCount<<" packets"<<std::endl;
+}
+
+void Step4_End(){
+    //STEP::关闭输入文件，并销毁具柄
+    //STEP::Close the input file，and destroy the handle
+    avformat_close_input(&inFileHandle);
+}
+
+int main(int argc, char *argv[]){
+    //STEP::打开源文件并获取源文件信息
+    //STEP::Open input file and get input file information
+    int64_t startTime = av_gettime_relative();
+    Step1_OpenInFile();
+
+    //STEP::读取所有数据包
+    //STEP::Read all packets
+    Step2_Scan();
+
+    //STEP::写入索引文件
+    //STEP::Write the index file
+    Step3_WriteIndex();
+
+    //STEP::关闭输入文件
+    //STEP::Close the input file
+    Step4_End();
+    std::cout<<"time: "<<(av_gettime_relative() - startTime) / 1000000.0<<"s"<<std::endl;
+}
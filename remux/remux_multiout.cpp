@@ -0,0 +1,370 @@
+/*
+ * 视频转封装例子（一路输入，多路输出），只解封装一次，同时输出到文件、直播流等多个目标，每个输出有独立的写线程
+ * The sample of remuxing video (one input, several outputs), demux only once and output to files, live streams and other targets at the same time, each output has its own writer thread
+ * Depends on FFmpeg 6.0
+ * Wirte by stoprefactoring.com
+*/
+
+#include <iostream>
+#include <thread>
+#include <atomic>
+extern "C" {
+    #include <libavutil/timestamp.h>
+    #include <libavutil/time.h>
+    #include <libavformat/avformat.h>
+}
+
+int ret = 0;
+
+//输入文件路径
+//Input file path
+const char *inFilePath  = "../../common/test.mp4";
+//const char *inFilePath  = "rtmp://192.168.3.202:1935/live/test";
+
+//输出列表，每个输出有独立的写线程和队列
+//isDropOnFull为true时，队列满了直接丢弃数据包，并等到下一个视频关键帧再恢复输出，适合直播推流，慢速或卡住的推流不会拖慢其他输出
+//isDropOnFull为false时，队列满了会等待，保证不丢数据，适合录制文件
+//Output list, each output has its own writer thread and queue
+//When isDropOnFull is true, packets are dropped when the queue is full, and output resumes at the next video keyframe, suitable for live push, a slow or stalled push will not slow down other outputs
+//When isDropOnFull is false, it waits when the queue is full to ensure no data loss, suitable for recording files
+typedef struct Output {
+    const char *outFilePath;                                                    //输出路径，output path
+    const char *formatName;                                                     //输出封装格式，output format
+    bool isDropOnFull;                                                          //队列满时是否丢包，whether to drop packets when the queue is full
+} Output;
+const Output outputList[] = {
+    {"./out.flv", "flv", false},
+    {"./out.ts", "mpegts", false},
+    //{"rtmp://192.168.3.202:1935/live/out", "flv", true},
+    //{"udp://192.168.3.202:1234", "mpegts", true},
+};
+const int outputLength = sizeof(outputList) / sizeof(*outputList);
+
+//每个输出队列的深度（数据包个数）
+//The depth of each output queue (number of packets)
+const unsigned int queueDepth = 256;
+
+//输入文件句柄
+//Input file handle
+AVFormatContext *inFileHandle = NULL;
+
+//无锁有界队列，只允许一个线程写入、一个线程读取（单生产者单消费者），NULL表示数据结束
+//Lock-free bounded queue, only one thread writes and one thread reads (single producer single consumer), NULL means end of data
+typedef struct Queue {
+    void **items;                                                               //环形缓冲区，ring buffer
+    unsigned int capacity;                                                      //缓冲区长度，比队列深度多1，buffer length, 1 more than the queue depth
+    std::atomic<unsigned int> head;                                             //读取位置，只由消费者修改，read position, only modified by the consumer
+    std::atomic<unsigned int> tail;                                             //写入位置，只由生产者修改，write position, only modified by the producer
+} Queue;
+
+//输出上下文结构体，每个输出有自己的句柄、轨道序号关联表、队列和写线程
+//Output context structure, each output has its own handle, track number correlation table, queue and writer thread
+typedef struct OutputContext {
+    const Output *output;                                                       //输出配置，output settings
+    AVFormatContext *outFileHandle;                                             //输出文件句柄，output file handle
+    int *streamMapping;                                                         //输入文件、输出文件的轨道序号关联表，track number correlation table for input and output files
+    Queue queue;                                                                //待写入的数据包队列，queue of packets waiting to be written
+    std::thread thread;                                                         //写线程，writer thread
+    bool isWaitKeyframe;                                                        //丢包后等待下一个关键帧，只由解封装线程访问，waiting for the next keyframe after dropping, only accessed by the demux thread
+    std::atomic<bool> isFailed;                                                 //输出出错，后续数据包全部丢弃，output failed, all following packets are dropped
+    int64_t writeCount;                                                         //已写入的数据包数，number of written packets
+    int64_t dropCount;                                                          //已丢弃的数据包数，number of dropped packets
+} OutputContext;
+OutputContext *outputContextList = NULL;
+
+//输入文件是否含有视频轨道，没有视频轨道时丢包后不需要等待关键帧
+//Whether the input file has a video track, if not, there is no need to wait for a keyframe after dropping
+bool isHaveVideo = false;
+
+void termination(const char* param){
+    std::cout<<param<<std::endl;
+    std::cout<<"Error occur, quit!"<<std::endl;
+    exit(-1);
+}
+
+void Queue_Init(Queue *queue){
+    queue->capacity = queueDepth + 1;
+    queue->items = (void **)av_malloc_array(queue->capacity, sizeof(*queue->items));
+    if(!queue->items){
+        termination("Could not allocate queue.");
+    }
+    queue->head.store(0);
+    queue->tail.store(0);
+}
+
+void Queue_Free(Queue *queue){
+    av_freep(&queue->items);
+}
+
+bool Queue_TryPush(Queue *queue, void *item){
+    unsigned int tail = queue->tail.load(std::memory_order_relaxed);
+    unsigned int next = (tail + 1) % queue->capacity;
+    if(next == queue->head.load(std::memory_order_acquire)){                    //队列已满，queue is full
+        return false;
+    }
+    queue->items[tail] = item;
+    queue->tail.store(next, std::memory_order_release);
+    return true;
+}
+
+bool Queue_TryPop(Queue *queue, void **item){
+    unsigned int head = queue->head.load(std::memory_order_relaxed);
+    if(head == queue->tail.load(std::memory_order_acquire)){                    //队列为空，queue is empty
+        return false;
+    }
+    *item = queue->items[head];
+    queue->head.store((head + 1) % queue->capacity, std::memory_order_release);
+    return true;
+}
+
+void Queue_Wait(unsigned int *spinCount){
+    //先自旋让出CPU，等待时间较长时再sleep，避免空转占满CPU
+    //Yield the CPU first, and sleep when waiting for a long time to avoid burning the CPU
+    if((*spinCount)++ < 64){
+        std::this_thread::yield();
+    } else {
+        av_usleep(200);
+    }
+}
+
+void Queue_Push(Queue *queue, void *item){
+    unsigned int spinCount = 0;
+    while(!Queue_TryPush(queue, item)){
+        Queue_Wait(&spinCount);
+    }
+}
+
+void *Queue_Pop(Queue *queue){
+    unsigned int spinCount = 0;
+    void *item = NULL;
+    while(!Queue_TryPop(queue, &item)){
+        Queue_Wait(&spinCount);
+    }
+    return item;
+}
+
+void Step1_OpenInFile(){
+    //STEP::打开源视频文件
+    //STEP::Open the input video file
+    AVDictionary* optionsDict = NULL;                                                 //设置输入源封装参数
+    av_dict_set(&optionsDict, "rw_timeout", "2000000", 0);                            //设置网络超时，当输入源为文件时，可注释此行。Set the network timeout, you can comment out this line when the input source is a file
+    ret = avformat_open_input(&inFileHandle, inFilePath, NULL, &optionsDict);
+    if(ret<0){
+        termination("Could not open input file.");
+    }
+
+    //STEP::获取源视频文件的流信息
+    //STEP::Get the stream information of the source video file
+    ret = avformat_find_stream_info(inFileHandle, NULL);
+    if(ret<0){
+        termination("Failed to retrieve input stream information.");
+    }
+    isHaveVideo = av_find_best_stream(inFileHandle, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0) >= 0;
+}
+
+void Step2_CreateOutFile(){
+    outputContextList = new OutputContext[outputLength];                                          //含有std::thread和std::atomic，需要用new构造，contains std::thread and std::atomic, must be constructed with new
+    for(int i=0;i<outputLength;i++){
+        OutputContext *context = &outputContextList[i];
+        context->output = &outputList[i];
+        context->outFileHandle = NULL;
+        context->isWaitKeyframe = false;
+        context->isFailed.store(false);
+        context->writeCount = 0;
+        context->dropCount = 0;
+        Queue_Init(&context->queue);
+
+        //STEP::创建输出文件句柄
+        //STEP::Creates an output file handle
+        ret = avformat_alloc_output_context2(&context->outFileHandle, NULL, context->output->formatName, context->output->outFilePath);
+        if(ret<0){
+            termination("Could not create output handle.");
+        }
+
+        //STEP::根据源轨道信息创建输出的音视频轨道，每个输出有自己的轨道序号关联表
+        //输出格式不支持的轨道（如flv中的字幕）会被跳过，不影响其他输出
+        //STEP::Create audio/video tracks for the output based on source track information, each output has its own track number correlation table
+        //Tracks not supported by the output format (e.g. subtitles in flv) are skipped without affecting other outputs
+        int outStreamIndex = 0;
+        context->streamMapping = (int *)av_malloc_array(inFileHandle->nb_streams, sizeof(*context->streamMapping));
+        if(!context->streamMapping){
+            termination("Could not allocate stream mapping.");
+        }
+        for(unsigned int j = 0; j < inFileHandle->nb_streams; j++) {
+            AVStream *inStream = inFileHandle->streams[j];
+            if ((inStream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO &&                          //过滤除video、audio、subtitle以外的轨道，Filter tracks except video, audio, subtitle
+                 inStream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO &&
+                 inStream->codecpar->codec_type != AVMEDIA_TYPE_SUBTITLE) ||
+                avformat_query_codec(context->outFileHandle->oformat, inStream->codecpar->codec_id, FF_COMPLIANCE_NORMAL) == 0) {
+                context->streamMapping[j] = -1;
+                continue;
+            }
+
+            AVStream *outStream = avformat_new_stream(context->outFileHandle, NULL);               //创建输出的轨道，Creating the output track
+            ret = avcodec_parameters_copy(outStream->codecpar, inStream->codecpar);                //复制源轨道的信息到输出轨道，Copying information from the source track to the output track
+            if(ret<0){
+                termination("Could not copy codec parameters.");
+            }
+            outStream->codecpar->codec_tag = 0;
+            context->streamMapping[j] = outStreamIndex++;
+        }
+
+        //STEP::打开输出文件，网络输出设置超时，卡住时写线程会报错退出而不是一直阻塞
+        //STEP::Open the output file, network outputs have a timeout, so a stalled writer thread fails instead of blocking forever
+        AVDictionary* optionsDict = NULL;
+        if(context->output->isDropOnFull){
+            av_dict_set(&optionsDict, "rw_timeout", "2000000", 0);
+        }
+        ret = avio_open2(&context->outFileHandle->pb, context->output->outFilePath, AVIO_FLAG_WRITE, NULL, &optionsDict);
+        av_dict_free(&optionsDict);
+        if(ret<0){
+            termination("Could not open out file.");
+        }
+
+        //STEP::写入文件头信息
+        //STEP::Write file header information
+        ret = avformat_write_header(context->outFileHandle, NULL);
+        if(ret<0){
+            termination("Could not write stream header to out file.");
+        }
+    }
+}
+
+void Thread_Writer(int outputIndex){
+    //STEP::从队列取出数据包写入输出，出错时只标记本输出失败，不影响其他输出
+    //STEP::Take packets from the queue and write them to the output, on error only this output is marked as failed, other outputs are not affected
+    OutputContext *context = &outputContextList[outputIndex];
+    while(1){
+        AVPacket *packet = (AVPacket *)Queue_Pop(&context->queue);
+        if(!packet){
+            break;
+        }
+        if(context->isFailed.load(std::memory_order_relaxed)){
+            av_packet_free(&packet);
+            continue;
+        }
+
+        //转换timebase（时间基），并将轨道序号修改为本输出的轨道序号
+        //Converts the timebase, and change the track number to the track number of this output
+        AVStream *inStream = inFileHandle->streams[packet->stream_index];
+        AVStream *outStream = context->outFileHandle->streams[context->streamMapping[packet->stream_index]];
+        av_packet_rescale_ts(packet, inStream->time_base, outStream->time_base);
+        packet->stream_index = context->streamMapping[packet->stream_index];
+
+        //封装packet，并写入输出，在多个线程中运行，不使用全局的ret
+        //Mux the packet and write to the output, runs in several threads, so the global ret is not used
+        if (av_interleaved_write_frame(context->outFileHandle, packet) < 0) {
+            std::cout<<context->output->outFilePath<<": could not mux packet, output stopped."<<std::endl;
+            context->isFailed.store(true);
+        } else {
+            context->writeCount++;
+        }
+        av_packet_free(&packet);
+    }
+}
+
+void Step3_Operation(){
+    //STEP::启动每个输出的写线程
+    //STEP::Start the writer thread of each output
+    for(int i=0;i<outputLength;i++){
+        outputContextList[i].thread = std::thread(Thread_Writer, i);
+    }
+
+    AVPacket *packet = av_packet_alloc();
+    if (!packet) {
+        termination("Could not allocate AVPacket.");
+    }
+
+    //STEP::av_read_frame会将源文件解封装，并将数据放到packet，只解封装一次，数据包的引用分发给每个输出，数据不拷贝
+    //STEP::av_read_frame unpacks the source file and puts the data into packet, demux only once, references of the packet are dispatched to every output without copying the data
+    while (av_read_frame(inFileHandle, packet) >= 0) {
+        bool isKeyframe = (packet->flags & AV_PKT_FLAG_KEY) &&
+                          inFileHandle->streams[packet->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
+        for(int i=0;i<outputLength;i++){
+            OutputContext *context = &outputContextList[i];
+            if(context->streamMapping[packet->stream_index] < 0 || context->isFailed.load(std::memory_order_relaxed)){
+                continue;
+            }
+
+            //丢包后从下一个视频关键帧恢复，避免输出无法解码的数据
+            //Resume at the next video keyframe after dropping, to avoid outputting undecodable data
+            if(context->isWaitKeyframe){
+                if(!isKeyframe){
+                    context->dropCount++;
+                    continue;
+                }
+                context->isWaitKeyframe = false;
+            }
+
+            AVPacket *outPacket = av_packet_clone(packet);
+            if(!outPacket){
+                termination("Could not allocate AVPacket.");
+            }
+            if(!context->output->isDropOnFull){
+                Queue_Push(&context->queue, outPacket);
+            } else if(!Queue_TryPush(&context->queue, outPacket)){
+                av_packet_free(&outPacket);
+                context->dropCount++;
+                context->isWaitKeyframe = isHaveVideo;
+            }
+        }
+        av_packet_unref(packet);
+    }
+
+    //STEP::向每个输出发送结束标志，并等待写线程结束
+    //STEP::Send the end flag to every output, and wait for the writer threads to finish
+    for(int i=0;i<outputLength;i++){
+        Queue_Push(&outputContextList[i].queue, NULL);
+    }
+    for(int i=0;i<outputLength;i++){
+        outputContextList[i].thread.join();
+    }
+
+    av_packet_free(&packet);
+}
+
+void Step4_End(){
+    for(int i=0;i<outputLength;i++){
+        OutputContext *context = &outputContextList[i];
+        std::cout<<context->output->outFilePath<<": "<<context->writeCount<<" packets written, "<<context->dropCount<<" packets dropped"<<std::endl;
+
+        //STEP::写入输出文件尾信息，失败的输出不再写入
+        //STEP::Write output file tail information, failed outputs are not written any more
+        if(!context->isFailed.load()){
+            ret = av_write_trailer(context->outFileHandle);
+            if(ret < 0) {
+                termination("Could not write the stream trailer to out file.");
+            }
+        }
+
+        //STEP::关闭输出文件，并销毁具柄
+        //STEP::Close the output file，and destroy the handle
+        avio_closep(&context->outFileHandle->pb);
+        avformat_free_context(context->outFileHandle);
+        av_freep(&context->streamMapping);
+        Queue_Free(&context->queue);
+    }
+    delete[] outputContextList;
+
+    //STEP::关闭输入文件，并销毁具柄
+    //STEP::Close the input file，and destroy the handle
+    avformat_close_input(&inFileHandle);
+}
+
+int main(int argc, char *argv[]){
+    //STEP::打开源文件并获取源文件信息
+    //STEP::Open input file and get input file information
+    Step1_OpenInFile();
+
+    //STEP::构造所有输出文件
+    //STEP::Constructing all output files
+    Step2_CreateOutFile();
+
+    //STEP::循环处理数据
+    //STEP::Cyclic processing data
+    Step3_Operation();
+
+    //STEP::关闭输入、输出文件
+    //STEP::Close input and output files
+    Step4_End();
+}
@@ -0,0 +1,769 @@
+/*
+ * 视频转封装例子（多路转发服务），一个进程同时转发多路直播流，网络读取由一个epoll线程完成，解封装、封装由少量工作线程完成
+ * The sample of remuxing video (multi-session relay), one process relays many live streams at the same time, network reads are done by one epoll thread, demuxing and muxing are done by a few worker threads
+ * Depends on FFmpeg 6.0
+ * Wirte by stoprefactoring.com
+*/
+
+#include <iostream>
+#include <string>
+#include <string.h>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+extern "C" {
+    #include <libavutil/timestamp.h>
+    #include <libavutil/time.h>
+    #include <libavutil/cpu.h>
+    #include <libavutil/opt.h>
+    #include <libavformat/avformat.h>
+}
+
+//转发会话列表
+//udp://ip:port为在本机端口接收，tcp://ip:port为连接到对端读取，这两种输入由epoll线程非阻塞读取，多个会话共用线程
+//其他协议（rtmp、http、srt等）由FFmpeg自己的阻塞I/O读取，每个会话占用一个线程，通过中断回调实现超时和退出
+//Relay session list
+//udp://ip:port receives on the local port, tcp://ip:port connects to the peer and reads, these two inputs are read non-blocking by the epoll thread, sessions share the threads
+//Other protocols (rtmp, http, srt, etc.) are read by FFmpeg's own blocking I/O, each session takes a thread, timeouts and exit are implemented by the interrupt callback
+typedef struct SessionConfig {
+    const char *inUrl;                                                          //输入地址，input address
+    const char *outFilePath;                                                    //输出路径，output path
+    const char *formatName;                                                     //输出封装格式，output format
+} SessionConfig;
+const SessionConfig sessionConfigList[] = {
+    {"udp://0.0.0.0:1234", "./relay_1234.ts", "mpegts"},
+    {"udp://0.0.0.0:1235", "./relay_1235.flv", "flv"},
+    //{"tcp://192.168.3.202:9000", "rtmp://192.168.3.202:1935/live/relay", "flv"},
+    //{"rtmp://192.168.3.202:1935/live/test", "./relay_rtmp.flv", "flv"},
+};
+const int sessionLength = sizeof(sessionConfigList) / sizeof(*sessionConfigList);
+
+//工作线程数，0表示CPU核心数的一半
+//Number of worker threads, 0 means half of the CPU cores
+const int workerCount = 0;
+
+//每个会话的接收缓冲区大小（字节），缓冲区满时UDP丢弃数据报，TCP暂停读取
+//Receive buffer size of each session (bytes), UDP datagrams are dropped when the buffer is full, TCP stops reading
+const int ringSize = 4 * 1024 * 1024;
+
+//缓冲区数据达到该值时才交给工作线程处理，越大每次调度转发的数据越多，越小延迟越低
+//The session is handed to a worker only when the buffer holds this much data, larger means more data relayed per schedule, smaller means lower latency
+const int readThreshold = 16 * 1024;
+
+//会话超时（微秒），超过该时间没有收到数据，会话结束
+//Session timeout (microseconds), the session ends when no data arrives for this long
+const int64_t sessionTimeout = 5000000;
+
+//每个会话的输出队列上限（字节），工作线程把封装结果放入队列，由会话的输出线程阻塞写出；超过上限时暂停转发该会话，数据留在接收缓冲区
+//Output queue limit of each session (bytes), workers put the muxed data into the queue and the output thread of the session writes it out with blocking I/O; above the limit the session is not relayed and the data stays in the receive buffer
+const int64_t outQueueSize = 4 * 1024 * 1024;
+
+//会话的输入方式
+//Input type of the session
+typedef enum SessionType {
+    SESSION_UDP = 0,                                                            //epoll线程读取UDP，UDP read by the epoll thread
+    SESSION_TCP,                                                                //epoll线程读取TCP，TCP read by the epoll thread
+    SESSION_FFMPEG,                                                             //FFmpeg阻塞I/O，FFmpeg blocking I/O
+} SessionType;
+
+//会话上下文结构体
+//Session context structure
+typedef struct Session {
+    const SessionConfig *config;                                                //会话配置，session settings
+    SessionType type;                                                           //输入方式，input type
+    int fd;                                                                     //socket
+    uint8_t *ring;                                                              //接收环形缓冲区，receive ring buffer
+    int64_t ringRead;                                                           //已读取的总字节数，total bytes read
+    int64_t ringWrite;                                                          //已写入的总字节数，total bytes written
+    std::mutex mutex;                                                           //保护缓冲区和状态，protects the buffer and the state
+    std::condition_variable condition;                                          //有新数据时通知，notified when new data arrives
+    bool isEof;                                                                 //输入结束，input ended
+    bool isScheduled;                                                           //已在工作队列中或正在处理，in the work queue or being processed
+    bool isPaused;                                                              //缓冲区满，暂停读取TCP，buffer full, TCP reading paused
+    bool isEnd;                                                                 //会话结束，session ended
+    bool isWorker;                                                              //已打开且由工作线程转发，读取不再等待，opened and relayed by the workers, reads no longer wait
+    int packetSize;                                                             //解封装器的TS包大小（188、192、204），TS packet size of the demuxer (188, 192, 204)
+    int64_t alignOffset;                                                        //TS包边界的位置对packetSize取余，工作线程交出数据后ringRead总在包边界上，position of the TS packet boundaries modulo packetSize, after a worker hands out data ringRead is always on a packet boundary
+    std::atomic<int64_t> activeTime;                                            //最后收到数据的时间，last time data arrived
+    int64_t dropBytes;                                                          //缓冲区满时丢弃的字节数，bytes dropped because the buffer was full
+    int64_t packetCount;                                                        //已转发的数据包数，number of relayed packets
+    AVIOContext *inAvio;                                                        //自定义AVIO，读取接收缓冲区，custom AVIO reading the receive buffer
+    AVFormatContext *inFileHandle;                                              //输入句柄，input handle
+    AVFormatContext *outFileHandle;                                             //输出句柄，output handle
+    AVIOContext *outAvio;                                                       //自定义AVIO，封装结果放入输出队列，custom AVIO putting the muxed data into the output queue
+    AVIOContext *outPb;                                                         //实际的输出，由输出线程写入，the real output, written by the output thread
+    std::deque<std::string> outQueue;                                           //等待写出的数据，data waiting to be written
+    int64_t outBytes;                                                           //输出队列中的字节数，bytes in the output queue
+    std::condition_variable outCondition;                                       //输出队列变化时通知，notified when the output queue changes
+    bool isOutEnd;                                                              //不再有输出数据，输出线程写完后关闭输出，no more output data, the output thread closes the output after writing
+    bool isOutError;                                                            //写出失败，writing failed
+    std::thread outThread;                                                      //epoll会话的输出线程，output thread of an epoll session
+    int *streamMapping;                                                         //输入、输出轨道序号关联表，track number correlation table for input and output
+    AVPacket *packet;
+    std::thread thread;                                                         //FFmpeg阻塞I/O会话或epoll会话探测的线程，thread of a FFmpeg blocking I/O session or of probing an epoll session
+} Session;
+Session *sessionList = NULL;
+
+//工作队列，epoll线程放入数据已就绪的会话，工作线程取出处理
+//Work queue, the epoll thread puts sessions with ready data in, workers take them out
+std::deque<Session *> workQueue;
+std::mutex workMutex;
+std::condition_variable workCondition;
+
+std::atomic<int> activeCount(0);
+std::atomic<bool> isExit(false);
+int epollFd = -1;
+
+void termination(const char* param){
+    std::cout<<param<<std::endl;
+    std::cout<<"Error occur, quit!"<<std::endl;
+    exit(-1);
+}
+
+void Signal_Exit(int signal){
+    isExit.store(true);
+}
+
+void Session_Error(Session *session, int errorCode){
+    char errorString[AV_ERROR_MAX_STRING_SIZE] = {0};
+    av_make_error_string(errorString, sizeof(errorString), errorCode);
+    std::cout<<session->config->inUrl<<": could not open session ("<<errorString<<")"<<std::endl;
+}
+
+int Session_Interrupt(void *opaque){
+    //STEP::FFmpeg阻塞I/O的中断回调，收到退出信号或超时后让阻塞的调用返回
+    //STEP::Interrupt callback of FFmpeg blocking I/O, makes blocked calls return after the exit signal or a timeout
+    Session *session = (Session *)opaque;
+    return isExit.load() || av_gettime_relative() - session->activeTime.load() > sessionTimeout;
+}
+
+int64_t Session_Size(Session *session){
+    return session->ringWrite - session->ringRead;
+}
+
+void Session_Schedule(Session *session){
+    //STEP::数据足够或输入结束时放入工作队列，调用时需持有session->mutex
+    //STEP::Put into the work queue when there is enough data or the input ended, session->mutex must be held by the caller
+    if(!session->isWorker || session->isScheduled || session->isEnd || session->outBytes > outQueueSize || (Session_Size(session) < readThreshold && !session->isEof)){
+        return;
+    }
+    session->isScheduled = true;
+    std::lock_guard<std::mutex> lock(workMutex);
+    workQueue.push_back(session);
+    workCondition.notify_one();
+}
+
+int Session_Read(void *opaque, uint8_t *buffer, int bufferSize){
+    //STEP::AVIO读回调，从接收缓冲区取数据
+    //探测线程中数据不足时短暂等待epoll线程写入；工作线程中不等待，只交出到TS包边界为止的数据，不足时返回EAGAIN，
+    //这样解封装器读完交出的数据时正好停在包边界上，数据到达后会话重新调度，从这里继续
+    //STEP::AVIO read callback, takes data from the receive buffer
+    //On the probing thread it waits briefly for the epoll thread when data is short; on a worker it never waits and only hands out data up to a TS packet boundary, returning EAGAIN when there is none,
+    //so when the demuxer has consumed what was handed out it stops exactly on a packet boundary, and the session continues from there once it is rescheduled with new data
+    Session *session = (Session *)opaque;
+    std::unique_lock<std::mutex> lock(session->mutex);
+    int size = 0;
+    while(1){
+        size = (int)FFMIN((int64_t)bufferSize, Session_Size(session));
+        if(session->isWorker && !session->isEof){
+            size -= (int)((session->ringRead + size - session->alignOffset) % session->packetSize);
+        }
+        if(size > 0){
+            break;
+        }
+        if(session->isEof){
+            return AVERROR_EOF;                                                                 //输入结束，剩余的数据已交出，input ended, the rest has been handed out
+        }
+        if(isExit.load()){
+            return AVERROR_EXIT;
+        }
+        if(av_gettime_relative() - session->activeTime.load() > sessionTimeout){
+            return AVERROR(ETIMEDOUT);
+        }
+        if(session->isWorker){
+            return AVERROR(EAGAIN);
+        }
+        session->condition.wait_for(lock, std::chrono::milliseconds(100));
+    }
+    for(int copied = 0; copied < size;){                                                         //跨过缓冲区末尾时分两次复制，copy in two parts across the end of the buffer
+        int64_t offset = session->ringRead % ringSize;
+        int length = (int)FFMIN((int64_t)(size - copied), ringSize - offset);
+        memcpy(buffer + copied, session->ring + offset, length);
+        session->ringRead += length;
+        copied += length;
+    }
+    return size;
+}
+
+int Session_OutWrite(void *opaque, uint8_t *buffer, int bufferSize){
+    //STEP::输出AVIO的写回调，数据放入输出队列后立即返回，工作线程不会阻塞在网络写入上
+    //探测线程自己转发的会话在队列超过上限时等待输出线程写出
+    //STEP::Write callback of the output AVIO, the data is put into the output queue and it returns at once, so workers never block on network writes
+    //A session relayed on its probing thread waits for the output thread when the queue is above the limit
+    Session *session = (Session *)opaque;
+    std::unique_lock<std::mutex> lock(session->mutex);
+    while(!session->isWorker && !session->isOutError && session->outBytes > outQueueSize){
+        session->outCondition.wait_for(lock, std::chrono::milliseconds(100));
+    }
+    if(session->isOutError){
+        return AVERROR(EIO);
+    }
+    session->outQueue.push_back(std::string((const char *)buffer, bufferSize));
+    session->outBytes += bufferSize;
+    session->outCondition.notify_all();
+    return bufferSize;
+}
+
+void Thread_Output(Session *session){
+    //STEP::epoll会话的输出线程，按顺序阻塞写出输出队列，队列降到上限以下时重新调度会话；会话关闭且队列写完后关闭输出
+    //STEP::Output thread of an epoll session, writes the output queue in order with blocking I/O and reschedules the session when the queue falls below the limit; closes the output once the session is closed and the queue is written
+    std::unique_lock<std::mutex> lock(session->mutex);
+    while(1){
+        while(session->outQueue.empty() && !session->isOutEnd){
+            session->outCondition.wait(lock);
+        }
+        if(session->outQueue.empty()){
+            break;
+        }
+        std::string chunk;
+        chunk.swap(session->outQueue.front());
+        session->outQueue.pop_front();
+        lock.unlock();
+        if(session->outPb->error >= 0){
+            avio_write(session->outPb, (const unsigned char *)chunk.data(), (int)chunk.size());
+            avio_flush(session->outPb);
+        }
+        lock.lock();
+        session->outBytes -= chunk.size();
+        if(session->outPb->error < 0 && !session->isOutError){
+            session->isOutError = true;
+            std::cout<<session->config->outFilePath<<": could not write output"<<std::endl;
+        }
+        session->outCondition.notify_all();
+        Session_Schedule(session);
+    }
+    lock.unlock();
+    avio_closep(&session->outPb);
+}
+
+void Session_Write(Session *session, const uint8_t *data, int size){
+    //STEP::写入接收缓冲区，调用时需持有session->mutex，且已确认空间足够
+    //STEP::Write into the receive buffer, session->mutex must be held by the caller and the space must have been checked
+    while(size > 0){
+        int64_t offset = session->ringWrite % ringSize;
+        int length = (int)FFMIN((int64_t)size, ringSize - offset);
+        memcpy(session->ring + offset, data, length);
+        session->ringWrite += length;
+        data += length;
+        size -= length;
+    }
+    session->activeTime.store(av_gettime_relative());
+    session->condition.notify_all();
+}
+
+void Session_Receive(Session *session){
+    //STEP::非阻塞读取socket直到没有数据，UDP缓冲区满时丢弃数据报，TCP缓冲区满时暂停读取
+    //STEP::Read the socket non-blocking until there is no data, UDP datagrams are dropped when the buffer is full, TCP reading is paused when the buffer is full
+    static uint8_t buffer[65536];
+    while(1){
+        std::unique_lock<std::mutex> lock(session->mutex);
+        int64_t space = ringSize - Session_Size(session);
+        if(session->type == SESSION_TCP && space == 0){
+            struct epoll_event event;
+            event.events = 0;
+            event.data.ptr = session;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, session->fd, &event);
+            session->isPaused = true;
+            break;
+        }
+        lock.unlock();
+        int readSize = session->type == SESSION_TCP ? (int)FFMIN(space, (int64_t)sizeof(buffer)) : (int)sizeof(buffer);
+        ssize_t size = recv(session->fd, buffer, readSize, 0);
+        lock.lock();
+        if(size < 0){
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                session->isEof = true;
+            }
+            break;
+        }
+        if(size == 0 && session->type == SESSION_TCP){
+            session->isEof = true;
+            break;
+        }
+        if(size > ringSize - Session_Size(session)){
+            session->dropBytes += size;
+            continue;
+        }
+        Session_Write(session, buffer, size);
+    }
+    std::lock_guard<std::mutex> lock(session->mutex);
+    if(session->isEof){
+        session->condition.notify_all();
+    }
+    Session_Schedule(session);
+}
+
+int Session_OpenSocket(Session *session){
+    //STEP::解析udp://、tcp://地址并创建非阻塞socket，UDP绑定本地端口，TCP连接对端
+    //STEP::Parse udp:// and tcp:// addresses and create a non-blocking socket, UDP binds the local port, TCP connects to the peer
+    char host[256] = {0};
+    char port[16] = {0};
+    int portNumber = -1;
+    av_url_split(NULL, 0, NULL, 0, host, sizeof(host), &portNumber, NULL, 0, session->config->inUrl);
+    snprintf(port, sizeof(port), "%d", portNumber);
+
+    struct addrinfo hints;
+    struct addrinfo *address = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = session->type == SESSION_UDP ? SOCK_DGRAM : SOCK_STREAM;
+    hints.ai_flags = session->type == SESSION_UDP ? AI_PASSIVE : 0;
+    if(getaddrinfo(host[0] ? host : NULL, port, &hints, &address) != 0){
+        return -1;
+    }
+    int fd = socket(address->ai_family, address->ai_socktype, 0);
+    int result = fd < 0 ? -1 : 0;
+    if(result == 0 && session->type == SESSION_UDP){
+        int bufferSize = ringSize;
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        result = bind(fd, address->ai_addr, address->ai_addrlen);
+    } else if(result == 0){
+        result = connect(fd, address->ai_addr, address->ai_addrlen);
+    }
+    freeaddrinfo(address);
+    if(result < 0){
+        if(fd >= 0){
+            close(fd);
+        }
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    session->fd = fd;
+    return 0;
+}
+
+void Session_FreeOutput(Session *session){
+    //STEP::释放输出AVIO，epoll会话把剩余数据交给输出队列，由输出线程写完后关闭实际的输出
+    //STEP::Free the output AVIO, an epoll session hands the remaining data to the output queue and the output thread closes the real output after writing it
+    if(!session->outAvio){
+        avio_closep(&session->outFileHandle->pb);
+        return;
+    }
+    avio_flush(session->outAvio);
+    av_freep(&session->outAvio->buffer);
+    avio_context_free(&session->outAvio);
+    session->outFileHandle->pb = NULL;
+}
+
+void Session_Close(Session *session){
+    //STEP::写入文件尾，关闭输入、输出，会话结束
+    //STEP::Write the trailer, close the input and output, the session ends
+    if(session->outFileHandle){
+        if(session->outFileHandle->pb){
+            av_write_trailer(session->outFileHandle);
+            Session_FreeOutput(session);
+        }
+        avformat_free_context(session->outFileHandle);
+        session->outFileHandle = NULL;
+    }
+    avformat_close_input(&session->inFileHandle);
+    if(session->inAvio){
+        av_freep(&session->inAvio->buffer);
+        avio_context_free(&session->inAvio);
+    }
+    if(session->fd >= 0){
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, session->fd, NULL);
+    }
+    av_packet_free(&session->packet);
+    av_freep(&session->streamMapping);
+    std::cout<<session->config->inUrl<<" -> "<<session->config->outFilePath<<": "<<session->packetCount<<" packets relayed, "
+             <<session->dropBytes<<" bytes dropped"<<std::endl;
+
+    std::lock_guard<std::mutex> lock(session->mutex);
+    session->isEnd = true;
+    session->isOutEnd = true;
+    session->outCondition.notify_all();
+    activeCount--;
+    workCondition.notify_all();
+}
+
+int Session_Open(Session *session){
+    //STEP::打开输入，epoll会话使用自定义AVIO从接收缓冲区读取，其他会话使用FFmpeg的I/O并设置中断回调
+    //STEP::Open the input, epoll sessions read from the receive buffer through a custom AVIO, other sessions use FFmpeg's I/O with an interrupt callback
+    session->inFileHandle = avformat_alloc_context();
+    if(!session->inFileHandle){
+        return AVERROR(ENOMEM);
+    }
+    session->inFileHandle->interrupt_callback.callback = Session_Interrupt;
+    session->inFileHandle->interrupt_callback.opaque = session;
+    if(session->type != SESSION_FFMPEG){
+        uint8_t *buffer = (uint8_t *)av_malloc(65536);
+        session->inAvio = buffer ? avio_alloc_context(buffer, 65536, 0, session, Session_Read, NULL, NULL) : NULL;
+        if(!session->inAvio){
+            av_free(buffer);
+            return AVERROR(ENOMEM);
+        }
+        session->inFileHandle->pb = session->inAvio;
+    }
+    int result = avformat_open_input(&session->inFileHandle, session->config->inUrl, NULL, NULL);
+    if(result < 0){
+        return result;
+    }
+    result = avformat_find_stream_info(session->inFileHandle, NULL);
+    if(result < 0){
+        return result;
+    }
+
+    //STEP::创建输出，根据源轨道信息创建输出的音视频轨道
+    //STEP::Create the output, create audio/video tracks for the output based on source track information
+    result = avformat_alloc_output_context2(&session->outFileHandle, NULL, session->config->formatName, session->config->outFilePath);
+    if(result < 0){
+        return result;
+    }
+    session->outFileHandle->interrupt_callback = session->inFileHandle->interrupt_callback;
+    int outStreamIndex = 0;
+    session->streamMapping = (int *)av_malloc_array(session->inFileHandle->nb_streams, sizeof(*session->streamMapping));
+    if(!session->streamMapping){
+        return AVERROR(ENOMEM);
+    }
+    for(unsigned int i = 0; i < session->inFileHandle->nb_streams; i++) {
+        AVStream *inStream = session->inFileHandle->streams[i];
+        if (inStream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO &&                               //过滤除video、audio以外的轨道，Filter tracks except video, audio
+            inStream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
+            session->streamMapping[i] = -1;
+            continue;
+        }
+        AVStream *outStream = avformat_new_stream(session->outFileHandle, NULL);
+        if(!outStream){
+            return AVERROR(ENOMEM);
+        }
+        result = avcodec_parameters_copy(outStream->codecpar, inStream->codecpar);
+        if(result < 0){
+            return result;
+        }
+        outStream->codecpar->codec_tag = 0;
+        session->streamMapping[i] = outStreamIndex++;
+    }
+    //STEP::FFmpeg阻塞I/O会话直接写出；epoll会话经输出队列由输出线程写出
+    //STEP::FFmpeg blocking I/O sessions write directly; epoll sessions write through the output queue and the output thread
+    if(session->type == SESSION_FFMPEG){
+        result = avio_open2(&session->outFileHandle->pb, session->config->outFilePath, AVIO_FLAG_WRITE, &session->outFileHandle->interrupt_callback, NULL);
+    } else {
+        result = avio_open2(&session->outPb, session->config->outFilePath, AVIO_FLAG_WRITE, &session->outFileHandle->interrupt_callback, NULL);
+        if(result >= 0){
+            session->outThread = std::thread(Thread_Output, session);
+            uint8_t *buffer = (uint8_t *)av_malloc(65536);
+            session->outAvio = buffer ? avio_alloc_context(buffer, 65536, 1, session, NULL, Session_OutWrite, NULL) : NULL;
+            if(!session->outAvio){
+                av_free(buffer);
+                return AVERROR(ENOMEM);
+            }
+            session->outFileHandle->pb = session->outAvio;
+        }
+    }
+    if(result < 0){
+        return result;
+    }
+    result = avformat_write_header(session->outFileHandle, NULL);
+    if(result < 0){
+        Session_FreeOutput(session);
+        return result;
+    }
+    session->packet = av_packet_alloc();
+    return session->packet ? 0 : AVERROR(ENOMEM);
+}
+
+int Session_Relay(Session *session){
+    //STEP::转发一个数据包，返回负数表示输入结束或出错
+    //STEP::Relay one packet, a negative return means the input ended or failed
+    AVPacket *packet = session->packet;
+    int result = av_read_frame(session->inFileHandle, packet);
+    if(result < 0){
+        return result;
+    }
+    if(session->streamMapping[packet->stream_index] < 0){
+        av_packet_unref(packet);
+        return 0;
+    }
+    AVStream *inStream = session->inFileHandle->streams[packet->stream_index];
+    AVStream *outStream = session->outFileHandle->streams[session->streamMapping[packet->stream_index]];
+    av_packet_rescale_ts(packet, inStream->time_base, outStream->time_base);
+    packet->stream_index = session->streamMapping[packet->stream_index];
+    result = av_interleaved_write_frame(session->outFileHandle, packet);
+    av_packet_unref(packet);
+    session->packetCount++;
+    return result;
+}
+
+void Session_Step(Session *session){
+    //STEP::工作线程处理一次会话，转发缓冲区中已有的数据，不会等待数据，会话已由探测线程打开
+    //STEP::A worker processes the session once, relays the data already in the buffer without waiting for data, the session was opened by its probing thread
+    while(1){
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            if((Session_Size(session) < readThreshold && !session->isEof) || session->outBytes > outQueueSize){
+                break;                                                                          //数据不足或输出队列已满，data is short or the output queue is full
+            }
+        }
+        int result = Session_Relay(session);
+        if(result == AVERROR(EAGAIN)){
+            //缓冲区中已没有完整的TS包，清除AVIO的错误状态，解封装器停在交出的数据结尾，即TS包边界，数据到达后继续
+            //No whole TS packet is left in the buffer, clear the error state of the AVIO, the demuxer stopped at the end of the handed-out data, a TS packet boundary, and continues when data arrives
+            session->inAvio->eof_reached = 0;
+            session->inAvio->error = 0;
+            break;
+        }
+        if(result < 0){
+            Session_Close(session);
+            return;
+        }
+    }
+}
+
+void Thread_Worker(){
+    //STEP::从工作队列取出会话处理，处理完后数据仍足够时重新放入队列
+    //STEP::Take sessions from the work queue and process them, put them back if there is still enough data afterwards
+    while(1){
+        Session *session = NULL;
+        {
+            std::unique_lock<std::mutex> lock(workMutex);
+            workCondition.wait_for(lock, std::chrono::milliseconds(100), []{ return !workQueue.empty() || activeCount.load() == 0; });
+            if(workQueue.empty()){
+                if(activeCount.load() == 0){
+                    break;
+                }
+                continue;
+            }
+            session = workQueue.front();
+            workQueue.pop_front();
+        }
+        Session_Step(session);
+        std::lock_guard<std::mutex> lock(session->mutex);
+        session->isScheduled = false;
+        Session_Schedule(session);
+    }
+}
+
+void Thread_Session(Session *session){
+    //STEP::FFmpeg阻塞I/O会话，在自己的线程中打开并转发，阻塞由中断回调打断
+    //STEP::FFmpeg blocking I/O session, opened and relayed in its own thread, blocking is broken by the interrupt callback
+    session->activeTime.store(av_gettime_relative());
+    int result = Session_Open(session);
+    if(result < 0){
+        Session_Error(session, result);
+    }
+    while(result >= 0){
+        result = Session_Relay(session);
+        session->activeTime.store(av_gettime_relative());
+    }
+    Session_Close(session);
+}
+
+void Thread_Open(Session *session){
+    //STEP::epoll会话的探测线程，打开输入时要等待足够的数据，在自己的线程中阻塞，不占用工作线程
+    //STEP::Probing thread of an epoll session, opening the input has to wait for enough data, so it blocks on its own thread instead of a worker
+    int result = Session_Open(session);
+    if(result < 0){
+        Session_Error(session, result);
+        Session_Close(session);
+        return;
+    }
+
+    //STEP::TS可以在包边界处暂停、继续解封装，交给工作线程非阻塞转发，探测线程退出
+    //探测时按任意长度读取，交出的数据不一定在包边界上，以解封装器实际读到的位置（avio_tell）和它的包大小（ts_packetsize，M2TS为192）确定之后的包边界
+    //STEP::TS can pause and continue demuxing on a packet boundary, so it is handed to the workers for non-blocking relaying and the probing thread exits
+    //Probing reads arbitrary lengths, so the data handed out is not necessarily on a packet boundary, the following boundaries are taken from the position the demuxer has actually consumed (avio_tell) and its packet size (ts_packetsize, 192 for M2TS)
+    int64_t packetSize = 0;
+    if(strcmp(session->inFileHandle->iformat->name, "mpegts") == 0 &&
+       av_opt_get_int(session->inFileHandle->priv_data, "ts_packetsize", 0, &packetSize) >= 0 && packetSize > 0){
+        std::lock_guard<std::mutex> lock(session->mutex);
+        session->packetSize = (int)packetSize;
+        session->alignOffset = avio_tell(session->inAvio) % packetSize;
+        session->isWorker = true;
+        Session_Schedule(session);
+        return;
+    }
+
+    //STEP::其他封装在数据不足时中断会丢失解析状态，在探测线程中继续阻塞转发
+    //STEP::Other formats lose their parsing state when interrupted by short data, so they keep relaying with blocking reads on the probing thread
+    std::cout<<session->config->inUrl<<": "<<session->inFileHandle->iformat->name<<" input, relayed on its own thread"<<std::endl;
+    while(Session_Relay(session) >= 0){
+    }
+    Session_Close(session);
+}
+
+void Thread_IO(){
+    //STEP::epoll等待所有socket，有数据时读入对应会话的缓冲区；定时检查超时、退出和暂停的TCP会话
+    //STEP::epoll waits on all sockets and reads data into the session buffers; periodically checks timeouts, exit and paused TCP sessions
+    struct epoll_event eventList[64];
+    bool isExitHandled = false;
+    while(activeCount.load() > 0){
+        int count = epoll_wait(epollFd, eventList, 64, 50);
+        for(int i=0;i<count;i++){
+            Session_Receive((Session *)eventList[i].data.ptr);
+        }
+        int64_t now = av_gettime_relative();
+        for(int i=0;i<sessionLength;i++){
+            Session *session = &sessionList[i];
+            if(session->type == SESSION_FFMPEG){
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(session->mutex);
+            if(session->isEnd){
+                continue;
+            }
+            if(isExit.load() || now - session->activeTime.load() > sessionTimeout){
+                session->isEof = true;
+                session->condition.notify_all();
+            }
+            if(session->isPaused && Session_Size(session) < ringSize / 2){
+                struct epoll_event event;
+                event.events = EPOLLIN;
+                event.data.ptr = session;
+                epoll_ctl(epollFd, EPOLL_CTL_MOD, session->fd, &event);
+                session->isPaused = false;
+            }
+            Session_Schedule(session);
+        }
+        if(isExit.load() && !isExitHandled){
+            std::cout<<"Exit signal received, closing sessions."<<std::endl;
+            isExitHandled = true;
+        }
+    }
+}
+
+void Step1_OpenSession(){
+    //STEP::创建所有会话，udp、tcp输入创建socket并加入epoll
+    //STEP::Create all sessions, udp and tcp inputs create sockets and join epoll
+    epollFd = epoll_create1(0);
+    if(epollFd < 0){
+        termination("Could not create epoll.");
+    }
+    sessionList = new Session[sessionLength];                                                  //含有std::mutex和std::thread，需要用new构造，contains std::mutex and std::thread, must be constructed with new
+    for(int i=0;i<sessionLength;i++){
+        Session *session = &sessionList[i];
+        session->config = &sessionConfigList[i];
+        session->type = strncmp(session->config->inUrl, "udp://", 6) == 0 ? SESSION_UDP :
+                        strncmp(session->config->inUrl, "tcp://", 6) == 0 ? SESSION_TCP : SESSION_FFMPEG;
+        session->fd = -1;
+        session->ring = NULL;
+        session->ringRead = 0;
+        session->ringWrite = 0;
+        session->isEof = false;
+        session->isScheduled = false;
+        session->isPaused = false;
+        session->isEnd = false;
+        session->isWorker = false;
+        session->packetSize = 0;
+        session->alignOffset = 0;
+        session->outAvio = NULL;
+        session->outPb = NULL;
+        session->outBytes = 0;
+        session->isOutEnd = false;
+        session->isOutError = false;
+        session->activeTime.store(av_gettime_relative());
+        session->dropBytes = 0;
+        session->packetCount = 0;
+        session->inAvio = NULL;
+        session->inFileHandle = NULL;
+        session->outFileHandle = NULL;
+        session->streamMapping = NULL;
+        session->packet = NULL;
+        activeCount++;
+        if(session->type == SESSION_FFMPEG){
+            continue;
+        }
+
+        session->ring = (uint8_t *)av_malloc(ringSize);
+        if(!session->ring){
+            termination("Could not allocate receive buffer.");
+        }
+        if(Session_OpenSocket(session) < 0){
+            termination("Could not open socket.");
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = session;
+        if(epoll_ctl(epollFd, EPOLL_CTL_ADD, session->fd, &event) < 0){
+            termination("Could not add socket to epoll.");
+        }
+    }
+}
+
+void Step2_Operation(){
+    //STEP::启动工作线程、FFmpeg阻塞I/O会话线程，当前线程运行epoll循环，所有会话结束后退出
+    //STEP::Start the workers and the FFmpeg blocking I/O session threads, the current thread runs the epoll loop, exit after all sessions end
+    int threads = workerCount > 0 ? workerCount : (av_cpu_count() / 2 > 1 ? av_cpu_count() / 2 : 1);
+    std::thread *workerList = new std::thread[threads];
+    for(int i=0;i<threads;i++){
+        workerList[i] = std::thread(Thread_Worker);
+    }
+    for(int i=0;i<sessionLength;i++){
+        if(sessionList[i].type == SESSION_FFMPEG){
+            sessionList[i].thread = std::thread(Thread_Session, &sessionList[i]);
+        } else {
+            sessionList[i].thread = std::thread(Thread_Open, &sessionList[i]);
+        }
+    }
+
+    Thread_IO();
+
+    for(int i=0;i<threads;i++){
+        workerList[i].join();
+    }
+    delete[] workerList;
+    for(int i=0;i<sessionLength;i++){
+        if(sessionList[i].thread.joinable()){
+            sessionList[i].thread.join();
+        }
+        if(sessionList[i].outThread.joinable()){
+            sessionList[i].outThread.join();
+        }
+    }
+}
+
+void Step3_End(){
+    //STEP::关闭socket，释放缓冲区
+    //STEP::Close the sockets, free the buffers
+    for(int i=0;i<sessionLength;i++){
+        if(sessionList[i].fd >= 0){
+            close(sessionList[i].fd);
+        }
+        av_freep(&sessionList[i].ring);
+    }
+    delete[] sessionList;
+    close(epollFd);
+}
+
+int main(int argc, char *argv[]){
+    //STEP::收到Ctrl+C或kill时，所有会话写完文件尾再退出
+    //STEP::On Ctrl+C or kill, all sessions write their trailers before exiting
+    signal(SIGINT, Signal_Exit);
+    signal(SIGTERM, Signal_Exit);
+    signal(SIGPIPE, SIG_IGN);
+    avformat_network_init();
+
+    //STEP::创建所有会话
+    //STEP::Create all sessions
+    Step1_OpenSession();
+
+    //STEP::转发直到所有会话结束
+    //STEP::Relay until all sessions end
+    Step2_Operation();
+
+    //STEP::释放资源
+    //STEP::Free resources
+    Step3_End();
+    avformat_network_deinit();
+}
@@ -6,10 +6,31 @@
 */
 
 #include <iostream>
+#include <atomic>
+#include <string.h>
+#include <string>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 extern "C" {  
     #include <libavutil/timestamp.h>
+    #include <libavutil/time.h>
     #include <libavformat/avformat.h>
 }
+#include "../common/index_format.h"
+#include "../common/alloc_count.h"
+#include "../common/metrics.h"
 
 int ret = 0;
 
@@ -18,6 +39,111 @@ int ret = 0;
 const char *inFilePath  = "../../common/test.mp4";
 //const char *inFilePath  = "rtmp://192.168.3.202:1935/live/test";
 const char *outFilePath  = "./out.flv";
+//输出的封装格式，NULL表示按输出路径的后缀判断（如./out.mp4），推流地址（如rtmp://）需指定为flv
+//Output format, NULL means guessed from the suffix of the output path (such as ./out.mp4), push addresses (such as rtmp://) need flv
+const char *outFormatName = "flv";
+
+//读写后端，只对本地文件生效，网络地址始终使用FFmpeg默认的avio_open
+//IO_DEFAULT：FFmpeg默认的avio_open，缓冲区较小，大文件时系统调用次数多
+//IO_READ_BUFFER：大缓冲区read()，并通过posix_fadvise提示内核顺序预读
+//IO_READ_MMAP：mmap映射整个输入文件，并通过madvise提示内核顺序预读，读取时没有系统调用
+//IO_WRITE_ASYNC：写入数据先攒成大块，由后台线程按顺序pwrite，解封装不必等待磁盘，可选O_DIRECT绕过页缓存
+//I/O backend, only applies to local files, network addresses always use FFmpeg's default avio_open
+//IO_DEFAULT: FFmpeg's default avio_open, the buffer is small, so large files cost many system calls
+//IO_READ_BUFFER: large buffer read(), with posix_fadvise hinting the kernel to read ahead sequentially
+//IO_READ_MMAP: mmap the whole input file, with madvise hinting the kernel to read ahead sequentially, no system calls when reading
+//IO_WRITE_ASYNC: written data is gathered into large chunks and pwrite in order by a background thread, so demuxing does not wait for the disk, O_DIRECT can optionally bypass the page cache
+typedef enum IOBackend {
+    IO_DEFAULT = 0,
+    IO_READ_BUFFER,
+    IO_READ_MMAP,
+    IO_WRITE_ASYNC,
+} IOBackend;
+const char *ioBackendName[] = {"default", "buffer", "mmap", "async"};
+const IOBackend inIOBackend = IO_READ_BUFFER;
+const IOBackend outIOBackend = IO_WRITE_ASYNC;
+
+//读写缓冲区大小（字节），后台写线程最多排队的块数，是否使用O_DIRECT写入
+//O_DIRECT只用于按4096字节对齐的整块数据，文件尾等不对齐的数据仍走页缓存
+//I/O buffer size (bytes), the maximum number of chunks queued for the background writer, whether to write with O_DIRECT
+//O_DIRECT is only used for whole chunks aligned to 4096 bytes, unaligned data such as the file tail still goes through the page cache
+const int ioBufferSize = 4 * 1024 * 1024;
+const unsigned int ioQueueDepth = 4;
+const bool isDirectWrite = false;
+
+//输出的时间范围（微秒），从源视频的rangeStart开始，时长为rangeDuration，0表示到结尾
+//转封装不解码，只能从关键帧开始，起点会对齐到rangeStart之前最近的视频关键帧；直播流等不能定位的输入从当前位置开始计算
+//Time range of the output (microseconds), starting at rangeStart of the source video and lasting rangeDuration, 0 means to the end
+//Remuxing does not decode and can only start at a keyframe, so the start snaps to the nearest video keyframe before rangeStart; inputs that can not seek, such as live streams, count from the current position
+const int64_t rangeStart = 0;
+const int64_t rangeDuration = 0;
+
+//索引文件（由remux_index生成）的后缀，索引文件路径为源文件路径加后缀，NULL表示不使用索引
+//索引存在且与源文件一致时跳过avformat_find_stream_info，并按索引直接定位；源文件的大小、修改时间或内容变化后索引自动失效
+//Suffix of the index file (built by remux_index), the index file path is the source file path plus the suffix, NULL means no index
+//When the index exists and matches the source file, avformat_find_stream_info is skipped and seeking uses the index directly; the index becomes invalid automatically when the size, modification time or content of the source file changes
+const char *indexSuffix = ".idx";
+
+//分片MP4输出，只在输出格式为mp4、mov时生效：moov写在文件开头，之后每个分片（moof+mdat）完成后立即写出，写入过程中即可播放，结束时不需要回写moov，进程异常退出时已写出的分片仍然可用
+//分片从fragmentDuration之后的第一个视频关键帧开始，isCmaf为true时按CMAF规范输出（cmfc兼容品牌等），可直接作为DASH/HLS的fMP4分段
+//使用IO_WRITE_ASYNC时分片先交给后台写线程，进程异常退出时队列中还未写入的最多ioQueueDepth个数据块会丢失
+//Fragmented MP4 output, only for the mp4 and mov formats: moov is written at the start of the file, then every fragment (moof+mdat) is written as soon as it completes, the file is playable while being written, no moov rewrite is needed at the end, and the fragments already written survive a crash
+//A fragment starts at the first video keyframe after fragmentDuration, when isCmaf is true the output follows CMAF (the cmfc compatible brand, etc.) and can be used directly as fMP4 segments of DASH/HLS
+//With IO_WRITE_ASYNC the fragments are handed to the background writer first, at most ioQueueDepth chunks still queued are lost on a crash
+const bool isFragmented = false;
+const int64_t fragmentDuration = 2000000;
+const bool isCmaf = false;
+
+//写入方式：WRITE_INTERLEAVED总是使用av_interleaved_write_frame，它把每个数据包放进内部队列等待其他轨道，每个数据包都要申请队列节点和缓冲区引用
+//WRITE_DIRECT总是使用av_write_frame直接写入，不排队；WRITE_AUTO先缓存开头writeProbeDuration（微秒，按dts跨度）或writeProbePackets个数据包，
+//统计数据包比已读取的最大dts落后的最大值，不超过interleaveTolerance时整个过程直接写入，否则整个过程交织写入，决定后不再改变（avformat.h不允许混用两种写入函数）
+//Write mode: WRITE_INTERLEAVED always uses av_interleaved_write_frame, which puts every packet into an internal queue to wait for the other tracks, allocating a queue node and a buffer reference per packet
+//WRITE_DIRECT always writes directly with av_write_frame without queueing; WRITE_AUTO first buffers the opening writeProbeDuration (microseconds, by dts span) or writeProbePackets packets,
+//and measures how far packets fall behind the largest dts read so far, within interleaveTolerance the whole run writes directly, otherwise the whole run writes interleaved, the mode never changes once decided (avformat.h forbids mixing the two write functions)
+//WRITE_BOUNDED使用自己的有界交织队列，适合音频会卡顿或晚到数秒的直播源：av_interleaved_write_frame等待落后的轨道时不限制缓存，进程内存会涨到数GB
+//Write mode WRITE_BOUNDED uses our own bounded interleaving queue, suitable for live sources whose audio stalls or arrives seconds late: av_interleaved_write_frame buffers without limit while waiting for the lagging track, and the process grows to gigabytes
+typedef enum WriteMode {
+    WRITE_INTERLEAVED = 0,
+    WRITE_DIRECT,
+    WRITE_AUTO,
+    WRITE_BOUNDED,
+} WriteMode;
+const WriteMode writeMode = WRITE_AUTO;
+const int64_t interleaveTolerance = 1000000;
+const int64_t writeProbeDuration = 2000000;
+const int writeProbePackets = 1000;
+
+//有界交织队列的上限：缓存的时长（微秒，队列中最大与最小dts之差）和字节数，任一超出时按interleavePolicy处理；音视频轨道超过interleaveMaxDuration（单调时钟）没有数据包时也不再等待它
+//Limits of the bounded interleaving queue: buffered duration (microseconds, the difference between the largest and smallest dts in the queue) and bytes, interleavePolicy applies when either is exceeded; an audio/video track with no packet for longer than interleaveMaxDuration (monotonic clock) is no longer waited for either
+const int64_t interleaveMaxDuration = 2000000;
+const int64_t interleaveMaxBytes = 16 * 1024 * 1024;
+typedef enum InterleavePolicy {
+    INTERLEAVE_FLUSH = 0,                                                       //写出最早的数据包直到回到上限内，落后轨道的数据包到达后照常写出，不丢数据但轨道间乱序，write the earliest packets until back within the limits, packets of the lagging track are still written when they arrive, nothing is lost but tracks are out of order
+    INTERLEAVE_DROP,                                                            //丢弃最早的数据包直到回到上限内，保持交织顺序，领先轨道丢失数据，适合落后轨道很快恢复的情况，drop the earliest packets until back within the limits, the interleaving order is kept and the leading tracks lose data, suitable when the lagging track recovers quickly
+    INTERLEAVE_GAP,                                                             //写出最早的数据包，落后轨道晚于已写出位置到达的数据包丢弃，该轨道留下空缺，保持交织顺序，write the earliest packets, packets of the lagging track that arrive behind the written position are dropped, leaving a gap in that track and keeping the interleaving order
+} InterleavePolicy;
+const char *interleavePolicyName[] = {"flush", "drop", "gap"};
+const InterleavePolicy interleavePolicy = INTERLEAVE_GAP;
+
+//探测参数，probeSize为avformat_find_stream_info最多读取的字节数，analyzeDuration为最多分析的时长（微秒），0表示使用FFmpeg默认值（5000000字节、5秒）
+//直播流每次重连都要重新探测，默认值会带来数秒的启动延迟，可适当调小，如probeSize = 500000、analyzeDuration = 1000000
+//Probing parameters, probeSize is the maximum bytes read by avformat_find_stream_info, analyzeDuration is the maximum duration analyzed (microseconds), 0 means FFmpeg's default (5000000 bytes, 5 seconds)
+//Live streams are probed again on every reconnect, the defaults cost seconds of startup latency, they can be lowered, such as probeSize = 500000, analyzeDuration = 1000000
+const int64_t probeSize = 0;
+const int64_t analyzeDuration = 0;
+
+//直播流的轨道参数缓存目录，按输入地址保存上次完整探测得到的轨道参数，NULL表示不使用缓存
+//有缓存时只按streamCacheProbeSize、streamCacheAnalyzeDuration做一次快速探测，结果与缓存一致时用缓存补全参数，读到第一个视频关键帧即开始输出
+//轨道数、编码或已探测到的参数（分辨率、采样率、extradata等）与缓存不一致时，改为完整探测并更新缓存
+//Cache directory of live stream track parameters, the parameters from the last full probe are saved per input address, NULL means no cache
+//With a cache only a quick probe limited by streamCacheProbeSize and streamCacheAnalyzeDuration is done, when it agrees with the cache the parameters are completed from the cache and output starts at the first video keyframe
+//When the number of tracks, the codecs or the probed parameters (resolution, sample rate, extradata, etc.) differ from the cache, a full probe is done and the cache is updated
+const char *streamCacheDir = "./stream_cache";
+const int64_t streamCacheProbeSize = 32768;
+const int64_t streamCacheAnalyzeDuration = 200000;
+
+//轨道参数缓存使用与索引文件相同的格式（common/index_format.h），没有关键帧和数据包，sourceSize、sourceHash为输入地址的长度和哈希
+//The track parameter cache uses the same format as the index file (common/index_format.h) without keyframes and packets, sourceSize and sourceHash are the length and hash of the input address
 
 //输入输出文件句柄
 //Input and output file handles
@@ -28,34 +154,769 @@ AVFormatContext *outFileHandle = NULL;
 //Track number correlation table for input files and output files
 int *streamMapping = NULL;
 
+//已加载的索引或轨道参数缓存
+//The loaded index or track parameter cache
+SourceIndex sourceIndex = {NULL, 0, NULL, NULL, NULL, NULL, NULL};
+
+//时间范围的状态：源视频时间轴上的起止时间（微秒），实际起点（起点之后第一个视频关键帧，微秒），各轨道是否已读到rangeEnd
+//停止读取要等待的轨道（音视频，不含封面图片，读到rangeEnd或自己的结尾后不再等待）和各轨道的结尾（微秒，未知时为INT64_MAX）
+//实际起点确定前读到的非视频数据包先缓存，确定后重新检查
+//State of the time range: begin and end on the source timeline (microseconds), the actual start (first video keyframe from the start, microseconds), whether each track has reached rangeEnd
+//The tracks that stopping waits for (audio/video without cover pictures, no longer waited for once they reach rangeEnd or their own end) and the end of each track (microseconds, INT64_MAX when unknown)
+//Non-video packets read before the actual start is known are buffered and checked again once it is known
+bool isRange = false;
+int64_t rangeBegin = 0;
+int64_t rangeEnd = INT64_MAX;
+int64_t rangeOffset = AV_NOPTS_VALUE;
+int rangeVideoIndex = -1;
+int rangeActiveCount = 0;
+std::vector<bool> rangeEndList;
+std::vector<bool> rangeActiveList;
+std::vector<int64_t> rangeTrackEndList;
+std::vector<AVPacket *> rangePendingList;
+
+//启动状态：打开输入的时间，探测耗时，第一个数据包写出的耗时（微秒），直播流是否已读到第一个视频关键帧
+//Startup state: the time the input was opened, the probing cost, the cost until the first packet was written (microseconds), whether a live stream has reached its first video keyframe
+int64_t openTime = 0;
+int64_t probeCost = 0;
+int64_t firstOutputCost = -1;
+int startVideoIndex = -1;
+bool isStarted = true;
+
+//自定义读后端的状态
+//State of the custom read backend
+typedef struct InIO {
+    int fd;                                                                     //文件描述符，file descriptor
+    uint8_t *map;                                                               //mmap映射地址，mmap address
+    int64_t size;                                                               //文件大小，file size
+    int64_t position;                                                           //当前读取位置，current read position
+} InIO;
+InIO inIO = {-1, NULL, 0, 0};
+
+//后台写线程的数据块，offset为写入文件的位置
+//A data chunk for the background writer, offset is the position to write in the file
+typedef struct WriteChunk {
+    uint8_t *data;                                                              //按4096字节对齐的缓冲区，buffer aligned to 4096 bytes
+    int size;                                                                   //数据长度，data length
+    int64_t offset;                                                             //写入位置，write position
+} WriteChunk;
+
+//自定义写后端的状态
+//State of the custom write backend
+typedef struct OutIO {
+    int fd;                                                                     //普通写入的文件描述符，file descriptor for normal writes
+    int directFd;                                                               //O_DIRECT写入的文件描述符，file descriptor for O_DIRECT writes
+    int64_t position;                                                           //当前写入位置，current write position
+    int64_t size;                                                               //已写入的文件大小，size of the written file
+    std::deque<WriteChunk> pending;                                             //等待写入的数据块，按顺序写入，chunks waiting to be written, written in order
+    std::vector<uint8_t *> freeList;                                            //可复用的缓冲区，reusable buffers
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::thread thread;                                                         //后台写线程，background writer thread
+    bool isEnd;                                                                 //没有更多数据，no more data
+    int error;                                                                  //后台写入的错误码，error code of background writes
+} OutIO;
+OutIO outIO;
+
+//性能统计配置，统计代码在common/metrics.h
+//Metrics configuration, the metrics code is in common/metrics.h
+const MetricsFormat metricsFormat = METRICS_NONE;
+//指标名前缀
+//Metric name prefix
+const char *metricsName = "remux_tofile";
+
+//统计导出文件路径，先写临时文件再rename，读取方不会读到写了一半的内容
+//UDP导出地址，格式为ip:port，NULL表示不发送
+//导出间隔（秒）
+//Metrics export file path, a temporary file is written and then renamed, so readers never see a half-written file
+//UDP export address in ip:port format, NULL means not sending
+//Export interval (seconds)
+const char *metricsFilePath = "./remux_tofile.prom";
+const char *metricsUdpAddress = NULL;
+//const char *metricsUdpAddress = "127.0.0.1:9125";
+const int metricsInterval = 1;
+
+//统计的处理阶段
+//Measured processing stages
+typedef enum Stage {
+    STAGE_READ = 0,                                                             //av_read_frame
+    STAGE_WRITE,                                                                //av_interleaved_write_frame
+    STAGE_LENGTH,
+} Stage;
+const char *stageName[] = {"read", "write"};
+
+//写入路径的状态：是否交织写入，写入方式是否已决定，探测窗口缓存的数据包，窗口内最早、最大的dts和最大落后值（微秒），主循环中读取、写入阶段的分配次数，数据包数
+//State of the write path: whether writing is interleaved, whether the write mode has been decided, packets buffered in the probe window, the earliest and largest dts and the largest lag in the window (microseconds), allocations of the read and write stages in the main loop, number of packets
+bool isInterleaving = writeMode == WRITE_INTERLEAVED;
+bool isWriteDecided = writeMode != WRITE_AUTO;
+std::vector<AVPacket *> writeProbeList;
+int64_t writeFirstDts = AV_NOPTS_VALUE;
+int64_t writeLastDts = AV_NOPTS_VALUE;
+int64_t writeLag = 0;
+int64_t allocReadCount = 0;
+int64_t allocWriteCount = 0;
+int64_t allocPacketCount = 0;
+
+//有界交织队列中的数据包，dts已换算为微秒
+//A packet in the bounded interleaving queue, dts converted to microseconds
+typedef struct InterleaveItem {
+    AVPacket *packet;
+    int64_t dts;
+} InterleaveItem;
+
+//有界交织队列，每个输出轨道一个队列，每次写出所有队列头部dts最小的数据包；数据包结构体用完后放回packetPool复用
+//Bounded interleaving queue, one queue per output track, the packet with the smallest head dts of all queues is written each time; packet structures are put back into packetPool for reuse after writing
+typedef struct Interleaver {
+    std::vector<std::deque<InterleaveItem> > queueList;                         //按输出轨道排列的队列，queues laid out by output track
+    std::vector<bool> waitList;                                                 //写出前是否需要等待该轨道（音视频轨道，字幕等稀疏轨道不等待），whether writing waits for the track (audio/video, sparse tracks such as subtitles are not waited for)
+    std::vector<bool> keyframeList;                                             //视频轨道丢弃数据后需要等到下一个关键帧，a video track waits for the next keyframe after dropping data
+    std::vector<bool> endList;                                                  //轨道已读到自己的结尾，the track has reached its own end
+    std::vector<int> inputList;                                                 //输出轨道对应的输入轨道序号，input track index of each output track
+    std::vector<int64_t> trackEndList;                                          //轨道的结束时间（微秒），未知时为INT64_MAX，end time of the track (microseconds), INT64_MAX when unknown
+    std::vector<int64_t> activeList;                                            //轨道最后一次放入数据包的时刻（单调时钟，微秒），moment the track last pushed a packet (monotonic clock, microseconds)
+    std::vector<AVPacket *> packetPool;                                         //可复用的数据包结构体，reusable packet structures
+    int64_t bytes;                                                              //当前缓存的字节数，bytes currently buffered
+    int64_t packets;                                                            //当前缓存的数据包数，packets currently buffered
+    int64_t lastDts;                                                            //已写出的最大dts（微秒），largest written dts (microseconds)
+    int64_t maxDuration;                                                        //缓存时长的峰值，peak buffered duration
+    int64_t maxBytes;                                                           //缓存字节数的峰值，peak buffered bytes
+    int64_t limitCount;                                                         //超出上限的数据包数，packets handled over the limits
+    int64_t dropCount;                                                          //丢弃的数据包数，packets dropped
+} Interleaver;
+Interleaver interleaver;
+
+int64_t Interleave_Duration(){
+    //STEP::当前缓存的时长，即所有队列中最大与最小dts之差
+    //STEP::The duration currently buffered, the difference between the largest and smallest dts of all queues
+    int64_t minDts = INT64_MAX;
+    int64_t maxDts = INT64_MIN;
+    for(size_t i=0;i<interleaver.queueList.size();i++){
+        if(!interleaver.queueList[i].empty()){
+            minDts = FFMIN(minDts, interleaver.queueList[i].front().dts);
+            maxDts = FFMAX(maxDts, interleaver.queueList[i].back().dts);
+        }
+    }
+    return minDts <= maxDts ? maxDts - minDts : 0;
+}
+
 void termination(const char* param){
     std::cout<<param<<std::endl;
     std::cout<<"Error occur, quit!"<<std::endl;
     exit(-1);
 }
 
+void Metrics_Extra(std::string *text, MetricsFormat format){
+    //STEP::追加读取、写入阶段的内存分配次数，有界交织队列的状态和首个数据包的写出耗时，JSON中未开启或未知的值为-1
+    //STEP::Append the allocations of the read and write stages, the state of the bounded interleaving queue and the cost of the first output packet, values that are off or unknown are -1 in JSON
+    if(format == METRICS_PROMETHEUS){
+        if(isAllocCount){
+            Metrics_Append(text, "# TYPE %s_allocations_total counter\n%s_allocations_total{stage=\"read\"} %" PRId64 "\n%s_allocations_total{stage=\"write\"} %" PRId64 "\n",
+                           metricsName, metricsName, allocReadCount, metricsName, allocWriteCount);
+        }
+        if(writeMode == WRITE_BOUNDED){
+            Metrics_Append(text, "# TYPE %s_interleave_depth_seconds gauge\n%s_interleave_depth_seconds %.3f\n", metricsName, metricsName, Interleave_Duration() / 1000000.0);
+            Metrics_Append(text, "# TYPE %s_interleave_bytes gauge\n%s_interleave_bytes %" PRId64 "\n", metricsName, metricsName, interleaver.bytes);
+            Metrics_Append(text, "# TYPE %s_interleave_packets gauge\n%s_interleave_packets %" PRId64 "\n", metricsName, metricsName, interleaver.packets);
+            Metrics_Append(text, "# TYPE %s_interleave_limit_total counter\n%s_interleave_limit_total{policy=\"%s\"} %" PRId64 "\n", metricsName, metricsName, interleavePolicyName[interleavePolicy], interleaver.limitCount);
+            Metrics_Append(text, "# TYPE %s_interleave_dropped_total counter\n%s_interleave_dropped_total %" PRId64 "\n", metricsName, metricsName, interleaver.dropCount);
+        }
+        if(firstOutputCost >= 0){
+            Metrics_Append(text, "# TYPE %s_first_output_seconds gauge\n%s_first_output_seconds %.3f\n", metricsName, metricsName, firstOutputCost / 1000000.0);
+        }
+        return;
+    }
+    Metrics_Append(text, ",\"first_output\":%.3f,\"alloc_read\":%" PRId64 ",\"alloc_write\":%" PRId64 ",\"interleave\":{\"depth\":%.3f,\"bytes\":%" PRId64 ",\"packets\":%" PRId64 ",\"limit\":%" PRId64 ",\"dropped\":%" PRId64 "}",
+                   firstOutputCost >= 0 ? firstOutputCost / 1000000.0 : -1.0, isAllocCount ? allocReadCount : -1, isAllocCount ? allocWriteCount : -1,
+                   Interleave_Duration() / 1000000.0, interleaver.bytes, interleaver.packets, interleaver.limitCount, interleaver.dropCount);
+}
+
+bool IsLocalFile(const char *path){
+    return strstr(path, "://") == NULL;
+}
+
+int InIO_Read(void *opaque, uint8_t *buffer, int bufferSize){
+    InIO *io = (InIO *)opaque;
+    if(io->map){
+        int64_t remain = io->size - io->position;
+        if(remain <= 0){
+            return AVERROR_EOF;
+        }
+        int size = remain < bufferSize ? (int)remain : bufferSize;
+        memcpy(buffer, io->map + io->position, size);
+        io->position += size;
+        return size;
+    }
+    ssize_t size = read(io->fd, buffer, bufferSize);
+    if(size < 0){
+        return AVERROR(errno);
+    }
+    if(size == 0){
+        return AVERROR_EOF;
+    }
+    io->position += size;
+    return (int)size;
+}
+
+int64_t InIO_Seek(void *opaque, int64_t offset, int whence){
+    InIO *io = (InIO *)opaque;
+    if(whence & AVSEEK_SIZE){
+        return io->size;
+    }
+    whence &= ~AVSEEK_FORCE;
+    int64_t position = whence == SEEK_SET ? offset :
+                       whence == SEEK_CUR ? io->position + offset :
+                       whence == SEEK_END ? io->size + offset : -1;
+    if(position < 0){
+        return AVERROR(EINVAL);
+    }
+    if(!io->map && lseek(io->fd, position, SEEK_SET) < 0){
+        return AVERROR(errno);
+    }
+    io->position = position;
+    return position;
+}
+
+AVIOContext *InIO_Open(const char *path){
+    //STEP::打开输入文件，设置内核预读提示
+    //STEP::Open the input file, set the kernel read ahead hints
+    inIO.fd = open(path, O_RDONLY);
+    if(inIO.fd < 0){
+        termination("Could not open input file.");
+    }
+    struct stat fileStat;
+    if(fstat(inIO.fd, &fileStat) < 0){
+        termination("Could not get input file size.");
+    }
+    inIO.size = fileStat.st_size;
+    inIO.position = 0;
+    if(inIOBackend == IO_READ_MMAP && inIO.size > 0){
+        inIO.map = (uint8_t *)mmap(NULL, inIO.size, PROT_READ, MAP_PRIVATE, inIO.fd, 0);
+        if(inIO.map == MAP_FAILED){
+            termination("Could not mmap input file.");
+        }
+        madvise(inIO.map, inIO.size, MADV_SEQUENTIAL);
+        madvise(inIO.map, inIO.size, MADV_WILLNEED);
+    } else {
+        posix_fadvise(inIO.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(inIO.fd, 0, 0, POSIX_FADV_WILLNEED);
+    }
+
+    //STEP::创建使用大缓冲区的AVIOContext
+    //STEP::Create an AVIOContext with a large buffer
+    uint8_t *buffer = (uint8_t *)av_malloc(ioBufferSize);
+    if(!buffer){
+        termination("Could not allocate I/O buffer.");
+    }
+    AVIOContext *avio = avio_alloc_context(buffer, ioBufferSize, 0, &inIO, InIO_Read, NULL, InIO_Seek);
+    if(!avio){
+        termination("Could not allocate AVIOContext.");
+    }
+    return avio;
+}
+
+void InIO_Close(AVIOContext **avio){
+    av_freep(&(*avio)->buffer);
+    avio_context_free(avio);
+    if(inIO.map){
+        munmap(inIO.map, inIO.size);
+        inIO.map = NULL;
+    }
+    close(inIO.fd);
+    inIO.fd = -1;
+}
+
+void Thread_OutIOWriter(){
+    //STEP::按顺序写入数据块，对齐的整块使用O_DIRECT，其他使用普通写入
+    //STEP::Write the chunks in order, aligned whole chunks use O_DIRECT, others use normal writes
+    while(1){
+        std::unique_lock<std::mutex> lock(outIO.mutex);
+        outIO.condition.wait(lock, []{ return !outIO.pending.empty() || outIO.isEnd; });
+        if(outIO.pending.empty()){
+            break;
+        }
+        WriteChunk chunk = outIO.pending.front();
+        lock.unlock();
+
+        bool isDirect = outIO.directFd >= 0 && chunk.size == ioBufferSize && chunk.offset % 4096 == 0;
+        int fd = isDirect ? outIO.directFd : outIO.fd;
+        int64_t written = 0;
+        while(written < chunk.size){
+            ssize_t size = pwrite(fd, chunk.data + written, chunk.size - written, chunk.offset + written);
+            if(size < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                lock.lock();
+                outIO.error = AVERROR(errno);
+                lock.unlock();
+                break;
+            }
+            written += size;
+        }
+
+        //写完后才从队列移除，保证后续的seek回写不会和本块乱序
+        //Remove it from the queue only after writing, so later seek-back writes cannot be reordered with this chunk
+        lock.lock();
+        outIO.pending.pop_front();
+        outIO.freeList.push_back(chunk.data);
+        outIO.condition.notify_all();
+    }
+}
+
+int OutIO_Write(void *opaque, uint8_t *buffer, int bufferSize){
+    //STEP::把avio的缓冲区拷贝到对齐的数据块，交给后台线程写入，队列满时等待
+    //STEP::Copy the avio buffer into an aligned chunk and hand it to the background writer, wait when the queue is full
+    OutIO *io = (OutIO *)opaque;
+    std::unique_lock<std::mutex> lock(io->mutex);
+    io->condition.wait(lock, [io]{ return io->pending.size() < ioQueueDepth || io->error < 0; });
+    if(io->error < 0){
+        return io->error;
+    }
+    WriteChunk chunk;
+    if(!io->freeList.empty()){
+        chunk.data = io->freeList.back();
+        io->freeList.pop_back();
+    } else if(posix_memalign((void **)&chunk.data, 4096, ioBufferSize) != 0){
+        return AVERROR(ENOMEM);
+    }
+    memcpy(chunk.data, buffer, bufferSize);
+    chunk.size = bufferSize;
+    chunk.offset = io->position;
+    io->pending.push_back(chunk);
+    io->condition.notify_all();
+    io->position += bufferSize;
+    if(io->position > io->size){
+        io->size = io->position;
+    }
+    return bufferSize;
+}
+
+int64_t OutIO_Seek(void *opaque, int64_t offset, int whence){
+    //STEP::mp4、flv等封装写完后会seek回文件头回写，只需要修改写入位置，数据块里已经带有各自的位置
+    //STEP::Muxers such as mp4 and flv seek back to rewrite the header, only the write position changes, each chunk carries its own position
+    OutIO *io = (OutIO *)opaque;
+    std::lock_guard<std::mutex> lock(io->mutex);
+    if(whence & AVSEEK_SIZE){
+        return io->size;
+    }
+    whence &= ~AVSEEK_FORCE;
+    int64_t position = whence == SEEK_SET ? offset :
+                       whence == SEEK_CUR ? io->position + offset :
+                       whence == SEEK_END ? io->size + offset : -1;
+    if(position < 0){
+        return AVERROR(EINVAL);
+    }
+    io->position = position;
+    return position;
+}
+
+AVIOContext *OutIO_Open(const char *path){
+    //STEP::打开输出文件，需要O_DIRECT时额外打开一个描述符，并启动后台写线程
+    //STEP::Open the output file, open another descriptor when O_DIRECT is needed, and start the background writer
+    outIO.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(outIO.fd < 0){
+        termination("Could not open out file.");
+    }
+    outIO.directFd = -1;
+    if(isDirectWrite){
+        outIO.directFd = open(path, O_WRONLY | O_DIRECT);
+        if(outIO.directFd < 0){
+            std::cout<<"O_DIRECT is not supported, use normal writes."<<std::endl;
+        }
+    }
+    outIO.position = 0;
+    outIO.size = 0;
+    outIO.isEnd = false;
+    outIO.error = 0;
+    outIO.thread = std::thread(Thread_OutIOWriter);
+
+    uint8_t *buffer = (uint8_t *)av_malloc(ioBufferSize);
+    if(!buffer){
+        termination("Could not allocate I/O buffer.");
+    }
+    AVIOContext *avio = avio_alloc_context(buffer, ioBufferSize, 1, &outIO, NULL, OutIO_Write, OutIO_Seek);
+    if(!avio){
+        termination("Could not allocate AVIOContext.");
+    }
+    return avio;
+}
+
+int OutIO_Close(AVIOContext **avio){
+    //STEP::写出avio中剩余的数据，等待后台线程写完，再关闭文件
+    //STEP::Write out the data left in avio, wait for the background writer to finish, then close the file
+    avio_flush(*avio);
+    int result = (*avio)->error;
+    av_freep(&(*avio)->buffer);
+    avio_context_free(avio);
+    {
+        std::lock_guard<std::mutex> lock(outIO.mutex);
+        outIO.isEnd = true;
+        outIO.condition.notify_all();
+    }
+    outIO.thread.join();
+    for(unsigned int i=0;i<outIO.freeList.size();i++){
+        free(outIO.freeList[i]);
+    }
+    outIO.freeList.clear();
+    if(outIO.directFd >= 0){
+        close(outIO.directFd);
+    }
+    if(close(outIO.fd) < 0 && result >= 0){
+        result = AVERROR(errno);
+    }
+    return outIO.error < 0 ? outIO.error : result;
+}
+
+uint64_t Cache_Hash(const char *url){
+    //STEP::输入地址的FNV-1a哈希，作为缓存文件名
+    //STEP::FNV-1a hash of the input address, used as the cache file name
+    uint64_t hash = 14695981039346656037ULL;
+    for(const char *c = url; *c; c++){
+        hash = (hash ^ (uint8_t)*c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+std::string Cache_Path(){
+    char name[32];
+    snprintf(name, sizeof(name), "/%016" PRIx64 ".cache", Cache_Hash(inFilePath));
+    return std::string(streamCacheDir) + name;
+}
+
+bool Cache_Open(){
+    //STEP::只有直播流等网络输入使用缓存，本地文件使用索引；加载后检查缓存是否属于这个地址
+    //STEP::Only network inputs such as live streams use the cache, local files use the index; after loading check that the cache belongs to this address
+    if(!streamCacheDir || IsLocalFile(inFilePath)){
+        return false;
+    }
+    if(!Index_Map(&sourceIndex, Cache_Path().c_str())){
+        return false;
+    }
+    const IndexHeader *header = sourceIndex.header;
+    if(header->sourceSize != (int64_t)strlen(inFilePath) || header->sourceHash != Cache_Hash(inFilePath)){
+        Index_Close(&sourceIndex);
+        return false;
+    }
+    return true;
+}
+
+bool Cache_Match(){
+    //STEP::快速探测到的参数与缓存比较，只比较已经探测到的值，未探测到的值由缓存补全
+    //STEP::Compare the quickly probed parameters with the cache, only values already probed are compared, values not probed yet are completed from the cache
+    if(inFileHandle->nb_streams != sourceIndex.header->streamCount){
+        return false;
+    }
+    for(unsigned int i = 0; i < inFileHandle->nb_streams; i++) {
+        AVCodecParameters *codecpar = inFileHandle->streams[i]->codecpar;
+        const IndexStream *indexStream = &sourceIndex.streams[i];
+        if(codecpar->codec_type != indexStream->codecType || codecpar->codec_id != indexStream->codecID ||
+           (codecpar->width > 0 && codecpar->width != indexStream->width) ||
+           (codecpar->height > 0 && codecpar->height != indexStream->height) ||
+           (codecpar->sample_rate > 0 && codecpar->sample_rate != indexStream->sampleRate) ||
+           (codecpar->ch_layout.nb_channels > 0 && codecpar->ch_layout.nb_channels != indexStream->channels)){
+            return false;
+        }
+        if(codecpar->extradata_size > 0 && (codecpar->extradata_size != indexStream->extradataSize ||
+           memcmp(codecpar->extradata, sourceIndex.extradata + indexStream->extradataOffset, codecpar->extradata_size) != 0)){
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Cache_Probe(){
+    //STEP::快速探测，flv、mpegts等没有文件头的格式在读到数据包后才创建轨道，需要读到各轨道的第一批数据包
+    //轨道已经齐全的格式不必探测；读到的数据包留在解封装器的缓冲中，不一致时完整探测会接着使用
+    //STEP::Quick probe, formats without a header such as flv and mpegts create tracks only when their packets are read, so the first packets of every track have to be read
+    //Formats whose tracks are already complete need no probing; the packets read stay buffered in the demuxer, and a full probe continues from them when the cache differs
+    if((inFileHandle->ctx_flags & AVFMTCTX_NOHEADER) || inFileHandle->nb_streams != sourceIndex.header->streamCount){
+        int64_t fullProbeSize = inFileHandle->probesize;
+        int64_t fullAnalyzeDuration = inFileHandle->max_analyze_duration;
+        inFileHandle->probesize = streamCacheProbeSize;
+        inFileHandle->max_analyze_duration = streamCacheAnalyzeDuration;
+        int result = avformat_find_stream_info(inFileHandle, NULL);
+        inFileHandle->probesize = fullProbeSize;
+        inFileHandle->max_analyze_duration = fullAnalyzeDuration;
+        if(result < 0){
+            return false;
+        }
+    }
+    return Cache_Match() && Index_ApplyStreams(&sourceIndex, inFileHandle);
+}
+
+void Cache_Write(){
+    //STEP::完整探测后保存轨道参数，先写临时文件再rename，其他进程不会读到写了一半的缓存；写入失败只影响下次启动速度，不终止
+    //STEP::Save the track parameters after a full probe, a temporary file is written and then renamed so other processes never read a half-written cache; a write failure only affects the next startup, so it does not terminate
+    if(!streamCacheDir || IsLocalFile(inFilePath)){
+        return;
+    }
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = INDEX_VERSION;
+    header.streamCount = inFileHandle->nb_streams;
+    header.sourceSize = strlen(inFilePath);
+    header.sourceHash = Cache_Hash(inFilePath);
+    header.startTime = AV_NOPTS_VALUE;
+    header.duration = AV_NOPTS_VALUE;
+    const char *formatName = inFileHandle->iformat->name;
+    size_t formatLength = strcspn(formatName, ",");
+    memcpy(header.formatName, formatName, FFMIN(formatLength, sizeof(header.formatName) - 1));
+
+    std::vector<IndexStream> streamList(inFileHandle->nb_streams);
+    for(unsigned int i = 0; i < inFileHandle->nb_streams; i++) {
+        AVStream *inStream = inFileHandle->streams[i];
+        AVCodecParameters *codecpar = inStream->codecpar;
+        IndexStream *indexStream = &streamList[i];
+        memset(indexStream, 0, sizeof(*indexStream));
+        indexStream->bitRate = codecpar->bit_rate;
+        indexStream->startTime = AV_NOPTS_VALUE;                                                   //直播流每次连接的时间戳都不同，timestamps differ on every connection of a live stream
+        indexStream->duration = AV_NOPTS_VALUE;
+        indexStream->extradataOffset = header.extradataSize;
+        indexStream->extradataSize = codecpar->extradata_size;
+        indexStream->codecType = codecpar->codec_type;
+        indexStream->codecID = codecpar->codec_id;
+        indexStream->format = codecpar->format;
+        indexStream->profile = codecpar->profile;
+        indexStream->level = codecpar->level;
+        indexStream->width = codecpar->width;
+        indexStream->height = codecpar->height;
+        indexStream->sampleRate = codecpar->sample_rate;
+        indexStream->channels = codecpar->ch_layout.nb_channels;
+        indexStream->fieldOrder = codecpar->field_order;
+        indexStream->colorRange = codecpar->color_range;
+        indexStream->colorPrimaries = codecpar->color_primaries;
+        indexStream->colorTrc = codecpar->color_trc;
+        indexStream->colorSpace = codecpar->color_space;
+        indexStream->sampleAspectRatio[0] = codecpar->sample_aspect_ratio.num;
+        indexStream->sampleAspectRatio[1] = codecpar->sample_aspect_ratio.den;
+        indexStream->timeBase[0] = inStream->time_base.num;
+        indexStream->timeBase[1] = inStream->time_base.den;
+        indexStream->frameRate[0] = inStream->r_frame_rate.num;
+        indexStream->frameRate[1] = inStream->r_frame_rate.den;
+        indexStream->avgFrameRate[0] = inStream->avg_frame_rate.num;
+        indexStream->avgFrameRate[1] = inStream->avg_frame_rate.den;
+        header.extradataSize += codecpar->extradata_size;
+    }
+
+    mkdir(streamCacheDir, 0755);
+    std::string cachePath = Cache_Path();
+    std::string tempPath = cachePath + ".tmp";
+    FILE *file = fopen(tempPath.c_str(), "wb");
+    if(!file){
+        std::cout<<"Could not open stream cache "<<tempPath<<std::endl;
+        return;
+    }
+    bool isWritten = fwrite(&header, sizeof(header), 1, file) == 1;
+    isWritten = isWritten && (streamList.empty() || fwrite(streamList.data(), sizeof(IndexStream), streamList.size(), file) == streamList.size());
+    for(unsigned int i = 0; isWritten && i < inFileHandle->nb_streams; i++) {
+        AVCodecParameters *codecpar = inFileHandle->streams[i]->codecpar;
+        isWritten = codecpar->extradata_size <= 0 || fwrite(codecpar->extradata, 1, codecpar->extradata_size, file) == (size_t)codecpar->extradata_size;
+    }
+    if(fclose(file) != 0 || !isWritten || rename(tempPath.c_str(), cachePath.c_str()) != 0){
+        unlink(tempPath.c_str());
+        std::cout<<"Could not write stream cache "<<cachePath<<std::endl;
+    }
+}
+
+bool Start_Packet(AVPacket *packet){
+    //STEP::直播流从中途开始读取，第一个视频关键帧之前的数据包无法解码，全部丢弃
+    //STEP::A live stream is joined midway, packets before the first video keyframe can not be decoded, so they are all dropped
+    if(isStarted){
+        return true;
+    }
+    if(packet->stream_index != startVideoIndex || !(packet->flags & AV_PKT_FLAG_KEY)){
+        return false;
+    }
+    isStarted = true;
+    return true;
+}
+
+void Range_Init(){
+    //STEP::计算时间范围在源视频时间轴上的位置，源视频的起始时间不一定为0
+    //STEP::Calculate the position of the time range on the source timeline, the source does not necessarily start at 0
+    isRange = rangeStart > 0 || rangeDuration > 0;
+    if(!isRange){
+        return;
+    }
+    rangeBegin = (inFileHandle->start_time != AV_NOPTS_VALUE ? inFileHandle->start_time : 0) + rangeStart;
+    rangeEnd = rangeDuration > 0 ? rangeBegin + rangeDuration : INT64_MAX;
+    rangeVideoIndex = av_find_best_stream(inFileHandle, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    rangeOffset = rangeVideoIndex < 0 ? rangeBegin : AV_NOPTS_VALUE;                               //没有视频轨道时不需要对齐关键帧，no keyframe alignment is needed without video
+    rangeEndList.assign(inFileHandle->nb_streams, false);
+    rangeActiveList.assign(inFileHandle->nb_streams, false);
+    rangeTrackEndList.assign(inFileHandle->nb_streams, INT64_MAX);
+    for(unsigned int i = 0; i < inFileHandle->nb_streams; i++) {
+        AVStream *inStream = inFileHandle->streams[i];
+        AVMediaType type = inStream->codecpar->codec_type;
+        if((type != AVMEDIA_TYPE_AUDIO && type != AVMEDIA_TYPE_VIDEO) || (inStream->disposition & AV_DISPOSITION_ATTACHED_PIC)){
+            continue;                                                                               //封面图片只有一个数据包，永远读不到rangeEnd，a cover picture has a single packet and never reaches rangeEnd
+        }
+        rangeActiveList[i] = true;
+        rangeActiveCount++;
+        if(inStream->start_time != AV_NOPTS_VALUE && inStream->duration > 0){
+            rangeTrackEndList[i] = av_rescale_q(inStream->start_time + inStream->duration, inStream->time_base, AV_TIME_BASE_Q);
+        }
+    }
+
+    //STEP::定位到rangeBegin之前最近的关键帧，不必从头读取；有索引时直接定位到索引中的关键帧
+    //STEP::Seek to the nearest keyframe before rangeBegin, so reading does not start from the beginning; with an index, seek directly to the keyframe in the index
+    if(rangeStart > 0){
+        ret = Index_Seek(&sourceIndex, inFileHandle, rangeVideoIndex, rangeBegin);
+        if(ret<0){
+            termination("Could not seek to the range start.");
+        }
+    }
+}
+
+void Range_Inactive(int index){
+    //轨道不再需要等待，所有等待的轨道都结束后停止读取
+    //The track is no longer waited for, reading stops once all waited tracks have ended
+    if(rangeActiveList[index]){
+        rangeActiveList[index] = false;
+        rangeActiveCount--;
+    }
+}
+
+bool Range_Packet(AVStream *inStream, AVPacket *packet){
+    //STEP::判断数据包是否在时间范围内，在范围内时把时间戳平移到从0开始
+    //STEP::Check whether the packet is inside the time range, and shift its timestamps to start at 0 when it is
+    if(!isRange){
+        return true;
+    }
+    int index = packet->stream_index;
+    if(rangeEndList[index]){
+        return false;
+    }
+    int64_t pts = packet->pts != AV_NOPTS_VALUE ? av_rescale_q(packet->pts, inStream->time_base, AV_TIME_BASE_Q) : AV_NOPTS_VALUE;
+    int64_t dts = packet->dts != AV_NOPTS_VALUE ? av_rescale_q(packet->dts, inStream->time_base, AV_TIME_BASE_Q) : pts;
+
+    //数据包按dts排列，轨道的dts到达rangeEnd后，之后的数据包都在范围外
+    //短于时间范围的轨道读到自己的结尾后也不再等待，数据包照常处理
+    //Packets are in dts order, once the dts of a track reaches rangeEnd, all later packets are outside the range
+    //A track shorter than the range is no longer waited for once it reaches its own end, the packet is handled as usual
+    if(dts != AV_NOPTS_VALUE && dts >= rangeEnd){
+        rangeEndList[index] = true;
+        Range_Inactive(index);
+        return false;
+    }
+    if(pts != AV_NOPTS_VALUE && pts + av_rescale_q(packet->duration, inStream->time_base, AV_TIME_BASE_Q) >= rangeTrackEndList[index]){
+        Range_Inactive(index);
+    }
+
+    //定位后读到的第一个视频关键帧为实际起点，之前的视频数据包和pts早于起点的数据包（如开放GOP的前导帧）丢弃
+    //之前的非视频数据包可能pts不早于起点，先缓存，起点确定后由Range_Flush重新检查
+    //The first video keyframe read after seeking is the actual start, earlier video packets and packets with pts before it (such as leading pictures of an open GOP) are dropped
+    //Earlier non-video packets may have a pts not before the start, they are buffered and checked again by Range_Flush once the start is known
+    if(rangeOffset == AV_NOPTS_VALUE){
+        if(index != rangeVideoIndex && pts != AV_NOPTS_VALUE){
+            AVPacket *pending = av_packet_alloc();
+            if(!pending){
+                termination("Could not allocate AVPacket.");
+            }
+            av_packet_move_ref(pending, packet);
+            rangePendingList.push_back(pending);
+            return false;
+        }
+        if(index != rangeVideoIndex || !(packet->flags & AV_PKT_FLAG_KEY) || pts == AV_NOPTS_VALUE){
+            return false;
+        }
+        rangeOffset = pts;
+        std::cout<<"range starts at keyframe "<<(rangeOffset - rangeBegin + rangeStart) / 1000000.0<<"s"<<std::endl;
+    }
+    if(pts == AV_NOPTS_VALUE || pts < rangeOffset){
+        return false;
+    }
+    int64_t offset = av_rescale_q(rangeOffset, AV_TIME_BASE_Q, inStream->time_base);
+    packet->pts -= offset;
+    if(packet->dts != AV_NOPTS_VALUE){
+        packet->dts -= offset;
+    }
+    return true;
+}
+
 void Step1_OpenInFile(){
     //STEP::打开源视频文件
     //STEP::Open the input video file
+    openTime = av_gettime_relative();
     AVDictionary* optionsDict = NULL;                                                 //设置输入源封装参数
     av_dict_set(&optionsDict, "rw_timeout", "2000000", 0);                            //设置网络超时，当输入源为文件时，可注释此行。Set the network timeout, you can comment out this line when the input source is a file
-    ret = avformat_open_input(&inFileHandle, inFilePath, NULL, &optionsDict);
+    if(probeSize > 0){
+        av_dict_set_int(&optionsDict, "probesize", probeSize, 0);                     //探测的最大字节数，maximum bytes to probe
+    }
+    if(analyzeDuration > 0){
+        av_dict_set_int(&optionsDict, "analyzeduration", analyzeDuration, 0);         //探测的最大时长，maximum duration to probe
+    }
+    if(inIOBackend != IO_DEFAULT && IsLocalFile(inFilePath)){                          //使用自定义读后端，Use the custom read backend
+        inFileHandle = avformat_alloc_context();
+        if(!inFileHandle){
+            termination("Could not allocate input handle.");
+        }
+        inFileHandle->pb = InIO_Open(inFilePath);
+    }
+    bool isIndexed = Index_Open(&sourceIndex, inFilePath, indexSuffix);                                                    //索引有效时直接指定解封装器，跳过格式探测，with a valid index the demuxer is given directly and format probing is skipped
+    bool isCached = !isIndexed && Cache_Open();                                       //直播流有缓存时同样直接指定解封装器，a live stream with a cache also gives the demuxer directly
+    const AVInputFormat *inFormat = sourceIndex.header ? av_find_input_format(sourceIndex.header->formatName) : NULL;
+    ret = avformat_open_input(&inFileHandle, inFilePath, inFormat, &optionsDict);
+    av_dict_free(&optionsDict);
     if(ret<0){
         termination("Could not open input file.");
     }
 
-    //STEP::获取源视频文件的流信息
-    //STEP::Get the stream information of the source video file
-    ret = avformat_find_stream_info(inFileHandle, NULL);
-    if(ret<0){
-        termination("Failed to retrieve input stream information.");
+    //STEP::获取源视频文件的流信息，索引有效时使用索引中的参数，不再探测；直播流有缓存时快速探测后用缓存补全
+    //都不可用时完整探测，直播流完整探测后更新缓存
+    //STEP::Get the stream information of the source video file, with a valid index the parameters in the index are used without probing; a live stream with a cache is probed quickly and completed from the cache
+    //Otherwise a full probe is done, and a live stream updates its cache after the full probe
+    if(isIndexed && Index_ApplyStreams(&sourceIndex, inFileHandle)){
+        std::cout<<"stream information loaded from index"<<std::endl;
+    } else if(isCached && Cache_Probe()){
+        std::cout<<"stream information loaded from cache"<<std::endl;
+    } else {
+        if(isCached){
+            std::cout<<"stream cache does not match, full probe"<<std::endl;
+        }
+        ret = avformat_find_stream_info(inFileHandle, NULL);
+        if(ret<0){
+            termination("Failed to retrieve input stream information.");
+        }
+        Cache_Write();
+    }
+    if(isCached){
+        Index_Close(&sourceIndex);                                                                //缓存只用于补全参数，extradata已复制，the cache only completes the parameters, extradata has been copied
+    }
+    probeCost = av_gettime_relative() - openTime;
+
+    //STEP::直播流从第一个视频关键帧开始输出
+    //STEP::Live streams start output at the first video keyframe
+    if(!IsLocalFile(inFilePath)){
+        startVideoIndex = av_find_best_stream(inFileHandle, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        isStarted = startVideoIndex < 0;
     }
+
+    //STEP::设置了时间范围时，定位到范围的起点
+    //STEP::When a time range is set, seek to the start of the range
+    Range_Init();
+}
+
+AVDictionary *Fragment_Options(){
+    //STEP::输出为mp4、mov时设置分片参数，frag_keyframe配合min_frag_duration使分片从关键帧开始且不短于fragmentDuration
+    //delay_moov让moov等到第一个分片时再写，编码器不输出全局头时，mov封装器可以从第一个数据包取得参数集
+    //STEP::Set the fragmentation options when the output is mp4 or mov, frag_keyframe with min_frag_duration makes every fragment start at a keyframe and last at least fragmentDuration
+    //delay_moov holds moov until the first fragment, so the mov muxer can take the parameter sets from the first packet when the encoder has no global header
+    const char *formatName = outFileHandle->oformat->name;
+    if(!isFragmented || (strcmp(formatName, "mp4") != 0 && strcmp(formatName, "mov") != 0)){
+        return NULL;
+    }
+    AVDictionary *optionsDict = NULL;
+    av_dict_set(&optionsDict, "movflags", isCmaf ? "+frag_keyframe+empty_moov+default_base_moof+delay_moov+cmaf" : "+frag_keyframe+empty_moov+default_base_moof+delay_moov", 0);
+    av_dict_set_int(&optionsDict, "min_frag_duration", fragmentDuration, 0);
+    return optionsDict;
 }
 
 void Step2_CreateOutFile(){
     //STEP::创建输出文件句柄outFileHandle
     //STEP::Creates an output file handle, outFileHandle.
-    ret = avformat_alloc_output_context2(&outFileHandle, NULL, "flv", outFilePath);
+    ret = avformat_alloc_output_context2(&outFileHandle, NULL, outFormatName, outFilePath);
     if(ret<0){
         termination("Could not create output handle.");
     }
@@ -91,16 +952,22 @@ void Step2_CreateOutFile(){
         streamMapping[i] = outStreamIndex++;                                                       //记录源文件轨道序号与输出文件轨道序号的对应关系，Record the correspondence between the track number of the source file and the track number of the output file.
     }
 
-    //STEP::打开输出文件
-    //STEP::Open the output file
-    ret = avio_open(&outFileHandle->pb, outFilePath, AVIO_FLAG_WRITE);
-    if(ret<0){
-        termination("Could not open out file.");
+    //STEP::打开输出文件，本地文件可使用自定义写后端
+    //STEP::Open the output file, local files can use the custom write backend
+    if(outIOBackend == IO_WRITE_ASYNC && IsLocalFile(outFilePath)){
+        outFileHandle->pb = OutIO_Open(outFilePath);
+    } else {
+        ret = avio_open(&outFileHandle->pb, outFilePath, AVIO_FLAG_WRITE);
+        if(ret<0){
+            termination("Could not open out file.");
+        }
     }
 
-    //STEP::写入文件头信息
-    //STEP::Write file header information
-    ret = avformat_write_header(outFileHandle, NULL);
+    //STEP::写入文件头信息，mp4、mov可使用分片输出
+    //STEP::Write file header information, mp4 and mov can use fragmented output
+    AVDictionary *fragmentDict = Fragment_Options();
+    ret = avformat_write_header(outFileHandle, &fragmentDict);
+    av_dict_free(&fragmentDict);
     if(ret<0){
         termination("Could not write stream header to out file.");
     }
@@ -112,46 +979,388 @@ void Step2_CreateOutFile(){
     // avformat_write_header(outFileHandle, &optionsDict);
 }
 
+void Interleave_Init(){
+    //STEP::为每个输出轨道创建队列，音视频轨道写出前需要等待，封面图片只有一个数据包，不等待
+    //keyframeList初始为false：Start_Packet和Range_Packet已保证视频从关键帧开始，只有丢弃数据后才需要等待下一个关键帧
+    //STEP::Create a queue for every output track, audio/video tracks are waited for before writing, a cover picture has a single packet and is not waited for
+    //keyframeList starts false: Start_Packet and Range_Packet already make the video start at a keyframe, waiting for the next keyframe is only needed after dropping data
+    interleaver.queueList.resize(outFileHandle->nb_streams);
+    interleaver.waitList.assign(outFileHandle->nb_streams, false);
+    interleaver.keyframeList.assign(outFileHandle->nb_streams, false);
+    interleaver.endList.assign(outFileHandle->nb_streams, false);
+    interleaver.inputList.assign(outFileHandle->nb_streams, -1);
+    interleaver.trackEndList.assign(outFileHandle->nb_streams, INT64_MAX);
+    interleaver.activeList.assign(outFileHandle->nb_streams, av_gettime_relative());
+    for(unsigned int i = 0; i < inFileHandle->nb_streams; i++) {
+        if(streamMapping[i] < 0){
+            continue;
+        }
+        AVStream *inStream = inFileHandle->streams[i];
+        AVMediaType type = inStream->codecpar->codec_type;
+        int outIndex = streamMapping[i];
+        interleaver.inputList[outIndex] = i;
+        interleaver.waitList[outIndex] = (type == AVMEDIA_TYPE_AUDIO || type == AVMEDIA_TYPE_VIDEO) && !(inStream->disposition & AV_DISPOSITION_ATTACHED_PIC);
+
+        //有时间范围时时间戳已平移，轨道结尾由Range_Packet判断（rangeActiveList）
+        //With a time range the timestamps are shifted, the end of the track is decided by Range_Packet (rangeActiveList)
+        if(!isRange && inStream->start_time != AV_NOPTS_VALUE && inStream->duration > 0){
+            interleaver.trackEndList[outIndex] = av_rescale_q(inStream->start_time + inStream->duration, inStream->time_base, AV_TIME_BASE_Q);
+        }
+    }
+    interleaver.bytes = 0;
+    interleaver.packets = 0;
+    interleaver.lastDts = AV_NOPTS_VALUE;
+    interleaver.maxDuration = 0;
+    interleaver.maxBytes = 0;
+    interleaver.limitCount = 0;
+    interleaver.dropCount = 0;
+}
+
+void Interleave_Release(InterleaveItem *item){
+    interleaver.bytes -= item->packet->size;
+    interleaver.packets--;
+    av_packet_unref(item->packet);
+    interleaver.packetPool.push_back(item->packet);
+}
+
+void Interleave_Drop(unsigned int streamIndex){
+    //STEP::丢弃队列头部的数据包，视频轨道丢弃后继续丢弃到下一个关键帧为止，否则之后的帧无法解码
+    //STEP::Drop the packet at the head of the queue, a video track keeps dropping until the next keyframe, otherwise the following frames can not be decoded
+    std::deque<InterleaveItem> *queue = &interleaver.queueList[streamIndex];
+    bool isVideo = outFileHandle->streams[streamIndex]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
+    do {
+        Interleave_Release(&queue->front());
+        queue->pop_front();
+        interleaver.dropCount++;
+    } while(isVideo && !queue->empty() && !(queue->front().packet->flags & AV_PKT_FLAG_KEY));
+    if(isVideo && queue->empty()){
+        interleaver.keyframeList[streamIndex] = true;
+    }
+}
+
+bool Interleave_Wait(unsigned int streamIndex, int64_t now){
+    //STEP::判断队列为空时是否还要等待该轨道：已结束（到达时间范围终点或自己的结尾）或超过interleaveMaxDuration没有新数据包的轨道不再等待，
+    //否则其他轨道会一直缓存到超出上限；不再等待的轨道之后又有数据包时恢复等待
+    //STEP::Decide whether an empty track is still waited for: a track that has ended (reached the range end or its own end) or has had no new packet for longer than interleaveMaxDuration is not waited for,
+    //otherwise the other tracks buffer until they hit the limits; a track that pushes a packet again is waited for again
+    if(!interleaver.waitList[streamIndex] || interleaver.endList[streamIndex]){
+        return false;
+    }
+    if(isRange && !rangeActiveList[interleaver.inputList[streamIndex]]){
+        return false;
+    }
+    return now - interleaver.activeList[streamIndex] <= interleaveMaxDuration;
+}
+
+void Interleave_Write(bool isFlush){
+    //STEP::所有需要等待的轨道都有数据包时，写出头部dts最小的数据包；有轨道为空时等待，超出上限时按策略写出或丢弃最早的数据包；isFlush为true时写出全部
+    //STEP::When every waited track has a packet, write the one with the smallest head dts; wait while a track is empty, and write or drop the earliest packet by the policy when over the limits; isFlush writes everything
+    int64_t now = av_gettime_relative();
+    while(interleaver.packets > 0){
+        unsigned int streamIndex = 0;
+        int64_t minDts = INT64_MAX;
+        bool isReady = true;
+        for(unsigned int i = 0; i < interleaver.queueList.size(); i++) {
+            if(interleaver.queueList[i].empty()){
+                isReady = isReady && !Interleave_Wait(i, now);
+            } else if(interleaver.queueList[i].front().dts < minDts){
+                minDts = interleaver.queueList[i].front().dts;
+                streamIndex = i;
+            }
+        }
+        interleaver.maxDuration = FFMAX(interleaver.maxDuration, Interleave_Duration());
+        interleaver.maxBytes = FFMAX(interleaver.maxBytes, interleaver.bytes);
+        if(!isReady && !isFlush){
+            if(Interleave_Duration() <= interleaveMaxDuration && interleaver.bytes <= interleaveMaxBytes){
+                break;
+            }
+            interleaver.limitCount++;
+            if(interleavePolicy == INTERLEAVE_DROP){
+                Interleave_Drop(streamIndex);
+                continue;
+            }
+        }
+
+        InterleaveItem item = interleaver.queueList[streamIndex].front();
+        interleaver.queueList[streamIndex].pop_front();
+        if(interleaver.lastDts == AV_NOPTS_VALUE || item.dts > interleaver.lastDts){
+            interleaver.lastDts = item.dts;
+        }
+        ret = av_write_frame(outFileHandle, item.packet);
+        if(ret < 0){
+            termination("Could not mux packet.");
+        }
+        Interleave_Release(&item);
+    }
+}
+
+int Interleave_Push(AVStream *outStream, AVPacket *packet){
+    //STEP::数据包放入所在轨道的队列，没有dts的数据包使用该轨道上一个数据包的dts
+    //STEP::Put the packet into the queue of its track, a packet without dts uses the dts of the previous packet of the track
+    unsigned int streamIndex = packet->stream_index;
+    std::deque<InterleaveItem> *queue = &interleaver.queueList[streamIndex];
+    int64_t timestamp = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    int64_t dts = timestamp != AV_NOPTS_VALUE ? av_rescale_q(timestamp, outStream->time_base, AV_TIME_BASE_Q) :
+                  !queue->empty() ? queue->back().dts : interleaver.lastDts != AV_NOPTS_VALUE ? interleaver.lastDts : 0;
+
+    //STEP::记录轨道的活动时刻，数据包到达轨道结尾后不再等待该轨道
+    //STEP::Record the activity of the track, the track is no longer waited for once a packet reaches its end
+    interleaver.activeList[streamIndex] = av_gettime_relative();
+    if(dts + av_rescale_q(packet->duration, outStream->time_base, AV_TIME_BASE_Q) >= interleaver.trackEndList[streamIndex]){
+        interleaver.endList[streamIndex] = true;
+    }
+
+    //STEP::INTERLEAVE_GAP时丢弃晚于已写出位置到达的数据包；视频轨道丢弃数据后从下一个关键帧重新开始
+    //STEP::With INTERLEAVE_GAP drop packets arriving behind the written position; a video track restarts at the next keyframe after dropping data
+    bool isVideo = outStream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
+    if(interleavePolicy == INTERLEAVE_GAP && interleaver.lastDts != AV_NOPTS_VALUE && dts < interleaver.lastDts){
+        interleaver.dropCount++;
+        interleaver.keyframeList[streamIndex] = isVideo;
+        return 0;
+    }
+    if(interleaver.keyframeList[streamIndex]){
+        if(!(packet->flags & AV_PKT_FLAG_KEY)){
+            interleaver.dropCount++;
+            return 0;
+        }
+        interleaver.keyframeList[streamIndex] = false;
+    }
+
+    //STEP::从packetPool取出数据包结构体，转移数据包的引用，不复制数据
+    //STEP::Take a packet structure from packetPool and move the reference of the packet, the data is not copied
+    InterleaveItem item;
+    if(!interleaver.packetPool.empty()){
+        item.packet = interleaver.packetPool.back();
+        interleaver.packetPool.pop_back();
+    } else {
+        item.packet = av_packet_alloc();
+        if(!item.packet){
+            return AVERROR(ENOMEM);
+        }
+    }
+    av_packet_move_ref(item.packet, packet);
+    item.dts = dts;
+    queue->push_back(item);
+    interleaver.bytes += item.packet->size;
+    interleaver.packets++;
+    Interleave_Write(false);
+    return 0;
+}
+
+void Interleave_Free(){
+    //STEP::输出交织队列的峰值，释放剩余的数据包和packetPool
+    //STEP::Print the peaks of the interleaving queue, free the remaining packets and packetPool
+    if(writeMode != WRITE_BOUNDED){
+        return;
+    }
+    std::cout<<"interleave: peak "<<interleaver.maxDuration / 1000<<"ms, "<<interleaver.maxBytes<<" bytes, over limits "<<interleaver.limitCount
+             <<" times ("<<interleavePolicyName[interleavePolicy]<<"), dropped "<<interleaver.dropCount<<" packets"<<std::endl;
+    for(size_t i=0;i<interleaver.queueList.size();i++){
+        while(!interleaver.queueList[i].empty()){
+            Interleave_Release(&interleaver.queueList[i].front());
+            interleaver.queueList[i].pop_front();
+        }
+    }
+    for(size_t i=0;i<interleaver.packetPool.size();i++){
+        av_packet_free(&interleaver.packetPool[i]);
+    }
+    interleaver.packetPool.clear();
+}
+
+int Write_Decide(){
+    //STEP::根据探测窗口内的最大落后值一次性决定写入方式，再按读取顺序写出缓存的数据包
+    //STEP::Decide the write mode once from the largest lag in the probe window, then write the buffered packets in read order
+    isWriteDecided = true;
+    isInterleaving = writeLag > interleaveTolerance;
+    std::cout<<"write mode: input lags at most "<<writeLag / 1000<<"ms in the first "<<writeProbeList.size()<<" packets, use "
+             <<(isInterleaving ? "interleaved" : "direct")<<" writing"<<std::endl;
+    int result = 0;
+    for(size_t i = 0; i < writeProbeList.size(); i++){
+        if(result >= 0){
+            result = isInterleaving ? av_interleaved_write_frame(outFileHandle, writeProbeList[i]) : av_write_frame(outFileHandle, writeProbeList[i]);
+        }
+        av_packet_free(&writeProbeList[i]);
+    }
+    writeProbeList.clear();
+    return result;
+}
+
+int Write_Packet(AVStream *outStream, AVPacket *packet){
+    //STEP::WRITE_BOUNDED时交给有界交织队列；写入方式已决定时按决定的方式写入
+    //STEP::With WRITE_BOUNDED hand it to the bounded interleaving queue; once the write mode is decided write in that mode
+    if(writeMode == WRITE_BOUNDED){
+        return Interleave_Push(outStream, packet);
+    }
+    if(isWriteDecided){
+        return isInterleaving ? av_interleaved_write_frame(outFileHandle, packet) : av_write_frame(outFileHandle, packet);
+    }
+
+    //STEP::WRITE_AUTO时先缓存数据包，统计比已读取的最大dts落后的最大值，窗口结束后决定写入方式
+    //STEP::With WRITE_AUTO buffer the packet first and track the largest lag behind the largest dts read so far, decide the write mode when the window ends
+    int64_t timestamp = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    if(timestamp != AV_NOPTS_VALUE){
+        int64_t dts = av_rescale_q(timestamp, outStream->time_base, AV_TIME_BASE_Q);
+        if(writeFirstDts == AV_NOPTS_VALUE){
+            writeFirstDts = dts;
+        }
+        if(writeLastDts != AV_NOPTS_VALUE && dts < writeLastDts){
+            writeLag = FFMAX(writeLag, writeLastDts - dts);
+        }
+        if(writeLastDts == AV_NOPTS_VALUE || dts > writeLastDts){
+            writeLastDts = dts;
+        }
+    }
+    AVPacket *probePacket = av_packet_alloc();
+    if(!probePacket){
+        return AVERROR(ENOMEM);
+    }
+    av_packet_move_ref(probePacket, packet);
+    writeProbeList.push_back(probePacket);
+    if((int)writeProbeList.size() < writeProbePackets && (writeFirstDts == AV_NOPTS_VALUE || writeLastDts - writeFirstDts < writeProbeDuration)){
+        return 0;
+    }
+    return Write_Decide();
+}
+
+void Step3_Output(AVPacket *packet){
+    int inIndex = packet->stream_index;
+
+    //转换timebase（时间基），一般不同的封装格式下，时间基是不一样的
+    //Converts the timebase, which is generally different for different package formats
+    AVStream *inStream = inFileHandle->streams[packet->stream_index];
+    AVStream *outStream = outFileHandle->streams[streamMapping[packet->stream_index]];
+    av_packet_rescale_ts(packet, inStream->time_base, outStream->time_base);
+
+    //将轨道序号修改为对应的输出文件轨道序号
+    //Change the track number to the corresponding output file track number.
+    packet->stream_index = streamMapping[packet->stream_index];
+
+    //封装packet，并写入输出文件
+    //Mux the packet and write to the output file
+    int64_t stageTime = Metrics_Now();
+    int64_t allocNow = allocCount.load(std::memory_order_relaxed);
+    ret = Write_Packet(outStream, packet);
+    if (ret < 0) {
+        termination("Could not mux packet.");   
+    }
+    Metrics_Record(inIndex, STAGE_WRITE, stageTime);
+    allocWriteCount += allocCount.load(std::memory_order_relaxed) - allocNow;
+
+    //STEP::记录从打开输入到写出第一个数据包的耗时，用于衡量启动延迟
+    //STEP::Record the time from opening the input to writing the first packet, used to measure the startup latency
+    if(firstOutputCost < 0){
+        firstOutputCost = av_gettime_relative() - openTime;
+        std::cout<<"probe: "<<probeCost / 1000.0<<"ms, first output packet: "<<firstOutputCost / 1000.0<<"ms"<<std::endl;
+    }
+
+    av_packet_unref(packet);
+}
+
+void Range_Flush(){
+    //STEP::实际起点确定后，缓存的数据包按读取顺序重新检查，范围内的写出
+    //STEP::Once the actual start is known, the buffered packets are checked again in reading order, those inside the range are written
+    if(rangeOffset == AV_NOPTS_VALUE || rangePendingList.empty()){
+        return;
+    }
+    for(size_t i=0;i<rangePendingList.size();i++){
+        AVPacket *pending = rangePendingList[i];
+        if(Range_Packet(inFileHandle->streams[pending->stream_index], pending) && Start_Packet(pending)){
+            Step3_Output(pending);
+        }
+        av_packet_free(&pending);
+    }
+    rangePendingList.clear();
+}
+
 void Step3_Operation(){
     AVPacket *packet = av_packet_alloc();
     if (!packet) {
         termination("Could not allocate AVPacket.");   
     }
+    if(!Metrics_Init(metricsFormat, metricsName, metricsFilePath, metricsUdpAddress, metricsInterval, stageName, STAGE_LENGTH, inFileHandle->nb_streams, Metrics_Extra)){
+        termination("Could not initialize metrics.");
+    }
+    if(writeMode == WRITE_BOUNDED){
+        Interleave_Init();
+    }
 
     //STEP::av_read_frame会将源文件解封装，并将数据放到packet
     //数据包一般是按dts（解码时间戳）顺序排列的
     //STEP::av_read_frame unpacks the source file and puts the data into packet
     //The packets are generally in dts (decoding timestamp) order
+    int64_t stageTime = Metrics_Now();
+    int64_t allocStart = allocCount.load(std::memory_order_relaxed);
     while (av_read_frame(inFileHandle, packet) >= 0) {
+        int64_t allocNow = allocCount.load(std::memory_order_relaxed);
+        allocReadCount = allocNow - allocStart - allocWriteCount;                             //写入以外的分配都计入读取，主要是av_read_frame，allocations outside writing count as reading, mostly av_read_frame
+        allocPacketCount++;
+        int inIndex = packet->stream_index;
+        Metrics_Record(inIndex, STAGE_READ, stageTime);
+        Metrics_Progress(inFileHandle->streams[inIndex], packet);
 
         //根据之前的关联关系，判断是否舍弃此packet
         //Determine whether to discard this packet based on previous associations
         if(streamMapping[packet->stream_index] < 0){
             av_packet_unref(packet);
+            stageTime = Metrics_Now();
             continue;
         }
 
-        //转换timebase（时间基），一般不同的封装格式下，时间基是不一样的
-        //Converts the timebase, which is generally different for different package formats
-        AVStream *inStream = inFileHandle->streams[packet->stream_index];
-        AVStream *outStream = outFileHandle->streams[streamMapping[packet->stream_index]];
-        av_packet_rescale_ts(packet, inStream->time_base, outStream->time_base);
+        //STEP::丢弃时间范围外的数据包，所有音视频轨道都读到rangeEnd后停止读取
+        //STEP::Drop packets outside the time range, reading stops once all audio/video tracks have reached rangeEnd
+        if(!Range_Packet(inFileHandle->streams[inIndex], packet)){
+            av_packet_unref(packet);
+            if(isRange && rangeActiveCount == 0){
+                break;
+            }
+            stageTime = Metrics_Now();
+            continue;
+        }
 
-        //将轨道序号修改为对应的输出文件轨道序号
-        //Change the track number to the corresponding output file track number.
-        packet->stream_index = streamMapping[packet->stream_index];
+        //STEP::直播流丢弃第一个视频关键帧之前的数据包
+        //STEP::Live streams drop packets before the first video keyframe
+        if(!Start_Packet(packet)){
+            av_packet_unref(packet);
+            stageTime = Metrics_Now();
+            continue;
+        }
+
+        Step3_Output(packet);
+
+        //STEP::实际起点确定后，重新检查之前缓存的非视频数据包
+        //STEP::Once the actual start is known, check the buffered non-video packets again
+        Range_Flush();
+
+        //STEP::按间隔导出统计
+        //STEP::Export metrics periodically
+        Metrics_Export(outFileHandle, false);
+        stageTime = Metrics_Now();
+    }
+
+    //STEP::写出有界交织队列中剩余的数据包
+    //STEP::Write the packets left in the bounded interleaving queue
+    if(writeMode == WRITE_BOUNDED){
+        Interleave_Write(true);
+    }
 
-        //封装packet，并写入输出文件
-        //Mux the packet and write to the output file
-        ret = av_interleaved_write_frame(outFileHandle, packet);
+    //STEP::输入不足一个探测窗口时，在结束时决定写入方式并写出缓存的数据包
+    //STEP::When the input is shorter than one probe window, decide the write mode at the end and write the buffered packets
+    if(!isWriteDecided){
+        ret = Write_Decide();
         if (ret < 0) {
             termination("Could not mux packet.");   
         }
-
-        av_packet_unref(packet);
     }
-
+    Metrics_Export(outFileHandle, true);
+    if(isAllocCount && allocPacketCount > 0){
+        std::cout<<"write mode: "<<(writeMode == WRITE_BOUNDED ? "bounded" : isInterleaving ? "interleaved" : "direct")<<", packets: "<<allocPacketCount<<", allocations per packet: read "
+                 <<(double)allocReadCount / allocPacketCount<<", write "<<(double)allocWriteCount / allocPacketCount<<std::endl;
+    }
     av_packet_free(&packet);
+    for(size_t i=0;i<rangePendingList.size();i++){
+        av_packet_free(&rangePendingList[i]);                                                     //没有读到视频关键帧，no video keyframe was read
+    }
+    rangePendingList.clear();
 }
 
 void Step4_End(){
@@ -164,15 +1373,31 @@ void Step4_End(){
 
     //STEP::关闭输出文件，并销毁具柄
     //STEP::Close the output file，and destroy the handle
-    ret = avio_closep(&outFileHandle->pb);
+    //自定义的AVIOContext不能用avio_closep关闭
+    //A custom AVIOContext can not be closed by avio_closep
+    if(outIOBackend == IO_WRITE_ASYNC && IsLocalFile(outFilePath)){
+        ret = OutIO_Close(&outFileHandle->pb);
+    } else {
+        ret = avio_closep(&outFileHandle->pb);
+    }
     if(ret < 0) {
         termination("Could not close out file.");   
     }
     avformat_free_context(outFileHandle);
 
-    //STEP::关闭输入文件，并销毁具柄
-    //STEP::Close the input file，and destroy the handle
+    //STEP::释放统计和交织队列
+    //STEP::Free the metrics and the interleaving queue
+    Metrics_Free();
+    Interleave_Free();
+
+    //STEP::关闭输入文件，并销毁具柄，自定义的AVIOContext需要自己释放
+    //STEP::Close the input file，and destroy the handle, a custom AVIOContext has to be freed by ourselves
+    AVIOContext *inIOContext = inFileHandle->flags & AVFMT_FLAG_CUSTOM_IO ? inFileHandle->pb : NULL;
     avformat_close_input(&inFileHandle);
+    if(inIOContext){
+        InIO_Close(&inIOContext);
+    }
+    Index_Close(&sourceIndex);
 }
 
 int main(int argc, char *argv[]){
@@ -186,9 +1411,17 @@ int main(int argc, char *argv[]){
 
     //STEP::循环处理数据
     //STEP::Cyclic processing data
+    int64_t inBytes = avio_size(inFileHandle->pb);
+    int64_t startTime = av_gettime_relative();
     Step3_Operation();
 
     //STEP::关闭输入、输出文件
     //STEP::Close input and output files
     Step4_End();
+
+    //STEP::输出耗时与吞吐量（包含等待后台写完），用于对比不同的读写后端
+    //STEP::Print the time and throughput (including waiting for background writes), to compare the I/O backends
+    double costTime = (av_gettime_relative() - startTime) / 1000000.0;
+    std::cout<<"read backend: "<<ioBackendName[inIOBackend]<<", write backend: "<<ioBackendName[outIOBackend]<<", time: "<<costTime<<"s, "
+             <<(costTime > 0 && inBytes > 0 ? inBytes / 1048576.0 / costTime : 0)<<" MB/s"<<std::endl;
 }
\ No newline at end of file
@@ -6,11 +6,24 @@
 */
 
 #include <iostream>
+#include <atomic>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <errno.h>
+#include <vector>
 extern "C" {  
     #include <libavutil/timestamp.h>
     #include <libavformat/avformat.h>
     #include <libavutil/time.h>
 }
+#include "../common/alloc_count.h"
+#include "../common/metrics.h"
 
 int ret = 0;
 
@@ -19,6 +32,34 @@ int ret = 0;
 const char *inFilePath  = "../../common/test.mp4";
 const char *outFilePath  = "rtmp://192.168.3.202:1935/live/out";
 
+//提前发送的时间（毫秒），数据包会比其时间戳对应的时刻提前这么久发出，给网络和播放端留出缓冲
+//Lead time (milliseconds), packets are sent this much earlier than the moment of their timestamps, leaving a buffer for the network and the player
+const int leadTime = 0;
+
+//时间戳跳变阈值（秒），数据包时间与时钟相差超过该值时重新对齐时钟，避免时间戳跳变、回绕后长时间sleep或连续突发
+//Timestamp jump threshold (seconds), when a packet is further than this from the clock, the clock is re-aligned, to avoid sleeping for a long time or bursting after a timestamp jump or wrap
+const int resyncThreshold = 10;
+
+//控速统计输出间隔（秒）
+//Pacing statistics report interval (seconds)
+const int pacingReportInterval = 10;
+
+//写入方式：WRITE_INTERLEAVED总是使用av_interleaved_write_frame，它把每个数据包放进内部队列等待其他轨道，每个数据包都要申请队列节点和缓冲区引用
+//WRITE_DIRECT总是使用av_write_frame直接写入，不排队；WRITE_AUTO先缓存开头writeProbeDuration（微秒，按dts跨度）或writeProbePackets个数据包，
+//统计数据包比已读取的最大dts落后的最大值，不超过interleaveTolerance时整个过程直接写入，否则整个过程交织写入，决定后不再改变（avformat.h不允许混用两种写入函数）；窗口内的数据包在窗口结束时才发出，推流开始会晚这么久
+//Write mode: WRITE_INTERLEAVED always uses av_interleaved_write_frame, which puts every packet into an internal queue to wait for the other tracks, allocating a queue node and a buffer reference per packet
+//WRITE_DIRECT always writes directly with av_write_frame without queueing; WRITE_AUTO first buffers the opening writeProbeDuration (microseconds, by dts span) or writeProbePackets packets,
+//and measures how far packets fall behind the largest dts read so far, within interleaveTolerance the whole run writes directly, otherwise the whole run writes interleaved, the mode never changes once decided (avformat.h forbids mixing the two write functions); the packets in the window are sent when it ends, so the stream starts that much later
+typedef enum WriteMode {
+    WRITE_INTERLEAVED = 0,
+    WRITE_DIRECT,
+    WRITE_AUTO,
+} WriteMode;
+const WriteMode writeMode = WRITE_AUTO;
+const int64_t interleaveTolerance = 1000000;
+const int64_t writeProbeDuration = 2000000;
+const int writeProbePackets = 1000;
+
 //输入输出文件句柄
 //Input and output file handles
 AVFormatContext *inFileHandle = NULL;
@@ -28,12 +69,153 @@ AVFormatContext *outFileHandle = NULL;
 //Track number correlation table for input files and output files
 int *streamMapping = NULL;
 
+//性能统计配置，统计代码在common/metrics.h
+//Metrics configuration, the metrics code is in common/metrics.h
+const MetricsFormat metricsFormat = METRICS_NONE;
+//指标名前缀
+//Metric name prefix
+const char *metricsName = "remux_tostream";
+
+//统计导出文件路径，先写临时文件再rename，读取方不会读到写了一半的内容
+//UDP导出地址，格式为ip:port，NULL表示不发送
+//导出间隔（秒）
+//Metrics export file path, a temporary file is written and then renamed, so readers never see a half-written file
+//UDP export address in ip:port format, NULL means not sending
+//Export interval (seconds)
+const char *metricsFilePath = "./remux_tostream.prom";
+const char *metricsUdpAddress = NULL;
+//const char *metricsUdpAddress = "127.0.0.1:9125";
+const int metricsInterval = 1;
+
+//统计的处理阶段
+//Measured processing stages
+typedef enum Stage {
+    STAGE_READ = 0,                                                             //av_read_frame
+    STAGE_PACE,                                                                 //控速等待，pacing sleep
+    STAGE_WRITE,                                                                //av_interleaved_write_frame
+    STAGE_LENGTH,
+} Stage;
+const char *stageName[] = {"read", "pace", "write"};
+
+//写入路径的状态：是否交织写入，写入方式是否已决定，探测窗口缓存的数据包，窗口内最早、最大的dts和最大落后值（微秒），主循环中读取、写入阶段的分配次数，数据包数
+//State of the write path: whether writing is interleaved, whether the write mode has been decided, packets buffered in the probe window, the earliest and largest dts and the largest lag in the window (microseconds), allocations of the read and write stages in the main loop, number of packets
+bool isInterleaving = writeMode == WRITE_INTERLEAVED;
+bool isWriteDecided = writeMode != WRITE_AUTO;
+std::vector<AVPacket *> writeProbeList;
+int64_t writeFirstDts = AV_NOPTS_VALUE;
+int64_t writeLastDts = AV_NOPTS_VALUE;
+int64_t writeLag = 0;
+int64_t allocReadCount = 0;
+int64_t allocWriteCount = 0;
+int64_t allocPacketCount = 0;
+
 void termination(const char* param){
     std::cout<<param<<std::endl;
     std::cout<<"Error occur, quit!"<<std::endl;
     exit(-1);
 }
 
+void Metrics_Extra(std::string *text, MetricsFormat format){
+    //STEP::追加读取、写入阶段的内存分配次数，未开启ALLOC_COUNT时JSON中为-1
+    //STEP::Append the allocations of the read and write stages, -1 in JSON when ALLOC_COUNT is off
+    if(format == METRICS_PROMETHEUS){
+        if(isAllocCount){
+            Metrics_Append(text, "# TYPE %s_allocations_total counter\n%s_allocations_total{stage=\"read\"} %" PRId64 "\n%s_allocations_total{stage=\"write\"} %" PRId64 "\n",
+                           metricsName, metricsName, allocReadCount, metricsName, allocWriteCount);
+        }
+        return;
+    }
+    Metrics_Append(text, ",\"alloc_read\":%" PRId64 ",\"alloc_write\":%" PRId64, isAllocCount ? allocReadCount : -1, isAllocCount ? allocWriteCount : -1);
+}
+
+//控速引擎的状态，所有轨道共用一个时钟，按每个数据包的dts计算绝对的发送时刻
+//State of the pacing engine, all tracks share one clock, and the absolute send time is calculated from the dts of every packet
+typedef struct Pacing {
+    int64_t startTime;                                                          //时钟基准（单调时钟，微秒），clock base (monotonic clock, microseconds)
+    int64_t firstDts;                                                           //时间戳基准（微秒），timestamp base (microseconds)
+    int64_t lastDts;                                                            //最新的时间戳（微秒），latest timestamp (microseconds)
+    int64_t count;                                                              //已控速的数据包数，number of paced packets
+    int64_t lateCount;                                                          //晚于发送时刻1毫秒以上的数据包数，number of packets more than 1 millisecond behind their send time
+    int64_t jitterSum;                                                          //实际发送时刻与计划时刻的偏差之和（微秒），sum of deviations between actual and planned send time (microseconds)
+    int64_t jitterMax;                                                          //最大偏差（微秒），maximum deviation (microseconds)
+    int64_t resyncCount;                                                        //重新对齐时钟的次数，number of clock re-alignments
+    int64_t reportTime;                                                         //上次输出统计的时间，last report time
+} Pacing;
+Pacing pacing = {0, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0, 0, 0, 0, 0, 0};
+
+int64_t Pacing_Now(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+void Pacing_SleepUntil(int64_t deadline){
+    //STEP::按绝对时刻sleep，误差不会随sleep次数累积
+    //STEP::Sleep until an absolute time, so errors do not accumulate over many sleeps
+    struct timespec time;
+    time.tv_sec = deadline / 1000000;
+    time.tv_nsec = (deadline % 1000000) * 1000;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, NULL) == EINTR){
+    }
+}
+
+void Pacing_Report(bool isForce){
+    //STEP::输出抖动和漂移，漂移为正表示发送落后于时间戳
+    //STEP::Print jitter and drift, a positive drift means sending falls behind the timestamps
+    int64_t now = Pacing_Now();
+    if(pacing.count == 0 || (!isForce && now - pacing.reportTime < pacingReportInterval * 1000000LL)){
+        return;
+    }
+    pacing.reportTime = now;
+    int64_t drift = (now - pacing.startTime) - (pacing.lastDts - pacing.firstDts) - leadTime * 1000LL;
+    std::cout<<"pacing: packets "<<pacing.count<<", late "<<pacing.lateCount
+             <<", jitter avg "<<pacing.jitterSum / pacing.count<<"us max "<<pacing.jitterMax<<"us"
+             <<", drift "<<drift / 1000<<"ms, resync "<<pacing.resyncCount<<std::endl;
+}
+
+void Pacing_Wait(AVStream *outStream, AVPacket *packet){
+    //STEP::所有轨道按各自的dts计算发送时刻，到时刻再发送，任何轨道都不会突发
+    //STEP::Every track calculates its send time from its own dts and waits until then, so no track bursts
+    //数据包的时间戳已换算为输出轨道的timebase
+    //The packet timestamps are already in the output track timebase
+    int64_t timestamp = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    if(timestamp == AV_NOPTS_VALUE){
+        return;
+    }
+    int64_t dts = av_rescale_q(timestamp, outStream->time_base, AV_TIME_BASE_Q);
+    int64_t now = Pacing_Now();
+    if(pacing.firstDts == AV_NOPTS_VALUE){
+        pacing.startTime = now;                                                             //记录开始时间，Record start time
+        pacing.firstDts = dts;                                                              //防止第一个dts非0的情况，Preventing the first dts from being non-zero
+        pacing.reportTime = now;
+    }
+    int64_t deadline = pacing.startTime + (dts - pacing.firstDts) - leadTime * 1000LL;
+    if(deadline - now > resyncThreshold * 1000000LL || now - deadline > resyncThreshold * 1000000LL){
+        pacing.startTime = now;                                                             //时间戳跳变，以当前数据包重新对齐，timestamp jump, re-align to the current packet
+        pacing.firstDts = dts;
+        deadline = now - leadTime * 1000LL;
+        pacing.resyncCount++;
+    }
+    if(dts > pacing.lastDts || pacing.lastDts == AV_NOPTS_VALUE){
+        pacing.lastDts = dts;
+    }
+
+    if(deadline > now){
+        Pacing_SleepUntil(deadline);
+        now = Pacing_Now();
+    }
+    int64_t jitter = now - deadline;
+    if(jitter > 1000){
+        pacing.lateCount++;
+    }
+    pacing.jitterSum += jitter;
+    if(jitter > pacing.jitterMax){
+        pacing.jitterMax = jitter;
+    }
+    pacing.count++;
+    Pacing_Report(false);
+}
+
 void Step1_OpenInFile(){
     //STEP::打开源视频文件
     //STEP::Open the input video file
@@ -112,25 +294,84 @@ void Step2_CreateOutFile(){
     // avformat_write_header(outFileHandle, &optionsDict);
 }
 
+int Write_Decide(){
+    //STEP::根据探测窗口内的最大落后值一次性决定写入方式，再按读取顺序写出缓存的数据包
+    //STEP::Decide the write mode once from the largest lag in the probe window, then write the buffered packets in read order
+    isWriteDecided = true;
+    isInterleaving = writeLag > interleaveTolerance;
+    std::cout<<"write mode: input lags at most "<<writeLag / 1000<<"ms in the first "<<writeProbeList.size()<<" packets, use "
+             <<(isInterleaving ? "interleaved" : "direct")<<" writing"<<std::endl;
+    int result = 0;
+    for(size_t i = 0; i < writeProbeList.size(); i++){
+        if(result >= 0){
+            result = isInterleaving ? av_interleaved_write_frame(outFileHandle, writeProbeList[i]) : av_write_frame(outFileHandle, writeProbeList[i]);
+        }
+        av_packet_free(&writeProbeList[i]);
+    }
+    writeProbeList.clear();
+    return result;
+}
+
+int Write_Packet(AVStream *outStream, AVPacket *packet){
+    if(isWriteDecided){
+        return isInterleaving ? av_interleaved_write_frame(outFileHandle, packet) : av_write_frame(outFileHandle, packet);
+    }
+
+    //STEP::WRITE_AUTO时先缓存数据包，统计比已读取的最大dts落后的最大值，窗口结束后决定写入方式
+    //STEP::With WRITE_AUTO buffer the packet first and track the largest lag behind the largest dts read so far, decide the write mode when the window ends
+    int64_t timestamp = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    if(timestamp != AV_NOPTS_VALUE){
+        int64_t dts = av_rescale_q(timestamp, outStream->time_base, AV_TIME_BASE_Q);
+        if(writeFirstDts == AV_NOPTS_VALUE){
+            writeFirstDts = dts;
+        }
+        if(writeLastDts != AV_NOPTS_VALUE && dts < writeLastDts){
+            writeLag = FFMAX(writeLag, writeLastDts - dts);
+        }
+        if(writeLastDts == AV_NOPTS_VALUE || dts > writeLastDts){
+            writeLastDts = dts;
+        }
+    }
+    AVPacket *probePacket = av_packet_alloc();
+    if(!probePacket){
+        return AVERROR(ENOMEM);
+    }
+    av_packet_move_ref(probePacket, packet);
+    writeProbeList.push_back(probePacket);
+    if((int)writeProbeList.size() < writeProbePackets && (writeFirstDts == AV_NOPTS_VALUE || writeLastDts - writeFirstDts < writeProbeDuration)){
+        return 0;
+    }
+    return Write_Decide();
+}
+
 void Step3_Operation(){
-    int64_t firstDts = AV_NOPTS_VALUE;
-    int64_t firstTime = 0;
-    int64_t trackIndex = -1;
     AVPacket *packet = av_packet_alloc();
     if (!packet) {
         termination("Could not allocate AVPacket.");   
     }
+    if(!Metrics_Init(metricsFormat, metricsName, metricsFilePath, metricsUdpAddress, metricsInterval, stageName, STAGE_LENGTH, inFileHandle->nb_streams, Metrics_Extra)){
+        termination("Could not initialize metrics.");
+    }
 
     //STEP::av_read_frame会将源文件解封装，并将数据放到packet
     //数据包一般是按dts（解码时间戳）顺序排列的
     //STEP::av_read_frame unpacks the source file and puts the data into packet
     //The packets are generally in dts (decoding timestamp) order
+    int64_t stageTime = Metrics_Now();
+    int64_t allocStart = allocCount.load(std::memory_order_relaxed);
     while (av_read_frame(inFileHandle, packet) >= 0) {
+        int64_t allocNow = allocCount.load(std::memory_order_relaxed);
+        allocReadCount = allocNow - allocStart - allocWriteCount;                             //写入以外的分配都计入读取，主要是av_read_frame，allocations outside writing count as reading, mostly av_read_frame
+        allocPacketCount++;
+        int inIndex = packet->stream_index;
+        Metrics_Record(inIndex, STAGE_READ, stageTime);
+        Metrics_Progress(inFileHandle->streams[inIndex], packet);
 
         //根据之前的关联关系，判断是否舍弃此packet
         //Determine whether to discard this packet based on previous associations
         if(streamMapping[packet->stream_index] < 0){
             av_packet_unref(packet);
+            stageTime = Metrics_Now();
             continue;
         }
 
@@ -144,30 +385,46 @@ void Step3_Operation(){
         //Change the track number to the corresponding output file track number.
         packet->stream_index = streamMapping[packet->stream_index];
 
-        //计算时间间隔，必要时sleep
-        //Calculate the time interval, sleep if necessary
-        if(firstDts == AV_NOPTS_VALUE){
-            firstDts = packet->dts;                                                         //防止第一个dts非0的情况，Preventing the first dts from being non-zero
-            firstTime = av_gettime();                                                       //记录开始时间，Record start time
-            trackIndex = packet->stream_index;                                              //记录观察的轨道序号，一般只观察一个轨道序号就行，Record the number of track observed, usually just one orbital number
-        } else if(trackIndex == packet->stream_index){
-            int64_t delay = av_rescale_q(packet->dts - firstDts, outStream->time_base, AV_TIME_BASE_Q);     //将相差的dts转换为实际时间间隔，Converts the difference dts to actual time intervals
-            int64_t intervalTime =  av_gettime() - firstTime;
-            if(delay > 0 && delay > intervalTime){
-                av_usleep(delay - intervalTime);
-            }
-        }
+        //按时间戳控速，所有轨道共用一个单调时钟
+        //Pace by timestamp, all tracks share one monotonic clock
+        int64_t paceTime = Metrics_Now();
+        Pacing_Wait(outStream, packet);
+        Metrics_Record(inIndex, STAGE_PACE, paceTime);
 
         //封装packet，并写入输出文件
         //Mux the packet and write to the output file
-        ret = av_interleaved_write_frame(outFileHandle, packet);
+        stageTime = Metrics_Now();
+        allocNow = allocCount.load(std::memory_order_relaxed);
+        ret = Write_Packet(outStream, packet);
         if (ret < 0) {
             termination("Could not mux packet.");   
         }
+        Metrics_Record(inIndex, STAGE_WRITE, stageTime);
+        allocWriteCount += allocCount.load(std::memory_order_relaxed) - allocNow;
 
         av_packet_unref(packet);
+
+        //STEP::按间隔导出统计
+        //STEP::Export metrics periodically
+        Metrics_Export(outFileHandle, false);
+        stageTime = Metrics_Now();
     }
 
+    //STEP::输入不足一个探测窗口时，在结束时决定写入方式并写出缓存的数据包
+    //STEP::When the input is shorter than one probe window, decide the write mode at the end and write the buffered packets
+    if(!isWriteDecided){
+        ret = Write_Decide();
+        if (ret < 0) {
+            termination("Could not mux packet.");   
+        }
+    }
+
+    Metrics_Export(outFileHandle, true);
+    if(isAllocCount && allocPacketCount > 0){
+        std::cout<<"write mode: "<<(isInterleaving ? "interleaved" : "direct")<<", packets: "<<allocPacketCount<<", allocations per packet: read "
+                 <<(double)allocReadCount / allocPacketCount<<", write "<<(double)allocWriteCount / allocPacketCount<<std::endl;
+    }
+    Pacing_Report(true);
     av_packet_free(&packet);
 }
 
@@ -187,6 +444,10 @@ void Step4_End(){
     }
     avformat_free_context(outFileHandle);
 
+    //STEP::释放统计
+    //STEP::Free the metrics
+    Metrics_Free();
+
     //STEP::关闭输入文件，并销毁具柄
     //STEP::Close the input file，and destroy the handle
     avformat_close_input(&inFileHandle);
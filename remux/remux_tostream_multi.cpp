@@ -0,0 +1,446 @@
+/*
+ * 视频转封装例子（多路推流），一个进程同时把多个文件按时间戳控速推成直播流，所有通道共用一个时间轮
+ * The sample of remuxing video (multiple streams), one process pushes several files as live streams paced by timestamp at the same time, all channels share one timer wheel
+ * Depends on FFmpeg 6.0
+ * Wirte by stoprefactoring.com
+*/
+
+#include <iostream>
+#include <string>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+extern "C" {
+    #include <libavutil/timestamp.h>
+    #include <libavformat/avformat.h>
+    #include <libavutil/time.h>
+}
+
+int ret = 0;
+
+//输入文件路径，每个通道都推送这个文件
+//Input file path, every channel pushes this file
+const char *inFilePath  = "../../common/test.mp4";
+
+//通道数和输出地址模板，%d替换为通道序号
+//Number of channels and the output address template, %d is replaced by the channel number
+const int channelCount = 100;
+const char *outFilePattern  = "rtmp://192.168.3.202:1935/live/out_%d";
+
+//提前发送的时间（毫秒），数据包会比其时间戳对应的时刻提前这么久发出，给网络和播放端留出缓冲
+//Lead time (milliseconds), packets are sent this much earlier than the moment of their timestamps, leaving a buffer for the network and the player
+const int leadTime = 0;
+
+//时间戳跳变阈值（秒），数据包时间与时钟相差超过该值时重新对齐时钟
+//Timestamp jump threshold (seconds), when a packet is further than this from the clock, the clock is re-aligned
+const int resyncThreshold = 10;
+
+//控速统计输出间隔（秒）
+//Pacing statistics report interval (seconds)
+const int pacingReportInterval = 10;
+
+//单次写入的超时（微秒），所有通道在一个线程中写入，一个慢速的对端最多拖住其他通道这么久，超时的通道关闭后重连
+//打开输入、输出的超时（微秒），重连时同样会拖住其他通道，所以也要短
+//Timeout of a single write (microseconds), all channels write on one thread, so a slow peer holds the other channels for at most this long, a channel that times out is closed and reconnected
+//Timeout of opening the input and output (microseconds), reconnecting holds the other channels as well, so it must be short too
+const int64_t writeTimeout = 100000;
+const int64_t openTimeout = 1000000;
+
+//通道出错（打开失败、写入失败或超时）后的重连间隔（秒）和最多重连次数，超过次数后只结束该通道，不影响其他通道
+//Reconnect interval (seconds) and maximum reconnect count after a channel fails (open failure, write failure or timeout), beyond that only this channel ends, other channels are not affected
+const int channelRetryInterval = 5;
+const int channelRetryLimit = 3;
+
+//时间轮的刻度（微秒）和槽数，一圈为1024毫秒，发送时刻更远的通道会在槽中多等几圈
+//Tick (microseconds) and slot count of the timer wheel, one round is 1024 milliseconds, channels with a later send time wait in the slot for more rounds
+const int64_t wheelTick = 1000;
+#define WHEEL_SLOT_LENGTH 1024
+
+//通道上下文结构体，原来的全局句柄、轨道关联表、控速状态都放到这里
+//Channel context structure, the former global handles, track mapping and pacing state are all here
+typedef struct Channel {
+    int index;                                                                  //通道序号，channel number
+    char outFilePath[512];                                                      //输出地址，output address
+    AVFormatContext *inFileHandle;                                              //输入文件句柄，input file handle
+    AVFormatContext *outFileHandle;                                             //输出文件句柄，output file handle
+    int *streamMapping;                                                         //输入文件、输出文件的轨道序号关联表，track number correlation table for input and output files
+    AVPacket *packet;                                                           //已读取、等待发送的数据包，packet read and waiting to be sent
+    int64_t deadline;                                                           //等待发送的数据包的发送时刻，send time of the waiting packet
+    int64_t startTime;                                                          //时钟基准（单调时钟，微秒），clock base (monotonic clock, microseconds)
+    int64_t firstDts;                                                           //时间戳基准（微秒），timestamp base (microseconds)
+    int64_t lastDts;                                                            //最新的时间戳（微秒），latest timestamp (microseconds)
+    int64_t count;                                                              //已发送的数据包数，number of packets sent
+    int64_t lateCount;                                                          //晚于发送时刻1毫秒以上的数据包数，number of packets more than 1 millisecond behind their send time
+    int64_t jitterSum;                                                          //实际发送时刻与计划时刻的偏差之和（微秒），sum of deviations between actual and planned send time (microseconds)
+    int64_t jitterMax;                                                          //最大偏差（微秒），maximum deviation (microseconds)
+    int64_t resyncCount;                                                        //重新对齐时钟的次数，number of clock re-alignments
+    int64_t ioDeadline;                                                         //当前阻塞I/O的截止时刻，中断回调在超过后打断，deadline of the current blocking I/O, the interrupt callback breaks it once passed
+    int retryCount;                                                             //已重连的次数，number of reconnects
+    bool isOpen;                                                                //输入、输出已打开，input and output are open
+    bool isEnd;                                                                 //通道结束或出错，channel finished or failed
+    Channel *next;                                                              //时间轮槽中的下一个通道，next channel in the wheel slot
+} Channel;
+Channel *channelList = NULL;
+
+//时间轮，每个槽是一个通道链表
+//Timer wheel, each slot is a linked list of channels
+Channel *wheel[WHEEL_SLOT_LENGTH] = {NULL};
+int64_t wheelTime = 0;
+int activeCount = 0;
+
+void termination(const char* param){
+    std::cout<<param<<std::endl;
+    std::cout<<"Error occur, quit!"<<std::endl;
+    exit(-1);
+}
+
+int64_t Pacing_Now(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+void Pacing_SleepUntil(int64_t deadline){
+    //STEP::按绝对时刻sleep，误差不会随sleep次数累积
+    //STEP::Sleep until an absolute time, so errors do not accumulate over many sleeps
+    struct timespec time;
+    time.tv_sec = deadline / 1000000;
+    time.tv_nsec = (deadline % 1000000) * 1000;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, NULL) == EINTR){
+    }
+}
+
+int Channel_Interrupt(void *opaque){
+    //STEP::阻塞I/O的中断回调，超过截止时刻后让阻塞的调用返回，一个通道不会拖住单线程循环中的其他通道
+    //STEP::Interrupt callback of blocking I/O, makes the blocked call return once the deadline has passed, so one channel does not hold the other channels of the single-threaded loop
+    Channel *channel = (Channel *)opaque;
+    return Pacing_Now() > channel->ioDeadline;
+}
+
+void Channel_Close(Channel *channel){
+    //STEP::关闭通道的输入、输出，已写入文件头时写入文件尾，可以只打开了一部分
+    //STEP::Close the input and output of the channel, write the trailer when the header was written, it may be only partly open
+    if(channel->outFileHandle){
+        if(channel->outFileHandle->pb){
+            channel->ioDeadline = Pacing_Now() + writeTimeout;
+            if(channel->isOpen){
+                av_write_trailer(channel->outFileHandle);
+            }
+            avio_closep(&channel->outFileHandle->pb);
+        }
+        avformat_free_context(channel->outFileHandle);
+        channel->outFileHandle = NULL;
+    }
+    avformat_close_input(&channel->inFileHandle);
+    av_packet_free(&channel->packet);
+    av_freep(&channel->streamMapping);
+    channel->isOpen = false;
+}
+
+void Channel_Fail(Channel *channel, const char *reason){
+    //STEP::通道出错时只关闭这个通道，未超过重连次数时等待channelRetryInterval后重新打开，从头推送
+    //STEP::When a channel fails only this channel is closed, below the reconnect limit it is reopened after channelRetryInterval and pushes from the beginning
+    Channel_Close(channel);
+    if(channel->retryCount >= channelRetryLimit){
+        std::cout<<channel->outFilePath<<": "<<reason<<", channel stopped."<<std::endl;
+        channel->isEnd = true;
+        return;
+    }
+    channel->retryCount++;
+    channel->deadline = Pacing_Now() + channelRetryInterval * 1000000LL;
+    channel->firstDts = AV_NOPTS_VALUE;
+    channel->lastDts = AV_NOPTS_VALUE;
+    std::cout<<channel->outFilePath<<": "<<reason<<", reconnect "<<channel->retryCount<<"/"<<channelRetryLimit<<" in "<<channelRetryInterval<<"s."<<std::endl;
+}
+
+int Channel_Open(Channel *channel){
+    //STEP::打开源视频文件，获取流信息；出错时返回错误码，由调用方只关闭这个通道
+    //STEP::Open the input video file, get the stream information; on failure the error code is returned and the caller closes only this channel
+    AVIOInterruptCB interruptCallback = {Channel_Interrupt, channel};
+    channel->ioDeadline = Pacing_Now() + openTimeout;
+    channel->inFileHandle = avformat_alloc_context();
+    if(!channel->inFileHandle){
+        return AVERROR(ENOMEM);
+    }
+    channel->inFileHandle->interrupt_callback = interruptCallback;
+    int result = avformat_open_input(&channel->inFileHandle, inFilePath, NULL, NULL);
+    if(result<0){
+        return result;
+    }
+    result = avformat_find_stream_info(channel->inFileHandle, NULL);
+    if(result<0){
+        return result;
+    }
+
+    //STEP::创建输出句柄，根据源轨道信息创建输出的音视频轨道
+    //STEP::Create the output handle, create audio/video tracks for the output based on source track information
+    result = avformat_alloc_output_context2(&channel->outFileHandle, NULL, "flv", channel->outFilePath);
+    if(result<0){
+        return result;
+    }
+    channel->outFileHandle->interrupt_callback = interruptCallback;
+    int outStreamIndex = 0;
+    channel->streamMapping = (int *)av_malloc_array(channel->inFileHandle->nb_streams, sizeof(*channel->streamMapping));
+    if(!channel->streamMapping){
+        return AVERROR(ENOMEM);
+    }
+    for(unsigned int i = 0; i < channel->inFileHandle->nb_streams; i++) {
+        AVStream *inStream = channel->inFileHandle->streams[i];
+        if (inStream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO &&                               //过滤除video、audio以外的轨道，Filter tracks except video, audio
+            inStream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
+            channel->streamMapping[i] = -1;
+            continue;
+        }
+        AVStream *outStream = avformat_new_stream(channel->outFileHandle, NULL);
+        if(!outStream){
+            return AVERROR(ENOMEM);
+        }
+        result = avcodec_parameters_copy(outStream->codecpar, inStream->codecpar);
+        if(result<0){
+            return result;
+        }
+        outStream->codecpar->codec_tag = 0;
+        channel->streamMapping[i] = outStreamIndex++;
+    }
+
+    //STEP::打开输出，写入文件头信息，阻塞由中断回调按openTimeout打断
+    //STEP::Open the output, write file header information, blocking is broken by the interrupt callback after openTimeout
+    result = avio_open2(&channel->outFileHandle->pb, channel->outFilePath, AVIO_FLAG_WRITE, &channel->outFileHandle->interrupt_callback, NULL);
+    if(result<0){
+        return result;
+    }
+    result = avformat_write_header(channel->outFileHandle, NULL);
+    if(result<0){
+        return result;
+    }
+
+    channel->packet = av_packet_alloc();
+    if (!channel->packet) {
+        return AVERROR(ENOMEM);
+    }
+    channel->isOpen = true;
+    return 0;
+}
+
+bool Channel_Start(Channel *channel){
+    //STEP::打开通道并读取第一个数据包，失败时按重连策略处理，返回通道是否已打开
+    //STEP::Open the channel and read its first packet, a failure is handled by the reconnect policy, returns whether the channel is open
+    int result = Channel_Open(channel);
+    if(result < 0){
+        char errorString[AV_ERROR_MAX_STRING_SIZE] = {0};
+        av_make_error_string(errorString, sizeof(errorString), result);
+        Channel_Fail(channel, (std::string("could not open channel (") + errorString + ")").c_str());
+        return false;
+    }
+    return true;
+}
+
+void Channel_Read(Channel *channel){
+    //STEP::读取下一个需要发送的数据包，并计算它的发送时刻
+    //STEP::Read the next packet to send, and calculate its send time
+    //读到文件结尾时通道正常结束；读取出错或超时按重连策略处理，与打开、写入失败相同
+    //At the end of the file the channel ends normally; a read error or timeout is handled by the reconnect policy, the same as open and write failures
+    AVPacket *packet = channel->packet;
+    channel->ioDeadline = Pacing_Now() + openTimeout;
+    while(1){
+        int result = av_read_frame(channel->inFileHandle, packet);
+        if(result == AVERROR_EOF){
+            channel->isEnd = true;
+            return;
+        }
+        if(result < 0){
+            char errorString[AV_ERROR_MAX_STRING_SIZE] = {0};
+            av_make_error_string(errorString, sizeof(errorString), result);
+            Channel_Fail(channel, (std::string("could not read packet (") + errorString + ")").c_str());
+            return;
+        }
+        if(channel->streamMapping[packet->stream_index] >= 0){
+            break;
+        }
+        av_packet_unref(packet);
+    }
+
+    int64_t now = Pacing_Now();
+    int64_t timestamp = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    if(timestamp == AV_NOPTS_VALUE){
+        channel->deadline = now;                                                            //没有时间戳的数据包立即发送，packets without timestamp are sent at once
+        return;
+    }
+    int64_t dts = av_rescale_q(timestamp, channel->inFileHandle->streams[packet->stream_index]->time_base, AV_TIME_BASE_Q);
+    if(channel->firstDts == AV_NOPTS_VALUE){
+        channel->startTime = now;
+        channel->firstDts = dts;
+    }
+    channel->deadline = channel->startTime + (dts - channel->firstDts) - leadTime * 1000LL;
+    if(channel->deadline - now > resyncThreshold * 1000000LL || now - channel->deadline > resyncThreshold * 1000000LL){
+        channel->startTime = now;                                                           //时间戳跳变，以当前数据包重新对齐，timestamp jump, re-align to the current packet
+        channel->firstDts = dts;
+        channel->deadline = now - leadTime * 1000LL;
+        channel->resyncCount++;
+    }
+    if(channel->lastDts == AV_NOPTS_VALUE || dts > channel->lastDts){
+        channel->lastDts = dts;
+    }
+}
+
+void Channel_Send(Channel *channel){
+    //STEP::发送所有已到发送时刻的数据包，出错的通道只结束自己，不影响其他通道
+    //STEP::Send all packets whose send time has come, a failed channel only ends itself without affecting other channels
+    int64_t now = Pacing_Now();
+    while(!channel->isEnd && channel->deadline <= now){
+        int64_t jitter = now - channel->deadline;
+        if(jitter > 1000){
+            channel->lateCount++;
+        }
+        channel->jitterSum += jitter;
+        if(jitter > channel->jitterMax){
+            channel->jitterMax = jitter;
+        }
+        channel->count++;
+
+        AVPacket *packet = channel->packet;
+        AVStream *inStream = channel->inFileHandle->streams[packet->stream_index];
+        AVStream *outStream = channel->outFileHandle->streams[channel->streamMapping[packet->stream_index]];
+        av_packet_rescale_ts(packet, inStream->time_base, outStream->time_base);
+        packet->stream_index = channel->streamMapping[packet->stream_index];
+        channel->ioDeadline = now + writeTimeout;
+        if (av_interleaved_write_frame(channel->outFileHandle, packet) < 0) {
+            Channel_Fail(channel, "could not mux packet or write timed out");
+            break;
+        }
+        Channel_Read(channel);
+        now = Pacing_Now();
+    }
+}
+
+void Wheel_Insert(Channel *channel){
+    //STEP::按发送时刻向上取整放入时间轮的槽，处理该槽的刻度不早于发送时刻；不晚于当前刻度的放到下一个刻度
+    //STEP::Put the channel into the wheel slot of its send time rounded up, so the tick processing the slot is not earlier than the send time; send times up to the current tick go to the next tick
+    int64_t slotTime = (channel->deadline + wheelTick - 1) / wheelTick * wheelTick;
+    if(slotTime <= wheelTime){
+        slotTime = wheelTime + wheelTick;
+    }
+    int slot = (slotTime / wheelTick) % WHEEL_SLOT_LENGTH;
+    channel->next = wheel[slot];
+    wheel[slot] = channel;
+}
+
+void Pacing_Report(bool isForce){
+    //STEP::汇总所有通道的抖动和漂移，漂移为正表示发送落后于时间戳
+    //STEP::Sum up the jitter and drift of all channels, a positive drift means sending falls behind the timestamps
+    static int64_t reportTime = 0;
+    int64_t now = Pacing_Now();
+    if(!isForce && now - reportTime < pacingReportInterval * 1000000LL){
+        return;
+    }
+    reportTime = now;
+    int64_t count = 0;
+    int64_t lateCount = 0;
+    int64_t jitterSum = 0;
+    int64_t jitterMax = 0;
+    int64_t driftMax = 0;
+    int64_t resyncCount = 0;
+    for(int i=0;i<channelCount;i++){
+        Channel *channel = &channelList[i];
+        count += channel->count;
+        lateCount += channel->lateCount;
+        jitterSum += channel->jitterSum;
+        resyncCount += channel->resyncCount;
+        jitterMax = channel->jitterMax > jitterMax ? channel->jitterMax : jitterMax;
+        if(channel->firstDts != AV_NOPTS_VALUE && !channel->isEnd){
+            int64_t drift = (now - channel->startTime) - (channel->lastDts - channel->firstDts) - leadTime * 1000LL;
+            driftMax = drift > driftMax ? drift : driftMax;
+        }
+    }
+    std::cout<<"pacing: channels "<<activeCount<<"/"<<channelCount<<", packets "<<count<<", late "<<lateCount
+             <<", jitter avg "<<(count > 0 ? jitterSum / count : 0)<<"us max "<<jitterMax<<"us"
+             <<", drift max "<<driftMax / 1000<<"ms, resync "<<resyncCount<<std::endl;
+}
+
+void Step1_OpenChannel(){
+    //STEP::打开所有通道
+    //STEP::Open all channels
+    channelList = (Channel *)av_calloc(channelCount, sizeof(*channelList));
+    if(!channelList){
+        termination("Could not allocate channels.");
+    }
+    for(int i=0;i<channelCount;i++){
+        Channel *channel = &channelList[i];
+        channel->index = i;
+        snprintf(channel->outFilePath, sizeof(channel->outFilePath), outFilePattern, i);
+        channel->firstDts = AV_NOPTS_VALUE;
+        channel->lastDts = AV_NOPTS_VALUE;
+        Channel_Start(channel);
+    }
+}
+
+void Step2_Operation(){
+    //STEP::每个通道读取第一个数据包，放入时间轮
+    //STEP::Each channel reads its first packet and is put into the timer wheel
+    //打开失败、等待重连的通道也放入时间轮，到重连时刻时重新打开
+    //Channels that failed to open and wait to reconnect are put into the wheel as well, and reopened at their reconnect time
+    wheelTime = Pacing_Now() / wheelTick * wheelTick;
+    for(int i=0;i<channelCount;i++){
+        if(channelList[i].isOpen){
+            Channel_Read(&channelList[i]);
+        }
+        if(!channelList[i].isEnd){
+            Wheel_Insert(&channelList[i]);
+            activeCount++;
+        }
+    }
+
+    //STEP::单线程按刻度推进时间轮，只处理当前槽中已到发送时刻的通道，再按新的发送时刻放回时间轮
+    //STEP::A single thread advances the wheel tick by tick, only channels in the current slot whose send time has come are processed, then put back by their new send time
+    while(activeCount > 0){
+        wheelTime += wheelTick;
+        Pacing_SleepUntil(wheelTime);
+        int slot = (wheelTime / wheelTick) % WHEEL_SLOT_LENGTH;
+        Channel **link = &wheel[slot];
+        while(*link){
+            Channel *channel = *link;
+            if(channel->deadline > wheelTime){                                                  //还要再等几圈，wait for more rounds
+                link = &channel->next;
+                continue;
+            }
+            *link = channel->next;
+            if(!channel->isOpen){                                                               //到重连时刻，reconnect time has come
+                if(Channel_Start(channel)){
+                    Channel_Read(channel);
+                }
+            } else {
+                Channel_Send(channel);
+            }
+            if(channel->isEnd){
+                activeCount--;
+            } else {
+                Wheel_Insert(channel);                                                          //插入链表头，本轮不会再访问到，inserted at the list head, not visited again in this round
+            }
+        }
+        Pacing_Report(false);
+    }
+    Pacing_Report(true);
+}
+
+void Step3_End(){
+    //STEP::写入文件尾，关闭所有通道
+    //STEP::Write the trailers and close all channels
+    for(int i=0;i<channelCount;i++){
+        Channel_Close(&channelList[i]);
+    }
+    av_freep(&channelList);
+}
+
+int main(int argc, char *argv[]){
+    //STEP::打开所有通道的输入、输出
+    //STEP::Open the input and output of all channels
+    Step1_OpenChannel();
+
+    //STEP::按时间轮控速推流
+    //STEP::Push the streams paced by the timer wheel
+    Step2_Operation();
+
+    //STEP::关闭所有通道
+    //STEP::Close all channels
+    Step3_End();
+}
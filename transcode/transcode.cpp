@@ -6,12 +6,42 @@
 */
 
 #include <iostream>
+#include <string>
+#include <string.h>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <cmath>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
 extern "C" {  
     #include <libavutil/timestamp.h>
     #include <libavformat/avformat.h>
     #include <libavcodec/avcodec.h>
     #include <libavcodec/codec.h>
+    #include <libavutil/cpu.h>
+    #include <libavutil/buffer.h>
+    #include <libavutil/imgutils.h>
+    #include <libavutil/pixdesc.h>
+    #include <libavutil/opt.h>
+    #include <libswscale/swscale.h>
+    #include <libswresample/swresample.h>
+    #include <libavutil/audio_fifo.h>
+    #include <libavutil/samplefmt.h>
+    #include <libavutil/channel_layout.h>
+    #include <libavutil/intreadwrite.h>
+    #include <libavutil/time.h>
+    #include <libavutil/pixelutils.h>
 }
+#include "../common/index_format.h"
+#include "../common/metrics.h"
+#include "../common/thread_policy.h"
 
 int ret = 0;
 
@@ -25,22 +55,222 @@ const char *outFilePath  = "./out.mp4";
 //Video target encoding
 const AVCodecID videoCodecID = AV_CODEC_ID_H265;
 //音频目标编码
-//音频编码一般有固定的frameSize，如AAC是1024个采样是一帧，MP3是1052个采样是一帧
-//但是单纯的转编码，不会改变音频帧的原始数据
-//如果单纯采用转编码，将AAC转MP3，编码器是不会自动将一帧1024个采样改为1052个采样的，而是会报错退出
-//所以这里按原音频编码格式输出，但是程序仍然会进行完整的解码/编码过程
+//音频编码一般有固定的frameSize，如AAC是1024个采样是一帧，MP3是1152个采样是一帧
+//单纯的转编码不会改变音频帧的原始数据，编码器也不会自动把一帧1024个采样改为1152个采样，而是会报错退出
+//所以这里解码后先经过重采样，再通过FIFO按编码器的frameSize重新切分，因此也可以转为其他音频编码，如AAC转MP3
 //Audio target encoding
-//Audio encoding generally has a fixed frameSize, such as AAC is 1024 samples is a frame, MP3 is 1052 samples is a frame.
-//But pure transcoding will not change the original data of the audio frame.
-//If you simply use transcoding to convert AAC to MP3, the encoder will not automatically change a frame from 1024 samples to 1052 samples, but will report an error and exit.
-//So here the output is in the original audio encoding format, but the program still performs the full decoding/encoding process.
+//Audio encoding generally has a fixed frameSize, such as AAC is 1024 samples is a frame, MP3 is 1152 samples is a frame.
+//Pure transcoding will not change the original data of the audio frame, and the encoder will not change a frame from 1024 samples to 1152 samples by itself, but will report an error and exit.
+//So here the decoded audio is resampled first, then re-chunked by the encoder's frameSize through a FIFO, so it can also be converted to other audio encodings, such as AAC to MP3
 const AVCodecID audioCodecID = AV_CODEC_ID_AAC;
+//音频目标采样率、声道数，0表示与源音频一致
+//Audio target sample rate and number of channels, 0 means the same as the source audio
+const int audioSampleRate = 0;
+const int audioChannels = 0;
+
+//编解码线程预算，即本进程所有编解码器可使用的线程总数，0表示使用全部CPU核心
+//同一台机器同时运行多个转码进程时，应设为 CPU核心数/进程数，防止线程数超过CPU核心数导致互相争抢
+//Codec thread budget, the total number of threads all codecs of this process may use, 0 means all CPU cores
+//When running several transcoding processes on one host, set it to number of CPU cores / number of processes, to prevent more threads than CPU cores
+const int threadBudget = 0;
+
+//视频目标分辨率，0表示与源视频一致；只设置宽或高其中一个时，另一个按源视频的比例计算
+//降低分辨率（如4K转1080p）是减少编码开销最有效的方式
+//Video target resolution, 0 means the same as the source video; when only the width or height is set, the other one is calculated from the source aspect ratio
+//Downscaling (such as 4K to 1080p) is the most effective way to reduce the encoding cost
+const int videoWidth = 0;
+const int videoHeight = 0;
+
+//视频码率控制：videoBitRate大于0时为平均码率（bit/s），否则为恒定质量，videoCrf为libx264、libx265的crf，为0时使用编码器自己的默认值（libx264为23，libx265为28）
+//Video rate control: average bitrate (bit/s) when videoBitRate is greater than 0, otherwise constant quality, videoCrf is the crf of libx264 and libx265, 0 uses the encoder's own default (23 for libx264, 28 for libx265)
+const int64_t videoBitRate = 0;
+const int videoCrf = 0;
+
+//预分析：正式编码前快速解码一遍视频（跳过环路滤波），缩小为宽preAnalysisWidth的灰度图，按8x8块计算与上一帧的SAD（帧间开销）和与块均值的SAD（帧内开销），
+//块开销取两者较小值，与编码器前瞻的估算方式相同；帧间开销突增到近期均值的sceneCutThreshold倍以上且超过sceneCutMinCost（每像素）时判为场景切换，场景不短于sceneMinDuration
+//场景切换处强制为IDR帧；平均码率模式下按各场景的开销生成x265的zones码率系数，相当于两遍编码中第一遍的码率分配，恒定质量模式下编码器本身已按开销分配，只使用场景切换
+//SAD使用libavutil的pixelutils（有SSE2/AVX2实现），解码以外的开销很小，额外CPU约为一次解码
+//Pre-analysis: before the real encode, the video is decoded once quickly (loop filter skipped) and downscaled to grayscale with a width of preAnalysisWidth, every 8x8 block gets the SAD against the previous frame (inter cost) and against the block mean (intra cost),
+//the block cost is the smaller of the two, the same estimate the encoder lookahead uses; a scene cut is detected when the inter cost jumps above sceneCutThreshold times its recent mean and above sceneCutMinCost (per pixel), scenes last at least sceneMinDuration
+//Scene cuts are forced to IDR frames; in average bitrate mode x265 zones with bitrate factors are generated from the cost of every scene, the bit allocation the first pass of a two-pass encode would give, in constant quality mode the encoder already allocates by cost, so only the scene cuts are used
+//SAD uses the pixelutils of libavutil (with SSE2/AVX2 versions), apart from decoding the cost is very small, the extra CPU is about one decode
+const bool isPreAnalysis = false;
+const int preAnalysisWidth = 256;
+const double sceneCutThreshold = 3.0;
+const double sceneCutMinCost = 8.0;
+const int64_t sceneMinDuration = 1000000;
+
+//去重：解码后、编码前丢弃与上一个送入编码器的帧几乎相同的帧（录屏、幻灯片、暂停的直播等），缩小为宽dedupWidth的灰度图后按8x8块比较，
+//所有块的平均每像素差值都不超过dedupThreshold时为重复帧；保留帧的时间戳不变，输出为可变帧率，播放时上一帧一直显示到下一帧
+//一帧最多代替dedupMaxDuration时长的重复帧，之后即使相同也送入编码器，避免长时间没有新帧（播放器定位、直播延迟等）；结束时送入最后一个被丢弃的帧，使时长不变
+//Dedup: between decoding and encoding, drop frames that are almost the same as the last frame sent to the encoder (screen recordings, slides, paused live streams, etc.), compared by 8x8 blocks after downscaling to grayscale with a width of dedupWidth,
+//a frame is a duplicate when the average difference per pixel of every block is at most dedupThreshold; the timestamps of kept frames are unchanged, the output is variable frame rate, players show the previous frame until the next one
+//A frame stands in for at most dedupMaxDuration of duplicates, after that a frame is sent even if the same, so there is never a long time without a new frame (player seeking, live latency, etc.); the last dropped frame is sent at the end so the duration is unchanged
+//平均码率模式下x265按恒定帧率（time_base和帧数）估算每帧码率，丢弃的帧越多实际码率越低于videoBitRate；预分析的zones按帧序号划分，丢帧后对不上，去重时不生成zones，只使用场景切换（按时间）
+//In average bitrate mode x265 budgets bits per frame assuming a constant frame rate (time_base and frame count), so the more frames are dropped the further the actual bitrate undershoots videoBitRate; the pre-analysis zones are split by frame number and no longer match once frames are dropped, so no zones are generated with dedup, only the scene cuts (by time) are used
+const bool isDedup = false;
+const int dedupWidth = 256;
+const double dedupThreshold = 1.0;
+const int64_t dedupMaxDuration = 2000000;
+
+//流复制策略：源轨道的编码、profile和参数已与目标一致时直接复制，不解码也不编码，每个轨道的决定及原因会输出到日志
+//Stream copy policy: when the codec, profile and parameters of the source track already match the target, the track is copied without decoding or encoding, the decision and reason of each track are logged
+typedef enum CopyPolicy {
+    COPY_NEVER = 0,                                                             //总是转编码，always transcode
+    COPY_AUTO,                                                                  //兼容时复制，copy when compatible
+} CopyPolicy;
+const CopyPolicy copyPolicy = COPY_AUTO;
+//目标profile，FF_PROFILE_UNKNOWN表示不限制，如FF_PROFILE_HEVC_MAIN、FF_PROFILE_AAC_LOW
+//Target profile, FF_PROFILE_UNKNOWN means no restriction, such as FF_PROFILE_HEVC_MAIN, FF_PROFILE_AAC_LOW
+const int videoProfile = FF_PROFILE_UNKNOWN;
+const int audioProfile = FF_PROFILE_UNKNOWN;
+
+//输出的时间范围（微秒），从源视频的rangeStart开始，时长为rangeDuration，0表示到结尾
+//Time range of the output (microseconds), starting at rangeStart of the source video and lasting rangeDuration, 0 means to the end
+const int64_t rangeStart = 0;
+const int64_t rangeDuration = 0;
+//智能剪切：设置了时间范围且视频轨道为复制时，只重新编码剪切点所在的不完整GOP，其余GOP直接复制
+//关闭时，设置了时间范围的视频轨道总是转编码，以保证剪切精确到帧
+//Smart cut: when a time range is set and the video track is copied, only the partial GOPs at the cut points are re-encoded, the other GOPs are copied
+//When disabled, video tracks are always transcoded when a time range is set, so that the cut is frame-accurate
+const bool isSmartCut = true;
+
+//索引文件（由remux_index生成）的后缀，索引文件路径为源文件路径加后缀，NULL表示不使用索引
+//索引存在且与源文件一致时跳过avformat_find_stream_info，并按索引直接定位；源文件的大小、修改时间或内容变化后索引自动失效
+//Suffix of the index file (built by remux_index), the index file path is the source file path plus the suffix, NULL means no index
+//When the index exists and matches the source file, avformat_find_stream_info is skipped and seeking uses the index directly; the index becomes invalid automatically when the size, modification time or content of the source file changes
+const char *indexSuffix = ".idx";
+
+//分片MP4输出，只在输出格式为mp4、mov时生效：moov写在文件开头，之后每个分片（moof+mdat）完成后立即写出，写入过程中即可播放，结束时不需要回写moov，进程异常退出时已写出的分片仍然可用
+//分片从fragmentDuration之后的第一个视频关键帧开始，isCmaf为true时按CMAF规范输出（cmfc兼容品牌等），可直接作为DASH/HLS的fMP4分段
+//Fragmented MP4 output, only for the mp4 and mov formats: moov is written at the start of the file, then every fragment (moof+mdat) is written as soon as it completes, the file is playable while being written, no moov rewrite is needed at the end, and the fragments already written survive a crash
+//A fragment starts at the first video keyframe after fragmentDuration, when isCmaf is true the output follows CMAF (the cmfc compatible brand, etc.) and can be used directly as fMP4 segments of DASH/HLS
+const bool isFragmented = false;
+const int64_t fragmentDuration = 2000000;
+const bool isCmaf = false;
+
+//断点续转，用于长时间的转码：每隔checkpointInterval在视频关键帧处结束当前分片，并写入检查点文件（输出文件路径加checkpointSuffix），
+//记录已提交的输出字节数、下一个分片的序号、续转的时间点、各轨道最后写入的dts和转码音频轨道的下一个采样位置；进程被杀后再次运行时，截掉最后一个不完整的分片，源文件定位到续转点继续追加
+//开启后自动使用分片MP4（只支持mp4、mov），视频编码器使用封闭GOP，续转点的关键帧不引用之前的帧，新的编码器从这里开始与未中断的运行结构一致；正常结束后删除检查点文件
+//Resumable transcoding, for long runs: every checkpointInterval the current fragment is ended at a video keyframe and a checkpoint file (the output file path plus checkpointSuffix) is written,
+//recording the committed output bytes, the number of the next fragment, the resume time, the last written dts of every track and the next sample position of every transcoded audio track; when run again after the process was killed, the last incomplete fragment is cut off and the source is sought to the resume time to continue appending
+//Fragmented MP4 is used automatically (mp4 and mov only), video encoders use closed GOPs so the keyframe at the resume time references no earlier frame, and a new encoder starting there gives the same structure as an uninterrupted run; the checkpoint file is removed after a normal finish
+const bool isResumable = false;
+const char *checkpointSuffix = ".ckpt";
+const int64_t checkpointInterval = 30000000;
+
+//低延迟模式，用于直播转码（如h264直播流转h265再推流），默认的编码器前瞻、B帧和不限长的缓冲适合文件，但会带来数秒的延迟
+//开启后：输入不缓冲（fflags nobuffer），解码器、编码器只用条带级多线程（帧级多线程每个线程会多缓冲一帧），编码器使用zerolatency调优，
+//前瞻帧数、B帧数（即重排序深度）限制为下面的值，输出的交织等待不超过延迟预算，每个数据包写出后立即刷新
+//Low-latency mode, for live transcoding (such as relaying an h264 live stream as h265), the default encoder lookahead, B-frames and unbounded buffering suit files but add seconds of delay
+//When enabled: the input is not buffered (fflags nobuffer), decoders and encoders only use slice threading (frame threading buffers one more frame per thread), the encoder uses the zerolatency tune,
+//the lookahead frames and B-frames (the reorder depth) are limited to the values below, interleaving the output waits no longer than the latency budget, and every packet is flushed as soon as it is written
+const bool isLowLatency = false;
+const int lowLatencyLookahead = 0;
+const int lowLatencyBFrames = 0;
+
+//延迟预算（微秒），即从输入数据包的时间戳到输出写出时间增加的延迟（glass-to-glass）上限
+//输入时间戳与单调时钟的对应关系取所有输入数据包中最早的到达时刻，本地文件读取快于实时，延迟为负
+//Latency budget (microseconds), the upper limit of the delay added from the timestamp of an input packet to the time it is written out (glass-to-glass)
+//The mapping from input timestamps to the monotonic clock uses the earliest arrival over all input packets, local files are read faster than realtime so their latency is negative
+const int64_t latencyBudget = 500000;
+
+//落后处理策略：视频帧送入编码器前已落后于实时超过预算的3/4（留1/4给编码和封装）时的处理方式，音频开销很小且丢弃会有断续声，不处理
+//Late-frame policy: what to do when a video frame is already behind realtime by more than 3/4 of the budget before encoding (1/4 is left for encoding and muxing), audio costs little and dropping it is audible, so it is left alone
+typedef enum LatePolicy {
+    LATE_NONE = 0,                                                              //只统计，only measure
+    LATE_DROP,                                                                  //丢弃落后的帧，时间戳保留，最多隔帧丢弃以保证持续有输出，drop late frames, timestamps are kept, at most every other frame is dropped so output never stalls
+    LATE_QUALITY,                                                               //降低质量：解码跳过环路滤波、缩放改用快速双线性，延迟回到预算一半以下时恢复，lower quality: decoding skips the loop filter and scaling uses fast bilinear, restored when latency falls below half the budget
+} LatePolicy;
+const LatePolicy latePolicy = LATE_DROP;
+
+//时间范围在源视频时间轴上的起止时间（微秒），尚未读到rangeEnd的音视频轨道数
+//Begin and end of the time range on the source timeline (microseconds), number of audio/video tracks that have not reached rangeEnd yet
+bool isRange = false;
+int64_t rangeBegin = 0;
+int64_t rangeEnd = INT64_MAX;
+int rangeActiveCount = 0;
+
+//已加载的索引，header为NULL表示没有可用的索引，格式见common/index_format.h
+//The loaded index, header is NULL when no index is available, see common/index_format.h for the format
+SourceIndex sourceIndex = {NULL, 0, NULL, NULL, NULL, NULL, NULL};
+
+//检查点文件格式：CheckpointHeader | 每个输出轨道最后写入的dts（int64_t，输出轨道的timebase）× streamCount | 每个输出轨道的下一个音频采样位置（int64_t，编码器采样率，不是转码音频时为AV_NOPTS_VALUE）× streamCount
+//Checkpoint file format: CheckpointHeader | the last written dts of every output track (int64_t, in the output track timebase) × streamCount | the next audio sample position of every output track (int64_t, at the encoder sample rate, AV_NOPTS_VALUE when not transcoded audio) × streamCount
+#define CHECKPOINT_MAGIC "VPCKPT"
+#define CHECKPOINT_VERSION 2
+
+typedef struct CheckpointHeader {
+    char magic[8];                                                              //CHECKPOINT_MAGIC
+    uint32_t version;                                                           //格式版本，format version
+    uint32_t streamCount;                                                       //输出轨道数，number of output tracks
+    int64_t sourceSize;                                                         //源文件大小，source file size
+    uint64_t sourceHash;                                                        //源文件头尾各64KB的哈希，与索引相同，hash of the first and last 64KB of the source file, same as the index
+    int64_t outputOffset;                                                       //已提交的输出字节数，即最后一个完整分片的结尾，committed output bytes, the end of the last complete fragment
+    int64_t fragmentIndex;                                                      //下一个分片的序号（mfhd），number of the next fragment (mfhd)
+    int64_t resumeTime;                                                         //续转点，下一个分片第一个视频关键帧的时间（微秒，输出时间轴），resume time, the time of the first video keyframe of the next fragment (microseconds, output timeline)
+} CheckpointHeader;
+
+//断点续转的状态
+//Resumable transcoding state
+typedef struct Checkpoint {
+    bool isEnabled;                                                             //是否写入检查点，whether checkpoints are written
+    bool isResuming;                                                            //是否从检查点继续，whether continuing from a checkpoint
+    int referenceIndex;                                                         //按其关键帧提交的输出轨道，第一个视频轨道，没有时为第一个音频轨道，output track whose keyframes commit, the first video track, or the first audio track without one
+    int64_t lastTime;                                                           //上一个检查点的时间（微秒），time of the last checkpoint (microseconds)
+    int64_t count;                                                              //本次写入的检查点数，checkpoints written by this run
+    CheckpointHeader header;                                                    //读取或最近写入的检查点，the checkpoint read or last written
+    std::vector<int64_t> lastDtsList;                                           //每个输出轨道最后写入的dts，last written dts of every output track
+    std::vector<int64_t> resumeDtsList;                                         //检查点中每个输出轨道最后写入的dts，续转后不超过它的数据包已在文件中，the last written dts of every output track in the checkpoint, packets up to it are already in the file after resuming
+    std::vector<int64_t> endList;                                               //每个输出轨道最后写入的数据包的结束时间（pts+duration），end (pts+duration) of the last written packet of every output track
+    std::vector<int64_t> audioPtsList;                                          //每个转码音频轨道的下一个采样位置，即已写入的数据包之后第一个采样在编码器输入中的位置，the next sample position of every transcoded audio track, the position in the encoder input of the first sample after the written packets
+} Checkpoint;
+Checkpoint checkpoint;
 
 //输入输出文件句柄
 //Input and output file handles
 AVFormatContext *inFileHandle = NULL;
 AVFormatContext *outFileHandle = NULL;
 
+//智能剪切的状态，每个复制的视频轨道一个
+//缓存一个完整的GOP，以及下一个关键帧和它的前导帧（开放GOP中pts小于关键帧、参考上一个GOP的帧），再根据GOP与时间范围的关系决定复制、重新编码或丢弃
+//Smart cut state, one per copied video track
+//A whole GOP is buffered, plus the next keyframe and its leading pictures (in an open GOP, pictures with pts before the keyframe that reference the previous GOP), then copied, re-encoded or dropped depending on how it overlaps the time range
+typedef struct SmartCut {
+    std::vector<AVPacket *> gopList;                                            //当前GOP的数据包（解码顺序），packets of the current GOP (decoding order)
+    std::vector<AVPacket *> nextList;                                           //下一个关键帧和它的前导帧，the next keyframe and its leading pictures
+    std::vector<AVPacket *> previousList;                                       //上一个复制的GOP，重新编码本GOP的前导帧时作为参考，the previous copied GOP, the reference when re-encoding the leading pictures of this GOP
+    AVCodecContext *decoder;                                                    //解码不完整GOP的解码器，decoder for partial GOPs
+    bool isPreviousCopied;                                                      //上一个GOP是否为复制，whether the previous GOP was copied
+    int64_t lastDts;                                                            //上一个写入的dts（输出时间基），last written dts (output time base)
+    int copyCount;                                                              //复制的GOP数，number of copied GOPs
+    int encodeCount;                                                            //重新编码的GOP数，number of re-encoded GOPs
+} SmartCut;
+
+//缩小的灰度图（只有亮度），预分析和去重用来比较帧
+//Downscaled grayscale picture (luma only), used by the pre-analysis and dedup to compare frames
+typedef struct GrayScaler {
+    SwsContext *scaler;                                                         //缩小为灰度图的转换器，converter to the downscaled grayscale picture
+    int scaleWidth;                                                             //转换器对应的源帧宽度，source frame width of the converter
+    int scaleHeight;                                                            //转换器对应的源帧高度，source frame height of the converter
+    int scaleFormat;                                                            //转换器对应的源帧像素格式，source frame pixel format of the converter
+    int width;                                                                  //灰度图宽度，8的倍数，grayscale width, a multiple of 8
+    int height;                                                                 //灰度图高度，8的倍数，grayscale height, a multiple of 8
+} GrayScaler;
+
+//去重状态，每个转编码的视频轨道一个
+//Dedup state, one per transcoded video track
+typedef struct Dedup {
+    GrayScaler grayScaler;                                                      //灰度图转换器，grayscale converter
+    std::vector<uint8_t> current;                                               //当前帧的灰度图，grayscale picture of the current frame
+    std::vector<uint8_t> reference;                                             //上一个送入编码器的帧的灰度图，grayscale picture of the last frame sent to the encoder
+    bool hasReference;                                                          //reference是否有效，whether reference is valid
+    int64_t referenceTime;                                                      //上一个送入编码器的帧的时间（微秒），time of the last frame sent to the encoder (microseconds)
+    AVFrame *lastFrame;                                                         //最后一个被丢弃的帧，结束时送入编码器，the last dropped frame, sent to the encoder at the end
+    int64_t frameCount;                                                         //比较的帧数，number of frames compared
+    int64_t dropCount;                                                          //丢弃的帧数，number of frames dropped
+} Dedup;
+
 //轨道上下文结构体，存放解码器、编码器、输出轨道序号、轨道类型等
 //Track context structure, inlcude the decoder, encoder, output track number, track type
 typedef struct StreamContext {
@@ -48,6 +278,26 @@ typedef struct StreamContext {
     unsigned int outIndex;                                                      //输出轨道序号，output track number
     AVCodecContext *decoder;                                                    //解码器，decoder
     AVCodecContext *encoder;                                                    //编码器，encoder
+    int decodeThreads;                                                          //解码线程数，number of decoder threads
+    int encodeThreads;                                                          //编码线程数，number of encoder threads
+    SwsContext *scaler;                                                         //分辨率、像素格式转换器，resolution and pixel format converter
+    AVFrame *scaleFrame;                                                        //转换后的帧，converted frame
+    int scaleWidth;                                                             //转换器对应的源帧宽度，source frame width of the converter
+    int scaleHeight;                                                            //转换器对应的源帧高度，source frame height of the converter
+    int scaleFormat;                                                            //转换器对应的源帧像素格式，source frame pixel format of the converter
+    int scaleFlags;                                                             //转换器的缩放算法，scaling algorithm of the converter
+    SwrContext *resampler;                                                      //音频重采样器，audio resampler
+    AVAudioFifo *audioFifo;                                                     //重采样后的音频FIFO，audio FIFO after resampling
+    AVFrame *audioFrame;                                                        //按frame_size重新切分后的音频帧，audio frame re-chunked by frame_size
+    uint8_t **resampleData;                                                     //重采样输出缓冲区，resample output buffer
+    int resampleCapacity;                                                       //重采样输出缓冲区可容纳的采样数，number of samples the resample output buffer can hold
+    int64_t audioPts;                                                           //下一个音频帧的时间戳（以采样为单位），timestamp of the next audio frame (in samples)
+    int64_t audioResume;                                                        //续转时编码器的起始采样位置，之前的采样从FIFO丢弃，the sample position the encoder starts at when resuming, earlier samples are drained from the FIFO
+    bool isAudioPreroll;                                                        //续转后编码器的第一帧只用于预热，它的数据包丢弃，the first frame after resuming only primes the encoder, its packet is dropped
+    bool isCopy;                                                                //直接复制，不转编码，copied without transcoding
+    bool isRangeEnd;                                                            //已读到rangeEnd，reached rangeEnd
+    SmartCut *smartCut;                                                         //智能剪切状态，smart cut state
+    Dedup *dedup;                                                               //去重状态，dedup state
     bool isDecodeEnd;                                                           //解码器处理完毕标志，decode end
     bool isEncodeEnd;                                                           //编码器处理完毕标志，encode end
 } StreamContext;
@@ -56,27 +306,315 @@ typedef struct StreamContext {
 StreamContext *streamContextMapping = NULL;
 int streamContextLength = 0;
 
+//帧缓冲池，解码器和格式转换等环节共用，按缓冲区大小区分，每种大小对应一个AVBufferPool
+//帧被释放后缓冲区回到池中，稳定运行时不再为每一帧申请图像内存
+//Frame buffer pool, shared by the decoder and stages such as format conversion, keyed by buffer size, each size has its own AVBufferPool
+//When a frame is released its buffers go back to the pool, in steady state no picture memory is allocated per frame
+typedef struct FramePool {
+    size_t size;                                                                //缓冲区大小，buffer size
+    AVBufferPool *pool;                                                         //缓冲池，buffer pool
+} FramePool;
+FramePool framePoolMapping[32];
+int framePoolLength = 0;
+std::mutex framePoolMutex;                                                      //多线程解码时get_buffer2会在多个线程中调用，get_buffer2 is called from several threads with multi-threaded decoding
+std::atomic<int64_t> framePoolGetCount(0);                                      //从池中获取缓冲区的次数，number of buffers taken from the pool
+std::atomic<int64_t> framePoolMissCount(0);                                     //池中无空闲缓冲区而新申请内存的次数，number of times the pool was empty and new memory was allocated
+
+//性能统计配置，统计代码在common/metrics.h
+//Metrics configuration, the metrics code is in common/metrics.h
+const MetricsFormat metricsFormat = METRICS_NONE;
+//指标名前缀
+//Metric name prefix
+const char *metricsName = "transcode";
+
+//统计导出文件路径，先写临时文件再rename，读取方不会读到写了一半的内容
+//UDP导出地址，格式为ip:port，NULL表示不发送
+//导出间隔（秒）
+//Metrics export file path, a temporary file is written and then renamed, so readers never see a half-written file
+//UDP export address in ip:port format, NULL means not sending
+//Export interval (seconds)
+const char *metricsFilePath = "./transcode.prom";
+const char *metricsUdpAddress = NULL;
+//const char *metricsUdpAddress = "127.0.0.1:9125";
+const int metricsInterval = 1;
+
+//统计的处理阶段
+//Measured processing stages
+typedef enum Stage {
+    STAGE_READ = 0,                                                             //av_read_frame
+    STAGE_DECODE,                                                               //avcodec_send_packet
+    STAGE_DECODE_RECEIVE,                                                       //avcodec_receive_frame
+    STAGE_ENCODE,                                                               //avcodec_send_frame
+    STAGE_ENCODE_RECEIVE,                                                       //avcodec_receive_packet
+    STAGE_WRITE,                                                                //av_interleaved_write_frame
+    STAGE_LENGTH,
+} Stage;
+const char *stageName[] = {"read", "decode", "decode_receive", "encode", "encode_receive", "write"};
+
+//编解码器中的在途数量：已送入但还未取出的数据包/帧
+//In-flight counts inside the codecs: packets/frames sent but not yet received
+typedef enum InFlight {
+    INFLIGHT_DECODE = 0,
+    INFLIGHT_ENCODE,
+    INFLIGHT_LENGTH,
+} InFlight;
+const char *inFlightName[] = {"decode", "encode"};
+//按[轨道][INFLIGHT_*]排列的在途数量，只在开启统计时分配
+//In-flight counts laid out as [track][INFLIGHT_*], only allocated when metrics are enabled
+int64_t *inFlightList = NULL;
+
+//预分析结果
+//Pre-analysis results
+typedef struct PreAnalysis {
+    GrayScaler grayScaler;                                                      //灰度图转换器，grayscale converter
+    std::vector<uint8_t> current;                                               //当前帧的灰度图，grayscale picture of the current frame
+    std::vector<uint8_t> previous;                                              //上一帧的灰度图，grayscale picture of the previous frame
+    bool hasPrevious;                                                           //previous是否有效，whether previous is valid
+    av_pixelutils_sad_fn sad;                                                   //8x8块的SAD函数，SAD function of 8x8 blocks
+    double interMean;                                                           //近期帧间开销的均值（每像素），负数表示重新开始，recent mean of the inter cost (per pixel), negative means starting over
+    int64_t lastCutTime;                                                        //上一个场景切换的时间（微秒），time of the last scene cut (microseconds)
+    std::vector<double> costList;                                               //每帧的开销（每像素），cost of every frame (per pixel)
+    std::vector<int> cutFrameList;                                              //场景切换处的帧序号，frame numbers of the scene cuts
+    std::vector<int64_t> cutTimeList;                                           //场景切换处的时间（微秒，输出时间轴），time of the scene cuts (microseconds, output timeline)
+    size_t cutCursor;                                                           //编码时下一个场景切换，next scene cut while encoding
+    std::string zones;                                                          //x265的zones参数，zones parameter of x265
+} PreAnalysis;
+PreAnalysis preAnalysis;
+
+//延迟统计，低延迟模式下总是统计，不依赖metricsFormat
+//Latency measurement, always measured in low-latency mode regardless of metricsFormat
+typedef struct Latency {
+    int64_t base;                                                               //输入时间轴（微秒）到单调时钟的偏移，offset from the input timeline (microseconds) to the monotonic clock
+    Histogram histogram;                                                        //写出时的延迟，latency when written out
+    int64_t max;                                                                //最大延迟，maximum latency
+    int64_t overCount;                                                          //超出预算的数据包数，number of packets over the budget
+    int64_t dropCount;                                                          //丢弃的视频帧数，number of video frames dropped
+    bool isPreviousDropped;                                                     //上一帧是否被丢弃，whether the previous frame was dropped
+    bool isDegraded;                                                            //是否处于降低质量状态，whether quality is lowered
+} Latency;
+Latency latency = {AV_NOPTS_VALUE, {{0}, 0, 0}, 0, 0, 0, false, false};
+
 void termination(const char* param){
     std::cout<<param<<std::endl;
     std::cout<<"Error occur, quit!"<<std::endl;
     exit(-1);
 }
 
+void Metrics_InFlight(int streamIndex, int type, int count){
+    if(metrics.format != METRICS_NONE){
+        inFlightList[streamIndex * INFLIGHT_LENGTH + type] += count;
+    }
+}
+
+void Metrics_Extra(std::string *text, MetricsFormat format){
+    //STEP::追加编解码器中的在途数量，低延迟模式下追加写出延迟
+    //STEP::Append the in-flight counts inside the codecs, and the output latency in low-latency mode
+    if(format == METRICS_PROMETHEUS){
+        Metrics_Append(text, "# TYPE %s_inflight gauge\n", metricsName);
+        for(int i=0;i<metrics.streamLength;i++){
+            for(int j=0;j<INFLIGHT_LENGTH;j++){
+                if(inFlightList[i * INFLIGHT_LENGTH + j] != 0 || metrics.histogram[i * STAGE_LENGTH].count > 0){
+                    Metrics_Append(text, "%s_inflight{stream=\"%d\",stage=\"%s\"} %" PRId64 "\n", metricsName, i, inFlightName[j], inFlightList[i * INFLIGHT_LENGTH + j]);
+                }
+            }
+        }
+        if(isLowLatency && latency.histogram.count > 0){
+            Metrics_Append(text, "# TYPE %s_output_latency_us histogram\n", metricsName);
+            int64_t cumulative = 0;
+            for(int k=0;k<METRICS_BUCKET_LENGTH - 1;k++){
+                cumulative += latency.histogram.bucket[k];
+                Metrics_Append(text, "%s_output_latency_us_bucket{le=\"%lld\"} %" PRId64 "\n", metricsName, 1LL << k, cumulative);
+            }
+            Metrics_Append(text, "%s_output_latency_us_bucket{le=\"+Inf\"} %" PRId64 "\n", metricsName, latency.histogram.count);
+            Metrics_Append(text, "%s_output_latency_us_sum %" PRId64 "\n%s_output_latency_us_count %" PRId64 "\n", metricsName, latency.histogram.sum, metricsName, latency.histogram.count);
+            Metrics_Append(text, "# TYPE %s_output_latency_max_us gauge\n%s_output_latency_max_us %" PRId64 "\n", metricsName, metricsName, latency.max);
+            Metrics_Append(text, "# TYPE %s_late_packets_total counter\n%s_late_packets_total %" PRId64 "\n", metricsName, metricsName, latency.overCount);
+            Metrics_Append(text, "# TYPE %s_dropped_frames_total counter\n%s_dropped_frames_total %" PRId64 "\n", metricsName, metricsName, latency.dropCount);
+        }
+        return;
+    }
+    Metrics_Append(text, ",\"latency\":{\"count\":%" PRId64 ",\"sum_us\":%" PRId64 ",\"max_us\":%" PRId64 ",\"late\":%" PRId64 ",\"dropped\":%" PRId64 ",\"buckets\":[",
+                   latency.histogram.count, latency.histogram.sum, latency.max, latency.overCount, latency.dropCount);
+    for(int k=0;k<METRICS_BUCKET_LENGTH;k++){
+        Metrics_Append(text, "%s%" PRId64, k ? "," : "", latency.histogram.bucket[k]);
+    }
+    Metrics_Append(text, "]},\"inflight\":[");
+    bool isFirst = true;
+    for(int i=0;i<metrics.streamLength;i++){
+        for(int j=0;j<INFLIGHT_LENGTH;j++){
+            if(inFlightList[i * INFLIGHT_LENGTH + j] == 0 && metrics.histogram[i * STAGE_LENGTH].count == 0){
+                continue;
+            }
+            Metrics_Append(text, "%s{\"stream\":%d,\"stage\":\"%s\",\"value\":%" PRId64 "}", isFirst ? "" : ",", i, inFlightName[j], inFlightList[i * INFLIGHT_LENGTH + j]);
+            isFirst = false;
+        }
+    }
+    Metrics_Append(text, "]");
+}
+
+AVBufferRef *FramePool_Alloc(void *opaque, size_t size){
+    //池中没有空闲缓冲区时才会调用，即未命中
+    //Only called when the pool has no free buffer, that is a miss
+    framePoolMissCount++;
+    return av_buffer_alloc(size);
+}
+
+AVBufferRef *FramePool_GetBuffer(size_t size){
+    //STEP::查找对应大小的缓冲池，不存在则创建
+    //STEP::Find the buffer pool of this size, create it if it does not exist
+    AVBufferPool *pool = NULL;
+    framePoolMutex.lock();
+    for(int i=0;i<framePoolLength;i++){
+        if(framePoolMapping[i].size == size){
+            pool = framePoolMapping[i].pool;
+            break;
+        }
+    }
+    if(!pool && framePoolLength < (int)(sizeof(framePoolMapping) / sizeof(*framePoolMapping))){
+        pool = av_buffer_pool_init2(size, NULL, FramePool_Alloc, NULL);
+        if(pool){
+            framePoolMapping[framePoolLength].size = size;
+            framePoolMapping[framePoolLength].pool = pool;
+            framePoolLength++;
+        }
+    }
+    framePoolMutex.unlock();
+
+    //STEP::从池中取出缓冲区，av_buffer_pool_get本身是线程安全的
+    //STEP::Take a buffer from the pool, av_buffer_pool_get itself is thread-safe
+    framePoolGetCount++;
+    if(!pool){
+        return FramePool_Alloc(NULL, size);
+    }
+    return av_buffer_pool_get(pool);
+}
+
+int FramePool_GetVideoBuffer(AVCodecContext *decoder, AVFrame *frame){
+    //STEP::计算对齐后的宽高和每行字节数，解码器有额外的对齐要求
+    //STEP::Calculate the aligned width, height and bytes per line, decoders have extra alignment requirements
+    enum AVPixelFormat pixFmt = (enum AVPixelFormat)frame->format;
+    int width = frame->width;
+    int height = frame->height;
+    int linesizeAlign[AV_NUM_DATA_POINTERS];
+    if(decoder){
+        avcodec_align_dimensions2(decoder, &width, &height, linesizeAlign);
+    }
+    int linesize[4] = {0};
+    int result = av_image_fill_linesizes(linesize, pixFmt, width);                              //可能在解码线程中调用，不使用全局的ret，may be called from decoder threads, so the global ret is not used
+    if(result < 0){
+        return result;
+    }
+    ptrdiff_t alignedLinesize[4] = {0};
+    for(int i=0;i<4;i++){
+        linesize[i] = (linesize[i] + 63) & ~63;                                                 //每行按64字节对齐，便于SIMD处理，align every line to 64 bytes for SIMD
+        alignedLinesize[i] = linesize[i];
+    }
+    size_t planeSize[4] = {0};
+    result = av_image_fill_plane_sizes(planeSize, pixFmt, height, alignedLinesize);
+    if(result < 0){
+        return result;
+    }
+
+    //STEP::每个平面从对应大小的缓冲池中取一块缓冲区，多留16+64字节，解码器可能越界读写
+    //STEP::Each plane takes a buffer from the pool of its size, with 16+64 extra bytes because decoders may read and write beyond the end
+    for(int i=0;i<4 && planeSize[i] > 0;i++){
+        frame->buf[i] = FramePool_GetBuffer(planeSize[i] + 16 + 64);
+        if(!frame->buf[i]){
+            av_frame_unref(frame);
+            return AVERROR(ENOMEM);
+        }
+        frame->data[i] = frame->buf[i]->data;
+        frame->linesize[i] = linesize[i];
+    }
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+int FramePool_GetAudioBuffer(AVFrame *frame){
+    //STEP::音频帧同样从帧缓冲池获取内存，平面格式每个声道一块缓冲区，交错格式所有声道共用一块
+    //STEP::Audio frames also get memory from the frame buffer pool, planar formats use one buffer per channel, packed formats share one buffer for all channels
+    enum AVSampleFormat sampleFmt = (enum AVSampleFormat)frame->format;
+    int channels = frame->ch_layout.nb_channels;
+    int planes = av_sample_fmt_is_planar(sampleFmt) ? channels : 1;
+    int linesize = frame->nb_samples * av_get_bytes_per_sample(sampleFmt) * (planes == 1 ? channels : 1);
+    linesize = (linesize + 63) & ~63;
+    if(planes > AV_NUM_DATA_POINTERS){
+        return av_frame_get_buffer(frame, 0);                                                   //声道数过多时交给FFmpeg默认实现，too many channels, use the default implementation of FFmpeg
+    }
+    for(int i=0;i<planes;i++){
+        frame->buf[i] = FramePool_GetBuffer(linesize);
+        if(!frame->buf[i]){
+            av_frame_unref(frame);
+            return AVERROR(ENOMEM);
+        }
+        frame->data[i] = frame->buf[i]->data;
+    }
+    frame->linesize[0] = linesize;
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+int FramePool_GetBuffer2(AVCodecContext *decoder, AVFrame *frame, int flags){
+    //硬件帧、调色板格式等特殊情况交给FFmpeg默认的实现
+    //Special cases such as hardware frames and palette formats are left to the default implementation of FFmpeg
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat)frame->format);
+    if(decoder->codec_type != AVMEDIA_TYPE_VIDEO || !desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL))){
+        return avcodec_default_get_buffer2(decoder, frame, flags);
+    }
+    return FramePool_GetVideoBuffer(decoder, frame);
+}
+
+void FramePool_Free(){
+    //STEP::输出命中统计，并释放所有缓冲池，池中的缓冲区在所有帧释放后才会真正释放
+    //STEP::Print the hit statistics and free all buffer pools, the buffers are really freed after all frames are released
+    int64_t getCount = framePoolGetCount;
+    int64_t missCount = framePoolMissCount;
+    std::cout<<"frame pool: "<<getCount - missCount<<" hits, "<<missCount<<" misses"<<std::endl;
+    for(int i=0;i<framePoolLength;i++){
+        av_buffer_pool_uninit(&framePoolMapping[i].pool);
+    }
+    framePoolLength = 0;
+}
+
 void Step_OpenInFile(){
     //STEP::打开源视频文件
     //STEP::Open the input video file
     AVDictionary* optionsDict = NULL;                                                 //设置输入源封装参数
     av_dict_set(&optionsDict, "rw_timeout", "2000000", 0);                            //设置网络超时，当输入源为文件时，可注释此行。Set the network timeout, you can comment out this line when the input source is a file
-    ret = avformat_open_input(&inFileHandle, inFilePath, NULL, &optionsDict);
+    if(isLowLatency){
+        av_dict_set(&optionsDict, "fflags", "nobuffer", 0);                           //低延迟模式下解封装器不缓冲数据包，the demuxer does not buffer packets in low-latency mode
+    }
+    bool isIndexed = Index_Open(&sourceIndex, inFilePath, indexSuffix);                                                    //索引有效时直接指定解封装器，跳过格式探测，with a valid index the demuxer is given directly and format probing is skipped
+    const AVInputFormat *inFormat = isIndexed ? av_find_input_format(sourceIndex.header->formatName) : NULL;
+    ret = avformat_open_input(&inFileHandle, inFilePath, inFormat, &optionsDict);
     if(ret<0){
         termination("Could not open input file.");
     }
 
-    //STEP::获取源视频文件的流信息
-    //STEP::Get the stream information of the source video file
-    ret = avformat_find_stream_info(inFileHandle, NULL);
-    if(ret<0){
-        termination("Failed to retrieve input stream information.");
+    //STEP::获取源视频文件的流信息，索引有效时使用索引中的参数，不再探测
+    //STEP::Get the stream information of the source video file, with a valid index the parameters in the index are used without probing
+    if(Index_ApplyStreams(&sourceIndex, inFileHandle)){
+        std::cout<<"stream information loaded from index"<<std::endl;
+    } else {
+        ret = avformat_find_stream_info(inFileHandle, NULL);
+        if(ret<0){
+            termination("Failed to retrieve input stream information.");
+        }
+    }
+
+    //STEP::计算时间范围在源视频时间轴上的位置，源视频的起始时间不一定为0
+    //STEP::Calculate the position of the time range on the source timeline, the source does not necessarily start at 0
+    isRange = rangeStart > 0 || rangeDuration > 0;
+    rangeBegin = (inFileHandle->start_time != AV_NOPTS_VALUE ? inFileHandle->start_time : 0) + rangeStart;
+    rangeEnd = rangeDuration > 0 ? rangeBegin + rangeDuration : INT64_MAX;
+
+    //STEP::定位到rangeBegin之前最近的关键帧，不必从头读取和解码；范围内精确到帧的剪切由后续的解码环节完成；有索引时直接定位到索引中的关键帧
+    //STEP::Seek to the nearest keyframe before rangeBegin, so reading and decoding do not start from the beginning; the frame-accurate cut inside the range is done after decoding; with an index, seek directly to the keyframe in the index
+    if(isRange && rangeStart > 0){
+        ret = Index_Seek(&sourceIndex, inFileHandle, av_find_best_stream(inFileHandle, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0), rangeBegin);
+        if(ret<0){
+            termination("Could not seek to the range start.");
+        }
     }
 
     //STEP::根据源轨道信息创建streamContextMapping
@@ -87,196 +625,1754 @@ void Step_OpenInFile(){
         streamContextLength = 0;
         termination("Could not allocate stream context mapping.");
     }
-    for(int i=0;i<streamContextLength;i++){
-        streamContextMapping[i].type = inFileHandle->streams[i]->codecpar->codec_type;
-        streamContextMapping[i].outIndex = -1;
-        streamContextMapping[i].decoder = NULL;
-        streamContextMapping[i].encoder = NULL;
-        streamContextMapping[i].isDecodeEnd = false;
-        streamContextMapping[i].isEncodeEnd = false;
+    for(int i=0;i<streamContextLength;i++){
+        streamContextMapping[i].type = inFileHandle->streams[i]->codecpar->codec_type;
+        streamContextMapping[i].outIndex = -1;
+        streamContextMapping[i].decoder = NULL;
+        streamContextMapping[i].encoder = NULL;
+        streamContextMapping[i].scaler = NULL;
+        streamContextMapping[i].scaleFrame = NULL;
+        streamContextMapping[i].scaleWidth = 0;
+        streamContextMapping[i].scaleHeight = 0;
+        streamContextMapping[i].scaleFormat = AV_PIX_FMT_NONE;
+        streamContextMapping[i].scaleFlags = 0;
+        streamContextMapping[i].resampler = NULL;
+        streamContextMapping[i].audioFifo = NULL;
+        streamContextMapping[i].audioFrame = NULL;
+        streamContextMapping[i].resampleData = NULL;
+        streamContextMapping[i].resampleCapacity = 0;
+        streamContextMapping[i].audioPts = AV_NOPTS_VALUE;
+        streamContextMapping[i].audioResume = AV_NOPTS_VALUE;
+        streamContextMapping[i].isAudioPreroll = false;
+        streamContextMapping[i].isCopy = false;
+        streamContextMapping[i].isRangeEnd = false;
+        if(streamContextMapping[i].type == AVMEDIA_TYPE_AUDIO || streamContextMapping[i].type == AVMEDIA_TYPE_VIDEO){
+            rangeActiveCount++;
+        }
+        streamContextMapping[i].smartCut = NULL;
+        streamContextMapping[i].dedup = NULL;
+        streamContextMapping[i].isDecodeEnd = false;
+        streamContextMapping[i].isEncodeEnd = false;
+    }
+}
+
+AVDictionary *Fragment_Options(){
+    //STEP::输出为mp4、mov时设置分片参数，frag_keyframe配合min_frag_duration使分片从关键帧开始且不短于fragmentDuration
+    //delay_moov让moov等到第一个分片时再写，编码器不输出全局头时，mov封装器可以从第一个数据包取得参数集
+    //STEP::Set the fragmentation options when the output is mp4 or mov, frag_keyframe with min_frag_duration makes every fragment start at a keyframe and last at least fragmentDuration
+    //delay_moov holds moov until the first fragment, so the mov muxer can take the parameter sets from the first packet when the encoder has no global header
+    //断点续转时编码器输出全局头，不使用delay_moov，moov在写文件头时写出；不写只包含本次分片的mfra；
+    //续转时frag_discont让分片的起始时间（tfdt）取自数据包的时间戳，fragment_index使分片序号接着检查点继续
+    //With resumable transcoding the encoders output global headers and delay_moov is not used, moov is written with the file header; mfra, which would only list the fragments of this run, is skipped;
+    //when resuming, frag_discont takes the start time of the fragment (tfdt) from the packet timestamps, and fragment_index continues the fragment numbers from the checkpoint
+    const char *formatName = outFileHandle->oformat->name;
+    if((!isFragmented && !isResumable) || (strcmp(formatName, "mp4") != 0 && strcmp(formatName, "mov") != 0)){
+        return NULL;
+    }
+    std::string movFlags = "+frag_keyframe+empty_moov+default_base_moof";
+    movFlags += isResumable ? "+skip_trailer" : "+delay_moov";
+    movFlags += isCmaf ? "+cmaf" : "";
+    movFlags += checkpoint.isResuming ? "+frag_discont" : "";
+    AVDictionary *optionsDict = NULL;
+    av_dict_set(&optionsDict, "movflags", movFlags.c_str(), 0);
+    av_dict_set_int(&optionsDict, "min_frag_duration", fragmentDuration, 0);
+    if(checkpoint.isResuming){
+        av_dict_set_int(&optionsDict, "fragment_index", checkpoint.header.fragmentIndex, 0);
+    }
+    return optionsDict;
+}
+
+std::string Checkpoint_Path(){
+    return std::string(outFilePath) + checkpointSuffix;
+}
+
+void Checkpoint_Open(){
+    //STEP::输出为mp4、mov且没有智能剪切的轨道时启用检查点，智能剪切按GOP缓存和衔接，不能从中间继续
+    //STEP::Checkpoints are enabled when the output is mp4 or mov and no track uses smart cut, smart cut buffers and joins by GOP and can not continue from the middle
+    if(!isResumable){
+        return;
+    }
+    const char *formatName = outFileHandle->oformat->name;
+    if(strcmp(formatName, "mp4") != 0 && strcmp(formatName, "mov") != 0){
+        std::cout<<"checkpoints need mp4 or mov output, disabled"<<std::endl;
+        return;
+    }
+    for(int i=0;i<streamContextLength;i++){
+        if(streamContextMapping[i].smartCut){
+            std::cout<<"checkpoints do not support smart cut, disabled"<<std::endl;
+            return;
+        }
+    }
+    checkpoint.isEnabled = true;
+    checkpoint.isResuming = false;
+    checkpoint.referenceIndex = -1;
+    checkpoint.lastTime = AV_NOPTS_VALUE;
+    checkpoint.count = 0;
+    for(unsigned int i = 0; i < outFileHandle->nb_streams && checkpoint.referenceIndex < 0; i++) {
+        if(outFileHandle->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO){
+            checkpoint.referenceIndex = i;
+        }
+    }
+    for(unsigned int i = 0; i < outFileHandle->nb_streams && checkpoint.referenceIndex < 0; i++) {
+        if(outFileHandle->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO){
+            checkpoint.referenceIndex = i;
+        }
+    }
+    checkpoint.lastDtsList.assign(outFileHandle->nb_streams, AV_NOPTS_VALUE);
+    checkpoint.resumeDtsList.assign(outFileHandle->nb_streams, AV_NOPTS_VALUE);
+    checkpoint.endList.assign(outFileHandle->nb_streams, AV_NOPTS_VALUE);
+    checkpoint.audioPtsList.assign(outFileHandle->nb_streams, AV_NOPTS_VALUE);
+
+    //STEP::读取检查点，检查格式、轨道数、源文件的大小和哈希，以及输出文件不短于已提交的字节数，任一不一致时从头开始
+    //STEP::Read the checkpoint, check the format, the number of tracks, the size and hash of the source file, and that the output file is not shorter than the committed bytes, start over if any of them differs
+    std::string checkpointPath = Checkpoint_Path();
+    FILE *file = fopen(checkpointPath.c_str(), "rb");
+    if(!file){
+        return;
+    }
+    CheckpointHeader *header = &checkpoint.header;
+    bool isRead = fread(header, sizeof(*header), 1, file) == 1 && memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) == 0 &&
+                  header->version == CHECKPOINT_VERSION && header->streamCount == outFileHandle->nb_streams &&
+                  fread(checkpoint.resumeDtsList.data(), sizeof(int64_t), header->streamCount, file) == header->streamCount &&
+                  fread(checkpoint.audioPtsList.data(), sizeof(int64_t), header->streamCount, file) == header->streamCount;
+    fclose(file);
+    struct stat sourceStat;
+    struct stat outputStat;
+    bool isSource = stat(inFilePath, &sourceStat) < 0 ||
+                    (header->sourceSize == sourceStat.st_size && header->sourceHash == Index_Hash(inFilePath, sourceStat.st_size));
+    if(!isRead || !isSource || stat(outFilePath, &outputStat) < 0 || outputStat.st_size < header->outputOffset){
+        std::cout<<"checkpoint "<<checkpointPath<<" does not match, starting over"<<std::endl;
+        checkpoint.resumeDtsList.assign(outFileHandle->nb_streams, AV_NOPTS_VALUE);
+        checkpoint.audioPtsList.assign(outFileHandle->nb_streams, AV_NOPTS_VALUE);
+        return;
+    }
+
+    //STEP::源文件定位到续转点之前最近的关键帧，续转点之前的帧在解码后丢弃
+    //STEP::Seek the source to the nearest keyframe before the resume time, frames before the resume time are dropped after decoding
+    ret = Index_Seek(&sourceIndex, inFileHandle, av_find_best_stream(inFileHandle, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0), header->resumeTime + (isRange ? rangeBegin : 0));
+    if(ret<0){
+        termination("Could not seek to the checkpoint.");
+    }
+    checkpoint.isResuming = true;
+    checkpoint.lastTime = header->resumeTime;
+    checkpoint.lastDtsList = checkpoint.resumeDtsList;
+    std::cout<<"resuming from checkpoint at "<<header->resumeTime / 1000000.0<<"s, "<<header->outputOffset<<" bytes"<<std::endl;
+}
+
+void Checkpoint_Write(int64_t time){
+    //STEP::写出交织队列中的全部数据包，结束当前分片，此时输出文件的长度即为已提交的字节数
+    //STEP::Write all packets in the interleaving queue and end the current fragment, the length of the output file is then the committed bytes
+    ret = av_interleaved_write_frame(outFileHandle, NULL);
+    if(ret<0){
+        termination("Could not flush the interleaving queue.");
+    }
+    ret = av_write_frame(outFileHandle, NULL);
+    if(ret<0){
+        termination("Could not flush the fragment.");
+    }
+    avio_flush(outFileHandle->pb);
+    if(outFileHandle->pb->error < 0){
+        termination("Could not write out file.");
+    }
+
+    CheckpointHeader *header = &checkpoint.header;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    header->version = CHECKPOINT_VERSION;
+    header->streamCount = outFileHandle->nb_streams;
+    struct stat sourceStat;
+    if(stat(inFilePath, &sourceStat) == 0){
+        header->sourceSize = sourceStat.st_size;
+        header->sourceHash = Index_Hash(inFilePath, sourceStat.st_size);
+    }
+    header->outputOffset = avio_tell(outFileHandle->pb);
+    av_opt_get_int(outFileHandle->priv_data, "fragment_index", 0, &header->fragmentIndex);
+    header->resumeTime = time;
+
+    //STEP::转码音频轨道的下一个采样位置：最后写入的数据包的结束时间换算为采样，加上编码器的前导延迟（数据包时间戳比输入帧早initial_padding个采样）
+    //本次还没有写入该轨道的数据包时沿用读取的检查点中的值
+    //STEP::The next sample position of a transcoded audio track: the end of the last written packet converted to samples, plus the encoder delay (packet timestamps are initial_padding samples earlier than the input frames)
+    //When no packet of the track has been written by this run, the value from the checkpoint read is kept
+    for(int i=0;i<streamContextLength;i++){
+        StreamContext *context = &streamContextMapping[i];
+        if(context->isCopy || !context->resampler || checkpoint.endList[context->outIndex] == AV_NOPTS_VALUE){
+            continue;
+        }
+        AVCodecContext *encoder = context->encoder;
+        checkpoint.audioPtsList[context->outIndex] = av_rescale_q(checkpoint.endList[context->outIndex], outFileHandle->streams[context->outIndex]->time_base,
+                                                                  av_make_q(1, encoder->sample_rate)) + encoder->initial_padding;
+    }
+
+    //STEP::先写临时文件，fsync后再rename，任何时刻被杀都只会留下完整的旧检查点或新检查点
+    //STEP::Write a temporary file, fsync and then rename it, so a kill at any moment leaves either the complete old checkpoint or the new one
+    std::string checkpointPath = Checkpoint_Path();
+    std::string tempPath = checkpointPath + ".tmp";
+    FILE *file = fopen(tempPath.c_str(), "wb");
+    if(!file){
+        termination("Could not create checkpoint file.");
+    }
+    bool isWritten = fwrite(header, sizeof(*header), 1, file) == 1 &&
+                     fwrite(checkpoint.lastDtsList.data(), sizeof(int64_t), header->streamCount, file) == header->streamCount &&
+                     fwrite(checkpoint.audioPtsList.data(), sizeof(int64_t), header->streamCount, file) == header->streamCount &&
+                     fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if(fclose(file) != 0 || !isWritten || rename(tempPath.c_str(), checkpointPath.c_str()) != 0){
+        unlink(tempPath.c_str());
+        termination("Could not write checkpoint file.");
+    }
+    checkpoint.lastTime = time;
+    checkpoint.count++;
+}
+
+bool Checkpoint_Packet(AVPacket *packet){
+    //STEP::续转时丢弃检查点之前已写入的数据包（复制的轨道从关键帧开始、音频编码器重新开始都会重复）
+    //STEP::When resuming, drop packets already written before the checkpoint (copied tracks restart at a keyframe and a restarted audio encoder repeats some)
+    if(!checkpoint.isEnabled){
+        return true;
+    }
+    unsigned int outIndex = packet->stream_index;
+    int64_t dts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    if(dts != AV_NOPTS_VALUE && checkpoint.resumeDtsList[outIndex] != AV_NOPTS_VALUE && dts <= checkpoint.resumeDtsList[outIndex]){
+        return false;
+    }
+
+    //STEP::参考轨道的关键帧距上一个检查点超过checkpointInterval时，在写入它之前提交
+    //STEP::When a keyframe of the reference track is more than checkpointInterval after the last checkpoint, commit before writing it
+    if((int)outIndex == checkpoint.referenceIndex && (packet->flags & AV_PKT_FLAG_KEY) && packet->pts != AV_NOPTS_VALUE){
+        int64_t time = av_rescale_q(packet->pts, outFileHandle->streams[outIndex]->time_base, AV_TIME_BASE_Q);
+        if(checkpoint.lastTime == AV_NOPTS_VALUE){
+            checkpoint.lastTime = time;
+        } else if(time - checkpoint.lastTime >= checkpointInterval){
+            Checkpoint_Write(time);
+        }
+    }
+    if(dts != AV_NOPTS_VALUE){
+        checkpoint.lastDtsList[outIndex] = dts;
+    }
+    if(packet->pts != AV_NOPTS_VALUE){
+        checkpoint.endList[outIndex] = packet->pts + packet->duration;
+    }
+    return true;
+}
+
+int64_t Checkpoint_AudioStart(unsigned int inIndex){
+    //STEP::续转时转码音频轨道从检查点记录的下一个采样位置之前一帧开始编码，这一帧只用于预热编码器（AAC等编码器相邻帧之间有重叠），它的数据包丢弃
+    //STEP::When resuming, a transcoded audio track starts encoding one frame before the next sample position in the checkpoint, that frame only primes the encoder (encoders such as AAC overlap adjacent frames) and its packet is dropped
+    if(!checkpoint.isResuming){
+        return AV_NOPTS_VALUE;
+    }
+    StreamContext *context = &streamContextMapping[inIndex];
+    int64_t position = checkpoint.audioPtsList[context->outIndex];
+    if(position == AV_NOPTS_VALUE){
+        return AV_NOPTS_VALUE;
+    }
+    return position - (context->encoder->frame_size > 0 ? context->encoder->frame_size : 1024);
+}
+
+bool Checkpoint_Frame(unsigned int inIndex, AVFrame *frame){
+    //STEP::续转时丢弃续转点之前的视频帧，续转点的帧是新编码器的第一帧，即关键帧
+    //STEP::When resuming, drop video frames before the resume time, the frame at the resume time is the first frame of the new encoder, so a keyframe
+    if(!checkpoint.isResuming || streamContextMapping[inIndex].type != AVMEDIA_TYPE_VIDEO){
+        return true;
+    }
+    int64_t time = frame->pts != AV_NOPTS_VALUE ? frame->pts : frame->best_effort_timestamp;
+    return time == AV_NOPTS_VALUE || time >= checkpoint.header.resumeTime;
+}
+
+void Checkpoint_Close(){
+    //STEP::正常结束后删除检查点文件
+    //STEP::Remove the checkpoint file after a normal finish
+    if(!checkpoint.isEnabled){
+        return;
+    }
+    unlink(Checkpoint_Path().c_str());
+    std::cout<<"checkpoints: "<<checkpoint.count<<" written"<<(checkpoint.isResuming ? ", resumed from a checkpoint" : "")<<std::endl;
+}
+
+void Step_CreateOutFile(){
+    //STEP::创建输出文件句柄outFileHandle
+    //STEP::Creates an output file handle, outFileHandle.
+    ret = avformat_alloc_output_context2(&outFileHandle, NULL, NULL, outFilePath);
+    if(ret<0){
+        termination("Could not create output handle.");
+    }
+
+    //设置输出的格式，如下设置等于ffmpeg ... -f flv rtmp://xxx
+    //Set the format of the output, the following settings are equal to ffmpeg ... -f flv rtmp://xxx
+    //avformat_alloc_output_context2(&outFileHandle, NULL, "flv", outFilePath);
+
+    //STEP::根据源轨道信息创建输出文件的音视频轨道
+    //由于仅做转封装是无法改变音视频数据的，所以轨道信息只能复制
+    //STEP::Create audio/video tracks for output files based on source track information
+    //Since it is not possible to change the audio and video data by only doing remuxing, the track information can only be copied
+    unsigned int outStreamIndex = 0;
+    for(unsigned int i = 0; i < streamContextLength; i++) {
+        AVStream *inStream = inFileHandle->streams[i];
+        if (streamContextMapping[i].type != AVMEDIA_TYPE_AUDIO &&                                  //过滤除video、audio、subtitle以外的轨道，Filter tracks except video, audio, subtitle
+            streamContextMapping[i].type != AVMEDIA_TYPE_VIDEO &&
+            streamContextMapping[i].type != AVMEDIA_TYPE_SUBTITLE) {
+                streamContextMapping[i].outIndex = -1;
+                continue;
+        }
+
+        AVStream *outStream = avformat_new_stream(outFileHandle, NULL);                            //创建输出的轨道，Creating the output track
+        if(streamContextMapping[i].encoder){                                                       //尝试从编码器复制输出轨道信息，Trying to copy the output track information from the encoder
+            ret = avcodec_parameters_from_context(outStream->codecpar, streamContextMapping[i].encoder);
+        }else{
+            ret = avcodec_parameters_copy(outStream->codecpar, inStream->codecpar);                //复制源轨道的信息到输出轨道，Copying information from the source track to the output track
+        }
+        if(ret<0){
+            termination("Could not copy codec parameters.");
+        }
+        outStream->codecpar->codec_tag = 0;
+        streamContextMapping[i].outIndex = outStreamIndex++;                                       //记录源文件轨道序号与输出文件轨道序号的对应关系，Record the correspondence between the track number of the source file and the track number of the output file.
+    }
+
+    //STEP::低延迟模式下交织等待不超过延迟预算，每个数据包写出后立即刷新，不在avio缓冲区中积攒
+    //STEP::In low-latency mode interleaving waits no longer than the latency budget, and every packet is flushed right after it is written instead of gathering in the avio buffer
+    if(isLowLatency){
+        outFileHandle->max_interleave_delta = latencyBudget;
+        outFileHandle->flush_packets = 1;
+        outFileHandle->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+    }
+
+    //STEP::读取检查点，有效时从检查点继续
+    //STEP::Read the checkpoint, continue from it when valid
+    Checkpoint_Open();
+
+    //STEP::打开输出文件；从检查点继续时截掉最后一个不完整的分片，文件头已在文件中，写入内存缓冲区后丢弃
+    //STEP::Open the output file; when continuing from a checkpoint, cut off the last incomplete fragment, the file header is already in the file so it is written to a memory buffer and discarded
+    if(checkpoint.isResuming){
+        if(truncate(outFilePath, checkpoint.header.outputOffset) < 0){
+            termination("Could not truncate out file.");
+        }
+        ret = avio_open_dyn_buf(&outFileHandle->pb);
+    } else {
+        ret = avio_open(&outFileHandle->pb, outFilePath, AVIO_FLAG_WRITE);
+    }
+    if(ret<0){
+        termination("Could not open out file.");
+    }
+
+    //STEP::写入文件头信息，mp4、mov可使用分片输出
+    //STEP::Write file header information, mp4 and mov can use fragmented output
+    AVDictionary *fragmentDict = Fragment_Options();
+    ret = avformat_write_header(outFileHandle, &fragmentDict);
+    av_dict_free(&fragmentDict);
+    if(ret<0){
+        termination("Could not write stream header to out file.");
+    }
+
+    //STEP::从检查点继续时换回输出文件，从已提交的字节数处追加
+    //STEP::When continuing from a checkpoint, switch back to the output file and append at the committed bytes
+    if(checkpoint.isResuming){
+        uint8_t *headerData = NULL;
+        avio_close_dyn_buf(outFileHandle->pb, &headerData);
+        av_free(headerData);
+        outFileHandle->pb = NULL;
+        ret = avio_open(&outFileHandle->pb, outFilePath, AVIO_FLAG_READ_WRITE);
+        if(ret<0 || avio_seek(outFileHandle->pb, checkpoint.header.outputOffset, SEEK_SET) < 0){
+            termination("Could not open out file.");
+        }
+    }
+
+    // 设置输出封装参数的方式，如hls的hls_time参数
+    // The way to set the output muxing parameters, such as the hls_time parameter of hls
+    // AVDictionary* optionsDict = NULL;
+    // av_dict_set(&optionsDict, "hls_time", "2", 0);
+    // avformat_write_header(outFileHandle, &optionsDict);
+}
+
+bool CopyPolicy_Check(int index, std::string *reason){
+    //STEP::检查源轨道能否直接复制，不能复制时给出原因
+    //STEP::Check whether the source track can be copied, give the reason when it can not
+    AVCodecParameters *codecpar = inFileHandle->streams[index]->codecpar;
+    bool isVideo = codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
+    AVCodecID targetID = isVideo ? videoCodecID : audioCodecID;
+    int targetProfile = isVideo ? videoProfile : audioProfile;
+    const char *profileName = avcodec_profile_name(codecpar->codec_id, codecpar->profile);
+    if(copyPolicy == COPY_NEVER){
+        *reason = "copy policy is COPY_NEVER";
+        return false;
+    }
+    if(codecpar->codec_id != targetID){
+        *reason = std::string(avcodec_get_name(codecpar->codec_id)) + " -> " + avcodec_get_name(targetID);
+        return false;
+    }
+    if(targetProfile != FF_PROFILE_UNKNOWN && codecpar->profile != targetProfile){
+        const char *targetName = avcodec_profile_name(targetID, targetProfile);
+        *reason = std::string("profile ") + (profileName ? profileName : "unknown") + " -> " + (targetName ? targetName : "unknown");
+        return false;
+    }
+
+    //STEP::输出封装格式需支持该编码；需要全局头（如mp4）时源轨道必须有extradata
+    //STEP::The output format must support the codec; the source track must have extradata when global headers are needed (such as mp4)
+    const AVOutputFormat *outFormat = av_guess_format(NULL, outFilePath, NULL);
+    if(outFormat && avformat_query_codec(outFormat, codecpar->codec_id, FF_COMPLIANCE_NORMAL) == 0){
+        *reason = std::string(avcodec_get_name(codecpar->codec_id)) + " is not supported by " + outFormat->name;
+        return false;
+    }
+    if(outFormat && (outFormat->flags & AVFMT_GLOBALHEADER) && codecpar->extradata_size <= 0){
+        *reason = std::string("no extradata for the global header of ") + outFormat->name;
+        return false;
+    }
+
+    //STEP::视频的分辨率、像素格式，音频的采样率、声道数需与目标一致
+    //STEP::The resolution and pixel format of video, the sample rate and channels of audio must match the target
+    const AVCodec *encoderInfo = avcodec_find_encoder(targetID);
+    char detail[256];
+    if(isVideo){
+        if((videoWidth > 0 && videoWidth != codecpar->width) || (videoHeight > 0 && videoHeight != codecpar->height)){
+            *reason = "resolution " + std::to_string(codecpar->width) + "x" + std::to_string(codecpar->height) + " differs from the target";
+            return false;
+        }
+        bool isSupported = !encoderInfo || !encoderInfo->pix_fmts;
+        for(int j=0;!isSupported && encoderInfo->pix_fmts[j] != AV_PIX_FMT_NONE;j++){
+            isSupported = encoderInfo->pix_fmts[j] == codecpar->format;
+        }
+        if(!isSupported){
+            const char *formatName = av_get_pix_fmt_name((enum AVPixelFormat)codecpar->format);
+            *reason = std::string("pixel format ") + (formatName ? formatName : "unknown") + " is not produced by " + encoderInfo->name;
+            return false;
+        }
+        if(isRange && !isSmartCut){
+            *reason = "time range is set without smart cut, a frame-accurate cut needs re-encoding";
+            return false;
+        }
+        if(videoBitRate > 0 || videoCrf > 0){
+            *reason = "rate control is set (videoBitRate or videoCrf), it only applies when encoding";
+            return false;
+        }
+        if(isPreAnalysis){
+            *reason = "pre-analysis is enabled, its scene cuts and zones only apply when encoding";
+            return false;
+        }
+        if(isDedup && !isLowLatency){
+            *reason = "dedup is enabled, duplicate frames can only be dropped between decoding and encoding";
+            return false;
+        }
+        snprintf(detail, sizeof(detail), "%s %s %dx%d%s", avcodec_get_name(codecpar->codec_id), profileName ? profileName : "",
+                 codecpar->width, codecpar->height, isRange ? ", smart cut" : "");
+    } else {
+        if(audioSampleRate > 0 && audioSampleRate != codecpar->sample_rate){
+            *reason = "sample rate " + std::to_string(codecpar->sample_rate) + " differs from the target";
+            return false;
+        }
+        if(audioChannels > 0 && audioChannels != codecpar->ch_layout.nb_channels){
+            *reason = std::to_string(codecpar->ch_layout.nb_channels) + " channels differ from the target";
+            return false;
+        }
+        snprintf(detail, sizeof(detail), "%s %s %dHz %d channels", avcodec_get_name(codecpar->codec_id), profileName ? profileName : "",
+                 codecpar->sample_rate, codecpar->ch_layout.nb_channels);
+    }
+    *reason = std::string(detail) + " matches the target";
+    return true;
+}
+
+void Step_CopyPolicy(){
+    //STEP::为每个音视频轨道决定复制还是转编码，并输出原因；设置了时间范围的复制视频轨道启用智能剪切
+    //STEP::Decide copy or transcode for every audio/video track and log the reason; copied video tracks with a time range use smart cut
+    for(int i=0;i<streamContextLength;i++){
+        AVMediaType type = streamContextMapping[i].type;
+        if(type != AVMEDIA_TYPE_AUDIO && type != AVMEDIA_TYPE_VIDEO){
+            continue;
+        }
+        std::string reason;
+        streamContextMapping[i].isCopy = CopyPolicy_Check(i, &reason);
+        std::cout<<"stream "<<i<<": "<<(streamContextMapping[i].isCopy ? "copy" : "transcode")<<" ("<<reason<<")"<<std::endl;
+        if(streamContextMapping[i].isCopy && type == AVMEDIA_TYPE_VIDEO && isRange){
+            SmartCut *smartCut = new SmartCut();
+            smartCut->decoder = NULL;
+            smartCut->isPreviousCopied = false;
+            smartCut->lastDts = AV_NOPTS_VALUE;
+            smartCut->copyCount = 0;
+            smartCut->encodeCount = 0;
+            streamContextMapping[i].smartCut = smartCut;
+        }
+    }
+}
+
+void Step_ThreadPolicy(){
+    //STEP::按common/thread_policy.h的规则分配编解码线程，复制的轨道（智能剪切除外）不需要编解码线程
+    //STEP::Allocate the codec threads by the rules in common/thread_policy.h, copied tracks (except smart cut) need no codec threads
+    std::vector<bool> isCodecList(streamContextLength);
+    for(int i=0;i<streamContextLength;i++){
+        isCodecList[i] = !streamContextMapping[i].isCopy || streamContextMapping[i].smartCut;
+    }
+    std::vector<ThreadPlan> planList = ThreadPolicy_Plan(inFileHandle, isCodecList, threadBudget);
+    for(int i=0;i<streamContextLength;i++){
+        streamContextMapping[i].decodeThreads = planList[i].decodeThreads;
+        streamContextMapping[i].encodeThreads = planList[i].encodeThreads;
+    }
+}
+
+void Step_OpenDecoder(){
+    //STEP::初始化轨道上下文列表
+    //STEP::Initialize stream context list
+    if(streamContextLength == 0){
+        return;
+    }
+
+    //STEP::根据输入文件的流信息创建解码器
+    //STEP::Create decoders based on the stream information of the input file
+    for(int i=0;i<streamContextLength;i++){
+        AVStream *inStream = inFileHandle->streams[i];
+        if (inStream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO &&                             //过滤除video、audio以外的轨道，Filter tracks except video, audio
+            inStream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO ) {
+            continue;
+        }
+        if (streamContextMapping[i].isCopy) {                                                   //复制的轨道不需要解码器，copied tracks need no decoder
+            continue;
+        }
+
+        const AVCodec *decoderInfo = avcodec_find_decoder(inStream->codecpar->codec_id);       //根据输入文件的流信息寻找解码器，Find the decoder based on the stream information of the input file
+        if(!decoderInfo){
+            termination("Could not find decoder for stream.");
+        }
+
+        AVCodecContext *decoder = avcodec_alloc_context3(decoderInfo);                          //创建解码器上下文，Create decoder context
+        if(!decoder){
+            termination("Could not allocate decoder context.");
+        }
+
+        ret = avcodec_parameters_to_context(decoder, inStream->codecpar);                       //从流信息拷贝参数到解码器上下文，Copy parameters from the stream information to the decoder context
+        if(ret<0){
+            termination("Could not copy parameters from the stream information to the decoder context.");
+        }
+
+        if(inStream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO){
+            decoder->framerate = av_guess_frame_rate(inFileHandle, inStream, NULL);
+        }
+
+        decoder->time_base = AV_TIME_BASE_Q;                                                    //固定TimeBase为1/1000000，能防止能多奇怪问题，Fixed TimeBase is 1/1000000，can prevent strange problems
+
+        //按线程策略设置解码线程，帧级多线程吞吐最高，解码器不支持时使用条带级多线程
+        //Set decoder threads by the thread policy, frame threading has the highest throughput, slice threading is used when the decoder does not support it
+        decoder->thread_count = streamContextMapping[i].decodeThreads;
+        decoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        if(isLowLatency){                                                                       //帧级多线程每个线程多缓冲一帧，低延迟模式只用条带级多线程，frame threading buffers one frame per thread, low-latency mode uses slice threading only
+            decoder->thread_type = FF_THREAD_SLICE;
+            decoder->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        }
+
+        //支持直接渲染（DR1）的视频解码器从帧缓冲池获取图像内存
+        //Video decoders that support direct rendering (DR1) get picture memory from the frame buffer pool
+        if(inStream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && (decoderInfo->capabilities & AV_CODEC_CAP_DR1)){
+            decoder->get_buffer2 = FramePool_GetBuffer2;
+        }
+
+        AVDictionary *optionsDict = NULL;
+        //av_dict_set(&optionsDict, "threads", "2", 0);                                         //可设置解码器的一些参数，如处理线程数，Set some parameters of the decoder, such as the number of processing threads
+        ret = avcodec_open2(decoder, decoderInfo, &optionsDict);
+        if(ret<0){
+            termination("Could not open decoder.");
+        }
+
+        decoder->time_base = AV_TIME_BASE_Q;                                                    //一些编码器会修改timebase，这里做一次覆盖设置，Some encoders modify timebase, do an override setting here
+        streamContextMapping[i].decoder = decoder;
+        streamContextMapping[i].type = inStream->codecpar->codec_type;
+    }
+}
+
+int Gray_Sad(const uint8_t *source1, ptrdiff_t stride1, const uint8_t *source2, ptrdiff_t stride2){
+    //pixelutils不可用（FFmpeg编译时关闭）时的8x8块SAD
+    //SAD of an 8x8 block when pixelutils is not available (disabled when FFmpeg was built)
+    int sum = 0;
+    for(int y=0;y<8;y++){
+        for(int x=0;x<8;x++){
+            sum += abs(source1[y * stride1 + x] - source2[y * stride2 + x]);
+        }
+    }
+    return sum;
+}
+
+av_pixelutils_sad_fn Gray_SadFunction(){
+    //8x8块的SAD函数，优先使用libavutil的pixelutils（有SSE2/AVX2实现）
+    //SAD function of 8x8 blocks, the pixelutils of libavutil (with SSE2/AVX2 versions) is preferred
+    av_pixelutils_sad_fn sad = av_pixelutils_get_sad_fn(3, 3, 0, NULL);
+    return sad ? sad : Gray_Sad;
+}
+
+bool Gray_Scale(GrayScaler *grayScaler, AVFrame *frame, int targetWidth, std::vector<uint8_t> *picture){
+    //STEP::缩小为宽targetWidth的灰度图，宽高取8的倍数；源帧的宽高、像素格式变化时重新创建转换器并返回true，之前的灰度图不能再用来比较
+    //STEP::Downscale to a grayscale picture with a width of targetWidth, width and height are multiples of 8; when the width, height or pixel format of the source frame changes, the converter is recreated and true is returned, earlier pictures can no longer be compared
+    bool isReset = false;
+    if(!grayScaler->scaler || grayScaler->scaleWidth != frame->width || grayScaler->scaleHeight != frame->height || grayScaler->scaleFormat != frame->format){
+        sws_freeContext(grayScaler->scaler);
+        grayScaler->width = FFMAX(FFMIN(targetWidth, frame->width) & ~7, 8);
+        grayScaler->height = FFMAX((int)av_rescale(grayScaler->width, frame->height, frame->width) & ~7, 8);
+        grayScaler->scaler = sws_getContext(frame->width, frame->height, (AVPixelFormat)frame->format,
+                                            grayScaler->width, grayScaler->height, AV_PIX_FMT_GRAY8, SWS_AREA, NULL, NULL, NULL);
+        if(!grayScaler->scaler){
+            termination("Could not initialize grayscale scaler.");
+        }
+        grayScaler->scaleWidth = frame->width;
+        grayScaler->scaleHeight = frame->height;
+        grayScaler->scaleFormat = frame->format;
+        isReset = true;
+    }
+    picture->resize(grayScaler->width * grayScaler->height);
+    uint8_t *data[4] = {picture->data(), NULL, NULL, NULL};
+    int linesize[4] = {grayScaler->width, 0, 0, 0};
+    sws_scale(grayScaler->scaler, frame->data, frame->linesize, 0, frame->height, data, linesize);
+    return isReset;
+}
+
+void Gray_Free(GrayScaler *grayScaler){
+    sws_freeContext(grayScaler->scaler);
+    grayScaler->scaler = NULL;
+}
+
+void PreAnalysis_Frame(AVFrame *frame){
+    //STEP::时间范围外的帧不参与分析，时间换算到输出时间轴，与编码时的帧时间一致
+    //STEP::Frames outside the time range are not analyzed, the time is converted to the output timeline, the same as the frame time when encoding
+    int64_t time = frame->pts != AV_NOPTS_VALUE ? frame->pts : frame->best_effort_timestamp;
+    if(time == AV_NOPTS_VALUE || (isRange && (time < rangeBegin || time >= rangeEnd))){
+        return;
+    }
+    time -= isRange ? rangeBegin : 0;
+
+    //STEP::缩小为灰度图，只用亮度，源帧的宽高、像素格式变化时重新开始比较
+    //STEP::Downscale to a grayscale picture, only luma is used, comparison starts over when the width, height or pixel format of the source frame changes
+    if(Gray_Scale(&preAnalysis.grayScaler, frame, preAnalysisWidth, &preAnalysis.current)){
+        preAnalysis.hasPrevious = false;
+    }
+
+    //STEP::每个8x8块的帧内开销为与块均值的SAD，帧间开销为与上一帧同位置块的SAD，块开销取较小值
+    //STEP::The intra cost of every 8x8 block is the SAD against the block mean, the inter cost is the SAD against the co-located block of the previous frame, the block cost is the smaller one
+    int width = preAnalysis.grayScaler.width;
+    int height = preAnalysis.grayScaler.height;
+    int64_t costSum = 0;
+    int64_t interSum = 0;
+    uint8_t flat[64];
+    for(int y=0;y<height;y+=8){
+        for(int x=0;x<width;x+=8){
+            const uint8_t *block = preAnalysis.current.data() + y * width + x;
+            int sum = 0;
+            for(int j=0;j<8;j++){
+                for(int i=0;i<8;i++){
+                    sum += block[j * width + i];
+                }
+            }
+            memset(flat, (sum + 32) / 64, sizeof(flat));
+            int intra = preAnalysis.sad(block, width, flat, 8);
+            int inter = preAnalysis.hasPrevious ? preAnalysis.sad(block, width, preAnalysis.previous.data() + y * width + x, width) : intra;
+            costSum += FFMIN(intra, inter);
+            interSum += inter;
+        }
+    }
+    double pixels = (double)width * height;
+    double cost = costSum / pixels;
+    double inter = interSum / pixels;
+
+    //STEP::帧间开销突增到近期均值的sceneCutThreshold倍以上时为场景切换，切换后均值重新开始
+    //STEP::A scene cut is when the inter cost jumps above sceneCutThreshold times its recent mean, the mean starts over after a cut
+    int frameNumber = (int)preAnalysis.costList.size();
+    if(preAnalysis.hasPrevious && preAnalysis.interMean >= 0 && inter > sceneCutMinCost && inter > preAnalysis.interMean * sceneCutThreshold &&
+       (preAnalysis.lastCutTime == AV_NOPTS_VALUE || time - preAnalysis.lastCutTime >= sceneMinDuration)){
+        preAnalysis.cutFrameList.push_back(frameNumber);
+        preAnalysis.cutTimeList.push_back(time);
+        preAnalysis.lastCutTime = time;
+        preAnalysis.interMean = -1;
+    } else if(preAnalysis.hasPrevious){
+        preAnalysis.interMean = preAnalysis.interMean < 0 ? inter : preAnalysis.interMean * 0.9 + inter * 0.1;
+    }
+    if(preAnalysis.lastCutTime == AV_NOPTS_VALUE){
+        preAnalysis.lastCutTime = time;
+    }
+    preAnalysis.costList.push_back(cost);
+    preAnalysis.current.swap(preAnalysis.previous);
+    preAnalysis.hasPrevious = true;
+}
+
+void PreAnalysis_Zones(){
+    //STEP::按场景切换分段，计算每个场景的平均开销；两遍编码中码率与开销的qcomp（0.6）次方成正比，系数按帧数加权平均为1，限制在0.5到2之间，接近1的场景不生成zone
+    //STEP::Split into scenes at the cuts and calculate the average cost of every scene; in two-pass encoding the bitrate is proportional to the cost to the power of qcomp (0.6), the factors are normalized to a frame-weighted mean of 1 and limited to 0.5 to 2, scenes close to 1 get no zone
+    int frameCount = (int)preAnalysis.costList.size();
+    std::vector<int> boundaryList(1, 0);
+    boundaryList.insert(boundaryList.end(), preAnalysis.cutFrameList.begin(), preAnalysis.cutFrameList.end());
+    boundaryList.push_back(frameCount);
+    std::vector<double> factorList;
+    double weightSum = 0;
+    for(size_t i=0;i+1<boundaryList.size();i++){
+        double sum = 0;
+        for(int j=boundaryList[i];j<boundaryList[i + 1];j++){
+            sum += preAnalysis.costList[j];
+        }
+        int length = boundaryList[i + 1] - boundaryList[i];
+        double factor = length > 0 ? pow(FFMAX(sum / length, 0.01), 0.6) : 0;
+        factorList.push_back(factor);
+        weightSum += factor * length;
+    }
+    if(videoBitRate <= 0 || frameCount == 0 || weightSum <= 0){
+        return;
+    }
+    if(isDedup && !isLowLatency){
+        std::cout<<"pre-analysis: zones are frame numbers and dedup drops frames, zones are not generated, only scene cuts are used"<<std::endl;
+        return;
+    }
+    for(size_t i=0;i<factorList.size();i++){
+        double factor = av_clipd(factorList[i] * frameCount / weightSum, 0.5, 2.0);
+        if(fabs(factor - 1) < 0.05 || boundaryList[i + 1] <= boundaryList[i]){
+            continue;
+        }
+        char zone[64];
+        snprintf(zone, sizeof(zone), "%s%d,%d,b=%.2f", preAnalysis.zones.empty() ? "" : "/", boundaryList[i], boundaryList[i + 1] - 1, factor);
+        preAnalysis.zones += zone;
+    }
+}
+
+void Step_PreAnalysis(){
+    //STEP::只分析转编码的视频轨道；直播流不能读两遍，续转时帧序号与zones对不上，都跳过
+    //STEP::Only the transcoded video track is analyzed; live streams can not be read twice and frame numbers do not match the zones when resuming, both are skipped
+    int inIndex = -1;
+    for(int i=0;i<streamContextLength && inIndex < 0;i++){
+        if(streamContextMapping[i].type == AVMEDIA_TYPE_VIDEO && streamContextMapping[i].decoder){
+            inIndex = i;
+        }
+    }
+    if(!isPreAnalysis || inIndex < 0){
+        return;
+    }
+    if(isLowLatency || strstr(inFilePath, "://")){
+        std::cout<<"pre-analysis skipped for live input"<<std::endl;
+        return;
+    }
+    if(isResumable && access(Checkpoint_Path().c_str(), F_OK) == 0){
+        std::cout<<"pre-analysis skipped when resuming"<<std::endl;
+        return;
+    }
+    if(videoBitRate <= 0){
+        std::cout<<"warning: pre-analysis in constant quality (crf) mode only forces IDR frames at scene cuts and generates no crf schedule, "
+                 <<"crf already spends bits by frame complexity, set videoBitRate for a per-scene bitrate schedule"<<std::endl;
+    }
+    int64_t startTime = av_gettime_relative();
+
+    //STEP::单独打开源文件和解码器，不影响正式转码的读取位置；解码跳过环路滤波，分析只需要大致的图像
+    //STEP::Open the source file and a decoder separately, so the reading position of the real transcode is not affected; decoding skips the loop filter, the analysis only needs an approximate picture
+    AVFormatContext *analysisHandle = NULL;
+    ret = avformat_open_input(&analysisHandle, inFilePath, NULL, NULL);
+    if(ret<0){
+        termination("Could not open input file for pre-analysis.");
+    }
+    if(analysisHandle->nb_streams != inFileHandle->nb_streams && avformat_find_stream_info(analysisHandle, NULL) < 0){
+        termination("Failed to retrieve input stream information for pre-analysis.");
+    }
+    AVStream *inStream = inFileHandle->streams[inIndex];
+    const AVCodec *decoderInfo = avcodec_find_decoder(inStream->codecpar->codec_id);
+    AVCodecContext *decoder = decoderInfo ? avcodec_alloc_context3(decoderInfo) : NULL;
+    if(!decoder || avcodec_parameters_to_context(decoder, inStream->codecpar) < 0){
+        termination("Could not allocate pre-analysis decoder.");
+    }
+    decoder->time_base = AV_TIME_BASE_Q;
+    decoder->thread_count = streamContextMapping[inIndex].decodeThreads;
+    decoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    decoder->skip_loop_filter = AVDISCARD_ALL;
+    ret = avcodec_open2(decoder, decoderInfo, NULL);
+    if(ret<0){
+        termination("Could not open pre-analysis decoder.");
+    }
+    if(isRange && rangeStart > 0){
+        av_seek_frame(analysisHandle, -1, rangeBegin, AVSEEK_FLAG_BACKWARD);
+    }
+
+    preAnalysis.sad = Gray_SadFunction();
+    preAnalysis.interMean = -1;
+    preAnalysis.lastCutTime = AV_NOPTS_VALUE;
+
+    //STEP::读取并解码视频轨道，读到rangeEnd后停止，最后取出解码器中剩余的帧
+    //STEP::Read and decode the video track, stop at rangeEnd, and finally take out the frames left in the decoder
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    if(!packet || !frame){
+        termination("Could not allocate pre-analysis packet.");
+    }
+    AVRational timeBase = analysisHandle->streams[inIndex]->time_base;
+    bool isEnd = false;
+    while(!isEnd){
+        if(av_read_frame(analysisHandle, packet) < 0){
+            isEnd = true;
+        } else if(packet->stream_index != inIndex){
+            av_packet_unref(packet);
+            continue;
+        } else if(packet->dts != AV_NOPTS_VALUE && av_rescale_q(packet->dts, timeBase, AV_TIME_BASE_Q) >= rangeEnd){
+            av_packet_unref(packet);
+            isEnd = true;
+        }
+        if(!isEnd){
+            av_packet_rescale_ts(packet, timeBase, decoder->time_base);
+        }
+        ret = avcodec_send_packet(decoder, isEnd ? NULL : packet);
+        av_packet_unref(packet);
+        if(ret < 0 && ret != AVERROR_EOF){
+            continue;
+        }
+        while(avcodec_receive_frame(decoder, frame) >= 0){
+            PreAnalysis_Frame(frame);
+            av_frame_unref(frame);
+        }
+    }
+    PreAnalysis_Zones();
+    std::cout<<"pre-analysis: "<<preAnalysis.costList.size()<<" frames, "<<preAnalysis.cutFrameList.size()<<" scene cuts, "
+             <<(av_gettime_relative() - startTime) / 1000<<"ms"<<(preAnalysis.zones.empty() ? "" : ", zones ")<<preAnalysis.zones<<std::endl;
+
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&decoder);
+    avformat_close_input(&analysisHandle);
+    Gray_Free(&preAnalysis.grayScaler);
+    std::vector<uint8_t>().swap(preAnalysis.current);
+    std::vector<uint8_t>().swap(preAnalysis.previous);
+}
+
+bool PreAnalysis_IsCut(int64_t pts){
+    //STEP::帧时间到达下一个场景切换时返回true，切换处的帧被丢弃时由之后的第一帧代替
+    //STEP::Return true when the frame time reaches the next scene cut, the first later frame takes its place when the frame at the cut was dropped
+    bool isCut = false;
+    while(pts != AV_NOPTS_VALUE && preAnalysis.cutCursor < preAnalysis.cutTimeList.size() && preAnalysis.cutTimeList[preAnalysis.cutCursor] <= pts){
+        preAnalysis.cutCursor++;
+        isCut = true;
+    }
+    return isCut;
+}
+
+bool Dedup_Frame(unsigned int inIndex, AVFrame *frame){
+    //STEP::与上一个送入编码器的帧按8x8块比较，任一块的差值超过dedupThreshold即不是重复帧，比较到第一个不同的块就结束
+    //STEP::Compare with the last frame sent to the encoder by 8x8 blocks, the frame is not a duplicate once any block differs by more than dedupThreshold, comparison ends at the first differing block
+    Dedup *dedup = streamContextMapping[inIndex].dedup;
+    if(!dedup){
+        return true;
+    }
+    int64_t time = frame->pts != AV_NOPTS_VALUE ? frame->pts : frame->best_effort_timestamp;
+    bool isReset = Gray_Scale(&dedup->grayScaler, frame, dedupWidth, &dedup->current);
+    bool isDuplicate = !isReset && dedup->hasReference && time != AV_NOPTS_VALUE && time - dedup->referenceTime < dedupMaxDuration;
+    int width = dedup->grayScaler.width;
+    int limit = (int)(dedupThreshold * 64);
+    for(int y=0;y<dedup->grayScaler.height && isDuplicate;y+=8){
+        for(int x=0;x<width && isDuplicate;x+=8){
+            isDuplicate = preAnalysis.sad(dedup->current.data() + y * width + x, width, dedup->reference.data() + y * width + x, width) <= limit;
+        }
+    }
+    dedup->frameCount++;
+
+    //STEP::重复帧保留为lastFrame后丢弃，时间戳不调整，上一个保留的帧一直显示到下一个保留的帧
+    //STEP::A duplicate frame is kept as lastFrame and dropped, timestamps are not adjusted, the previous kept frame is shown until the next kept one
+    av_frame_unref(dedup->lastFrame);
+    if(isDuplicate){
+        av_frame_move_ref(dedup->lastFrame, frame);
+        dedup->dropCount++;
+        return false;
+    }
+    dedup->current.swap(dedup->reference);
+    dedup->hasReference = true;
+    dedup->referenceTime = time;
+    return true;
+}
+
+void Step_OpenEncoder(){
+    //STEP::根据解码器创建编码器，因为单纯的转编码无法改变音视频基础参数，如分辨率、采样率等，所以这些参数只能复制
+    //STEP::Create encoders based on decoders, since it is not possible to change the audio and video data by only doing transcoding, the basic parameters such as resolution, sample rate, etc. can only be copied
+    for(int i=0;i<streamContextLength;i++){
+        if(!streamContextMapping[i].decoder){
+            continue;
+        }
+
+        const AVCodec *encoderInfo = NULL;
+        if (streamContextMapping[i].type == AVMEDIA_TYPE_VIDEO){
+            encoderInfo = avcodec_find_encoder(videoCodecID);                                  //根据目标编码器ID寻找编码器，Find the encoder based on the target encoder ID
+        } else if (streamContextMapping[i].type == AVMEDIA_TYPE_AUDIO ) {
+            encoderInfo = avcodec_find_encoder(audioCodecID);
+        }           
+        if(!encoderInfo){
+            termination("Could not find encoder for stream.");
+        }
+
+        AVCodecContext *encoder = avcodec_alloc_context3(encoderInfo);                          //创建编码器上下文，Create encoder context
+        if(!encoder){
+            termination("Could not allocate encoder context.");
+        }
+   
+        //设置编码器一些必要参数，由于单纯的转编码无法改这些参数，所以一般从解码器的信息中复制
+        //Set necessary parameters of the encoder, since it is not possible to change these parameters by transcoding, the parameters usually copied from the decoder
+        AVCodecContext *decoder = streamContextMapping[i].decoder;
+        if (streamContextMapping[i].type == AVMEDIA_TYPE_VIDEO){
+            //目标分辨率未设置的一边按源视频比例计算，并取偶数（yuv420p要求宽高为偶数）
+            //The unset side of the target resolution is calculated from the source aspect ratio, and rounded to even (yuv420p requires even width and height)
+            int width = videoWidth > 0 ? videoWidth : decoder->width;
+            int height = videoHeight > 0 ? videoHeight : decoder->height;
+            if(videoWidth > 0 && videoHeight <= 0){
+                height = (int)av_rescale(videoWidth, decoder->height, decoder->width);
+            } else if(videoHeight > 0 && videoWidth <= 0){
+                width = (int)av_rescale(videoHeight, decoder->width, decoder->height);
+            }
+            encoder->width = width & ~1;
+            encoder->height = height & ~1;
+            encoder->framerate = decoder->framerate;
+            encoder->sample_aspect_ratio = decoder->sample_aspect_ratio;
+
+            //编码器支持源视频的像素格式时直接使用，否则使用编码器的首选格式，由转换环节转换
+            //Use the pixel format of the source video if the encoder supports it, otherwise use the preferred format of the encoder and let the conversion stage convert
+            encoder->pix_fmt = decoder->pix_fmt;
+            if (encoderInfo->pix_fmts){
+                encoder->pix_fmt = encoderInfo->pix_fmts[0];
+                for(int j=0;encoderInfo->pix_fmts[j] != AV_PIX_FMT_NONE;j++){
+                    if(encoderInfo->pix_fmts[j] == decoder->pix_fmt){
+                        encoder->pix_fmt = decoder->pix_fmt;
+                        break;
+                    }
+                }
+            }
+            streamContextMapping[i].scaleFrame = av_frame_alloc();
+            if(!streamContextMapping[i].scaleFrame){
+                termination("Could not allocate AVFrame.");
+            }
+
+            //去重时创建去重状态，低延迟模式不去重，丢弃重复帧会让播放端以为卡住
+            //Create the dedup state when deduplicating, low-latency mode does not dedup, dropped duplicates would look like a stall to the player
+            if(isDedup && !isLowLatency){
+                Dedup *dedup = new Dedup();
+                dedup->grayScaler.scaler = NULL;
+                dedup->hasReference = false;
+                dedup->referenceTime = AV_NOPTS_VALUE;
+                dedup->lastFrame = av_frame_alloc();
+                dedup->frameCount = 0;
+                dedup->dropCount = 0;
+                if(!dedup->lastFrame){
+                    termination("Could not allocate AVFrame.");
+                }
+                streamContextMapping[i].dedup = dedup;
+                preAnalysis.sad = Gray_SadFunction();
+            }
+
+            //可以设置与编码相关的参数，如gop、去除b帧、码率等
+            //You can set and related parameters such as gop, removing b frames, and bitrate
+            // encoder->gop_size = 40;
+            // encoder->max_b_frames = 0;
+            if(videoBitRate > 0){
+                encoder->bit_rate = videoBitRate;
+            }
+        } else if (streamContextMapping[i].type == AVMEDIA_TYPE_AUDIO){
+            //采样率、声道数可以与源音频不同，由重采样环节转换；编码器不支持目标采样率时使用其支持的第一个采样率
+            //The sample rate and channels can differ from the source audio, the resampling stage converts them; the first supported sample rate is used if the encoder does not support the target one
+            encoder->sample_rate = audioSampleRate > 0 ? audioSampleRate : decoder->sample_rate;
+            if(encoderInfo->supported_samplerates){
+                bool isSupported = false;
+                for(int j=0;encoderInfo->supported_samplerates[j];j++){
+                    isSupported = isSupported || encoderInfo->supported_samplerates[j] == encoder->sample_rate;
+                }
+                if(!isSupported){
+                    encoder->sample_rate = encoderInfo->supported_samplerates[0];
+                }
+            }
+            if(audioChannels > 0){
+                av_channel_layout_default(&encoder->ch_layout, audioChannels);
+            } else {
+                av_channel_layout_copy(&encoder->ch_layout, &decoder->ch_layout);
+            }
+            encoder->channels = av_get_channel_layout_nb_channels(encoder->channel_layout);
+            if(encoderInfo->sample_fmts)
+                encoder->sample_fmt = encoderInfo->sample_fmts[0];
+            else
+                encoder->sample_fmt = decoder->sample_fmt;
+        }
+
+        encoder->time_base = AV_TIME_BASE_Q;                                                    //固定TimeBase为1/1000000，能防止能多奇怪问题，Fixed TimeBase is 1/1000000，can prevent strange problems
+
+        AVDictionary *optionsDict = NULL;
+        //av_dict_set(&optionsDict, "threads", "2", 0);                                         //可设置编码器的一些参数，如处理线程数，Set some parameters of the encoder, such as the number of processing threads
+        //按线程策略设置编码线程，libx265不使用thread_count，需通过x265-params的pools参数限制线程池大小
+        //Set encoder threads by the thread policy, libx265 ignores thread_count, its thread pool size is limited by the pools parameter of x265-params
+        encoder->thread_count = streamContextMapping[i].encodeThreads;
+        encoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        std::string x265Params = "pools=" + std::to_string(streamContextMapping[i].encodeThreads);
+
+        //低延迟模式：zerolatency调优，限制B帧数和前瞻帧数；zerolatency会关闭前瞻，再按lowLatencyLookahead设置
+        //Low-latency mode: zerolatency tune, limited B-frames and lookahead; zerolatency turns off the lookahead, which is then set by lowLatencyLookahead
+        if(isLowLatency && streamContextMapping[i].type == AVMEDIA_TYPE_VIDEO){
+            encoder->thread_type = FF_THREAD_SLICE;
+            encoder->max_b_frames = lowLatencyBFrames;
+            if(strcmp(encoderInfo->name, "libx264") == 0 || strcmp(encoderInfo->name, "libx265") == 0){
+                av_dict_set(&optionsDict, "tune", "zerolatency", 0);
+            }
+            if(strcmp(encoderInfo->name, "libx264") == 0){
+                av_dict_set_int(&optionsDict, "rc-lookahead", lowLatencyLookahead, 0);
+            }
+            x265Params += ":bframes=" + std::to_string(lowLatencyBFrames) + ":rc-lookahead=" + std::to_string(lowLatencyLookahead) + ":frame-threads=1";
+        }
+        //断点续转：封闭GOP，关键帧之后的帧不引用之前的GOP，可以从任一关键帧重新开始编码；输出格式需要全局头时参数集放在全局头中
+        //Resumable transcoding: closed GOPs, frames after a keyframe never reference the previous GOP, so encoding can restart at any keyframe; the parameter sets go to the global header when the output format needs one
+        //码率控制：未设置平均码率时使用恒定质量；预分析的场景切换强制为IDR帧，平均码率模式下加上按场景开销生成的zones
+        //Rate control: constant quality when no average bitrate is set; the scene cuts of the pre-analysis are forced to IDR frames, with the zones generated from the scene costs in average bitrate mode
+        if(streamContextMapping[i].type == AVMEDIA_TYPE_VIDEO && (strcmp(encoderInfo->name, "libx264") == 0 || strcmp(encoderInfo->name, "libx265") == 0)){
+            if(videoBitRate <= 0 && videoCrf > 0){
+                av_dict_set_int(&optionsDict, "crf", videoCrf, 0);
+            }
+            if(!preAnalysis.cutTimeList.empty()){
+                av_dict_set(&optionsDict, "forced-idr", "1", 0);
+            }
+            if(!preAnalysis.zones.empty()){
+                x265Params += ":zones=" + preAnalysis.zones;
+                if(strcmp(encoderInfo->name, "libx264") == 0){
+                    av_dict_set(&optionsDict, "x264-params", ("zones=" + preAnalysis.zones).c_str(), 0);        //libx264的zones格式相同，libx264 uses the same zones format
+                }
+            }
+        }
+        if(isResumable){
+            const AVOutputFormat *outFormat = av_guess_format(NULL, outFilePath, NULL);
+            if(outFormat && (outFormat->flags & AVFMT_GLOBALHEADER)){
+                encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+            }
+            encoder->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+            x265Params += ":open-gop=0";
+        }
+        if(strcmp(encoderInfo->name, "libx265") == 0){
+            av_dict_set(&optionsDict, "x265-params", x265Params.c_str(), 0);
+        }
+        ret = avcodec_open2(encoder, encoderInfo, &optionsDict);
+        if(ret<0){
+            termination("Could not open encoder.");
+        }
+
+        encoder->time_base = AV_TIME_BASE_Q;                                                    //一些编码器会修改timebase，这里做一次覆盖设置，Some encoders modify timebase, do an override setting here
+        streamContextMapping[i].encoder = encoder;
+
+        //STEP::音频创建重采样器和FIFO，重采样器的输出参数与编码器一致
+        //STEP::Create the resampler and FIFO for audio, the output parameters of the resampler match the encoder
+        if (streamContextMapping[i].type == AVMEDIA_TYPE_AUDIO){
+            ret = swr_alloc_set_opts2(&streamContextMapping[i].resampler,
+                                      &encoder->ch_layout, encoder->sample_fmt, encoder->sample_rate,
+                                      &decoder->ch_layout, decoder->sample_fmt, decoder->sample_rate,
+                                      0, NULL);
+            if(ret < 0 || swr_init(streamContextMapping[i].resampler) < 0){
+                termination("Could not initialize resampler.");
+            }
+            streamContextMapping[i].audioFifo = av_audio_fifo_alloc(encoder->sample_fmt, encoder->ch_layout.nb_channels, encoder->frame_size > 0 ? encoder->frame_size * 2 : 2048);
+            streamContextMapping[i].audioFrame = av_frame_alloc();
+            if(!streamContextMapping[i].audioFifo || !streamContextMapping[i].audioFrame){
+                termination("Could not allocate audio fifo.");
+            }
+        }
+    }
+}
+
+void Range_Shift(AVPacket *packet, AVRational timeBase){
+    //把时间戳平移到从时间范围的起点开始
+    //Shift the timestamps so that they start at the beginning of the time range
+    int64_t offset = av_rescale_q(rangeBegin, AV_TIME_BASE_Q, timeBase);
+    if(packet->pts != AV_NOPTS_VALUE){
+        packet->pts -= offset;
+    }
+    if(packet->dts != AV_NOPTS_VALUE){
+        packet->dts -= offset;
+    }
+}
+
+int64_t Range_Time(AVStream *inStream, AVPacket *packet){
+    int64_t timestamp = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+    return timestamp != AV_NOPTS_VALUE ? av_rescale_q(timestamp, inStream->time_base, AV_TIME_BASE_Q) : AV_NOPTS_VALUE;
+}
+
+bool Range_IsEnd(unsigned int inIndex, AVPacket *packet){
+    //STEP::数据包按dts排列，pts不小于dts，所以轨道的dts到达rangeEnd后，之后的数据包都在范围外
+    //STEP::Packets are in dts order and pts is not less than dts, so once the dts of a track reaches rangeEnd, all later packets are outside the range
+    StreamContext *context = &streamContextMapping[inIndex];
+    if(!isRange || context->isRangeEnd){
+        return context->isRangeEnd;
+    }
+    int64_t timestamp = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    if(timestamp == AV_NOPTS_VALUE || av_rescale_q(timestamp, inFileHandle->streams[inIndex]->time_base, AV_TIME_BASE_Q) < rangeEnd){
+        return false;
+    }
+    context->isRangeEnd = true;
+    if(context->type == AVMEDIA_TYPE_AUDIO || context->type == AVMEDIA_TYPE_VIDEO){
+        rangeActiveCount--;
+    }
+    return true;
+}
+
+bool Range_Packet(AVStream *inStream, AVPacket *packet){
+    //STEP::复制的轨道按数据包判断是否在时间范围内，在范围内时平移时间戳
+    //STEP::Copied tracks check by packet whether it is inside the time range, and shift the timestamps when it is
+    if(!isRange){
+        return true;
+    }
+    int64_t time = Range_Time(inStream, packet);
+    if(time == AV_NOPTS_VALUE || time < rangeBegin || time >= rangeEnd){
+        return false;
+    }
+    Range_Shift(packet, inStream->time_base);
+    return true;
+}
+
+bool Range_Frame(AVFrame *frame){
+    //STEP::转编码的轨道按解码后的帧判断，剪切精确到帧；解码器的timebase为AV_TIME_BASE_Q
+    //STEP::Transcoded tracks check by decoded frame, so the cut is frame-accurate; the decoder timebase is AV_TIME_BASE_Q
+    if(!isRange){
+        return true;
+    }
+    int64_t time = frame->pts != AV_NOPTS_VALUE ? frame->pts : frame->best_effort_timestamp;
+    if(time == AV_NOPTS_VALUE || time < rangeBegin || time >= rangeEnd){
+        return false;
+    }
+    frame->pts = time - rangeBegin;
+    return true;
+}
+
+void SmartCut_Write(unsigned int inIndex, AVPacket *packet, AVRational timeBase){
+    //STEP::写入智能剪切的数据包，复制部分与重新编码部分衔接处保证dts单调递增
+    //STEP::Write a smart cut packet, keep dts monotonic where copied and re-encoded parts meet
+    StreamContext *context = &streamContextMapping[inIndex];
+    SmartCut *smartCut = context->smartCut;
+    AVStream *outStream = outFileHandle->streams[context->outIndex];
+    av_packet_rescale_ts(packet, timeBase, outStream->time_base);
+    if(packet->dts != AV_NOPTS_VALUE && smartCut->lastDts != AV_NOPTS_VALUE && packet->dts <= smartCut->lastDts){
+        packet->dts = smartCut->lastDts + 1;
+        if(packet->pts != AV_NOPTS_VALUE && packet->pts < packet->dts){
+            packet->pts = packet->dts;
+        }
+    }
+    if(packet->dts != AV_NOPTS_VALUE){
+        smartCut->lastDts = packet->dts;
+    }
+    packet->stream_index = context->outIndex;
+    int64_t stageTime = Metrics_Now();
+    ret = av_interleaved_write_frame(outFileHandle, packet);
+    if(ret < 0){
+        termination("Could not mux packet.");
+    }
+    Metrics_Record(inIndex, STAGE_WRITE, stageTime);
+}
+
+void SmartCut_ToLengthPrefixed(AVCodecParameters *codecpar, AVPacket *packet){
+    //STEP::源轨道为mp4格式（avcC/hvcC，NAL前为4字节长度）时，把编码器输出的Annex B（起始码分隔）转换为相同格式
+    //STEP::When the source track is in mp4 format (avcC/hvcC, 4-byte length before each NAL), convert the Annex B output (start code delimited) of the encoder to the same format
+    if((codecpar->codec_id != AV_CODEC_ID_H264 && codecpar->codec_id != AV_CODEC_ID_HEVC) ||
+       codecpar->extradata_size <= 0 || codecpar->extradata[0] != 1){
+        return;
+    }
+    std::vector<int> nalList;                                                                   //每个NAL的起止位置，begin and end of each NAL
+    int begin = -1;
+    for(int i=0;i + 2 < packet->size;){
+        if(packet->data[i] == 0 && packet->data[i + 1] == 0 && packet->data[i + 2] == 1){
+            if(begin >= 0){
+                int end = i;
+                while(end > begin && packet->data[end - 1] == 0){
+                    end--;
+                }
+                nalList.push_back(begin);
+                nalList.push_back(end);
+            }
+            i += 3;
+            begin = i;
+        } else {
+            i++;
+        }
+    }
+    if(begin < 0){
+        return;
+    }
+    nalList.push_back(begin);
+    nalList.push_back(packet->size);
+
+    int size = 0;
+    for(size_t i=0;i<nalList.size();i+=2){
+        size += 4 + nalList[i + 1] - nalList[i];
+    }
+    AVBufferRef *buffer = av_buffer_alloc(size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if(!buffer){
+        termination("Could not allocate packet buffer.");
+    }
+    uint8_t *data = buffer->data;
+    for(size_t i=0;i<nalList.size();i+=2){
+        int length = nalList[i + 1] - nalList[i];
+        AV_WB32(data, length);
+        memcpy(data + 4, packet->data + nalList[i], length);
+        data += 4 + length;
+    }
+    memset(data, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    av_buffer_unref(&packet->buf);
+    packet->buf = buffer;
+    packet->data = buffer->data;
+    packet->size = size;
+}
+
+AVCodecContext *SmartCut_OpenEncoder(unsigned int inIndex, AVFrame *frame){
+    //STEP::每个不完整GOP使用一个新的编码器，从IDR帧开始，参数与源轨道一致
+    //不设置AV_CODEC_FLAG_GLOBAL_HEADER，参数集（SPS/PPS）写在码流中，与复制部分的extradata互不影响
+    //不使用B帧，dts与pts相同，便于与相邻的复制GOP衔接
+    //STEP::Every partial GOP uses a fresh encoder starting with an IDR frame, with the same parameters as the source track
+    //AV_CODEC_FLAG_GLOBAL_HEADER is not set, the parameter sets (SPS/PPS) are in-band and do not conflict with the extradata of the copied part
+    //No B-frames, so dts equals pts and joins the neighbouring copied GOPs easily
+    StreamContext *context = &streamContextMapping[inIndex];
+    AVStream *inStream = inFileHandle->streams[inIndex];
+    const AVCodec *encoderInfo = avcodec_find_encoder(videoCodecID);
+    if(!encoderInfo){
+        termination("Could not find encoder for smart cut.");
+    }
+    AVCodecContext *encoder = avcodec_alloc_context3(encoderInfo);
+    if(!encoder){
+        termination("Could not allocate encoder context.");
+    }
+    encoder->width = frame->width;
+    encoder->height = frame->height;
+    encoder->pix_fmt = (enum AVPixelFormat)frame->format;
+    encoder->sample_aspect_ratio = frame->sample_aspect_ratio;
+    encoder->framerate = av_guess_frame_rate(inFileHandle, inStream, NULL);
+    encoder->time_base = AV_TIME_BASE_Q;
+    encoder->profile = inStream->codecpar->profile;
+    encoder->level = inStream->codecpar->level;
+    encoder->bit_rate = inStream->codecpar->bit_rate;
+    encoder->color_range = inStream->codecpar->color_range;
+    encoder->color_primaries = inStream->codecpar->color_primaries;
+    encoder->color_trc = inStream->codecpar->color_trc;
+    encoder->colorspace = inStream->codecpar->color_space;
+    encoder->max_b_frames = 0;
+    encoder->thread_count = context->encodeThreads;
+    encoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+    AVDictionary *optionsDict = NULL;
+    if(strcmp(encoderInfo->name, "libx265") == 0){
+        std::string x265Params = "pools=" + std::to_string(context->encodeThreads);
+        av_dict_set(&optionsDict, "x265-params", x265Params.c_str(), 0);
+    }
+    ret = avcodec_open2(encoder, encoderInfo, &optionsDict);
+    av_dict_free(&optionsDict);
+    if(ret < 0){
+        termination("Could not open smart cut encoder.");
+    }
+    encoder->time_base = AV_TIME_BASE_Q;
+    return encoder;
+}
+
+void SmartCut_EncodeFrame(unsigned int inIndex, AVCodecContext *encoder, AVFrame *frame, AVPacket *packet, int64_t delay){
+    //STEP::编码一帧，frame为NULL表示清理编码器；dts按复制部分的解码延迟偏移，与相邻的复制GOP保持单调递增
+    //STEP::Encode a frame, NULL frame means cleaning up the encoder; dts is offset by the decoding delay of the copied part, to stay monotonic with the neighbouring copied GOPs
+    AVCodecParameters *codecpar = inFileHandle->streams[inIndex]->codecpar;
+    ret = avcodec_send_frame(encoder, frame);
+    if(ret < 0){
+        termination("Could not encoding.");
+    }
+    while((ret = avcodec_receive_packet(encoder, packet)) >= 0){
+        packet->pts -= rangeBegin;
+        packet->dts = packet->pts - delay;
+        SmartCut_ToLengthPrefixed(codecpar, packet);
+        SmartCut_Write(inIndex, packet, encoder->time_base);
+    }
+    if(ret != AVERROR(EAGAIN) && ret != AVERROR_EOF){
+        termination("Could not receive encoding.");
+    }
+}
+
+void SmartCut_Encode(unsigned int inIndex, const std::vector<AVPacket *> &packetList, int64_t begin, int64_t end, int64_t delay){
+    //STEP::解码packetList中的所有数据包，只把[begin, end)内的帧送入新的编码器
+    //STEP::Decode all packets of packetList, only frames inside [begin, end) go to the fresh encoder
+    StreamContext *context = &streamContextMapping[inIndex];
+    SmartCut *smartCut = context->smartCut;
+    AVStream *inStream = inFileHandle->streams[inIndex];
+    if(!smartCut->decoder){
+        const AVCodec *decoderInfo = avcodec_find_decoder(inStream->codecpar->codec_id);
+        smartCut->decoder = decoderInfo ? avcodec_alloc_context3(decoderInfo) : NULL;
+        if(!smartCut->decoder){
+            termination("Could not allocate smart cut decoder.");
+        }
+        ret = avcodec_parameters_to_context(smartCut->decoder, inStream->codecpar);
+        if(ret < 0){
+            termination("Could not copy parameters from the stream information to the decoder context.");
+        }
+        smartCut->decoder->time_base = AV_TIME_BASE_Q;
+        smartCut->decoder->pkt_timebase = AV_TIME_BASE_Q;
+        smartCut->decoder->thread_count = context->decodeThreads;
+        smartCut->decoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        ret = avcodec_open2(smartCut->decoder, decoderInfo, NULL);
+        if(ret < 0){
+            termination("Could not open smart cut decoder.");
+        }
+    }
+
+    AVCodecContext *encoder = NULL;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    if(!packet || !frame){
+        termination("Could not allocate smart cut buffers.");
+    }
+    for(size_t i=0;i<=packetList.size();i++){
+        if(i < packetList.size()){
+            ret = av_packet_ref(packet, packetList[i]);
+            if(ret < 0){
+                termination("Could not reference packet.");
+            }
+            av_packet_rescale_ts(packet, inStream->time_base, AV_TIME_BASE_Q);
+            ret = avcodec_send_packet(smartCut->decoder, packet);
+            av_packet_unref(packet);
+        } else {
+            ret = avcodec_send_packet(smartCut->decoder, NULL);
+        }
+        if(ret < 0){
+            termination("Could not decoding.");
+        }
+        while((ret = avcodec_receive_frame(smartCut->decoder, frame)) >= 0){
+            int64_t time = frame->pts != AV_NOPTS_VALUE ? frame->pts : frame->best_effort_timestamp;
+            if(time != AV_NOPTS_VALUE && time >= begin && time < end){
+                if(!encoder){
+                    encoder = SmartCut_OpenEncoder(inIndex, frame);
+                }
+                frame->pts = time;
+                frame->pict_type = AV_PICTURE_TYPE_NONE;
+                SmartCut_EncodeFrame(inIndex, encoder, frame, packet, delay);
+            }
+            av_frame_unref(frame);
+        }
+        if(ret != AVERROR(EAGAIN) && ret != AVERROR_EOF){
+            termination("Could not receive decoding.");
+        }
+    }
+    avcodec_flush_buffers(smartCut->decoder);                                                   //清空后可以继续解码下一个GOP，can decode the next GOP after flushing
+
+    if(encoder){
+        SmartCut_EncodeFrame(inIndex, encoder, NULL, packet, delay);
+        avcodec_free_context(&encoder);
+        smartCut->encodeCount++;
+    }
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+}
+
+void SmartCut_Gop(unsigned int inIndex){
+    //STEP::一个GOP缓存完毕（nextList为下一个关键帧和它的前导帧，为空表示文件结束），根据GOP与时间范围的关系处理
+    //GOP负责的时间段为[本关键帧, 下一个关键帧)，包括下一个GOP的前导帧，不包括本GOP的前导帧
+    //STEP::A GOP is fully buffered (nextList holds the next keyframe and its leading pictures, empty means end of file), handle it by how it overlaps the time range
+    //The GOP is responsible for [this keyframe, next keyframe), which includes the leading pictures of the next GOP but not its own
+    StreamContext *context = &streamContextMapping[inIndex];
+    SmartCut *smartCut = context->smartCut;
+    AVStream *inStream = inFileHandle->streams[inIndex];
+    AVPacket *keyframe = smartCut->gopList[0];
+    AVPacket *next = smartCut->nextList.empty() ? NULL : smartCut->nextList[0];
+    int64_t gopBegin = Range_Time(inStream, keyframe);
+    int64_t gopEnd = next ? Range_Time(inStream, next) : INT64_MAX;
+    if(!next && !context->isRangeEnd && gopBegin != AV_NOPTS_VALUE){
+        //文件结束的最后一个GOP，结束时刻为最晚的帧的结束时刻，整个在时间范围内时可以复制
+        //The last GOP at the end of file ends where its latest frame ends, it can be copied when it is entirely inside the time range
+        gopEnd = gopBegin;
+        for(size_t i=0;i<smartCut->gopList.size();i++){
+            AVPacket *packet = smartCut->gopList[i];
+            int64_t time = Range_Time(inStream, packet);
+            if(time != AV_NOPTS_VALUE){
+                gopEnd = FFMAX(gopEnd, time + av_rescale_q(FFMAX(packet->duration, (int64_t)1), inStream->time_base, AV_TIME_BASE_Q));
+            }
+        }
+    }
+    bool isCopied = false;
+    if(gopBegin == AV_NOPTS_VALUE || gopEnd == AV_NOPTS_VALUE || gopEnd <= rangeBegin || gopBegin >= rangeEnd){
+        //GOP在时间范围外，丢弃
+        //The GOP is outside the time range, drop it
+    } else if(gopBegin >= rangeBegin && gopEnd <= rangeEnd){
+        //STEP::整个GOP在时间范围内，直接复制；上一个GOP不是复制时，前导帧已由上一个GOP的重新编码输出，丢弃
+        //保留一份引用，下一个GOP重新编码时用来解码它的前导帧
+        //STEP::The whole GOP is inside the time range, copy it; when the previous GOP was not copied, its re-encoding already output the leading pictures, drop them
+        //Keep a reference, used to decode the leading pictures of the next GOP if it is re-encoded
+        std::vector<AVPacket *> copiedList;
+        for(size_t i=0;i<smartCut->gopList.size();i++){
+            AVPacket *packet = smartCut->gopList[i];
+            AVPacket *reference = av_packet_clone(packet);
+            if(!reference){
+                termination("Could not reference packet.");
+            }
+            copiedList.push_back(reference);
+            int64_t time = Range_Time(inStream, packet);
+            if(!smartCut->isPreviousCopied && time != AV_NOPTS_VALUE && time < gopBegin){
+                continue;
+            }
+            Range_Shift(packet, inStream->time_base);
+            SmartCut_Write(inIndex, packet, inStream->time_base);
+        }
+        for(size_t i=0;i<smartCut->previousList.size();i++){
+            av_packet_free(&smartCut->previousList[i]);
+        }
+        smartCut->previousList.swap(copiedList);
+        smartCut->copyCount++;
+        isCopied = true;
+    } else {
+        //STEP::剪切点所在的不完整GOP，重新编码范围内的部分
+        //上一个GOP是复制时，本GOP的前导帧在这里输出：先解码上一个GOP作为参考，范围从最早的前导帧开始
+        //下一个关键帧和它的前导帧一起解码，范围到下一个关键帧为止，包括下一个GOP的前导帧，下一个GOP复制时丢弃它们
+        //后面紧接复制的GOP时，dts按下一个关键帧的解码延迟偏移，否则按本GOP关键帧的解码延迟偏移
+        //STEP::A partial GOP at a cut point, re-encode the part inside the range
+        //When the previous GOP was copied, the leading pictures of this GOP are output here: the previous GOP is decoded first as the reference, and the range starts at the earliest leading picture
+        //The next keyframe is decoded together with its leading pictures, and the range goes up to the next keyframe, so it includes the leading pictures of the next GOP, which the next GOP drops when it is copied
+        //When a copied GOP follows, dts is offset by the decoding delay of the next keyframe, otherwise by the one of this GOP's keyframe
+        std::vector<AVPacket *> decodeList;
+        int64_t begin = gopBegin;
+        if(smartCut->isPreviousCopied){
+            decodeList = smartCut->previousList;
+            for(size_t i=0;i<smartCut->gopList.size();i++){
+                int64_t time = Range_Time(inStream, smartCut->gopList[i]);
+                if(time != AV_NOPTS_VALUE){
+                    begin = FFMIN(begin, time);
+                }
+            }
+        }
+        decodeList.insert(decodeList.end(), smartCut->gopList.begin(), smartCut->gopList.end());
+        decodeList.insert(decodeList.end(), smartCut->nextList.begin(), smartCut->nextList.end());
+        AVPacket *reference = next && gopEnd <= rangeEnd ? next : keyframe;
+        int64_t delay = 0;
+        if(reference->pts != AV_NOPTS_VALUE && reference->dts != AV_NOPTS_VALUE){
+            delay = av_rescale_q(reference->pts - reference->dts, inStream->time_base, AV_TIME_BASE_Q);
+        }
+        SmartCut_Encode(inIndex, decodeList, FFMAX(begin, rangeBegin), FFMIN(gopEnd, rangeEnd), delay);
+    }
+    smartCut->isPreviousCopied = isCopied;
+
+    //STEP::下一个关键帧和它的前导帧成为当前GOP的开头
+    //STEP::The next keyframe and its leading pictures become the start of the current GOP
+    for(size_t i=0;i<smartCut->gopList.size();i++){
+        av_packet_free(&smartCut->gopList[i]);
+    }
+    smartCut->gopList.swap(smartCut->nextList);
+    smartCut->nextList.clear();
+}
+
+void SmartCut_Packet(unsigned int inIndex, AVPacket *packet){
+    //STEP::收到下一个关键帧后继续缓存它的前导帧，直到第一个pts不小于它的数据包或再下一个关键帧，再处理当前GOP
+    //第一个关键帧之前的数据包无法解码，丢弃
+    //STEP::After the next keyframe arrives, keep buffering its leading pictures until the first packet whose pts is not before it or another keyframe, then handle the current GOP
+    //Packets before the first keyframe can not be decoded and are dropped
+    SmartCut *smartCut = streamContextMapping[inIndex].smartCut;
+    AVStream *inStream = inFileHandle->streams[inIndex];
+    bool isKeyframe = packet->flags & AV_PKT_FLAG_KEY;
+    if(!smartCut->nextList.empty()){
+        int64_t nextBegin = Range_Time(inStream, smartCut->nextList[0]);
+        int64_t time = Range_Time(inStream, packet);
+        if(isKeyframe || time == AV_NOPTS_VALUE || nextBegin == AV_NOPTS_VALUE || time >= nextBegin){
+            SmartCut_Gop(inIndex);
+        }
+    }
+    if(!isKeyframe && smartCut->gopList.empty()){
+        av_packet_unref(packet);
+        return;
+    }
+    AVPacket *gopPacket = av_packet_alloc();
+    if(!gopPacket){
+        termination("Could not allocate AVPacket.");
+    }
+    av_packet_move_ref(gopPacket, packet);
+    if(!smartCut->nextList.empty() || (isKeyframe && !smartCut->gopList.empty())){
+        smartCut->nextList.push_back(gopPacket);
+    } else {
+        smartCut->gopList.push_back(gopPacket);
     }
 }
 
-void Step_CreateOutFile(){
-    //STEP::创建输出文件句柄outFileHandle
-    //STEP::Creates an output file handle, outFileHandle.
-    ret = avformat_alloc_output_context2(&outFileHandle, NULL, NULL, outFilePath);
-    if(ret<0){
-        termination("Could not create output handle.");
+int64_t Latency_SourceTime(int64_t timestamp, AVRational timeBase){
+    //输出的时间戳已平移到时间范围的起点，换算回输入时间轴（微秒）
+    //Output timestamps have been shifted to the start of the time range, convert them back to the input timeline (microseconds)
+    return av_rescale_q(timestamp, timeBase, AV_TIME_BASE_Q) + (isRange ? rangeBegin : 0);
+}
+
+void Latency_Input(AVStream *inStream, AVPacket *packet){
+    //STEP::记录输入时间轴与单调时钟的偏移，取最早的到达时刻，连接时服务器突发发送的缓存GOP不会让偏移偏大
+    //STEP::Record the offset between the input timeline and the monotonic clock, the earliest arrival is used, so a cached GOP burst by the server on connect does not inflate it
+    if(!isLowLatency){
+        return;
+    }
+    int64_t timestamp = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    if(timestamp == AV_NOPTS_VALUE){
+        return;
+    }
+    int64_t base = av_gettime_relative() - av_rescale_q(timestamp, inStream->time_base, AV_TIME_BASE_Q);
+    if(latency.base == AV_NOPTS_VALUE || base < latency.base){
+        latency.base = base;
     }
+}
 
-    //设置输出的格式，如下设置等于ffmpeg ... -f flv rtmp://xxx
-    //Set the format of the output, the following settings are equal to ffmpeg ... -f flv rtmp://xxx
-    //avformat_alloc_output_context2(&outFileHandle, NULL, "flv", outFilePath);
+void Latency_Output(int64_t pts, AVRational timeBase){
+    //STEP::数据包写出后记录延迟，即写出时刻减去其时间戳对应的到达时刻；pts需在写出前取得，写出后数据包已被清空
+    //STEP::Record the latency after a packet is written, the write time minus the arrival time its timestamp maps to; pts has to be taken before writing, the packet is blank afterwards
+    if(!isLowLatency || latency.base == AV_NOPTS_VALUE || pts == AV_NOPTS_VALUE){
+        return;
+    }
+    int64_t cost = av_gettime_relative() - latency.base - Latency_SourceTime(pts, timeBase);
+    Histogram_Add(&latency.histogram, cost);
+    latency.max = FFMAX(latency.max, cost);
+    if(cost > latencyBudget){
+        latency.overCount++;
+    }
+}
 
-    //STEP::根据源轨道信息创建输出文件的音视频轨道
-    //由于仅做转封装是无法改变音视频数据的，所以轨道信息只能复制
-    //STEP::Create audio/video tracks for output files based on source track information
-    //Since it is not possible to change the audio and video data by only doing remuxing, the track information can only be copied
-    unsigned int outStreamIndex = 0;
-    for(unsigned int i = 0; i < streamContextLength; i++) {
-        AVStream *inStream = inFileHandle->streams[i];
-        if (streamContextMapping[i].type != AVMEDIA_TYPE_AUDIO &&                                  //过滤除video、audio、subtitle以外的轨道，Filter tracks except video, audio, subtitle
-            streamContextMapping[i].type != AVMEDIA_TYPE_VIDEO &&
-            streamContextMapping[i].type != AVMEDIA_TYPE_SUBTITLE) {
-                streamContextMapping[i].outIndex = -1;
-                continue;
+void Latency_Degrade(bool isDegraded){
+    //STEP::切换降低质量状态：解码器跳过环路滤波，缩放器在下一帧按新的算法重建
+    //libx265打开后不能修改参数，所以降低的是解码和缩放的开销
+    //STEP::Switch the lowered quality state: decoders skip the loop filter, scalers are rebuilt with the new algorithm on the next frame
+    //libx265 can not be reconfigured after opening, so the cost saved is in decoding and scaling
+    latency.isDegraded = isDegraded;
+    for(int i=0;i<streamContextLength;i++){
+        if(streamContextMapping[i].type == AVMEDIA_TYPE_VIDEO && streamContextMapping[i].decoder){
+            streamContextMapping[i].decoder->skip_loop_filter = isDegraded ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
         }
+    }
+    std::cout<<(isDegraded ? "behind realtime, lower quality" : "caught up, restore quality")<<std::endl;
+}
 
-        AVStream *outStream = avformat_new_stream(outFileHandle, NULL);                            //创建输出的轨道，Creating the output track
-        if(streamContextMapping[i].encoder){                                                       //尝试从编码器复制输出轨道信息，Trying to copy the output track information from the encoder
-            ret = avcodec_parameters_from_context(outStream->codecpar, streamContextMapping[i].encoder);
-        }else{
-            ret = avcodec_parameters_copy(outStream->codecpar, inStream->codecpar);                //复制源轨道的信息到输出轨道，Copying information from the source track to the output track
+bool Latency_Frame(unsigned int inIndex, AVFrame *frame){
+    //STEP::视频帧送入编码器前检查落后于实时的程度，超过预算的3/4时按策略处理；返回false表示丢弃
+    //STEP::Check how far a video frame is behind realtime before encoding, apply the policy beyond 3/4 of the budget; false means drop
+    if(!isLowLatency || latePolicy == LATE_NONE || streamContextMapping[inIndex].type != AVMEDIA_TYPE_VIDEO ||
+       latency.base == AV_NOPTS_VALUE || frame->pts == AV_NOPTS_VALUE){
+        return true;
+    }
+    int64_t lateness = av_gettime_relative() - latency.base - Latency_SourceTime(frame->pts, AV_TIME_BASE_Q);
+    bool isLate = lateness > latencyBudget * 3 / 4;
+    if(latePolicy == LATE_DROP){
+        if(isLate && !latency.isPreviousDropped){
+            latency.isPreviousDropped = true;
+            latency.dropCount++;
+            return false;
         }
-        if(ret<0){
-            termination("Could not copy codec parameters.");
+        latency.isPreviousDropped = false;
+    } else if(latePolicy == LATE_QUALITY){
+        if(isLate && !latency.isDegraded){
+            Latency_Degrade(true);
+        } else if(latency.isDegraded && lateness < latencyBudget / 2){
+            Latency_Degrade(false);
         }
-        outStream->codecpar->codec_tag = 0;
-        streamContextMapping[i].outIndex = outStreamIndex++;                                       //记录源文件轨道序号与输出文件轨道序号的对应关系，Record the correspondence between the track number of the source file and the track number of the output file.
     }
+    return true;
+}
 
-    //STEP::打开输出文件
-    //STEP::Open the output file
-    ret = avio_open(&outFileHandle->pb, outFilePath, AVIO_FLAG_WRITE);
-    if(ret<0){
-        termination("Could not open out file.");
+AVFrame *Step_Operation_Scale(unsigned int inIndex, AVFrame *frame){
+    //STEP::分辨率、像素格式与编码器一致时无需转换
+    //STEP::No conversion is needed when the resolution and pixel format match the encoder
+    StreamContext *context = &streamContextMapping[inIndex];
+    AVCodecContext *encoder = context->encoder;
+    if(context->type != AVMEDIA_TYPE_VIDEO ||
+       (frame->width == encoder->width && frame->height == encoder->height && frame->format == encoder->pix_fmt)){
+        return frame;
     }
 
-    //STEP::写入文件头信息
-    //STEP::Write file header information
-    ret = avformat_write_header(outFileHandle, NULL);
-    if(ret<0){
-        termination("Could not write stream header to out file.");
+    //STEP::缓存SwsContext，源帧的宽高、像素格式变化时才重新创建
+    //由libswscale把每帧切成水平条带，在其内部线程池中并行转换
+    //STEP::Cache the SwsContext, it is only recreated when the width, height or pixel format of the source frame changes
+    //libswscale splits every frame into horizontal slices and converts them in parallel in its internal thread pool
+    int scaleFlags = latency.isDegraded ? SWS_FAST_BILINEAR : SWS_BICUBIC;
+    if(!context->scaler || context->scaleWidth != frame->width || context->scaleHeight != frame->height || context->scaleFormat != frame->format ||
+       context->scaleFlags != scaleFlags){
+        sws_freeContext(context->scaler);
+        context->scaler = sws_alloc_context();
+        if(!context->scaler){
+            termination("Could not allocate scaler.");
+        }
+        av_opt_set_int(context->scaler, "srcw", frame->width, 0);
+        av_opt_set_int(context->scaler, "srch", frame->height, 0);
+        av_opt_set_int(context->scaler, "src_format", frame->format, 0);
+        av_opt_set_int(context->scaler, "dstw", encoder->width, 0);
+        av_opt_set_int(context->scaler, "dsth", encoder->height, 0);
+        av_opt_set_int(context->scaler, "dst_format", encoder->pix_fmt, 0);
+        av_opt_set_int(context->scaler, "sws_flags", scaleFlags, 0);
+        av_opt_set_int(context->scaler, "threads", context->decodeThreads, 0);
+        ret = sws_init_context(context->scaler, NULL, NULL);
+        if(ret < 0){
+            termination("Could not initialize scaler.");
+        }
+        context->scaleWidth = frame->width;
+        context->scaleHeight = frame->height;
+        context->scaleFormat = frame->format;
+        context->scaleFlags = scaleFlags;
     }
 
-    // 设置输出封装参数的方式，如hls的hls_time参数
-    // The way to set the output muxing parameters, such as the hls_time parameter of hls
-    // AVDictionary* optionsDict = NULL;
-    // av_dict_set(&optionsDict, "hls_time", "2", 0);
-    // avformat_write_header(outFileHandle, &optionsDict);
+    //STEP::目标帧的内存从帧缓冲池获取
+    //STEP::The memory of the target frame comes from the frame buffer pool
+    av_frame_unref(context->scaleFrame);
+    context->scaleFrame->format = encoder->pix_fmt;
+    context->scaleFrame->width = encoder->width;
+    context->scaleFrame->height = encoder->height;
+    ret = FramePool_GetVideoBuffer(NULL, context->scaleFrame);
+    if(ret < 0){
+        termination("Could not allocate scaled frame.");
+    }
+    ret = sws_scale_frame(context->scaler, context->scaleFrame, frame);
+    if(ret < 0){
+        termination("Could not scale frame.");
+    }
+    av_frame_copy_props(context->scaleFrame, frame);
+    return context->scaleFrame;
 }
 
-void Step_OpenDecoder(){
-    //STEP::初始化轨道上下文列表
-    //STEP::Initialize stream context list
-    if(streamContextLength == 0){
-        return;
-    }
+void Step_Operation_Encode(unsigned int inIndex, AVFrame *frame, AVPacket *packet){
+    StreamContext *context = &streamContextMapping[inIndex];
+    AVStream *outStream = outFileHandle->streams[context->outIndex];
 
-    //STEP::根据输入文件的流信息创建解码器
-    //STEP::Create decoders based on the stream information of the input file
-    for(int i=0;i<streamContextLength;i++){
-        AVStream *inStream = inFileHandle->streams[i];
-        if (inStream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO &&                             //过滤除video、audio以外的轨道，Filter tracks except video, audio
-            inStream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO ) {
-            continue;
-        }
+    //STEP::将原始帧转换为编码器需要的分辨率、格式后发送到编码器进行编码（异步），frame为NULL表示清理编码器
+    //STEP::Convert the original frame to the resolution and format the encoder needs, then send it to the encoder for encode (async), NULL frame means cleaning up the encoder
+    AVFrame *encodeFrame = frame ? Step_Operation_Scale(inIndex, frame) : NULL;
 
-        const AVCodec *decoderInfo = avcodec_find_decoder(inStream->codecpar->codec_id);       //根据输入文件的流信息寻找解码器，Find the decoder based on the stream information of the input file
-        if(!decoderInfo){
-            termination("Could not find decoder for stream.");
-        }
+    //STEP::视频帧的类型由编码器决定，不沿用解码器给出的源帧类型，只有预分析的场景切换处强制为关键帧
+    //STEP::The type of a video frame is decided by the encoder instead of keeping the source frame type from the decoder, only the scene cuts of the pre-analysis are forced to keyframes
+    if(encodeFrame && context->type == AVMEDIA_TYPE_VIDEO){
+        encodeFrame->pict_type = PreAnalysis_IsCut(encodeFrame->pts) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    }
+    int64_t stageTime = Metrics_Now();
+    ret = avcodec_send_frame(context->encoder, encodeFrame);
+    if(ret<0){
+        termination("Could not encoding.");
+    }
+    Metrics_Record(inIndex, STAGE_ENCODE, stageTime);
+    if(encodeFrame){
+        Metrics_InFlight(inIndex, INFLIGHT_ENCODE, 1);
+    }
+    if(frame){
+        av_frame_unref(frame);
+    }
+    if(encodeFrame && encodeFrame != frame){
+        av_frame_unref(encodeFrame);
+    }
 
-        AVCodecContext *decoder = avcodec_alloc_context3(decoderInfo);                          //创建解码器上下文，Create decoder context
-        if(!decoder){
-            termination("Could not allocate decoder context.");
+    while(1){
+        //STEP::尝试从编码器取出编码后的数据包
+        //STEP::Try to get the encoded packet
+        stageTime = Metrics_Now();
+        ret = avcodec_receive_packet(context->encoder, packet);
+        Metrics_Record(inIndex, STAGE_ENCODE_RECEIVE, stageTime);
+        if (ret == AVERROR(EAGAIN)){
+            break;
+        } else if (ret == AVERROR_EOF){
+            context->isEncodeEnd = true;
+            break;
+        } else if (ret < 0) {
+            termination("Could not receive encoding.");
         }
+        Metrics_InFlight(inIndex, INFLIGHT_ENCODE, -1);
 
-        ret = avcodec_parameters_to_context(decoder, inStream->codecpar);                       //从流信息拷贝参数到解码器上下文，Copy parameters from the stream information to the decoder context
-        if(ret<0){
-            termination("Could not copy parameters from the stream information to the decoder context.");
+        //续转后预热帧的数据包已在文件中，丢弃
+        //The packet of the priming frame after resuming is already in the file, drop it
+        if(context->isAudioPreroll){
+            context->isAudioPreroll = false;
+            av_packet_unref(packet);
+            continue;
         }
 
-        if(inStream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO){
-            decoder->framerate = av_guess_frame_rate(inFileHandle, inStream, NULL);
-        }
+        //将轨道序号修改为对应的输出文件轨道序号
+        //Change the track number to the corresponding output file track number.
+        packet->stream_index = context->outIndex;
 
-        decoder->time_base = AV_TIME_BASE_Q;                                                    //固定TimeBase为1/1000000，能防止能多奇怪问题，Fixed TimeBase is 1/1000000，can prevent strange problems
+        //根据输出流的timebase换算packet的相关时间戳
+        //Converting the packet's associated timestamp from the encoder's timebase
+        av_packet_rescale_ts(packet, context->encoder->time_base, outStream->time_base);
 
-        AVDictionary *optionsDict = NULL;
-        //av_dict_set(&optionsDict, "threads", "2", 0);                                         //可设置解码器的一些参数，如处理线程数，Set some parameters of the decoder, such as the number of processing threads
-        ret = avcodec_open2(decoder, decoderInfo, &optionsDict);
-        if(ret<0){
-            termination("Could not open decoder.");
+        //续转时丢弃已写入的数据包，到达检查点间隔时提交
+        //Drop packets already written when resuming, commit when the checkpoint interval is reached
+        if(!Checkpoint_Packet(packet)){
+            av_packet_unref(packet);
+            continue;
         }
 
-        decoder->time_base = AV_TIME_BASE_Q;                                                    //一些编码器会修改timebase，这里做一次覆盖设置，Some encoders modify timebase, do an override setting here
-        streamContextMapping[i].decoder = decoder;
-        streamContextMapping[i].type = inStream->codecpar->codec_type;
+        //封装packet，并写入输出文件
+        //Mux the packet and write to the output file
+        int64_t pts = packet->pts;
+        stageTime = Metrics_Now();
+        ret = av_interleaved_write_frame(outFileHandle, packet);
+        if (ret < 0) {
+            termination("Could not mux packet.");   
+        }
+        Metrics_Record(inIndex, STAGE_WRITE, stageTime);
+        Latency_Output(pts, outStream->time_base);
+        av_packet_unref(packet);
     }
 }
 
-void Step_OpenEncoder(){
-    //STEP::根据解码器创建编码器，因为单纯的转编码无法改变音视频基础参数，如分辨率、采样率等，所以这些参数只能复制
-    //STEP::Create encoders based on decoders, since it is not possible to change the audio and video data by only doing transcoding, the basic parameters such as resolution, sample rate, etc. can only be copied
-    for(int i=0;i<streamContextLength;i++){
-        if(!streamContextMapping[i].decoder){
-            continue;
-        }
+void Step_Operation_Resample(unsigned int inIndex, AVFrame *frame, AVPacket *packet){
+    StreamContext *context = &streamContextMapping[inIndex];
+    AVCodecContext *encoder = context->encoder;
 
-        const AVCodec *encoderInfo = NULL;
-        if (streamContextMapping[i].type == AVMEDIA_TYPE_VIDEO){
-            encoderInfo = avcodec_find_encoder(videoCodecID);                                  //根据目标编码器ID寻找编码器，Find the encoder based on the target encoder ID
-        } else if (streamContextMapping[i].type == AVMEDIA_TYPE_AUDIO ) {
-            encoderInfo = avcodec_find_encoder(audioCodecID);
-        }           
-        if(!encoderInfo){
-            termination("Could not find encoder for stream.");
+    //STEP::一次完成采样格式、采样率、声道布局的转换，结果写入FIFO，frame为NULL表示取出重采样器中剩余的数据
+    //STEP::Convert the sample format, sample rate and channel layout in one pass and write the result to the FIFO, NULL frame means taking out the remaining data of the resampler
+    if(frame && context->audioPts == AV_NOPTS_VALUE && frame->pts != AV_NOPTS_VALUE){
+        context->audioPts = av_rescale_q(frame->pts, context->decoder->time_base, av_make_q(1, encoder->sample_rate));
+        context->audioResume = Checkpoint_AudioStart(inIndex);
+    }
+    int inSamples = frame ? frame->nb_samples : 0;
+    int outSamples = swr_get_out_samples(context->resampler, inSamples);
+    if(outSamples > context->resampleCapacity){
+        if(context->resampleData){
+            av_freep(&context->resampleData[0]);
         }
-
-        AVCodecContext *encoder = avcodec_alloc_context3(encoderInfo);                          //创建编码器上下文，Create encoder context
-        if(!encoder){
-            termination("Could not allocate encoder context.");
+        av_freep(&context->resampleData);
+        ret = av_samples_alloc_array_and_samples(&context->resampleData, NULL, encoder->ch_layout.nb_channels, outSamples, encoder->sample_fmt, 0);
+        if(ret < 0){
+            termination("Could not allocate resample buffer.");
         }
-   
-        //设置编码器一些必要参数，由于单纯的转编码无法改这些参数，所以一般从解码器的信息中复制
-        //Set necessary parameters of the encoder, since it is not possible to change these parameters by transcoding, the parameters usually copied from the decoder
-        AVCodecContext *decoder = streamContextMapping[i].decoder;
-        if (streamContextMapping[i].type == AVMEDIA_TYPE_VIDEO){
-            encoder->height = decoder->height;
-            encoder->width = decoder->width;
-            encoder->framerate = decoder->framerate;
-            encoder->sample_aspect_ratio = decoder->sample_aspect_ratio;
-            if (encoderInfo->pix_fmts){
-                encoder->pix_fmt = encoderInfo->pix_fmts[0];
-            }else
-                encoder->pix_fmt = decoder->pix_fmt;
+        context->resampleCapacity = outSamples;
+    }
+    outSamples = swr_convert(context->resampler, context->resampleData, context->resampleCapacity,
+                             frame ? (const uint8_t **)frame->extended_data : NULL, inSamples);
+    if(outSamples < 0){
+        termination("Could not resample.");
+    }
+    if(frame){
+        av_frame_unref(frame);
+    }
+    if(outSamples > 0 && av_audio_fifo_write(context->audioFifo, (void **)context->resampleData, outSamples) < outSamples){
+        termination("Could not write audio fifo.");
+    }
 
-            //可以设置与编码相关的参数，如gop、去除b帧、码率等
-            //You can set and related parameters such as gop, removing b frames, and bitrate
-            // encoder->gop_size = 40;
-            // encoder->max_b_frames = 0;
-            //encoder->bit_rate = 2000000;
-        } else if (streamContextMapping[i].type == AVMEDIA_TYPE_AUDIO){
-            encoder->sample_rate = decoder->sample_rate;
-            av_channel_layout_copy(&encoder->ch_layout, &decoder->ch_layout);
-            encoder->channels = av_get_channel_layout_nb_channels(encoder->channel_layout);
-            if(encoderInfo->sample_fmts)
-                encoder->sample_fmt = encoderInfo->sample_fmts[0];
-            else
-                encoder->sample_fmt = decoder->sample_fmt;
+    //STEP::续转时丢弃起始采样位置之前的采样，刚好对齐时编码的第一帧是预热帧；输入的音频晚于起始位置时不预热，直接编码
+    //STEP::When resuming, drain the samples before the start position, when they line up exactly the first encoded frame is the priming frame; when the input audio starts after it, encode directly without priming
+    if(context->audioResume != AV_NOPTS_VALUE && context->audioPts != AV_NOPTS_VALUE){
+        int64_t skip = FFMIN(context->audioResume - context->audioPts, (int64_t)av_audio_fifo_size(context->audioFifo));
+        if(skip > 0){
+            av_audio_fifo_drain(context->audioFifo, (int)skip);
+            context->audioPts += skip;
         }
+        if(context->audioPts >= context->audioResume){
+            context->isAudioPreroll = context->audioPts == context->audioResume;
+            context->audioResume = AV_NOPTS_VALUE;
+        }
+    }
 
-        encoder->time_base = AV_TIME_BASE_Q;                                                    //固定TimeBase为1/1000000，能防止能多奇怪问题，Fixed TimeBase is 1/1000000，can prevent strange problems
-
-        AVDictionary *optionsDict = NULL;
-        //av_dict_set(&optionsDict, "threads", "2", 0);                                         //可设置编码器的一些参数，如处理线程数，Set some parameters of the encoder, such as the number of processing threads
-        ret = avcodec_open2(encoder, encoderInfo, &optionsDict);
-        if(ret<0){
-            termination("Could not open encoder.");
+    //STEP::按编码器的frame_size从FIFO取出采样组成新的帧，零散的小帧会在这里合并，不足一帧的留到下次
+    //结束时剩余的采样组成最后一帧，编码器不支持较短的最后一帧时补静音
+    //STEP::Take samples from the FIFO in frames of the encoder's frame_size, small scattered frames are merged here, the remainder waits for the next time
+    //At the end the remaining samples form the last frame, padded with silence if the encoder does not support a shorter last frame
+    int frameSize = encoder->frame_size > 0 ? encoder->frame_size : 1024;
+    while(av_audio_fifo_size(context->audioFifo) >= frameSize || (!frame && av_audio_fifo_size(context->audioFifo) > 0)){
+        int samples = FFMIN(av_audio_fifo_size(context->audioFifo), frameSize);
+        AVFrame *audioFrame = context->audioFrame;
+        audioFrame->nb_samples = samples;
+        if(samples < frameSize && encoder->frame_size > 0 &&
+           !(encoder->codec->capabilities & (AV_CODEC_CAP_SMALL_LAST_FRAME | AV_CODEC_CAP_VARIABLE_FRAME_SIZE))){
+            audioFrame->nb_samples = frameSize;
+        }
+        audioFrame->format = encoder->sample_fmt;
+        audioFrame->sample_rate = encoder->sample_rate;
+        ret = av_channel_layout_copy(&audioFrame->ch_layout, &encoder->ch_layout);
+        if(ret < 0 || FramePool_GetAudioBuffer(audioFrame) < 0){
+            termination("Could not allocate audio frame.");
+        }
+        if(audioFrame->nb_samples > samples){
+            av_samples_set_silence(audioFrame->extended_data, samples, audioFrame->nb_samples - samples, encoder->ch_layout.nb_channels, encoder->sample_fmt);
+        }
+        if(av_audio_fifo_read(context->audioFifo, (void **)audioFrame->extended_data, samples) < samples){
+            termination("Could not read audio fifo.");
         }
 
-        encoder->time_base = AV_TIME_BASE_Q;                                                    //一些编码器会修改timebase，这里做一次覆盖设置，Some encoders modify timebase, do an override setting here
-        streamContextMapping[i].encoder = encoder;
+        //根据已输出的采样数计算时间戳，保证音频时间戳连续
+        //Calculate the timestamp from the number of samples output, to keep the audio timestamps continuous
+        audioFrame->pts = av_rescale_q(context->audioPts, av_make_q(1, encoder->sample_rate), encoder->time_base);
+        context->audioPts += samples;
+        Step_Operation_Encode(inIndex, audioFrame, packet);
+    }
+}
+
+void Step_Operation_Frame(unsigned int inIndex, AVFrame *frame, AVPacket *packet){
+    //音频经过重采样和FIFO重新切分后再编码，视频直接进入编码环节
+    //Audio is resampled and re-chunked through the FIFO before encoding, video goes directly to the encoding stage
+    if(streamContextMapping[inIndex].resampler){
+        Step_Operation_Resample(inIndex, frame, packet);
+    } else if(frame){
+        Step_Operation_Encode(inIndex, frame, packet);
     }
 }
 
 void Step_Operation_TransCode(AVPacket *packet, AVFrame *frame){
     unsigned int inIndex = packet->stream_index;
-    unsigned int outIndex = streamContextMapping[inIndex].outIndex;
     AVStream *inStream = inFileHandle->streams[inIndex];
-    AVStream *outStream = outFileHandle->streams[outIndex];
 
     //根据编码器的timebase换算packet的相关时间戳
     //Converting the packet's associated timestamp from the encoder's timebase
@@ -284,16 +2380,21 @@ void Step_Operation_TransCode(AVPacket *packet, AVFrame *frame){
 
     //STEP::将数据包发送到解码器（异步）
     //STEP::Send the data packet to the decoder for decode (async)
+    int64_t stageTime = Metrics_Now();
     ret = avcodec_send_packet(streamContextMapping[inIndex].decoder, packet);
     if(ret<0){
         termination("Could not decoding.");
     }
+    Metrics_Record(inIndex, STAGE_DECODE, stageTime);
+    Metrics_InFlight(inIndex, INFLIGHT_DECODE, 1);
     av_packet_unref(packet);
 
     while(1){
         //STEP::尝试从解码器取出原始帧
         //STEP::Try to get the original frame
+        stageTime = Metrics_Now();
         ret = avcodec_receive_frame(streamContextMapping[inIndex].decoder, frame);
+        Metrics_Record(inIndex, STAGE_DECODE_RECEIVE, stageTime);
         if(ret == AVERROR(EAGAIN)){
             break;
         } else if (ret == AVERROR_EOF){
@@ -302,51 +2403,50 @@ void Step_Operation_TransCode(AVPacket *packet, AVFrame *frame){
         } else if (ret < 0){
             termination("Could not receive decoding.");
         }
+        Metrics_InFlight(inIndex, INFLIGHT_DECODE, -1);
 
-        //STEP::将原始帧发送到编码器进行编码（异步）
-        //STEP::Send the original frame to the encoder for encode (async)
-        ret = avcodec_send_frame(streamContextMapping[inIndex].encoder, frame);
-        if(ret<0){
-            termination("Could not encoding.");
+        //时间范围外的帧丢弃，低延迟模式下落后的视频帧按策略丢弃，续转时续转点之前的视频帧丢弃，去重时重复的视频帧丢弃
+        //Frames outside the time range are dropped, late video frames are dropped by the policy in low-latency mode, video frames before the resume time are dropped when resuming, duplicate video frames are dropped when deduplicating
+        if(!Range_Frame(frame) || !Latency_Frame(inIndex, frame) || !Checkpoint_Frame(inIndex, frame) || !Dedup_Frame(inIndex, frame)){
+            av_frame_unref(frame);
+            continue;
         }
-        av_frame_unref(frame);
-
-        while(1){
-            //STEP::尝试从编码器取出编码后的数据包
-            //STEP::Try to get the encoded packet
-            ret = avcodec_receive_packet(streamContextMapping[inIndex].encoder, packet);
-            if (ret == AVERROR(EAGAIN)){
-                break;
-            } else if (ret == AVERROR_EOF){
-                streamContextMapping[inIndex].isEncodeEnd = true;
-                break;
-            } else if (ret < 0) {
-                termination("Could not receive encoding.");
-            }
-
-            //将轨道序号修改为对应的输出文件轨道序号
-            //Change the track number to the corresponding output file track number.
-            packet->stream_index = outIndex;
 
-            //根据输出流的timebase换算packet的相关时间戳
-            //Converting the packet's associated timestamp from the encoder's timebase
-            av_packet_rescale_ts(packet, streamContextMapping[inIndex].encoder->time_base, outStream->time_base);
+        //STEP::将原始帧发送到编码器进行编码，并封装编码后的数据包
+        //STEP::Send the original frame to the encoder for encode, and mux the encoded packets
+        Step_Operation_Frame(inIndex, frame, packet);
+    }
+}
 
-            //封装packet，并写入输出文件
-            //Mux the packet and write to the output file
-            ret = av_interleaved_write_frame(outFileHandle, packet);
-            if (ret < 0) {
-                termination("Could not mux packet.");   
-            }
-            av_packet_unref(packet);
-        }
+void Dedup_End(unsigned int inIndex, AVPacket *packet){
+    //STEP::最后一个帧是重复帧时把它送入编码器，输出的时长与源视频一致
+    //STEP::When the last frame was a duplicate, send it to the encoder so the duration of the output matches the source
+    Dedup *dedup = streamContextMapping[inIndex].dedup;
+    if(dedup && dedup->lastFrame->buf[0]){
+        Step_Operation_Frame(inIndex, dedup->lastFrame, packet);
+    }
+    if(dedup){
+        std::cout<<"stream "<<inIndex<<": dedup dropped "<<dedup->dropCount<<" of "<<dedup->frameCount<<" frames"<<std::endl;
     }
 }
 
 void Step_Operation_End(AVPacket *packet, AVFrame *frame){
     for(unsigned int i = 0; i < streamContextLength; i++) {
         unsigned int inIndex = i;
-        unsigned int outIndex = streamContextMapping[inIndex].outIndex;
+
+        //STEP::智能剪切处理剩下的GOP，已缓存下一个关键帧时先处理当前GOP，再处理最后一个GOP
+        //STEP::Smart cut handles the remaining GOPs, the current one first when the next keyframe is buffered, then the last one
+        SmartCut *smartCut = streamContextMapping[inIndex].smartCut;
+        if(smartCut){
+            while(!smartCut->gopList.empty()){
+                SmartCut_Gop(inIndex);
+            }
+            std::cout<<"stream "<<i<<": smart cut copied "<<smartCut->copyCount<<" GOPs, re-encoded "<<smartCut->encodeCount<<" GOPs"<<std::endl;
+        }
+
+        if(!streamContextMapping[inIndex].decoder || !streamContextMapping[inIndex].encoder){
+            continue;
+        }
 
         //STEP::清理解码器中的数据
         //STEP::Clean up the decoder
@@ -365,49 +2465,31 @@ void Step_Operation_End(AVPacket *packet, AVFrame *frame){
                 } else if (ret < 0) {
                     termination("Could not receive decoding.");
                 }
-
-                //STEP::将原始帧发送到编码器进行编码（异步）
-                //STEP::Send the original frame to the encoder for encode (async)
-                ret = avcodec_send_frame(streamContextMapping[inIndex].encoder, frame);
-                if(ret<0){
-                    termination("Could not encoding.");
+                Metrics_InFlight(inIndex, INFLIGHT_DECODE, -1);
+                if(!Range_Frame(frame) || !Checkpoint_Frame(inIndex, frame) || !Dedup_Frame(inIndex, frame)){
+                    av_frame_unref(frame);
+                    continue;
                 }
-                av_frame_unref(frame);
+
+                //STEP::将原始帧发送到编码器进行编码，并封装编码后的数据包
+                //STEP::Send the original frame to the encoder for encode, and mux the encoded packets
+                Step_Operation_Frame(inIndex, frame, packet);
             }
         }
 
+        //STEP::送入去重时最后一个被丢弃的帧，取出重采样器和FIFO中剩余的音频
+        //STEP::Send the last frame dropped by dedup, take out the remaining audio in the resampler and FIFO
+        if(!streamContextMapping[i].isEncodeEnd){
+            Dedup_End(inIndex, packet);
+            Step_Operation_Frame(inIndex, NULL, packet);
+        }
+
         //STEP::清理编码器的数据
         //STEP::Clean up the encoder
         if(!streamContextMapping[i].isEncodeEnd){
             //向编码器发送NULL，告诉编码器无新的帧数据
             //Send NULL to the encoder to tell it there is no new frame
-            avcodec_send_frame(streamContextMapping[inIndex].encoder, NULL);
-
-            while(1){
-                ret = avcodec_receive_packet(streamContextMapping[inIndex].encoder, packet);
-                if (ret == AVERROR(EAGAIN)){                                                    //编码器还有未处理完的数据，Encoder indicates that it has not processed all the data
-                    continue;
-                } else if (ret == AVERROR_EOF){                                                 //编码器处理所有数据的标识，Encoder indicates that it has processed all the data
-                    streamContextMapping[i].isEncodeEnd = true;
-                    break;
-                } else if (ret < 0) {
-                    termination("Could not receive encoding.");
-                }
-
-                //将轨道序号修改为对应的输出文件轨道序号
-                //Change the track number to the corresponding output file track number.
-                packet->stream_index = outIndex;
-
-                av_packet_rescale_ts(packet, streamContextMapping[inIndex].encoder->time_base, outFileHandle->streams[outIndex]->time_base);
-
-                //封装packet，并写入输出文件
-                //Mux the packet and write to the output file
-                ret = av_interleaved_write_frame(outFileHandle, packet);
-                if (ret < 0) {
-                    termination("Could not mux packet.");   
-                }
-                av_packet_unref(packet);
-            }
+            Step_Operation_Encode(inIndex, NULL, packet);
         }
     }
 }
@@ -421,17 +2503,43 @@ void Step_Operation(){
     if (!frame) {
         termination("Could not allocate AVFrame.");   
     }
+    if(!Metrics_Init(metricsFormat, metricsName, metricsFilePath, metricsUdpAddress, metricsInterval, stageName, STAGE_LENGTH, inFileHandle->nb_streams, Metrics_Extra)){
+        termination("Could not initialize metrics.");
+    }
+    if(metricsFormat != METRICS_NONE){
+        inFlightList = (int64_t *)av_calloc(inFileHandle->nb_streams * INFLIGHT_LENGTH, sizeof(*inFlightList));
+        if(!inFlightList){
+            termination("Could not allocate metrics.");
+        }
+    }
 
     //STEP::av_read_frame会将源文件解封装，并将数据放到packet
     //数据包一般是按dts（解码时间戳）顺序排列的
     //STEP::av_read_frame unpacks the source file and puts the data into packet
     //The packets are generally in dts (decoding timestamp) order
+    int64_t stageTime = Metrics_Now();
     while (av_read_frame(inFileHandle, packet) >= 0) {
+        int inIndex = packet->stream_index;
+        Metrics_Record(inIndex, STAGE_READ, stageTime);
+        Metrics_Progress(inFileHandle->streams[inIndex], packet);
+        Latency_Input(inFileHandle->streams[inIndex], packet);
 
         //根据之前的关联关系，判断是否舍弃此packet
         //Determine whether to discard this packet based on previous associations
         if(streamContextMapping[packet->stream_index].outIndex < 0){
             av_packet_unref(packet);
+            stageTime = Metrics_Now();
+            continue;
+        }
+
+        //STEP::轨道读到rangeEnd后丢弃之后的数据包，所有音视频轨道都读到后停止读取
+        //STEP::After a track reaches rangeEnd its later packets are dropped, reading stops once all audio/video tracks have reached it
+        if(Range_IsEnd(inIndex, packet)){
+            av_packet_unref(packet);
+            if(rangeActiveCount == 0){
+                break;
+            }
+            stageTime = Metrics_Now();
             continue;
         }
 
@@ -440,7 +2548,15 @@ void Step_Operation(){
             //进入转编码流程
             //Enter the transcoding process
             Step_Operation_TransCode(packet, frame);
-        } 
+        }
+        //智能剪切的轨道，按GOP复制或重新编码，smart cut track, copied or re-encoded by GOP
+        else if(streamContextMapping[packet->stream_index].smartCut){
+            SmartCut_Packet(packet->stream_index, packet);
+        }
+        //时间范围外的数据包，packet outside the time range
+        else if(!Range_Packet(inFileHandle->streams[packet->stream_index], packet)){
+            av_packet_unref(packet);
+        }
         //不需要转编码的轨道，no need to transcoding
         else {
             //转换timebase（时间基），一般不同的封装格式下，时间基是不一样的
@@ -453,20 +2569,39 @@ void Step_Operation(){
             //Change the track number to the corresponding output file track number.
             packet->stream_index = streamContextMapping[packet->stream_index].outIndex;
 
-            //封装packet，并写入输出文件
-            //Mux the packet and write to the output file
-            ret = av_interleaved_write_frame(outFileHandle, packet);
-            if (ret < 0) {
-                termination("Could not mux packet.");   
+            //封装packet，并写入输出文件；续转时丢弃已写入的数据包
+            //Mux the packet and write to the output file; packets already written are dropped when resuming
+            if(Checkpoint_Packet(packet)){
+                int64_t pts = packet->pts;
+                stageTime = Metrics_Now();
+                ret = av_interleaved_write_frame(outFileHandle, packet);
+                if (ret < 0) {
+                    termination("Could not mux packet.");   
+                }
+                Metrics_Record(inIndex, STAGE_WRITE, stageTime);
+                Latency_Output(pts, outStream->time_base);
             }
 
             av_packet_unref(packet);
         }
+
+        //STEP::按间隔导出统计
+        //STEP::Export metrics periodically
+        Metrics_Export(outFileHandle, false);
+        stageTime = Metrics_Now();
     }
 
     //文件读取完成，但是编解码器中的数据未必全部处理完毕
     //The reading of the file is complete, but the data in the decoder and encoder may not be completely processed
     Step_Operation_End(packet, frame);
+    Metrics_Export(outFileHandle, true);
+
+    //STEP::输出延迟统计
+    //STEP::Print the latency statistics
+    if(isLowLatency && latency.histogram.count > 0){
+        std::cout<<"latency: average "<<latency.histogram.sum / latency.histogram.count / 1000.0<<"ms, max "<<latency.max / 1000.0<<"ms, budget "<<latencyBudget / 1000.0
+                 <<"ms, over budget "<<latency.overCount<<" packets, dropped "<<latency.dropCount<<" frames"<<std::endl;
+    }
 
     av_packet_free(&packet);
     av_frame_free(&frame);
@@ -484,7 +2619,48 @@ void Step_CloseCodec(){
             avcodec_free_context(&streamContextMapping[i].encoder);
             streamContextMapping[i].encoder = NULL;
         }
+        if(streamContextMapping[i].scaler){
+            sws_freeContext(streamContextMapping[i].scaler);
+            streamContextMapping[i].scaler = NULL;
+        }
+        av_frame_free(&streamContextMapping[i].scaleFrame);
+        swr_free(&streamContextMapping[i].resampler);
+        if(streamContextMapping[i].audioFifo){
+            av_audio_fifo_free(streamContextMapping[i].audioFifo);
+            streamContextMapping[i].audioFifo = NULL;
+        }
+        av_frame_free(&streamContextMapping[i].audioFrame);
+        if(streamContextMapping[i].resampleData){
+            av_freep(&streamContextMapping[i].resampleData[0]);
+        }
+        av_freep(&streamContextMapping[i].resampleData);
+        Dedup *dedup = streamContextMapping[i].dedup;
+        if(dedup){
+            Gray_Free(&dedup->grayScaler);
+            av_frame_free(&dedup->lastFrame);
+            delete dedup;
+            streamContextMapping[i].dedup = NULL;
+        }
+        SmartCut *smartCut = streamContextMapping[i].smartCut;
+        if(smartCut){
+            avcodec_free_context(&smartCut->decoder);
+            for(size_t j=0;j<smartCut->gopList.size();j++){
+                av_packet_free(&smartCut->gopList[j]);
+            }
+            for(size_t j=0;j<smartCut->nextList.size();j++){
+                av_packet_free(&smartCut->nextList[j]);
+            }
+            for(size_t j=0;j<smartCut->previousList.size();j++){
+                av_packet_free(&smartCut->previousList[j]);
+            }
+            delete smartCut;
+            streamContextMapping[i].smartCut = NULL;
+        }
     }
+
+    //STEP::释放帧缓冲池
+    //STEP::Free the frame buffer pool
+    FramePool_Free();
 }
 
 void Step_End(){
@@ -503,9 +2679,19 @@ void Step_End(){
     }
     avformat_free_context(outFileHandle);
 
+    //STEP::输出文件已完整，删除检查点文件
+    //STEP::The output file is complete, remove the checkpoint file
+    Checkpoint_Close();
+
+    //STEP::释放统计
+    //STEP::Free the metrics
+    Metrics_Free();
+    av_freep(&inFlightList);
+
     //STEP::关闭输入文件，并销毁具柄
     //STEP::Close the input file，and destroy the handle
     avformat_close_input(&inFileHandle);
+    Index_Close(&sourceIndex);
 
     //STEP::释放关联表
     //STEP::Free the association table
@@ -517,9 +2703,21 @@ int main(int argc, char *argv[]){
     //STEP::Open input file and get input file information
     Step_OpenInFile();
 
+    //STEP::决定每个轨道复制还是转编码
+    //STEP::Decide copy or transcode for each track
+    Step_CopyPolicy();
+
+    //STEP::按轨道开销分配编解码线程
+    //STEP::Allocate codec threads by the cost of each track
+    Step_ThreadPolicy();
+
     //STEP::初始化解码器
     //STEP::Initialize the decoder
     Step_OpenDecoder();
+
+    //STEP::预分析视频的复杂度和场景切换
+    //STEP::Pre-analyze the complexity and scene cuts of the video
+    Step_PreAnalysis();
     
     //STEP::初始化编码器
     //STEP::Initialize the encoder
@@ -0,0 +1,784 @@
+/*
+ * 视频转编码例子（分段并行），h264转h265例子，按关键帧把输入切成多段，由多个工作进程并行转码视频，最后无需重新编码直接拼接为一个文件
+ * The sample of transcoding video in parallel chunks, h264 to h265 example, split the input at keyframes, worker processes transcode the video chunks in parallel, then stitch them into one file without re-encoding
+ * Depends on FFmpeg 6.0
+ * Wirte by stoprefactoring.com
+*/
+
+#include <iostream>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+extern "C" {
+    #include <libavutil/timestamp.h>
+    #include <libavutil/cpu.h>
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+    #include <libavcodec/codec.h>
+}
+#include "../common/index_format.h"
+
+int ret = 0;
+
+//输入输出文件路径，只支持文件输入，直播流无法按时间分段
+//Input and output file paths, only file input is supported, live streams can not be split by time
+const char *inFilePath  = "../../common/test.mp4";
+const char *outFilePath  = "./out.mp4";
+
+//视频目标编码
+//Video target encoding
+const AVCodecID videoCodecID = AV_CODEC_ID_H265;
+//音频目标编码，音频编码开销很小，所以不分段，在拼接时顺序转码
+//Audio target encoding, audio encoding costs very little, so it is not split, it is transcoded sequentially while stitching
+const AVCodecID audioCodecID = AV_CODEC_ID_AAC;
+
+//每段的目标时长（秒），实际分段点为此时长后的第一个关键帧
+//Target duration of each chunk (seconds), the actual split point is the first keyframe after this duration
+const int chunkDuration = 10;
+//工作进程数，0表示使用CPU核心数
+//Number of worker processes, 0 means the number of CPU cores
+const int workerCount = 0;
+//分段中间文件的路径，使用nut格式可以原样保存时间戳
+//Path of the intermediate chunk files, the nut format keeps the timestamps unchanged
+const char *chunkFilePath = "./chunk_%d.nut";
+
+//索引文件（由remux_index生成）的后缀，索引文件路径为源文件路径加后缀，NULL表示不使用索引
+//索引存在且与源文件一致时跳过avformat_find_stream_info，并按索引规划分段；源文件的大小、修改时间或内容变化后索引自动失效
+//Suffix of the index file (built by remux_index), the index file path is the source file path plus the suffix, NULL means no index
+//When the index exists and matches the source file, avformat_find_stream_info is skipped and chunks are planned from the index; the index becomes invalid automatically when the size, modification time or content of the source file changes
+const char *indexSuffix = ".idx";
+
+//已加载的索引，header为NULL表示没有可用的索引，格式见common/index_format.h
+//The loaded index, header is NULL when no index is available, see common/index_format.h for the format
+SourceIndex sourceIndex = {NULL, 0, NULL, NULL, NULL, NULL, NULL};
+
+//输入输出文件句柄
+//Input and output file handles
+AVFormatContext *inFileHandle = NULL;
+AVFormatContext *outFileHandle = NULL;
+
+//轨道上下文结构体，存放解码器、编码器、输出轨道序号、轨道类型等
+//Track context structure, inlcude the decoder, encoder, output track number, track type
+typedef struct StreamContext {
+    AVMediaType type;                                                           //轨道类型，track type
+    int outIndex;                                                               //输出轨道序号，output track number
+    AVCodecContext *decoder;                                                    //解码器，decoder
+    AVCodecContext *encoder;                                                    //编码器，encoder
+} StreamContext;
+//轨道上下文关联表
+//Stream context correlation table
+StreamContext *streamContextMapping = NULL;
+int streamContextLength = 0;
+
+//分段计划，chunkStart[i]为第i段起始关键帧的dts（视频轨道timebase），解封装器索引中记录的是dts
+//Chunk plan, chunkStart[i] is the dts of the first keyframe of chunk i (in the video track timebase), the demuxer index records dts
+int videoIndex = -1;
+int64_t *chunkStart = NULL;
+int chunkCount = 0;
+//每个工作进程中编码器可用的线程数
+//Number of encoder threads in each worker process
+int encodeThreads = 1;
+
+void termination(const char* param){
+    std::cout<<param<<std::endl;
+    std::cout<<"Error occur, quit!"<<std::endl;
+    exit(-1);
+}
+
+std::string GetChunkPath(int index){
+    char path[1024];
+    snprintf(path, sizeof(path), chunkFilePath, index);
+    return path;
+}
+
+void Step_OpenInFile(){
+    //STEP::打开源视频文件，索引有效时直接指定解封装器，跳过格式探测；工作进程继承父进程已映射的索引
+    //STEP::Open the input video file, with a valid index the demuxer is given directly and format probing is skipped; worker processes inherit the index mapped by the parent
+    bool isIndexed = Index_Open(&sourceIndex, inFilePath, indexSuffix);
+    const AVInputFormat *inFormat = isIndexed ? av_find_input_format(sourceIndex.header->formatName) : NULL;
+    ret = avformat_open_input(&inFileHandle, inFilePath, inFormat, NULL);
+    if(ret<0){
+        termination("Could not open input file.");
+    }
+
+    //STEP::获取源视频文件的流信息，索引有效时使用索引中的参数，不再探测；每个工作进程都会重新打开输入，省下的探测时间按段数累计
+    //STEP::Get the stream information of the source video file, with a valid index the parameters in the index are used without probing; every worker opens the input again, so the saved probing time adds up per chunk
+    if(!Index_ApplyStreams(&sourceIndex, inFileHandle)){
+        ret = avformat_find_stream_info(inFileHandle, NULL);
+        if(ret<0){
+            termination("Failed to retrieve input stream information.");
+        }
+    }
+
+    //STEP::根据源轨道信息创建streamContextMapping
+    //STEP::Create streamContextMapping based on source track information
+    streamContextLength = inFileHandle->nb_streams;
+    streamContextMapping = (StreamContext *)av_malloc_array(streamContextLength, sizeof(*streamContextMapping));
+    if(!streamContextMapping){
+        streamContextLength = 0;
+        termination("Could not allocate stream context mapping.");
+    }
+    for(int i=0;i<streamContextLength;i++){
+        streamContextMapping[i].type = inFileHandle->streams[i]->codecpar->codec_type;
+        streamContextMapping[i].outIndex = -1;
+        streamContextMapping[i].decoder = NULL;
+        streamContextMapping[i].encoder = NULL;
+    }
+
+    videoIndex = av_find_best_stream(inFileHandle, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if(videoIndex < 0){
+        termination("Could not find video stream.");
+    }
+}
+
+bool Index_PlanChunks(){
+    //STEP::有索引时按视频轨道的字节数均衡分段，无需读取源文件：按总时长和chunkDuration估算段数，每段的目标字节数为视频总字节数/段数，累计达到目标后的第一个关键帧作为分段点
+    //码率高的部分画面复杂、编码慢，分段更短，各工作进程的负载比按时长分段更均衡
+    //STEP::With an index, balance the chunks by the bytes of the video track without reading the source file: estimate the number of chunks from the total duration and chunkDuration, the target bytes of each chunk is the total video bytes / number of chunks, the first keyframe after reaching the target is a split point
+    //High bitrate parts have complex pictures and encode slowly, so they get shorter chunks, the load of the workers is more balanced than splitting by duration
+    if(!sourceIndex.header || sourceIndex.streams[videoIndex].keyframeCount == 0){
+        return false;
+    }
+    const IndexHeader *header = sourceIndex.header;
+    int64_t totalBytes = 0;
+    for(int64_t i=0;i<header->packetCount;i++){
+        if(sourceIndex.packets[i].stream == videoIndex){
+            totalBytes += sourceIndex.packets[i].size;
+        }
+    }
+    int64_t targetCount = header->duration > 0 ? header->duration / ((int64_t)chunkDuration * AV_TIME_BASE) : 1;
+    int64_t targetBytes = totalBytes / (targetCount > 1 ? targetCount : 1);
+
+    chunkStart = (int64_t *)av_malloc_array(sourceIndex.streams[videoIndex].keyframeCount, sizeof(*chunkStart));
+    if(!chunkStart){
+        termination("Could not allocate chunk plan.");
+    }
+    chunkCount = 0;
+    int64_t bytes = 0;
+    for(int64_t i=0;i<header->packetCount;i++){
+        const IndexPacket *packet = &sourceIndex.packets[i];
+        if(packet->stream != videoIndex){
+            continue;
+        }
+        if((packet->flags & AV_PKT_FLAG_KEY) && packet->dts != AV_NOPTS_VALUE && (chunkCount == 0 || bytes >= targetBytes)){
+            chunkStart[chunkCount++] = packet->dts;
+            bytes = 0;
+        }
+        bytes += packet->size;
+    }
+    if(chunkCount == 0){
+        av_freep(&chunkStart);
+        return false;
+    }
+    std::cout<<"split into "<<chunkCount<<" chunks by source bytes (from index)"<<std::endl;
+    return true;
+}
+
+void Step_PlanChunks(){
+    //STEP::有索引时直接从索引规划分段
+    //STEP::With an index, plan the chunks directly from the index
+    if(Index_PlanChunks()){
+        return;
+    }
+
+    AVStream *inStream = inFileHandle->streams[videoIndex];
+    int64_t minDuration = av_rescale_q((int64_t)chunkDuration * AV_TIME_BASE, AV_TIME_BASE_Q, inStream->time_base);
+    chunkCount = 0;
+
+    //STEP::优先使用解封装器的索引（如mp4的moov）获取关键帧位置，无需读取数据
+    //STEP::Prefer the demuxer index (such as the moov of mp4) to get the keyframe positions, no data needs to be read
+    int entryCount = avformat_index_get_entries_count(inStream);
+    int64_t *keyframes = (int64_t *)av_malloc_array(entryCount > 0 ? entryCount : 1, sizeof(*keyframes));
+    int keyframeCount = 0;
+    if(!keyframes){
+        termination("Could not allocate keyframe list.");
+    }
+    for(int i=0;i<entryCount;i++){
+        const AVIndexEntry *entry = avformat_index_get_entry(inStream, i);
+        if(entry && (entry->flags & AVINDEX_KEYFRAME)){
+            keyframes[keyframeCount++] = entry->timestamp;
+        }
+    }
+
+    //STEP::没有索引时（如ts、flv），顺序读取一遍视频packet获取关键帧位置
+    //STEP::Without an index (such as ts, flv), read the video packets once to get the keyframe positions
+    if(keyframeCount == 0){
+        AVPacket *packet = av_packet_alloc();
+        if (!packet) {
+            termination("Could not allocate AVPacket.");
+        }
+        int capacity = 1;
+        while (av_read_frame(inFileHandle, packet) >= 0) {
+            if(packet->stream_index == videoIndex && (packet->flags & AV_PKT_FLAG_KEY) && packet->dts != AV_NOPTS_VALUE){
+                if(keyframeCount == capacity){
+                    capacity *= 2;
+                    keyframes = (int64_t *)av_realloc(keyframes, capacity * sizeof(*keyframes));
+                    if(!keyframes){
+                        termination("Could not allocate keyframe list.");
+                    }
+                }
+                keyframes[keyframeCount++] = packet->dts;
+            }
+            av_packet_unref(packet);
+        }
+        av_packet_free(&packet);
+    }
+    if(keyframeCount == 0){
+        termination("Could not find any keyframe.");
+    }
+
+    //STEP::从第一个关键帧开始，每隔chunkDuration秒后的第一个关键帧作为分段点
+    //STEP::Starting from the first keyframe, the first keyframe after every chunkDuration seconds is a split point
+    chunkStart = (int64_t *)av_malloc_array(keyframeCount, sizeof(*chunkStart));
+    if(!chunkStart){
+        termination("Could not allocate chunk plan.");
+    }
+    chunkStart[chunkCount++] = keyframes[0];
+    for(int i=1;i<keyframeCount;i++){
+        if(keyframes[i] - chunkStart[chunkCount - 1] >= minDuration){
+            chunkStart[chunkCount++] = keyframes[i];
+        }
+    }
+    av_free(keyframes);
+    std::cout<<"split into "<<chunkCount<<" chunks"<<std::endl;
+}
+
+void Step_OpenDecoder(AVMediaType mediaType){
+    //STEP::根据输入文件的流信息创建指定类型轨道的解码器
+    //STEP::Create decoders for the tracks of the given type based on the stream information of the input file
+    for(int i=0;i<streamContextLength;i++){
+        AVStream *inStream = inFileHandle->streams[i];
+        if (inStream->codecpar->codec_type != mediaType) {
+            inStream->discard = AVDISCARD_ALL;                                                  //不需要的轨道不解封装，Tracks that are not needed are not demuxed
+            continue;
+        }
+
+        const AVCodec *decoderInfo = avcodec_find_decoder(inStream->codecpar->codec_id);       //根据输入文件的流信息寻找解码器，Find the decoder based on the stream information of the input file
+        if(!decoderInfo){
+            termination("Could not find decoder for stream.");
+        }
+
+        AVCodecContext *decoder = avcodec_alloc_context3(decoderInfo);                          //创建解码器上下文，Create decoder context
+        if(!decoder){
+            termination("Could not allocate decoder context.");
+        }
+
+        ret = avcodec_parameters_to_context(decoder, inStream->codecpar);                       //从流信息拷贝参数到解码器上下文，Copy parameters from the stream information to the decoder context
+        if(ret<0){
+            termination("Could not copy parameters from the stream information to the decoder context.");
+        }
+
+        if(inStream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO){
+            decoder->framerate = av_guess_frame_rate(inFileHandle, inStream, NULL);
+        }
+
+        decoder->time_base = AV_TIME_BASE_Q;                                                    //固定TimeBase为1/1000000，能防止能多奇怪问题，Fixed TimeBase is 1/1000000，can prevent strange problems
+
+        //多个工作进程已经占满CPU，解码器使用单线程
+        //The worker processes already occupy all the CPUs, the decoder uses a single thread
+        decoder->thread_count = 1;
+
+        ret = avcodec_open2(decoder, decoderInfo, NULL);
+        if(ret<0){
+            termination("Could not open decoder.");
+        }
+
+        decoder->time_base = AV_TIME_BASE_Q;                                                    //一些编码器会修改timebase，这里做一次覆盖设置，Some encoders modify timebase, do an override setting here
+        streamContextMapping[i].decoder = decoder;
+        streamContextMapping[i].type = inStream->codecpar->codec_type;
+    }
+}
+
+void Step_OpenEncoder(){
+    //STEP::根据解码器创建编码器，基础参数从解码器复制
+    //STEP::Create encoders based on decoders, the basic parameters are copied from the decoder
+    for(int i=0;i<streamContextLength;i++){
+        if(!streamContextMapping[i].decoder){
+            continue;
+        }
+
+        const AVCodec *encoderInfo = NULL;
+        if (streamContextMapping[i].type == AVMEDIA_TYPE_VIDEO){
+            encoderInfo = avcodec_find_encoder(videoCodecID);                                  //根据目标编码器ID寻找编码器，Find the encoder based on the target encoder ID
+        } else if (streamContextMapping[i].type == AVMEDIA_TYPE_AUDIO ) {
+            encoderInfo = avcodec_find_encoder(audioCodecID);
+        }
+        if(!encoderInfo){
+            termination("Could not find encoder for stream.");
+        }
+
+        AVCodecContext *encoder = avcodec_alloc_context3(encoderInfo);                          //创建编码器上下文，Create encoder context
+        if(!encoder){
+            termination("Could not allocate encoder context.");
+        }
+
+        AVCodecContext *decoder = streamContextMapping[i].decoder;
+        AVDictionary *optionsDict = NULL;
+        if (streamContextMapping[i].type == AVMEDIA_TYPE_VIDEO){
+            encoder->height = decoder->height;
+            encoder->width = decoder->width;
+            encoder->framerate = decoder->framerate;
+            encoder->sample_aspect_ratio = decoder->sample_aspect_ratio;
+            if (encoderInfo->pix_fmts){
+                encoder->pix_fmt = encoderInfo->pix_fmts[0];
+            }else
+                encoder->pix_fmt = decoder->pix_fmt;
+
+            //各段的编码参数必须完全一致，拼接时所有段共用第一段的编码参数（extradata）
+            //The encoding parameters of all chunks must be identical, all chunks share the parameters (extradata) of the first chunk when stitching
+            encoder->thread_count = encodeThreads;
+            if(strcmp(encoderInfo->name, "libx265") == 0){
+                std::string x265Params = "pools=" + std::to_string(encodeThreads);
+                av_dict_set(&optionsDict, "x265-params", x265Params.c_str(), 0);
+            }
+        } else if (streamContextMapping[i].type == AVMEDIA_TYPE_AUDIO){
+            encoder->sample_rate = decoder->sample_rate;
+            av_channel_layout_copy(&encoder->ch_layout, &decoder->ch_layout);
+            if(encoderInfo->sample_fmts)
+                encoder->sample_fmt = encoderInfo->sample_fmts[0];
+            else
+                encoder->sample_fmt = decoder->sample_fmt;
+        }
+
+        encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;                                          //编码参数放到extradata，拼接时写入mp4文件头，put the codec parameters in extradata, it is written to the mp4 header when stitching
+        encoder->time_base = AV_TIME_BASE_Q;                                                    //固定TimeBase为1/1000000，能防止能多奇怪问题，Fixed TimeBase is 1/1000000，can prevent strange problems
+
+        ret = avcodec_open2(encoder, encoderInfo, &optionsDict);
+        av_dict_free(&optionsDict);
+        if(ret<0){
+            termination("Could not open encoder.");
+        }
+
+        encoder->time_base = AV_TIME_BASE_Q;                                                    //一些编码器会修改timebase，这里做一次覆盖设置，Some encoders modify timebase, do an override setting here
+        streamContextMapping[i].encoder = encoder;
+    }
+}
+
+void Step_Operation_Encode(int inIndex, AVFrame *frame, AVPacket *packet){
+    //STEP::将原始帧发送到编码器进行编码（异步），frame为NULL表示清理编码器
+    //STEP::Send the original frame to the encoder for encode (async), NULL frame means cleaning up the encoder
+    StreamContext *context = &streamContextMapping[inIndex];
+    AVStream *outStream = outFileHandle->streams[context->outIndex];
+    ret = avcodec_send_frame(context->encoder, frame);
+    if(ret<0){
+        termination("Could not encoding.");
+    }
+
+    while(1){
+        //STEP::尝试从编码器取出编码后的数据包，封装并写入输出文件
+        //STEP::Try to get the encoded packet, mux it and write to the output file
+        ret = avcodec_receive_packet(context->encoder, packet);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF){
+            break;
+        } else if (ret < 0) {
+            termination("Could not receive encoding.");
+        }
+
+        packet->stream_index = context->outIndex;
+        av_packet_rescale_ts(packet, context->encoder->time_base, outStream->time_base);
+        ret = av_interleaved_write_frame(outFileHandle, packet);
+        if (ret < 0) {
+            termination("Could not mux packet.");
+        }
+        av_packet_unref(packet);
+    }
+}
+
+void Step_Operation_Decode(int inIndex, AVPacket *packet, AVFrame *frame, int64_t rangeStart, int64_t rangeEnd){
+    //STEP::将数据包发送到解码器（异步），packet为NULL表示清理解码器
+    //STEP::Send the data packet to the decoder (async), NULL packet means cleaning up the decoder
+    StreamContext *context = &streamContextMapping[inIndex];
+    if(packet){
+        av_packet_rescale_ts(packet, inFileHandle->streams[inIndex]->time_base, context->decoder->time_base);
+    }
+    ret = avcodec_send_packet(context->decoder, packet);
+    if(ret<0){
+        termination("Could not decoding.");
+    }
+    if(packet){
+        av_packet_unref(packet);
+    }
+
+    AVPacket *outPacket = av_packet_alloc();
+    if (!outPacket) {
+        termination("Could not allocate AVPacket.");
+    }
+    while(1){
+        ret = avcodec_receive_frame(context->decoder, frame);
+        if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF){
+            break;
+        } else if (ret < 0){
+            termination("Could not receive decoding.");
+        }
+
+        //只编码本段范围内的帧，范围单位为1/1000000秒
+        //Only encode frames within the range of this chunk, the range is in 1/1000000 seconds
+        if(frame->pts != AV_NOPTS_VALUE && (frame->pts < rangeStart || frame->pts >= rangeEnd)){
+            av_frame_unref(frame);
+            continue;
+        }
+        Step_Operation_Encode(inIndex, frame, outPacket);
+        av_frame_unref(frame);
+    }
+    av_packet_free(&outPacket);
+}
+
+void Worker_TranscodeChunk(int chunkIndex){
+    //STEP::每段都重新打开输入文件，只解码视频轨道
+    //STEP::Each chunk opens the input file again, and only decodes the video track
+    Step_OpenInFile();
+    Step_OpenDecoder(AVMEDIA_TYPE_VIDEO);
+    Step_OpenEncoder();
+
+    //STEP::创建分段文件，只有一个视频轨道，时间戳保持为源文件的时间戳
+    //STEP::Create the chunk file, it only has a video track, the timestamps are kept as the source file timestamps
+    std::string chunkPath = GetChunkPath(chunkIndex);
+    ret = avformat_alloc_output_context2(&outFileHandle, NULL, "nut", chunkPath.c_str());
+    if(ret<0){
+        termination("Could not create chunk handle.");
+    }
+    AVStream *outStream = avformat_new_stream(outFileHandle, NULL);
+    ret = avcodec_parameters_from_context(outStream->codecpar, streamContextMapping[videoIndex].encoder);
+    if(ret<0){
+        termination("Could not copy codec parameters.");
+    }
+    outStream->time_base = streamContextMapping[videoIndex].encoder->time_base;
+    streamContextMapping[videoIndex].outIndex = 0;
+    ret = avio_open(&outFileHandle->pb, chunkPath.c_str(), AVIO_FLAG_WRITE);
+    if(ret<0){
+        termination("Could not open chunk file.");
+    }
+    ret = avformat_write_header(outFileHandle, NULL);
+    if(ret<0){
+        termination("Could not write stream header to chunk file.");
+    }
+
+    //STEP::跳转到本段的起始关键帧
+    //STEP::Seek to the first keyframe of this chunk
+    AVStream *inStream = inFileHandle->streams[videoIndex];
+    int64_t start = chunkStart[chunkIndex];
+    int64_t end = chunkIndex + 1 < chunkCount ? chunkStart[chunkIndex + 1] : INT64_MAX;
+    ret = av_seek_frame(inFileHandle, videoIndex, start, AVSEEK_FLAG_BACKWARD);
+    if(ret<0){
+        termination("Could not seek input file.");
+    }
+
+    //STEP::本段的帧范围为[起始关键帧的pts, 下一段起始关键帧的pts)，读取到对应的关键帧时才能确定
+    //读取到下一段的起始关键帧后，继续读取显示时间在其之前的帧（open gop的前置B帧），之后结束
+    //STEP::The frame range of this chunk is [pts of its first keyframe, pts of the first keyframe of the next chunk), it is known when the keyframes are read
+    //After reading the first keyframe of the next chunk, keep reading the frames displayed before it (leading B frames of an open gop), then stop
+    int64_t rangeStart = INT64_MIN;
+    int64_t rangeEnd = INT64_MAX;
+    int64_t endKeyPts = AV_NOPTS_VALUE;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    if (!packet || !frame) {
+        termination("Could not allocate AVPacket or AVFrame.");
+    }
+    bool isEndKeySeen = false;
+    while (av_read_frame(inFileHandle, packet) >= 0) {
+        if(packet->stream_index != videoIndex){
+            av_packet_unref(packet);
+            continue;
+        }
+        if(rangeStart == INT64_MIN){
+            if(!(packet->flags & AV_PKT_FLAG_KEY) || packet->dts < start){                       //跳转后第一个关键帧之前的数据丢弃，Drop the data before the first keyframe after seeking
+                av_packet_unref(packet);
+                continue;
+            }
+            rangeStart = av_rescale_q(packet->pts, inStream->time_base, AV_TIME_BASE_Q);
+        }
+        if(isEndKeySeen && packet->pts != AV_NOPTS_VALUE && packet->pts > endKeyPts){
+            av_packet_unref(packet);
+            break;
+        }
+        if(!isEndKeySeen && (packet->flags & AV_PKT_FLAG_KEY) && packet->dts >= end){
+            isEndKeySeen = true;
+            endKeyPts = packet->pts;
+            rangeEnd = av_rescale_q(packet->pts, inStream->time_base, AV_TIME_BASE_Q);
+        }
+        Step_Operation_Decode(videoIndex, packet, frame, rangeStart, rangeEnd);
+    }
+
+    //STEP::清理解码器、编码器中的数据，写入文件尾
+    //STEP::Clean up the decoder and encoder, and write the file tail
+    Step_Operation_Decode(videoIndex, NULL, frame, rangeStart, rangeEnd);
+    Step_Operation_Encode(videoIndex, NULL, packet);
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+
+    ret = av_write_trailer(outFileHandle);
+    if(ret < 0) {
+        termination("Could not write the stream trailer to chunk file.");
+    }
+    avio_closep(&outFileHandle->pb);
+    avformat_free_context(outFileHandle);
+    outFileHandle = NULL;
+    for(int i=0;i<streamContextLength;i++){
+        avcodec_free_context(&streamContextMapping[i].decoder);
+        avcodec_free_context(&streamContextMapping[i].encoder);
+    }
+    av_freep(&streamContextMapping);
+    avformat_close_input(&inFileHandle);
+}
+
+void Step_StartWorkers(){
+    //STEP::创建工作进程，第i个进程处理序号为 i, i+workers, i+2*workers... 的分段
+    //父进程的输入文件句柄先关闭，每个工作进程独立打开输入文件
+    //STEP::Create worker processes, worker i handles chunks i, i+workers, i+2*workers...
+    //The input file handle of the parent process is closed first, each worker opens the input file by itself
+    int workers = workerCount > 0 ? workerCount : av_cpu_count();
+    if(workers > chunkCount){
+        workers = chunkCount;
+    }
+    encodeThreads = av_cpu_count() / workers > 1 ? av_cpu_count() / workers : 1;
+    avformat_close_input(&inFileHandle);
+    av_freep(&streamContextMapping);
+
+    pid_t *pids = (pid_t *)av_malloc_array(workers, sizeof(*pids));
+    if(!pids){
+        termination("Could not allocate worker list.");
+    }
+    for(int i=0;i<workers;i++){
+        pids[i] = fork();
+        if(pids[i] < 0){
+            termination("Could not create worker process.");
+        } else if(pids[i] == 0){
+            for(int chunkIndex=i;chunkIndex<chunkCount;chunkIndex+=workers){
+                Worker_TranscodeChunk(chunkIndex);
+            }
+            exit(0);
+        }
+    }
+
+    //STEP::等待所有工作进程结束，任一进程失败则整个任务失败
+    //STEP::Wait for all worker processes to finish, the whole job fails if any of them fails
+    bool isFailed = false;
+    for(int i=0;i<workers;i++){
+        int status = 0;
+        if(waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+            isFailed = true;
+        }
+    }
+    av_free(pids);
+    if(isFailed){
+        termination("Worker process failed.");
+    }
+}
+
+AVFormatContext *Stitch_OpenChunk(int chunkIndex){
+    AVFormatContext *chunkHandle = NULL;
+    std::string chunkPath = GetChunkPath(chunkIndex);
+    ret = avformat_open_input(&chunkHandle, chunkPath.c_str(), NULL, NULL);
+    if(ret<0){
+        termination("Could not open chunk file.");
+    }
+    ret = avformat_find_stream_info(chunkHandle, NULL);
+    if(ret<0 || chunkHandle->nb_streams != 1){
+        termination("Failed to retrieve chunk stream information.");
+    }
+    return chunkHandle;
+}
+
+void Step_CreateOutFile(AVFormatContext *firstChunk){
+    //STEP::创建输出文件，视频轨道参数取自第一段，音频轨道参数取自音频编码器
+    //STEP::Create the output file, the video track parameters come from the first chunk, the audio track parameters come from the audio encoder
+    ret = avformat_alloc_output_context2(&outFileHandle, NULL, NULL, outFilePath);
+    if(ret<0){
+        termination("Could not create output handle.");
+    }
+
+    int outStreamIndex = 0;
+    for(int i = 0; i < streamContextLength; i++) {
+        AVStream *outStream = NULL;
+        if(i == videoIndex){
+            outStream = avformat_new_stream(outFileHandle, NULL);
+            ret = avcodec_parameters_copy(outStream->codecpar, firstChunk->streams[0]->codecpar);
+        } else if(streamContextMapping[i].encoder){
+            outStream = avformat_new_stream(outFileHandle, NULL);
+            ret = avcodec_parameters_from_context(outStream->codecpar, streamContextMapping[i].encoder);
+        } else {
+            continue;
+        }
+        if(ret<0){
+            termination("Could not copy codec parameters.");
+        }
+        outStream->codecpar->codec_tag = 0;
+        streamContextMapping[i].outIndex = outStreamIndex++;
+    }
+
+    ret = avio_open(&outFileHandle->pb, outFilePath, AVIO_FLAG_WRITE);
+    if(ret<0){
+        termination("Could not open out file.");
+    }
+    ret = avformat_write_header(outFileHandle, NULL);
+    if(ret<0){
+        termination("Could not write stream header to out file.");
+    }
+}
+
+void Step_Stitch(){
+    //STEP::重新打开输入文件，只解码音频轨道
+    //STEP::Open the input file again, and only decode the audio tracks
+    Step_OpenInFile();
+    Step_OpenDecoder(AVMEDIA_TYPE_AUDIO);
+    Step_OpenEncoder();
+
+    int chunkIndex = 0;
+    AVFormatContext *chunkHandle = Stitch_OpenChunk(chunkIndex);
+    Step_CreateOutFile(chunkHandle);
+    AVStream *outVideoStream = outFileHandle->streams[streamContextMapping[videoIndex].outIndex];
+
+    //STEP::按时间顺序交替处理分段中的视频packet和源文件中的音频packet，避免封装器缓存过多数据
+    //视频packet直接复制，各段的时间戳本身就是连续的，这里只保证dts单调递增
+    //STEP::Process the video packets of the chunks and the audio packets of the source file alternately in time order, to prevent the muxer from buffering too much data
+    //Video packets are copied directly, the timestamps of the chunks are already continuous, here only make sure dts increases monotonically
+    AVPacket *videoPacket = av_packet_alloc();
+    AVPacket *audioPacket = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    if (!videoPacket || !audioPacket || !frame) {
+        termination("Could not allocate AVPacket or AVFrame.");
+    }
+    bool hasVideo = false;
+    bool hasAudio = false;
+    bool isVideoEnd = false;
+    bool isAudioEnd = false;
+    int64_t lastVideoDts = AV_NOPTS_VALUE;
+    while(1){
+        //读取下一个视频packet，当前段读取完毕后打开下一段
+        //Read the next video packet, open the next chunk after the current one is finished
+        while(!hasVideo && !isVideoEnd){
+            if(av_read_frame(chunkHandle, videoPacket) >= 0){
+                av_packet_rescale_ts(videoPacket, chunkHandle->streams[0]->time_base, outVideoStream->time_base);
+                hasVideo = true;
+                continue;
+            }
+            avformat_close_input(&chunkHandle);
+            if(++chunkIndex >= chunkCount){
+                isVideoEnd = true;
+                break;
+            }
+            chunkHandle = Stitch_OpenChunk(chunkIndex);
+        }
+        //读取下一个需要转码的音频packet
+        //Read the next audio packet that needs transcoding
+        while(!hasAudio && !isAudioEnd){
+            if(av_read_frame(inFileHandle, audioPacket) < 0){
+                isAudioEnd = true;
+                break;
+            }
+            if(streamContextMapping[audioPacket->stream_index].encoder){
+                hasAudio = true;
+            } else {
+                av_packet_unref(audioPacket);
+            }
+        }
+        if(!hasVideo && !hasAudio){
+            break;
+        }
+
+        bool isVideoFirst = hasVideo && (!hasAudio ||
+            av_compare_ts(videoPacket->dts, outVideoStream->time_base, audioPacket->dts, inFileHandle->streams[audioPacket->stream_index]->time_base) <= 0);
+        if(isVideoFirst){
+            if(lastVideoDts != AV_NOPTS_VALUE && videoPacket->dts <= lastVideoDts){
+                videoPacket->dts = lastVideoDts + 1;
+                if(videoPacket->pts != AV_NOPTS_VALUE && videoPacket->pts < videoPacket->dts){
+                    videoPacket->pts = videoPacket->dts;
+                }
+            }
+            lastVideoDts = videoPacket->dts;
+            videoPacket->stream_index = streamContextMapping[videoIndex].outIndex;
+            ret = av_interleaved_write_frame(outFileHandle, videoPacket);
+            if (ret < 0) {
+                termination("Could not mux packet.");
+            }
+            av_packet_unref(videoPacket);
+            hasVideo = false;
+        } else {
+            Step_Operation_Decode(audioPacket->stream_index, audioPacket, frame, INT64_MIN, INT64_MAX);
+            hasAudio = false;
+        }
+    }
+
+    //STEP::清理音频解码器、编码器中的数据
+    //STEP::Clean up the audio decoders and encoders
+    for(int i=0;i<streamContextLength;i++){
+        if(streamContextMapping[i].encoder){
+            Step_Operation_Decode(i, NULL, frame, INT64_MIN, INT64_MAX);
+            Step_Operation_Encode(i, NULL, audioPacket);
+        }
+    }
+    av_packet_free(&videoPacket);
+    av_packet_free(&audioPacket);
+    av_frame_free(&frame);
+}
+
+void Step_CloseCodec(){
+    //STEP::释放编码器、解码器
+    //STEP::Free encoders and decoders
+    for(int i=0;i<streamContextLength;i++){
+        if(streamContextMapping[i].decoder){
+            avcodec_free_context(&streamContextMapping[i].decoder);
+        }
+        if(streamContextMapping[i].encoder){
+            avcodec_free_context(&streamContextMapping[i].encoder);
+        }
+    }
+}
+
+void Step_End(){
+    //STEP::写入输出文件尾信息
+    //Write output file tail information
+    ret = av_write_trailer(outFileHandle);
+    if(ret < 0) {
+        termination("Could not write the stream trailer to out file.");
+    }
+
+    //STEP::关闭输出文件，并销毁具柄
+    //STEP::Close the output file，and destroy the handle
+    ret = avio_closep(&outFileHandle->pb);
+    if(ret < 0) {
+        termination("Could not close out file.");
+    }
+    avformat_free_context(outFileHandle);
+
+    //STEP::关闭输入文件，并销毁具柄
+    //STEP::Close the input file，and destroy the handle
+    avformat_close_input(&inFileHandle);
+
+    //STEP::删除分段文件，释放关联表和分段计划
+    //STEP::Delete the chunk files, free the association table and the chunk plan
+    for(int i=0;i<chunkCount;i++){
+        unlink(GetChunkPath(i).c_str());
+    }
+    av_free(streamContextMapping);
+    av_free(chunkStart);
+    Index_Close(&sourceIndex);
+}
+
+int main(int argc, char *argv[]){
+    //STEP::打开源文件，并按关键帧制定分段计划
+    //STEP::Open the input file, and plan the chunks by keyframes
+    Step_OpenInFile();
+    Step_PlanChunks();
+
+    //STEP::启动工作进程并行转码各段视频
+    //STEP::Start worker processes to transcode the video chunks in parallel
+    Step_StartWorkers();
+
+    //STEP::拼接各段视频，同时转码音频
+    //STEP::Stitch the video chunks, and transcode the audio at the same time
+    Step_Stitch();
+
+    //STEP::关闭编码器、解码器
+    //STEP::Close encoder and decoder
+    Step_CloseCodec();
+
+    //STEP::关闭输入、输出文件
+    //STEP::Close input and output files
+    Step_End();
+}
@@ -0,0 +1,715 @@
+/*
+ * 视频转编码例子（多码率阶梯），解码一次，同时编码输出多个不同分辨率的h265文件，各文件的关键帧位置对齐
+ * The sample of transcoding video into an ABR ladder, decode once and encode several h265 files with different resolutions at the same time, keyframes are aligned across the files
+ * Depends on FFmpeg 6.0
+ * Wirte by stoprefactoring.com
+*/
+
+#include <iostream>
+#include <string>
+#include <string.h>
+#include <thread>
+#include <atomic>
+extern "C" {
+    #include <libavutil/timestamp.h>
+    #include <libavutil/time.h>
+    #include <libavutil/cpu.h>
+    #include <libavutil/opt.h>
+    #include <libavutil/audio_fifo.h>
+    #include <libavutil/channel_layout.h>
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+    #include <libavcodec/codec.h>
+    #include <libswscale/swscale.h>
+    #include <libswresample/swresample.h>
+}
+
+int ret = 0;
+
+//输入文件路径
+//Input file path
+const char *inFilePath  = "../../common/test.mp4";
+//const char *inFilePath  = "rtmp://192.168.3.202:1935/live/test";
+
+//码率阶梯，每一档对应一个输出文件，宽高为0表示与源视频一致
+//ABR ladder, each rendition has its own output file, 0 width/height means the same as the source video
+typedef struct Rendition {
+    const char *outFilePath;                                                    //输出文件路径，output file path
+    int width;                                                                  //目标宽度，target width
+    int height;                                                                 //目标高度，target height
+    int64_t bitRate;                                                            //目标码率，target bitrate
+} Rendition;
+const Rendition renditionList[] = {
+    {"./out_1080p.mp4", 1920, 1080, 5000000},
+    {"./out_720p.mp4", 1280, 720, 3000000},
+    {"./out_480p.mp4", 854, 480, 1200000},
+};
+const int renditionLength = sizeof(renditionList) / sizeof(*renditionList);
+
+//视频、音频目标编码，音频只编码一次，编码后的数据包复制到每个输出文件
+//Video and audio target encoding, audio is encoded only once, and the encoded packets are copied to every output file
+const AVCodecID videoCodecID = AV_CODEC_ID_H265;
+const AVCodecID audioCodecID = AV_CODEC_ID_AAC;
+
+//关键帧间隔（秒），所有档位在相同的时间点强制插入关键帧，切片或切换码率时各档位可以无缝衔接
+//Keyframe interval (seconds), all renditions force a keyframe at the same points in time, so that they can be switched seamlessly when segmenting or switching bitrates
+const int gopDuration = 2;
+
+//每个档位队列的深度，限制解码线程最多可以领先编码线程多少帧
+//The queue depth of each rendition, it limits how many frames the decode thread may run ahead of the encode threads
+const unsigned int queueDepth = 8;
+
+//输入文件句柄
+//Input file handle
+AVFormatContext *inFileHandle = NULL;
+
+//无锁有界队列，只允许一个线程写入、一个线程读取（单生产者单消费者），NULL表示数据结束
+//Lock-free bounded queue, only one thread writes and one thread reads (single producer single consumer), NULL means end of data
+typedef struct Queue {
+    void **items;                                                               //环形缓冲区，ring buffer
+    unsigned int capacity;                                                      //缓冲区长度，比队列深度多1，buffer length, 1 more than the queue depth
+    std::atomic<unsigned int> head;                                             //读取位置，只由消费者修改，read position, only modified by the consumer
+    std::atomic<unsigned int> tail;                                             //写入位置，只由生产者修改，write position, only modified by the producer
+} Queue;
+
+//档位上下文结构体，存放缩放器、编码器、输出文件、队列和线程
+//Rendition context structure, inlcude the scaler, encoder, output file, queues and thread
+typedef struct RenditionContext {
+    const Rendition *rendition;                                                 //档位配置，rendition settings
+    AVFormatContext *outFileHandle;                                             //输出文件句柄，output file handle
+    AVCodecContext *encoder;                                                    //视频编码器，video encoder
+    SwsContext *scaler;                                                         //缩放器，scaler
+    AVFrame *scaleFrame;                                                        //缩放后的帧，scaled frame
+    int videoOutIndex;                                                          //视频输出轨道序号，video output track number
+    int audioOutIndex;                                                          //音频输出轨道序号，audio output track number
+    Queue frameQueue;                                                           //待编码的视频帧队列，queue of video frames waiting to be encoded
+    Queue packetQueue;                                                          //已编码的音频数据包队列，queue of encoded audio packets
+    std::thread thread;                                                         //编码线程，encode thread
+    int64_t frameCount;                                                         //已编码的帧数，number of encoded frames
+} RenditionContext;
+RenditionContext *renditionContextList = NULL;
+
+//源视频、音频轨道的解码器，音频编码器、重采样器和FIFO
+//Decoders of the source video and audio tracks, the audio encoder, resampler and FIFO
+int videoIndex = -1;
+int audioIndex = -1;
+AVCodecContext *videoDecoder = NULL;
+AVCodecContext *audioDecoder = NULL;
+AVCodecContext *audioEncoder = NULL;
+SwrContext *resampler = NULL;
+AVAudioFifo *audioFifo = NULL;
+int64_t audioPts = AV_NOPTS_VALUE;
+int64_t nextKeyframePts = AV_NOPTS_VALUE;
+
+void termination(const char* param){
+    std::cout<<param<<std::endl;
+    std::cout<<"Error occur, quit!"<<std::endl;
+    exit(-1);
+}
+
+void Queue_Init(Queue *queue){
+    queue->capacity = queueDepth + 1;
+    queue->items = (void **)av_malloc_array(queue->capacity, sizeof(*queue->items));
+    if(!queue->items){
+        termination("Could not allocate queue.");
+    }
+    queue->head.store(0);
+    queue->tail.store(0);
+}
+
+void Queue_Free(Queue *queue){
+    av_freep(&queue->items);
+}
+
+bool Queue_TryPush(Queue *queue, void *item){
+    unsigned int tail = queue->tail.load(std::memory_order_relaxed);
+    unsigned int next = (tail + 1) % queue->capacity;
+    if(next == queue->head.load(std::memory_order_acquire)){                    //队列已满，queue is full
+        return false;
+    }
+    queue->items[tail] = item;
+    queue->tail.store(next, std::memory_order_release);
+    return true;
+}
+
+bool Queue_TryPop(Queue *queue, void **item){
+    unsigned int head = queue->head.load(std::memory_order_relaxed);
+    if(head == queue->tail.load(std::memory_order_acquire)){                    //队列为空，queue is empty
+        return false;
+    }
+    *item = queue->items[head];
+    queue->head.store((head + 1) % queue->capacity, std::memory_order_release);
+    return true;
+}
+
+void Queue_Wait(unsigned int *spinCount){
+    //先自旋让出CPU，等待时间较长时再sleep，避免空转占满CPU
+    //Yield the CPU first, and sleep when waiting for a long time to avoid burning the CPU
+    if((*spinCount)++ < 64){
+        std::this_thread::yield();
+    } else {
+        av_usleep(200);
+    }
+}
+
+void Queue_Push(Queue *queue, void *item){
+    unsigned int spinCount = 0;
+    while(!Queue_TryPush(queue, item)){
+        Queue_Wait(&spinCount);
+    }
+}
+
+AVCodecContext *OpenDecoder(AVStream *inStream, int threads){
+    const AVCodec *decoderInfo = avcodec_find_decoder(inStream->codecpar->codec_id);           //根据输入文件的流信息寻找解码器，Find the decoder based on the stream information of the input file
+    if(!decoderInfo){
+        termination("Could not find decoder for stream.");
+    }
+    AVCodecContext *decoder = avcodec_alloc_context3(decoderInfo);                              //创建解码器上下文，Create decoder context
+    if(!decoder){
+        termination("Could not allocate decoder context.");
+    }
+    ret = avcodec_parameters_to_context(decoder, inStream->codecpar);                           //从流信息拷贝参数到解码器上下文，Copy parameters from the stream information to the decoder context
+    if(ret<0){
+        termination("Could not copy parameters from the stream information to the decoder context.");
+    }
+    if(inStream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO){
+        decoder->framerate = av_guess_frame_rate(inFileHandle, inStream, NULL);
+    }
+    decoder->time_base = AV_TIME_BASE_Q;                                                        //固定TimeBase为1/1000000，能防止能多奇怪问题，Fixed TimeBase is 1/1000000，can prevent strange problems
+    decoder->thread_count = threads;
+    decoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    ret = avcodec_open2(decoder, decoderInfo, NULL);
+    if(ret<0){
+        termination("Could not open decoder.");
+    }
+    decoder->time_base = AV_TIME_BASE_Q;                                                        //一些编码器会修改timebase，这里做一次覆盖设置，Some encoders modify timebase, do an override setting here
+    return decoder;
+}
+
+void Step_OpenInFile(){
+    //STEP::打开源视频文件
+    //STEP::Open the input video file
+    AVDictionary* optionsDict = NULL;                                                 //设置输入源封装参数
+    av_dict_set(&optionsDict, "rw_timeout", "2000000", 0);                            //设置网络超时，当输入源为文件时，可注释此行。Set the network timeout, you can comment out this line when the input source is a file
+    ret = avformat_open_input(&inFileHandle, inFilePath, NULL, &optionsDict);
+    if(ret<0){
+        termination("Could not open input file.");
+    }
+
+    //STEP::获取源视频文件的流信息
+    //STEP::Get the stream information of the source video file
+    ret = avformat_find_stream_info(inFileHandle, NULL);
+    if(ret<0){
+        termination("Failed to retrieve input stream information.");
+    }
+
+    //STEP::选择一个视频轨道和一个音频轨道，其他轨道不解封装
+    //STEP::Select one video track and one audio track, other tracks are not demuxed
+    videoIndex = av_find_best_stream(inFileHandle, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    audioIndex = av_find_best_stream(inFileHandle, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    if(videoIndex < 0){
+        termination("Could not find video stream.");
+    }
+    for(unsigned int i=0;i<inFileHandle->nb_streams;i++){
+        if((int)i != videoIndex && (int)i != audioIndex){
+            inFileHandle->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+}
+
+void Step_OpenDecoder(){
+    //STEP::视频、音频各只解码一次，解码器使用约1/4的CPU核心，其余留给各档位的编码器
+    //STEP::Video and audio are each decoded only once, the decoder uses about 1/4 of the CPU cores, the rest is left to the encoders of the renditions
+    int threads = av_cpu_count() / 4 > 1 ? av_cpu_count() / 4 : 1;
+    videoDecoder = OpenDecoder(inFileHandle->streams[videoIndex], threads);
+    if(audioIndex >= 0){
+        audioDecoder = OpenDecoder(inFileHandle->streams[audioIndex], 1);
+    }
+}
+
+void Step_OpenEncoder(){
+    //STEP::为每个档位创建视频编码器，编码线程按分辨率大小分配
+    //STEP::Create a video encoder for each rendition, encoder threads are shared by resolution
+    int64_t totalPixels = 0;
+    for(int i=0;i<renditionLength;i++){
+        int width = renditionList[i].width > 0 ? renditionList[i].width : videoDecoder->width;
+        int height = renditionList[i].height > 0 ? renditionList[i].height : videoDecoder->height;
+        totalPixels += (int64_t)width * height;
+    }
+    int budget = av_cpu_count() - (av_cpu_count() / 4 > 1 ? av_cpu_count() / 4 : 1);
+
+    renditionContextList = new RenditionContext[renditionLength];                              //含有std::thread和std::atomic，需要用new构造，contains std::thread and std::atomic, must be constructed with new
+    for(int i=0;i<renditionLength;i++){
+        RenditionContext *context = &renditionContextList[i];
+        context->rendition = &renditionList[i];
+        context->outFileHandle = NULL;
+        context->scaler = NULL;
+        context->videoOutIndex = -1;
+        context->audioOutIndex = -1;
+        context->frameCount = 0;
+        context->scaleFrame = av_frame_alloc();
+        if(!context->scaleFrame){
+            termination("Could not allocate AVFrame.");
+        }
+        Queue_Init(&context->frameQueue);
+        Queue_Init(&context->packetQueue);
+
+        const AVCodec *encoderInfo = avcodec_find_encoder(videoCodecID);                       //根据目标编码器ID寻找编码器，Find the encoder based on the target encoder ID
+        if(!encoderInfo){
+            termination("Could not find encoder for stream.");
+        }
+        AVCodecContext *encoder = avcodec_alloc_context3(encoderInfo);                          //创建编码器上下文，Create encoder context
+        if(!encoder){
+            termination("Could not allocate encoder context.");
+        }
+        encoder->width = (context->rendition->width > 0 ? context->rendition->width : videoDecoder->width) & ~1;
+        encoder->height = (context->rendition->height > 0 ? context->rendition->height : videoDecoder->height) & ~1;
+        encoder->framerate = videoDecoder->framerate;
+        encoder->sample_aspect_ratio = videoDecoder->sample_aspect_ratio;
+        encoder->pix_fmt = encoderInfo->pix_fmts ? encoderInfo->pix_fmts[0] : videoDecoder->pix_fmt;
+        encoder->bit_rate = context->rendition->bitRate;
+        encoder->time_base = AV_TIME_BASE_Q;                                                    //固定TimeBase为1/1000000，能防止能多奇怪问题，Fixed TimeBase is 1/1000000，can prevent strange problems
+
+        //关键帧只在解码线程标记的位置产生：关闭场景切换检测和open gop，标记为I帧的位置强制为IDR帧
+        //Keyframes are only produced where the decode thread marks them: scene cut detection and open gop are disabled, frames marked as I are forced to be IDR frames
+        AVRational frameRate = encoder->framerate.num > 0 ? encoder->framerate : av_make_q(25, 1);
+        int gopSize = (int)(gopDuration * av_q2d(frameRate) + 0.5);
+        encoder->gop_size = gopSize;
+        encoder->keyint_min = gopSize;
+        encoder->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+        AVDictionary *optionsDict = NULL;
+        av_dict_set(&optionsDict, "forced-idr", "1", 0);
+        int threads = (int)(budget * ((double)encoder->width * encoder->height / totalPixels));
+        threads = threads > 1 ? threads : 1;
+        encoder->thread_count = threads;
+        if(strcmp(encoderInfo->name, "libx265") == 0){
+            std::string x265Params = "pools=" + std::to_string(threads) + ":scenecut=0:open-gop=0:keyint=" + std::to_string(gopSize) + ":min-keyint=" + std::to_string(gopSize);
+            av_dict_set(&optionsDict, "x265-params", x265Params.c_str(), 0);
+        } else if(strcmp(encoderInfo->name, "libx264") == 0){
+            av_dict_set(&optionsDict, "x264-params", "scenecut=0", 0);
+        }
+
+        const AVOutputFormat *outFormat = av_guess_format(NULL, context->rendition->outFilePath, NULL);
+        if(outFormat && (outFormat->flags & AVFMT_GLOBALHEADER)){
+            encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;                                      //mp4等格式需要把编码参数放到文件头，formats such as mp4 need the codec parameters in the file header
+        }
+
+        ret = avcodec_open2(encoder, encoderInfo, &optionsDict);
+        av_dict_free(&optionsDict);
+        if(ret<0){
+            termination("Could not open encoder.");
+        }
+        encoder->time_base = AV_TIME_BASE_Q;                                                    //一些编码器会修改timebase，这里做一次覆盖设置，Some encoders modify timebase, do an override setting here
+        context->encoder = encoder;
+    }
+
+    //STEP::创建音频编码器、重采样器和FIFO，所有档位共用
+    //STEP::Create the audio encoder, resampler and FIFO, shared by all renditions
+    if(!audioDecoder){
+        return;
+    }
+    const AVCodec *encoderInfo = avcodec_find_encoder(audioCodecID);
+    if(!encoderInfo){
+        termination("Could not find encoder for stream.");
+    }
+    audioEncoder = avcodec_alloc_context3(encoderInfo);
+    if(!audioEncoder){
+        termination("Could not allocate encoder context.");
+    }
+    audioEncoder->sample_rate = audioDecoder->sample_rate;
+    av_channel_layout_copy(&audioEncoder->ch_layout, &audioDecoder->ch_layout);
+    audioEncoder->sample_fmt = encoderInfo->sample_fmts ? encoderInfo->sample_fmts[0] : audioDecoder->sample_fmt;
+    audioEncoder->time_base = AV_TIME_BASE_Q;
+    audioEncoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    ret = avcodec_open2(audioEncoder, encoderInfo, NULL);
+    if(ret<0){
+        termination("Could not open encoder.");
+    }
+    audioEncoder->time_base = AV_TIME_BASE_Q;
+
+    ret = swr_alloc_set_opts2(&resampler,
+                              &audioEncoder->ch_layout, audioEncoder->sample_fmt, audioEncoder->sample_rate,
+                              &audioDecoder->ch_layout, audioDecoder->sample_fmt, audioDecoder->sample_rate,
+                              0, NULL);
+    if(ret < 0 || swr_init(resampler) < 0){
+        termination("Could not initialize resampler.");
+    }
+    audioFifo = av_audio_fifo_alloc(audioEncoder->sample_fmt, audioEncoder->ch_layout.nb_channels, 2048);
+    if(!audioFifo){
+        termination("Could not allocate audio fifo.");
+    }
+}
+
+void Step_CreateOutFile(){
+    //STEP::为每个档位创建输出文件，视频轨道取自本档位的编码器，音频轨道取自共用的音频编码器
+    //STEP::Create an output file for each rendition, the video track comes from the encoder of this rendition, the audio track comes from the shared audio encoder
+    for(int i=0;i<renditionLength;i++){
+        RenditionContext *context = &renditionContextList[i];
+        ret = avformat_alloc_output_context2(&context->outFileHandle, NULL, NULL, context->rendition->outFilePath);
+        if(ret<0){
+            termination("Could not create output handle.");
+        }
+
+        AVStream *outStream = avformat_new_stream(context->outFileHandle, NULL);
+        ret = avcodec_parameters_from_context(outStream->codecpar, context->encoder);
+        if(ret<0){
+            termination("Could not copy codec parameters.");
+        }
+        context->videoOutIndex = outStream->index;
+        if(audioEncoder){
+            outStream = avformat_new_stream(context->outFileHandle, NULL);
+            ret = avcodec_parameters_from_context(outStream->codecpar, audioEncoder);
+            if(ret<0){
+                termination("Could not copy codec parameters.");
+            }
+            context->audioOutIndex = outStream->index;
+        }
+
+        ret = avio_open(&context->outFileHandle->pb, context->rendition->outFilePath, AVIO_FLAG_WRITE);
+        if(ret<0){
+            termination("Could not open out file.");
+        }
+        ret = avformat_write_header(context->outFileHandle, NULL);
+        if(ret<0){
+            termination("Could not write stream header to out file.");
+        }
+    }
+}
+
+void Rendition_Encode(RenditionContext *context, AVFrame *frame, AVPacket *packet){
+    //STEP::缩放到本档位的分辨率后编码，frame为NULL表示清理编码器
+    //STEP::Scale to the resolution of this rendition and encode, NULL frame means cleaning up the encoder
+    AVFrame *encodeFrame = NULL;
+    if(frame){
+        if(!context->scaler){
+            context->scaler = sws_alloc_context();
+            if(!context->scaler){
+                termination("Could not allocate scaler.");
+            }
+            av_opt_set_int(context->scaler, "srcw", frame->width, 0);
+            av_opt_set_int(context->scaler, "srch", frame->height, 0);
+            av_opt_set_int(context->scaler, "src_format", frame->format, 0);
+            av_opt_set_int(context->scaler, "dstw", context->encoder->width, 0);
+            av_opt_set_int(context->scaler, "dsth", context->encoder->height, 0);
+            av_opt_set_int(context->scaler, "dst_format", context->encoder->pix_fmt, 0);
+            av_opt_set_int(context->scaler, "sws_flags", SWS_BICUBIC, 0);
+            if(sws_init_context(context->scaler, NULL, NULL) < 0){
+                termination("Could not initialize scaler.");
+            }
+        }
+        encodeFrame = context->scaleFrame;
+        if(sws_scale_frame(context->scaler, encodeFrame, frame) < 0){
+            termination("Could not scale frame.");
+        }
+        av_frame_copy_props(encodeFrame, frame);                                                //包含解码线程标记的关键帧类型，includes the keyframe type marked by the decode thread
+        context->frameCount++;
+    }
+    int result = avcodec_send_frame(context->encoder, encodeFrame);                             //在多个线程中运行，不使用全局的ret，runs in several threads, so the global ret is not used
+    if(encodeFrame){
+        av_frame_unref(encodeFrame);
+    }
+    if(result<0){
+        termination("Could not encoding.");
+    }
+
+    AVStream *outStream = context->outFileHandle->streams[context->videoOutIndex];
+    while(1){
+        result = avcodec_receive_packet(context->encoder, packet);
+        if (result == AVERROR(EAGAIN) || result == AVERROR_EOF){
+            break;
+        } else if (result < 0) {
+            termination("Could not receive encoding.");
+        }
+        packet->stream_index = context->videoOutIndex;
+        av_packet_rescale_ts(packet, context->encoder->time_base, outStream->time_base);
+        if (av_interleaved_write_frame(context->outFileHandle, packet) < 0) {
+            termination("Could not mux packet.");
+        }
+        av_packet_unref(packet);
+    }
+}
+
+void Thread_Rendition(int renditionIndex){
+    //STEP::轮询视频帧队列和音频数据包队列，两个队列都收到结束标志后退出
+    //STEP::Poll the video frame queue and the audio packet queue, exit after both queues have received the end flag
+    RenditionContext *context = &renditionContextList[renditionIndex];
+    AVPacket *packet = av_packet_alloc();
+    if (!packet) {
+        termination("Could not allocate AVPacket.");
+    }
+    bool isVideoEnd = false;
+    bool isAudioEnd = context->audioOutIndex < 0;
+    unsigned int spinCount = 0;
+    while(!isVideoEnd || !isAudioEnd){
+        bool isIdle = true;
+        void *item = NULL;
+        if(!isVideoEnd && Queue_TryPop(&context->frameQueue, &item)){
+            isIdle = false;
+            AVFrame *frame = (AVFrame *)item;
+            Rendition_Encode(context, frame, packet);
+            if(!frame){
+                isVideoEnd = true;
+            }
+            av_frame_free(&frame);
+        }
+        if(!isAudioEnd && Queue_TryPop(&context->packetQueue, &item)){
+            isIdle = false;
+            AVPacket *audioPacket = (AVPacket *)item;
+            if(!audioPacket){
+                isAudioEnd = true;
+                continue;
+            }
+            AVStream *outStream = context->outFileHandle->streams[context->audioOutIndex];
+            audioPacket->stream_index = context->audioOutIndex;
+            av_packet_rescale_ts(audioPacket, audioEncoder->time_base, outStream->time_base);
+            if (av_interleaved_write_frame(context->outFileHandle, audioPacket) < 0) {
+                termination("Could not mux packet.");
+            }
+            av_packet_free(&audioPacket);
+        }
+        if(isIdle){
+            Queue_Wait(&spinCount);
+        } else {
+            spinCount = 0;
+        }
+    }
+    av_packet_free(&packet);
+}
+
+void Step_Operation_Video(AVFrame *frame){
+    //STEP::按gopDuration在相同的时间点标记关键帧，所有档位共用同一个标记，关键帧因此对齐
+    //STEP::Mark keyframes at the same points in time by gopDuration, all renditions share the same mark, so the keyframes are aligned
+    frame->pict_type = AV_PICTURE_TYPE_NONE;
+    if(frame->pts != AV_NOPTS_VALUE){
+        if(nextKeyframePts == AV_NOPTS_VALUE || frame->pts >= nextKeyframePts){
+            frame->pict_type = AV_PICTURE_TYPE_I;
+            int64_t base = nextKeyframePts == AV_NOPTS_VALUE ? frame->pts : nextKeyframePts;
+            nextKeyframePts = base + (int64_t)gopDuration * AV_TIME_BASE;
+        }
+    }
+
+    //STEP::把帧的引用分发给每个档位，图像数据不拷贝
+    //STEP::Dispatch a reference of the frame to every rendition, the picture data is not copied
+    for(int i=0;i<renditionLength;i++){
+        AVFrame *outFrame = av_frame_clone(frame);
+        if(!outFrame){
+            termination("Could not allocate AVFrame.");
+        }
+        Queue_Push(&renditionContextList[i].frameQueue, outFrame);
+    }
+    av_frame_unref(frame);
+}
+
+void Step_Operation_AudioEncode(AVFrame *frame, AVPacket *packet){
+    //STEP::编码音频，编码后的数据包复制到每个档位
+    //STEP::Encode the audio, the encoded packets are copied to every rendition
+    ret = avcodec_send_frame(audioEncoder, frame);
+    if(ret<0){
+        termination("Could not encoding.");
+    }
+    while(1){
+        ret = avcodec_receive_packet(audioEncoder, packet);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF){
+            break;
+        } else if (ret < 0) {
+            termination("Could not receive encoding.");
+        }
+        for(int i=0;i<renditionLength;i++){
+            AVPacket *outPacket = av_packet_clone(packet);
+            if(!outPacket){
+                termination("Could not allocate AVPacket.");
+            }
+            Queue_Push(&renditionContextList[i].packetQueue, outPacket);
+        }
+        av_packet_unref(packet);
+    }
+}
+
+void Step_Operation_Audio(AVFrame *frame, AVFrame *audioFrame, AVPacket *packet){
+    //STEP::重采样后写入FIFO，再按编码器的frame_size切分编码，frame为NULL表示取出剩余的数据
+    //STEP::Resample into the FIFO, then encode in frames of the encoder's frame_size, NULL frame means taking out the remaining data
+    if(frame && audioPts == AV_NOPTS_VALUE && frame->pts != AV_NOPTS_VALUE){
+        audioPts = av_rescale_q(frame->pts, audioDecoder->time_base, av_make_q(1, audioEncoder->sample_rate));
+    }
+    int inSamples = frame ? frame->nb_samples : 0;
+    uint8_t **resampleData = NULL;
+    int outSamples = swr_get_out_samples(resampler, inSamples);
+    if(outSamples > 0){
+        ret = av_samples_alloc_array_and_samples(&resampleData, NULL, audioEncoder->ch_layout.nb_channels, outSamples, audioEncoder->sample_fmt, 0);
+        if(ret < 0){
+            termination("Could not allocate resample buffer.");
+        }
+        outSamples = swr_convert(resampler, resampleData, outSamples, frame ? (const uint8_t **)frame->extended_data : NULL, inSamples);
+        if(outSamples < 0){
+            termination("Could not resample.");
+        }
+        if(outSamples > 0 && av_audio_fifo_write(audioFifo, (void **)resampleData, outSamples) < outSamples){
+            termination("Could not write audio fifo.");
+        }
+        av_freep(&resampleData[0]);
+        av_freep(&resampleData);
+    }
+    if(frame){
+        av_frame_unref(frame);
+    }
+
+    int frameSize = audioEncoder->frame_size > 0 ? audioEncoder->frame_size : 1024;
+    while(av_audio_fifo_size(audioFifo) >= frameSize || (!frame && av_audio_fifo_size(audioFifo) > 0)){
+        int samples = FFMIN(av_audio_fifo_size(audioFifo), frameSize);
+        audioFrame->nb_samples = samples;
+        audioFrame->format = audioEncoder->sample_fmt;
+        audioFrame->sample_rate = audioEncoder->sample_rate;
+        av_channel_layout_copy(&audioFrame->ch_layout, &audioEncoder->ch_layout);
+        if(av_frame_get_buffer(audioFrame, 0) < 0 || av_audio_fifo_read(audioFifo, (void **)audioFrame->extended_data, samples) < samples){
+            termination("Could not read audio fifo.");
+        }
+        audioFrame->pts = av_rescale_q(audioPts, av_make_q(1, audioEncoder->sample_rate), audioEncoder->time_base);
+        audioPts += samples;
+        Step_Operation_AudioEncode(audioFrame, packet);
+        av_frame_unref(audioFrame);
+    }
+}
+
+void Step_Operation_Decode(AVCodecContext *decoder, AVPacket *packet, AVFrame *frame, AVFrame *audioFrame, AVPacket *audioPacket){
+    //STEP::将数据包发送到解码器（异步），packet为NULL表示清理解码器
+    //STEP::Send the data packet to the decoder (async), NULL packet means cleaning up the decoder
+    ret = avcodec_send_packet(decoder, packet);
+    if(ret<0){
+        termination("Could not decoding.");
+    }
+    if(packet){
+        av_packet_unref(packet);
+    }
+    while(1){
+        ret = avcodec_receive_frame(decoder, frame);
+        if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF){
+            break;
+        } else if (ret < 0){
+            termination("Could not receive decoding.");
+        }
+        if(decoder == videoDecoder){
+            Step_Operation_Video(frame);
+        } else {
+            Step_Operation_Audio(frame, audioFrame, audioPacket);
+        }
+    }
+}
+
+void Step_Operation(){
+    //STEP::启动各档位的编码线程
+    //STEP::Start the encode thread of each rendition
+    for(int i=0;i<renditionLength;i++){
+        renditionContextList[i].thread = std::thread(Thread_Rendition, i);
+    }
+
+    AVPacket *packet = av_packet_alloc();
+    AVPacket *audioPacket = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    AVFrame *audioFrame = av_frame_alloc();
+    if (!packet || !audioPacket || !frame || !audioFrame) {
+        termination("Could not allocate AVPacket or AVFrame.");
+    }
+
+    //STEP::解封装、解码只在当前线程进行一次
+    //STEP::Demuxing and decoding happen only once, in the current thread
+    while (av_read_frame(inFileHandle, packet) >= 0) {
+        AVStream *inStream = inFileHandle->streams[packet->stream_index];
+        if(packet->stream_index == videoIndex){
+            av_packet_rescale_ts(packet, inStream->time_base, videoDecoder->time_base);
+            Step_Operation_Decode(videoDecoder, packet, frame, audioFrame, audioPacket);
+        } else if(packet->stream_index == audioIndex){
+            av_packet_rescale_ts(packet, inStream->time_base, audioDecoder->time_base);
+            Step_Operation_Decode(audioDecoder, packet, frame, audioFrame, audioPacket);
+        } else {
+            av_packet_unref(packet);
+        }
+    }
+
+    //STEP::清理解码器、音频编码器中的数据，然后向各档位发送结束标志
+    //STEP::Clean up the decoders and the audio encoder, then send the end flag to every rendition
+    Step_Operation_Decode(videoDecoder, NULL, frame, audioFrame, audioPacket);
+    if(audioDecoder){
+        Step_Operation_Decode(audioDecoder, NULL, frame, audioFrame, audioPacket);
+        Step_Operation_Audio(NULL, audioFrame, audioPacket);
+        Step_Operation_AudioEncode(NULL, audioPacket);
+    }
+    for(int i=0;i<renditionLength;i++){
+        Queue_Push(&renditionContextList[i].frameQueue, NULL);
+        if(audioEncoder){
+            Queue_Push(&renditionContextList[i].packetQueue, NULL);
+        }
+    }
+    for(int i=0;i<renditionLength;i++){
+        renditionContextList[i].thread.join();
+    }
+
+    av_packet_free(&packet);
+    av_packet_free(&audioPacket);
+    av_frame_free(&frame);
+    av_frame_free(&audioFrame);
+}
+
+void Step_End(){
+    //STEP::写入各输出文件尾信息，关闭文件，释放编码器
+    //STEP::Write the tail information of each output file, close the files, free the encoders
+    for(int i=0;i<renditionLength;i++){
+        RenditionContext *context = &renditionContextList[i];
+        ret = av_write_trailer(context->outFileHandle);
+        if(ret < 0) {
+            termination("Could not write the stream trailer to out file.");
+        }
+        ret = avio_closep(&context->outFileHandle->pb);
+        if(ret < 0) {
+            termination("Could not close out file.");
+        }
+        avformat_free_context(context->outFileHandle);
+        avcodec_free_context(&context->encoder);
+        sws_freeContext(context->scaler);
+        av_frame_free(&context->scaleFrame);
+        Queue_Free(&context->frameQueue);
+        Queue_Free(&context->packetQueue);
+    }
+    delete[] renditionContextList;
+
+    //STEP::释放解码器、音频编码器、重采样器，关闭输入文件
+    //STEP::Free the decoders, audio encoder and resampler, close the input file
+    avcodec_free_context(&videoDecoder);
+    avcodec_free_context(&audioDecoder);
+    avcodec_free_context(&audioEncoder);
+    swr_free(&resampler);
+    if(audioFifo){
+        av_audio_fifo_free(audioFifo);
+    }
+    avformat_close_input(&inFileHandle);
+}
+
+int main(int argc, char *argv[]){
+    //STEP::打开源文件并获取源文件信息
+    //STEP::Open input file and get input file information
+    Step_OpenInFile();
+
+    //STEP::初始化解码器
+    //STEP::Initialize the decoder
+    Step_OpenDecoder();
+
+    //STEP::初始化各档位的编码器
+    //STEP::Initialize the encoder of each rendition
+    Step_OpenEncoder();
+
+    //STEP::构造各档位的输出文件
+    //STEP::Constructing the output file of each rendition
+    Step_CreateOutFile();
+
+    //STEP::循环处理数据，并统计处理速度
+    //STEP::Cyclic processing data, and measure the processing speed
+    int64_t startTime = av_gettime_relative();
+    Step_Operation();
+    double costTime = (av_gettime_relative() - startTime) / 1000000.0;
+    for(int i=0;i<renditionLength;i++){
+        std::cout<<renditionList[i].outFilePath<<": "<<renditionContextList[i].frameCount<<" frames, "<<(costTime > 0 ? renditionContextList[i].frameCount / costTime : 0)<<" fps"<<std::endl;
+    }
+
+    //STEP::关闭输入、输出文件
+    //STEP::Close input and output files
+    Step_End();
+}
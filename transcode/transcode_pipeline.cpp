@@ -0,0 +1,663 @@
+/*
+ * 视频转编码例子（流水线多线程），h264转h265例子，解封装/解码/编码/封装分别在独立线程中运行
+ * The sample of transcoding video with a multi-threaded pipeline, h264 to h265 example, demux/decode/encode/mux run on their own threads
+ * Depends on FFmpeg 6.0
+ * Wirte by stoprefactoring.com
+*/
+
+#include <iostream>
+#include <string>
+#include <string.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+extern "C" {
+    #include <libavutil/timestamp.h>
+    #include <libavutil/time.h>
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+    #include <libavcodec/codec.h>
+    #include <libavutil/cpu.h>
+}
+#include "../common/thread_policy.h"
+
+//输入输出文件路径
+//Input and output file paths
+const char *inFilePath  = "../../common/test.mp4";
+//const char *inFilePath  = "rtmp://192.168.3.202:1935/live/test";
+const char *outFilePath  = "./out.mp4";
+
+//视频目标编码
+//Video target encoding
+const AVCodecID videoCodecID = AV_CODEC_ID_H265;
+//音频目标编码，原因请看transcode.cpp的说明
+//Audio target encoding, see the notes in transcode.cpp for the reason
+const AVCodecID audioCodecID = AV_CODEC_ID_AAC;
+
+//编解码线程预算，即本进程所有编解码器可使用的线程总数，0表示使用全部CPU核心
+//同一台机器同时运行多个转码进程时，应设为 CPU核心数/进程数，防止线程数超过CPU核心数导致互相争抢
+//Codec thread budget, the total number of threads all codecs of this process may use, 0 means all CPU cores
+//When running several transcoding processes on one host, set it to number of CPU cores / number of processes, to prevent more threads than CPU cores
+const int threadBudget = 0;
+
+//各级队列的深度，即每个队列中最多可缓存的packet/frame数量，决定了流水线中同时在处理的数据量
+//数值越大，各线程间的等待越少，但占用的内存越多（4K的原始帧一帧约12MB）
+//The depth of each queue, that is the maximum number of packets/frames cached in a queue, it limits how much data is in flight in the pipeline
+//The larger the value, the less waiting between threads, but the more memory used (a 4K raw frame is about 12MB)
+const unsigned int queueDepth = 8;
+
+//输入输出文件句柄
+//Input and output file handles
+AVFormatContext *inFileHandle = NULL;
+AVFormatContext *outFileHandle = NULL;
+
+//无锁有界队列，只允许一个线程写入、一个线程读取（单生产者单消费者），存放AVPacket/AVFrame指针，NULL表示数据结束
+//Lock-free bounded queue, only one thread writes and one thread reads (single producer single consumer), stores AVPacket/AVFrame pointers, NULL means end of data
+typedef struct Queue {
+    void **items;                                                               //环形缓冲区，ring buffer
+    unsigned int capacity;                                                      //缓冲区长度，比队列深度多1，buffer length, 1 more than the queue depth
+    std::atomic<unsigned int> head;                                             //读取位置，只由消费者修改，read position, only modified by the consumer
+    std::atomic<unsigned int> tail;                                             //写入位置，只由生产者修改，write position, only modified by the producer
+} Queue;
+
+//轨道上下文结构体，存放解码器、编码器、输出轨道序号、轨道类型、各级队列和线程等
+//Track context structure, inlcude the decoder, encoder, output track number, track type, queues and threads
+typedef struct StreamContext {
+    AVMediaType type;                                                           //轨道类型，track type
+    int outIndex;                                                               //输出轨道序号，output track number
+    AVCodecContext *decoder;                                                    //解码器，decoder
+    AVCodecContext *encoder;                                                    //编码器，encoder
+    int decodeThreads;                                                          //解码线程数，number of decoder threads
+    int encodeThreads;                                                          //编码线程数，number of encoder threads
+    Queue decodeQueue;                                                          //待解码的packet队列，queue of packets waiting to be decoded
+    Queue encodeQueue;                                                          //待编码的frame队列，queue of frames waiting to be encoded
+    Queue muxQueue;                                                             //待封装的packet队列，queue of packets waiting to be muxed
+    std::thread decodeThread;                                                   //解码线程，decode thread
+    std::thread encodeThread;                                                   //编码线程，encode thread
+    bool isMuxEnd;                                                              //封装线程已收到此轨道的结束标志，the mux thread has received the end of this track
+    int64_t frameCount;                                                         //已编码的帧数，number of encoded frames
+} StreamContext;
+//轨道上下文关联表
+//Stream context correlation table
+StreamContext *streamContextMapping = NULL;
+int streamContextLength = 0;
+
+void termination(const char* param){
+    std::cout<<param<<std::endl;
+    std::cout<<"Error occur, quit!"<<std::endl;
+    exit(-1);
+}
+
+void Queue_Init(Queue *queue){
+    queue->capacity = queueDepth + 1;
+    queue->items = (void **)av_malloc_array(queue->capacity, sizeof(*queue->items));
+    if(!queue->items){
+        termination("Could not allocate queue.");
+    }
+    queue->head.store(0);
+    queue->tail.store(0);
+}
+
+void Queue_Free(Queue *queue){
+    av_freep(&queue->items);
+}
+
+bool Queue_TryPush(Queue *queue, void *item){
+    unsigned int tail = queue->tail.load(std::memory_order_relaxed);
+    unsigned int next = (tail + 1) % queue->capacity;
+    if(next == queue->head.load(std::memory_order_acquire)){                    //队列已满，queue is full
+        return false;
+    }
+    queue->items[tail] = item;
+    queue->tail.store(next, std::memory_order_release);
+    return true;
+}
+
+bool Queue_TryPop(Queue *queue, void **item){
+    unsigned int head = queue->head.load(std::memory_order_relaxed);
+    if(head == queue->tail.load(std::memory_order_acquire)){                    //队列为空，queue is empty
+        return false;
+    }
+    *item = queue->items[head];
+    queue->head.store((head + 1) % queue->capacity, std::memory_order_release);
+    return true;
+}
+
+void Queue_Wait(unsigned int *spinCount){
+    //先自旋让出CPU，等待时间较长时再sleep，避免空转占满CPU
+    //Yield the CPU first, and sleep when waiting for a long time to avoid burning the CPU
+    if((*spinCount)++ < 64){
+        std::this_thread::yield();
+    } else {
+        av_usleep(200);
+    }
+}
+
+void Queue_Push(Queue *queue, void *item){
+    unsigned int spinCount = 0;
+    while(!Queue_TryPush(queue, item)){
+        Queue_Wait(&spinCount);
+    }
+}
+
+void *Queue_Pop(Queue *queue){
+    void *item = NULL;
+    unsigned int spinCount = 0;
+    while(!Queue_TryPop(queue, &item)){
+        Queue_Wait(&spinCount);
+    }
+    return item;
+}
+
+void Step_OpenInFile(){
+    //STEP::打开源视频文件
+    //STEP::Open the input video file
+    AVDictionary* optionsDict = NULL;                                                 //设置输入源封装参数
+    av_dict_set(&optionsDict, "rw_timeout", "2000000", 0);                            //设置网络超时，当输入源为文件时，可注释此行。Set the network timeout, you can comment out this line when the input source is a file
+    int ret = avformat_open_input(&inFileHandle, inFilePath, NULL, &optionsDict);
+    if(ret<0){
+        termination("Could not open input file.");
+    }
+
+    //STEP::获取源视频文件的流信息
+    //STEP::Get the stream information of the source video file
+    ret = avformat_find_stream_info(inFileHandle, NULL);
+    if(ret<0){
+        termination("Failed to retrieve input stream information.");
+    }
+
+    //STEP::根据源轨道信息创建streamContextMapping
+    //STEP::Create streamContextMapping based on source track information
+    streamContextLength = inFileHandle->nb_streams;
+    streamContextMapping = new StreamContext[streamContextLength];                      //含有std::thread和std::atomic，需要用new构造，contains std::thread and std::atomic, must be constructed with new
+    for(int i=0;i<streamContextLength;i++){
+        streamContextMapping[i].type = inFileHandle->streams[i]->codecpar->codec_type;
+        streamContextMapping[i].outIndex = -1;
+        streamContextMapping[i].decoder = NULL;
+        streamContextMapping[i].encoder = NULL;
+        streamContextMapping[i].isMuxEnd = false;
+        streamContextMapping[i].frameCount = 0;
+        Queue_Init(&streamContextMapping[i].decodeQueue);
+        Queue_Init(&streamContextMapping[i].encodeQueue);
+        Queue_Init(&streamContextMapping[i].muxQueue);
+    }
+}
+
+void Step_CreateOutFile(){
+    //STEP::创建输出文件句柄outFileHandle
+    //STEP::Creates an output file handle, outFileHandle.
+    int ret = avformat_alloc_output_context2(&outFileHandle, NULL, NULL, outFilePath);
+    if(ret<0){
+        termination("Could not create output handle.");
+    }
+
+    //STEP::根据源轨道信息创建输出文件的音视频轨道
+    //STEP::Create audio/video tracks for output files based on source track information
+    int outStreamIndex = 0;
+    for(int i = 0; i < streamContextLength; i++) {
+        AVStream *inStream = inFileHandle->streams[i];
+        if (streamContextMapping[i].type != AVMEDIA_TYPE_AUDIO &&                                  //过滤除video、audio、subtitle以外的轨道，Filter tracks except video, audio, subtitle
+            streamContextMapping[i].type != AVMEDIA_TYPE_VIDEO &&
+            streamContextMapping[i].type != AVMEDIA_TYPE_SUBTITLE) {
+                streamContextMapping[i].outIndex = -1;
+                continue;
+        }
+
+        AVStream *outStream = avformat_new_stream(outFileHandle, NULL);                            //创建输出的轨道，Creating the output track
+        if(streamContextMapping[i].encoder){                                                       //尝试从编码器复制输出轨道信息，Trying to copy the output track information from the encoder
+            ret = avcodec_parameters_from_context(outStream->codecpar, streamContextMapping[i].encoder);
+        }else{
+            ret = avcodec_parameters_copy(outStream->codecpar, inStream->codecpar);                //复制源轨道的信息到输出轨道，Copying information from the source track to the output track
+        }
+        if(ret<0){
+            termination("Could not copy codec parameters.");
+        }
+        outStream->codecpar->codec_tag = 0;
+        streamContextMapping[i].outIndex = outStreamIndex++;                                       //记录源文件轨道序号与输出文件轨道序号的对应关系，Record the correspondence between the track number of the source file and the track number of the output file.
+    }
+
+    //STEP::打开输出文件
+    //STEP::Open the output file
+    ret = avio_open(&outFileHandle->pb, outFilePath, AVIO_FLAG_WRITE);
+    if(ret<0){
+        termination("Could not open out file.");
+    }
+
+    //STEP::写入文件头信息
+    //STEP::Write file header information
+    ret = avformat_write_header(outFileHandle, NULL);
+    if(ret<0){
+        termination("Could not write stream header to out file.");
+    }
+}
+
+void Step_ThreadPolicy(){
+    //STEP::按common/thread_policy.h的规则分配编解码线程，所有音视频轨道都转码
+    //STEP::Allocate the codec threads by the rules in common/thread_policy.h, all audio and video tracks are transcoded
+    std::vector<bool> isCodecList(streamContextLength, true);
+    std::vector<ThreadPlan> planList = ThreadPolicy_Plan(inFileHandle, isCodecList, threadBudget);
+    for(int i=0;i<streamContextLength;i++){
+        streamContextMapping[i].decodeThreads = planList[i].decodeThreads;
+        streamContextMapping[i].encodeThreads = planList[i].encodeThreads;
+    }
+}
+
+void Step_OpenDecoder(){
+    //STEP::根据输入文件的流信息创建解码器
+    //STEP::Create decoders based on the stream information of the input file
+    for(int i=0;i<streamContextLength;i++){
+        AVStream *inStream = inFileHandle->streams[i];
+        if (inStream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO &&                             //过滤除video、audio以外的轨道，Filter tracks except video, audio
+            inStream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO ) {
+            continue;
+        }
+
+        const AVCodec *decoderInfo = avcodec_find_decoder(inStream->codecpar->codec_id);       //根据输入文件的流信息寻找解码器，Find the decoder based on the stream information of the input file
+        if(!decoderInfo){
+            termination("Could not find decoder for stream.");
+        }
+
+        AVCodecContext *decoder = avcodec_alloc_context3(decoderInfo);                          //创建解码器上下文，Create decoder context
+        if(!decoder){
+            termination("Could not allocate decoder context.");
+        }
+
+        int ret = avcodec_parameters_to_context(decoder, inStream->codecpar);                   //从流信息拷贝参数到解码器上下文，Copy parameters from the stream information to the decoder context
+        if(ret<0){
+            termination("Could not copy parameters from the stream information to the decoder context.");
+        }
+
+        if(inStream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO){
+            decoder->framerate = av_guess_frame_rate(inFileHandle, inStream, NULL);
+        }
+
+        decoder->time_base = AV_TIME_BASE_Q;                                                    //固定TimeBase为1/1000000，能防止能多奇怪问题，Fixed TimeBase is 1/1000000，can prevent strange problems
+
+        //按线程策略设置解码线程，帧级多线程吞吐最高，解码器不支持时使用条带级多线程
+        //Set decoder threads by the thread policy, frame threading has the highest throughput, slice threading is used when the decoder does not support it
+        decoder->thread_count = streamContextMapping[i].decodeThreads;
+        decoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+        AVDictionary *optionsDict = NULL;
+        ret = avcodec_open2(decoder, decoderInfo, &optionsDict);
+        if(ret<0){
+            termination("Could not open decoder.");
+        }
+
+        decoder->time_base = AV_TIME_BASE_Q;                                                    //一些编码器会修改timebase，这里做一次覆盖设置，Some encoders modify timebase, do an override setting here
+        streamContextMapping[i].decoder = decoder;
+        streamContextMapping[i].type = inStream->codecpar->codec_type;
+    }
+}
+
+void Step_OpenEncoder(){
+    //STEP::根据解码器创建编码器，基础参数从解码器复制
+    //STEP::Create encoders based on decoders, the basic parameters are copied from the decoder
+    for(int i=0;i<streamContextLength;i++){
+        if(!streamContextMapping[i].decoder){
+            continue;
+        }
+
+        const AVCodec *encoderInfo = NULL;
+        if (streamContextMapping[i].type == AVMEDIA_TYPE_VIDEO){
+            encoderInfo = avcodec_find_encoder(videoCodecID);                                  //根据目标编码器ID寻找编码器，Find the encoder based on the target encoder ID
+        } else if (streamContextMapping[i].type == AVMEDIA_TYPE_AUDIO ) {
+            encoderInfo = avcodec_find_encoder(audioCodecID);
+        }
+        if(!encoderInfo){
+            termination("Could not find encoder for stream.");
+        }
+
+        AVCodecContext *encoder = avcodec_alloc_context3(encoderInfo);                          //创建编码器上下文，Create encoder context
+        if(!encoder){
+            termination("Could not allocate encoder context.");
+        }
+
+        AVCodecContext *decoder = streamContextMapping[i].decoder;
+        if (streamContextMapping[i].type == AVMEDIA_TYPE_VIDEO){
+            encoder->height = decoder->height;
+            encoder->width = decoder->width;
+            encoder->framerate = decoder->framerate;
+            encoder->sample_aspect_ratio = decoder->sample_aspect_ratio;
+            if (encoderInfo->pix_fmts){
+                encoder->pix_fmt = encoderInfo->pix_fmts[0];
+            }else
+                encoder->pix_fmt = decoder->pix_fmt;
+        } else if (streamContextMapping[i].type == AVMEDIA_TYPE_AUDIO){
+            encoder->sample_rate = decoder->sample_rate;
+            av_channel_layout_copy(&encoder->ch_layout, &decoder->ch_layout);
+            if(encoderInfo->sample_fmts)
+                encoder->sample_fmt = encoderInfo->sample_fmts[0];
+            else
+                encoder->sample_fmt = decoder->sample_fmt;
+        }
+
+        const AVOutputFormat *outFormat = av_guess_format(NULL, outFilePath, NULL);
+        if(outFormat && (outFormat->flags & AVFMT_GLOBALHEADER)){
+            encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;                                      //mp4等格式需要把编码参数放到文件头，formats such as mp4 need the codec parameters in the file header
+        }
+
+        encoder->time_base = AV_TIME_BASE_Q;                                                    //固定TimeBase为1/1000000，能防止能多奇怪问题，Fixed TimeBase is 1/1000000，can prevent strange problems
+
+        AVDictionary *optionsDict = NULL;
+        //按线程策略设置编码线程，libx265不使用thread_count，需通过x265-params的pools参数限制线程池大小
+        //Set encoder threads by the thread policy, libx265 ignores thread_count, its thread pool size is limited by the pools parameter of x265-params
+        encoder->thread_count = streamContextMapping[i].encodeThreads;
+        encoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        if(strcmp(encoderInfo->name, "libx265") == 0){
+            std::string x265Params = "pools=" + std::to_string(streamContextMapping[i].encodeThreads);
+            av_dict_set(&optionsDict, "x265-params", x265Params.c_str(), 0);
+        }
+        int ret = avcodec_open2(encoder, encoderInfo, &optionsDict);
+        if(ret<0){
+            termination("Could not open encoder.");
+        }
+
+        encoder->time_base = AV_TIME_BASE_Q;                                                    //一些编码器会修改timebase，这里做一次覆盖设置，Some encoders modify timebase, do an override setting here
+        streamContextMapping[i].encoder = encoder;
+    }
+}
+
+void Thread_Decode(int inIndex){
+    StreamContext *context = &streamContextMapping[inIndex];
+    AVStream *inStream = inFileHandle->streams[inIndex];
+    AVFrame *frame = av_frame_alloc();
+    if (!frame) {
+        termination("Could not allocate AVFrame.");
+    }
+
+    while(1){
+        //STEP::从解码队列取出packet，NULL表示解封装已结束，向解码器发送NULL清理剩余数据
+        //STEP::Take a packet from the decode queue, NULL means demuxing has finished, send NULL to the decoder to clean up the remaining data
+        AVPacket *packet = (AVPacket *)Queue_Pop(&context->decodeQueue);
+        if(packet){
+            av_packet_rescale_ts(packet, inStream->time_base, context->decoder->time_base);
+        }
+        int ret = avcodec_send_packet(context->decoder, packet);
+        if(ret<0){
+            termination("Could not decoding.");
+        }
+        bool isEnd = (packet == NULL);
+        av_packet_free(&packet);
+
+        //STEP::取出所有解码后的帧，放入编码队列
+        //STEP::Receive all decoded frames and put them into the encode queue
+        while(1){
+            ret = avcodec_receive_frame(context->decoder, frame);
+            if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF){
+                break;
+            } else if (ret < 0){
+                termination("Could not receive decoding.");
+            }
+
+            AVFrame *outFrame = av_frame_alloc();                                               //队列中存放帧的引用，不拷贝图像数据，the queue holds a reference to the frame, the picture data is not copied
+            if (!outFrame) {
+                termination("Could not allocate AVFrame.");
+            }
+            av_frame_move_ref(outFrame, frame);
+            Queue_Push(&context->encodeQueue, outFrame);
+        }
+
+        if(isEnd){
+            Queue_Push(&context->encodeQueue, NULL);
+            break;
+        }
+    }
+
+    av_frame_free(&frame);
+}
+
+void Thread_Encode(int inIndex){
+    StreamContext *context = &streamContextMapping[inIndex];
+    AVStream *outStream = outFileHandle->streams[context->outIndex];
+    AVPacket *packet = av_packet_alloc();
+    if (!packet) {
+        termination("Could not allocate AVPacket.");
+    }
+
+    while(1){
+        //STEP::从编码队列取出帧，NULL表示解码已结束，向编码器发送NULL清理剩余数据
+        //STEP::Take a frame from the encode queue, NULL means decoding has finished, send NULL to the encoder to clean up the remaining data
+        AVFrame *frame = (AVFrame *)Queue_Pop(&context->encodeQueue);
+        int ret = avcodec_send_frame(context->encoder, frame);
+        if(ret<0){
+            termination("Could not encoding.");
+        }
+        bool isEnd = (frame == NULL);
+        if(frame){
+            context->frameCount++;
+        }
+        av_frame_free(&frame);
+
+        //STEP::取出所有编码后的packet，放入封装队列
+        //STEP::Receive all encoded packets and put them into the mux queue
+        while(1){
+            ret = avcodec_receive_packet(context->encoder, packet);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF){
+                break;
+            } else if (ret < 0) {
+                termination("Could not receive encoding.");
+            }
+
+            packet->stream_index = context->outIndex;
+            av_packet_rescale_ts(packet, context->encoder->time_base, outStream->time_base);
+
+            AVPacket *outPacket = av_packet_alloc();
+            if (!outPacket) {
+                termination("Could not allocate AVPacket.");
+            }
+            av_packet_move_ref(outPacket, packet);
+            Queue_Push(&context->muxQueue, outPacket);
+        }
+
+        if(isEnd){
+            Queue_Push(&context->muxQueue, NULL);
+            break;
+        }
+    }
+
+    av_packet_free(&packet);
+}
+
+void Thread_Mux(){
+    //STEP::轮询各轨道的封装队列，直到所有轨道都收到结束标志
+    //封装线程不能阻塞在某一个队列上，否则其他轨道的队列写满后，上游线程会互相等待
+    //STEP::Poll the mux queue of each track until all tracks have received the end flag
+    //The mux thread must not block on one queue, otherwise upstream threads will wait for each other once the queues of other tracks are full
+    int activeCount = 0;
+    for(int i=0;i<streamContextLength;i++){
+        if(streamContextMapping[i].outIndex >= 0){
+            activeCount++;
+        }
+    }
+
+    unsigned int spinCount = 0;
+    while(activeCount > 0){
+        bool isIdle = true;
+        for(int i=0;i<streamContextLength;i++){
+            StreamContext *context = &streamContextMapping[i];
+            if(context->outIndex < 0 || context->isMuxEnd){
+                continue;
+            }
+
+            void *item = NULL;
+            if(!Queue_TryPop(&context->muxQueue, &item)){
+                continue;
+            }
+            isIdle = false;
+
+            AVPacket *packet = (AVPacket *)item;
+            if(!packet){
+                context->isMuxEnd = true;
+                activeCount--;
+                continue;
+            }
+
+            //封装packet，并写入输出文件
+            //Mux the packet and write to the output file
+            int ret = av_interleaved_write_frame(outFileHandle, packet);
+            if (ret < 0) {
+                termination("Could not mux packet.");
+            }
+            av_packet_free(&packet);
+        }
+
+        if(isIdle){
+            Queue_Wait(&spinCount);
+        } else {
+            spinCount = 0;
+        }
+    }
+}
+
+void Step_Operation(){
+    //STEP::启动解码、编码、封装线程
+    //STEP::Start the decode, encode and mux threads
+    for(int i=0;i<streamContextLength;i++){
+        if(streamContextMapping[i].outIndex < 0 || !streamContextMapping[i].decoder){
+            continue;
+        }
+        streamContextMapping[i].decodeThread = std::thread(Thread_Decode, i);
+        streamContextMapping[i].encodeThread = std::thread(Thread_Encode, i);
+    }
+    std::thread muxThread(Thread_Mux);
+
+    //STEP::在当前线程解封装，并按轨道分发packet
+    //需要转编码的轨道放入解码队列，不需要转编码的轨道直接放入封装队列
+    //STEP::Demux in the current thread and dispatch packets by track
+    //Tracks that need transcoding go to the decode queue, tracks that do not go directly to the mux queue
+    AVPacket *packet = av_packet_alloc();
+    if (!packet) {
+        termination("Could not allocate AVPacket.");
+    }
+    while (av_read_frame(inFileHandle, packet) >= 0) {
+        StreamContext *context = &streamContextMapping[packet->stream_index];
+        if(context->outIndex < 0){
+            av_packet_unref(packet);
+            continue;
+        }
+
+        AVPacket *outPacket = av_packet_alloc();
+        if (!outPacket) {
+            termination("Could not allocate AVPacket.");
+        }
+        if(context->decoder){
+            av_packet_move_ref(outPacket, packet);
+            Queue_Push(&context->decodeQueue, outPacket);
+        } else {
+            AVStream *inStream = inFileHandle->streams[packet->stream_index];
+            AVStream *outStream = outFileHandle->streams[context->outIndex];
+            av_packet_rescale_ts(packet, inStream->time_base, outStream->time_base);
+            packet->stream_index = context->outIndex;
+            av_packet_move_ref(outPacket, packet);
+            Queue_Push(&context->muxQueue, outPacket);
+        }
+    }
+    av_packet_free(&packet);
+
+    //STEP::文件读取完成，向各轨道发送结束标志，等待所有线程处理完毕
+    //STEP::The reading is complete, send the end flag to every track and wait for all threads to finish
+    for(int i=0;i<streamContextLength;i++){
+        if(streamContextMapping[i].outIndex < 0){
+            continue;
+        }
+        if(streamContextMapping[i].decoder){
+            Queue_Push(&streamContextMapping[i].decodeQueue, NULL);
+        } else {
+            Queue_Push(&streamContextMapping[i].muxQueue, NULL);
+        }
+    }
+    for(int i=0;i<streamContextLength;i++){
+        if(streamContextMapping[i].decodeThread.joinable()){
+            streamContextMapping[i].decodeThread.join();
+        }
+        if(streamContextMapping[i].encodeThread.joinable()){
+            streamContextMapping[i].encodeThread.join();
+        }
+    }
+    muxThread.join();
+}
+
+void Step_CloseCodec(){
+    //STEP::释放编码器、解码器
+    //STEP::Free encoders and decoders
+    for(int i=0;i<streamContextLength;i++){
+        if(streamContextMapping[i].decoder){
+            avcodec_free_context(&streamContextMapping[i].decoder);
+        }
+        if(streamContextMapping[i].encoder){
+            avcodec_free_context(&streamContextMapping[i].encoder);
+        }
+    }
+}
+
+void Step_End(){
+    //STEP::写入输出文件尾信息
+    //Write output file tail information
+    int ret = av_write_trailer(outFileHandle);
+    if(ret < 0) {
+        termination("Could not write the stream trailer to out file.");
+    }
+
+    //STEP::关闭输出文件，并销毁具柄
+    //STEP::Close the output file，and destroy the handle
+    ret = avio_closep(&outFileHandle->pb);
+    if(ret < 0) {
+        termination("Could not close out file.");
+    }
+    avformat_free_context(outFileHandle);
+
+    //STEP::关闭输入文件，并销毁具柄
+    //STEP::Close the input file，and destroy the handle
+    avformat_close_input(&inFileHandle);
+
+    //STEP::释放队列和关联表
+    //STEP::Free the queues and the association table
+    for(int i=0;i<streamContextLength;i++){
+        Queue_Free(&streamContextMapping[i].decodeQueue);
+        Queue_Free(&streamContextMapping[i].encodeQueue);
+        Queue_Free(&streamContextMapping[i].muxQueue);
+    }
+    delete[] streamContextMapping;
+}
+
+int main(int argc, char *argv[]){
+    //STEP::打开源文件并获取源文件信息
+    //STEP::Open input file and get input file information
+    Step_OpenInFile();
+
+    //STEP::按轨道开销分配编解码线程
+    //STEP::Allocate codec threads by the cost of each track
+    Step_ThreadPolicy();
+
+    //STEP::初始化解码器
+    //STEP::Initialize the decoder
+    Step_OpenDecoder();
+
+    //STEP::初始化编码器
+    //STEP::Initialize the encoder
+    Step_OpenEncoder();
+
+    //STEP::构造输出文件
+    //STEP::Constructing output files
+    Step_CreateOutFile();
+
+    //STEP::多线程循环处理数据，并统计处理速度
+    //STEP::Process data with multiple threads, and measure the processing speed
+    int64_t startTime = av_gettime_relative();
+    Step_Operation();
+    double costTime = (av_gettime_relative() - startTime) / 1000000.0;
+    for(int i=0;i<streamContextLength;i++){
+        if(streamContextMapping[i].type == AVMEDIA_TYPE_VIDEO && streamContextMapping[i].encoder){
+            std::cout<<"video stream "<<i<<": "<<streamContextMapping[i].frameCount<<" frames, "<<(costTime > 0 ? streamContextMapping[i].frameCount / costTime : 0)<<" fps"<<std::endl;
+        }
+    }
+
+    //STEP::关闭编码器、解码器
+    //STEP::Close encoder and decoder
+    Step_CloseCodec();
+
+    //STEP::关闭输入、输出文件
+    //STEP::Close input and output files
+    Step_End();
+}